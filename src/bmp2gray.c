@@ -1,10 +1,29 @@
 #include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+
+// x86/x64目标启用SSE2向量化路径
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BMP_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// 强制内联：像素格式内核以常量位深度调用通用实现，由编译器为每种格式展开出无分支的专用循环
+#if defined(_MSC_VER)
+#define BMP_FORCEINLINE static __forceinline
+#else
+#define BMP_FORCEINLINE static inline __attribute__((always_inline))
+#endif
 
 // 链接通用对话框库
 #pragma comment(lib, "comdlg32.lib")
+// 链接进程状态库（基准测试读取峰值内存）
+#pragma comment(lib, "psapi.lib")
 
 /*
 1. 对于灰度图转换功能:
@@ -40,6 +59,291 @@ typedef struct {
     int y;
 } Point;
 
+// 物体特征，在连通区域搜索过程中逐像素累积，无需二次扫描
+typedef struct {
+    double m00, m10, m01;       // 原始矩（零阶、一阶）
+    double m20, m11, m02;       // 原始矩（二阶）
+    double mu20, mu11, mu02;    // 中心矩（二阶）
+    double centroidX;           // 质心
+    double centroidY;
+    double orientation;         // 主轴方向（弧度，相对x轴）
+    int perimeter;              // 周长：与背景或图像边界相邻的像素边数
+    double intensitySum;        // 灰度累加值
+    double meanIntensity;       // 平均灰度
+} ObjectFeatures;
+
+// 物体记录
+typedef struct {
+    BoundingBox bbox;
+    int pixelCount;
+    BOOL pixelCountEstimated;   // pixelCount是由金字塔缩小图的灰度估计的近似值（金字塔仅细化边界框时）
+    ObjectFeatures features;    // 仅在启用特征计算时有效
+} ObjectInfo;
+
+// 灰度采样源，用于计算物体的平均灰度
+typedef struct {
+    const unsigned char* data;
+    int bitCount;
+    int rowSize;
+    const RGBQUAD* palette;     // 8位及以下图像的调色板，可为NULL
+} GraySource;
+
+// 物体检测选项
+typedef struct {
+    int minObjectSize;          // 最小物体像素数量
+    int maxObjects;             // 最多记录的物体数量
+    BOOL computeFeatures;       // 是否在标记过程中累积物体特征
+    const char* grayPath;       // 计算平均灰度用的灰度图，NULL表示使用输入图像本身
+    int pyramidFactor;          // 0表示全分辨率检测，2或4表示先在缩小的金字塔层上检测候选区域
+    BOOL pyramidExact;          // 金字塔模式下在候选区域内做全分辨率标记（否则只细化边界框）
+    BOOL rleOutput;             // 4位/8位输出按BI_RLE4/BI_RLE8压缩
+} DetectOptions;
+
+// ---- 暂存内存池 ----
+// 处理一张图像所需的临时内存（像素缓冲区、访问标记、BFS队列、物体数组等）从内存池中顺序分配，
+// 处理完一张图像后整体重置而不逐个释放。每个工作线程使用自己的内存池，分配时无需加锁。
+// 池空间不足时向系统追加新块；重置时若本轮用到了多个块，则按高水位合并为一个块，
+// 因此批处理中第一张图像之后不再向系统申请内存，长时间运行也不会产生碎片。
+#define ARENA_ALIGNMENT 16                  // 满足SSE2加载的对齐要求
+#define ARENA_MIN_BLOCK_SIZE (1 << 20)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;                // 本轮之前分配的块
+    unsigned char* data;                    // 对齐后的可用空间起点
+    size_t capacity;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;                       // 当前分配所在的块
+    size_t used;                            // 本轮已分配字节数（含对齐填充）
+    size_t highWater;                       // 历轮用量的最大值
+    int systemAllocations;                  // 向系统申请块的总次数
+    int resetCount;                         // 已重置的轮数
+} ScratchArena;
+
+void initScratchArena(ScratchArena* arena) {
+    memset(arena, 0, sizeof(ScratchArena));
+}
+
+// 向系统申请一个可用空间至少为capacity字节的块
+ArenaBlock* allocArenaBlock(size_t capacity) {
+    ArenaBlock* block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity + ARENA_ALIGNMENT);
+    if (!block) return NULL;
+    block->next = NULL;
+    block->data = (unsigned char*)(((size_t)(block + 1) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1));
+    block->capacity = capacity;
+    block->used = 0;
+    return block;
+}
+
+void freeArenaBlocks(ArenaBlock* block) {
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+// 从内存池分配size字节；arena为NULL时退化为malloc，由调用者用arenaRelease释放
+void* arenaAlloc(ScratchArena* arena, size_t size) {
+    if (!arena) return malloc(size);
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock* block = arena->head;
+    if (!block || block->capacity - block->used < size) {
+        // 新块至少是上一块的两倍，第一张图像只需少数几次追加
+        size_t capacity = ARENA_MIN_BLOCK_SIZE;
+        if (block && capacity < block->capacity * 2) capacity = block->capacity * 2;
+        if (capacity < size) capacity = size;
+        ArenaBlock* newBlock = allocArenaBlock(capacity);
+        if (!newBlock) return NULL;
+        newBlock->next = block;
+        arena->head = newBlock;
+        arena->systemAllocations++;
+        block = newBlock;
+    }
+
+    void* result = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->highWater) arena->highWater = arena->used;
+    return result;
+}
+
+// 分配并清零
+void* arenaCalloc(ScratchArena* arena, size_t count, size_t size) {
+    if (!arena) return calloc(count, size);
+    void* result = arenaAlloc(arena, count * size);
+    if (result) memset(result, 0, count * size);
+    return result;
+}
+
+// 释放单次分配：内存池中的分配在重置时统一回收，这里只处理arena为NULL的情况
+void arenaRelease(ScratchArena* arena, void* ptr) {
+    if (!arena && ptr) free(ptr);
+}
+
+// 一张图像处理完毕后重置内存池，必要时把多个块合并为一个高水位大小的块
+void resetScratchArena(ScratchArena* arena) {
+    if (arena->head && arena->head->next) {
+        size_t capacity = max(arena->highWater, (size_t)ARENA_MIN_BLOCK_SIZE);
+        freeArenaBlocks(arena->head);
+        arena->head = allocArenaBlock(capacity);
+        if (arena->head) arena->systemAllocations++;
+    } else if (arena->head) {
+        arena->head->used = 0;
+    }
+    arena->used = 0;
+    arena->resetCount++;
+}
+
+// 释放内存池的全部块
+void freeScratchArena(ScratchArena* arena) {
+    freeArenaBlocks(arena->head);
+    arena->head = NULL;
+    arena->used = 0;
+}
+
+// 线程局部存储
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// 获取单调时钟（秒）
+double getMonotonicSeconds(void) {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+// ---- 运行指标 ----
+// 各处理阶段的耗时和调用次数，以及关键计数，记录在每个线程自己的计数块中，热路径上无需同步。
+// 阶段按"计时点"划分：METRICS_TIMER_START开始计时，每到一个阶段结束处用METRICS_LAP
+// 把距上一个计时点的时间记入该阶段。编译时定义BMP_DISABLE_METRICS可完全移除这些代码。
+typedef enum {
+    STAGE_HEADER,               // 打开文件，读取和校验文件头、调色板
+    STAGE_READ,                 // 读取像素数据
+    STAGE_COMPUTE,              // 像素计算（灰度、二值化、差异）
+    STAGE_LABEL,                // 连通区域标记
+    STAGE_DRAW,                 // 绘制标记
+    STAGE_WRITE,                // 写出结果
+    STAGE_QUEUE_WAIT,           // 流水线中等待队列（队列满时的生产者、队列空时的消费者）
+    STAGE_COUNT
+} MetricsStage;
+
+typedef enum {
+    COUNTER_IMAGES,             // 处理成功的图像数
+    COUNTER_COMPONENTS,         // 标记出的连通区域数（含小于最小尺寸的）
+    COUNTER_PIXELS_VISITED,     // 连通区域搜索访问的像素数
+    COUNTER_BYTES_READ,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_QUEUE_PUSHES,       // 流水线队列的入队次数
+    COUNTER_QUEUE_DEPTH,        // 每次入队后队列深度之和，除以入队次数为平均深度
+    COUNTER_QUEUE_FULL_STALLS,  // 入队时队列已满、生产者等待的次数
+    COUNTER_QUEUE_EMPTY_STALLS, // 出队时队列为空、消费者等待的次数
+    COUNTER_CACHE_HITS,         // 结果缓存命中、跳过计算的次数
+    COUNTER_CACHE_MISSES,       // 结果缓存未命中、计算后存入缓存的次数
+    COUNTER_COUNT
+} MetricsCounter;
+
+typedef struct {
+    double stageSeconds[STAGE_COUNT];
+    long long stageCalls[STAGE_COUNT];
+    long long counters[COUNTER_COUNT];
+} MetricsBlock;
+
+const char* metricsStageNames[STAGE_COUNT] = { "header", "read", "compute", "label", "draw", "write", "queue_wait" };
+const char* metricsCounterNames[COUNTER_COUNT] = {
+    "images_processed", "components_found", "pixels_visited", "bytes_read", "bytes_written",
+    "queue_pushes", "queue_depth", "queue_full_stalls", "queue_empty_stalls", "cache_hits", "cache_misses"
+};
+
+#ifndef BMP_DISABLE_METRICS
+THREAD_LOCAL MetricsBlock threadMetrics;
+
+// 把距上一个计时点的时间记入stage，并把计时点移到当前时刻
+void metricsLap(double* timer, MetricsStage stage) {
+    double now = getMonotonicSeconds();
+    threadMetrics.stageSeconds[stage] += now - *timer;
+    threadMetrics.stageCalls[stage]++;
+    *timer = now;
+}
+
+#define METRICS_TIMER_START(timer) double timer = getMonotonicSeconds()
+#define METRICS_LAP(timer, stage) metricsLap(&(timer), (stage))
+#define METRICS_COUNT(counter, amount) (threadMetrics.counters[counter] += (amount))
+#else
+#define METRICS_TIMER_START(timer) ((void)0)
+#define METRICS_LAP(timer, stage) ((void)0)
+#define METRICS_COUNT(counter, amount) ((void)0)
+#endif
+
+// 复制当前线程的计数块（禁用指标时为全零）
+void MetricsSnapshot(MetricsBlock* snapshot) {
+#ifndef BMP_DISABLE_METRICS
+    *snapshot = threadMetrics;
+#else
+    memset(snapshot, 0, sizeof(MetricsBlock));
+#endif
+}
+
+// 清零当前线程的计数块
+void MetricsReset(void) {
+#ifndef BMP_DISABLE_METRICS
+    memset(&threadMetrics, 0, sizeof(MetricsBlock));
+#endif
+}
+
+// 把一个线程的快照累加到汇总块，用于合并多个工作线程的指标
+void MetricsMerge(MetricsBlock* total, const MetricsBlock* part) {
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        total->stageSeconds[i] += part->stageSeconds[i];
+        total->stageCalls[i] += part->stageCalls[i];
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        total->counters[i] += part->counters[i];
+    }
+}
+
+// 以Prometheus文本格式输出
+void MetricsWritePrometheus(FILE* out, const MetricsBlock* metrics) {
+    fprintf(out, "# HELP bmp_stage_seconds_total Time spent in each processing stage.\n");
+    fprintf(out, "# TYPE bmp_stage_seconds_total counter\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        fprintf(out, "bmp_stage_seconds_total{stage=\"%s\"} %.9f\n", metricsStageNames[i], metrics->stageSeconds[i]);
+    }
+    fprintf(out, "# HELP bmp_stage_calls_total Number of times each processing stage ran.\n");
+    fprintf(out, "# TYPE bmp_stage_calls_total counter\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        fprintf(out, "bmp_stage_calls_total{stage=\"%s\"} %lld\n", metricsStageNames[i], metrics->stageCalls[i]);
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(out, "# TYPE bmp_%s_total counter\n", metricsCounterNames[i]);
+        fprintf(out, "bmp_%s_total %lld\n", metricsCounterNames[i], metrics->counters[i]);
+    }
+}
+
+// 以JSON格式输出
+void MetricsWriteJson(FILE* out, const MetricsBlock* metrics) {
+    fprintf(out, "{\"stages\":{");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        fprintf(out, "%s\"%s\":{\"seconds\":%.9f,\"calls\":%lld}", i ? "," : "",
+                metricsStageNames[i], metrics->stageSeconds[i], metrics->stageCalls[i]);
+    }
+    fprintf(out, "},\"counters\":{");
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(out, "%s\"%s\":%lld", i ? "," : "", metricsCounterNames[i], metrics->counters[i]);
+    }
+    fprintf(out, "}}\n");
+}
+
 // 标记是否已访问过
 typedef struct {
     int width;
@@ -47,28 +351,28 @@ typedef struct {
     unsigned char* data;
 } VisitedMap;
 
-// 创建访问标记数组
-VisitedMap* createVisitedMap(int width, int height) {
-    VisitedMap* map = (VisitedMap*)malloc(sizeof(VisitedMap));
+// 创建访问标记数组（arena为NULL时使用malloc）
+VisitedMap* createVisitedMap(int width, int height, ScratchArena* arena) {
+    VisitedMap* map = (VisitedMap*)arenaAlloc(arena, sizeof(VisitedMap));
     if (map == NULL) return NULL;
-    
+
     map->width = width;
     map->height = height;
-    map->data = (unsigned char*)calloc(width * height, sizeof(unsigned char));
-    
+    map->data = (unsigned char*)arenaCalloc(arena, width * height, sizeof(unsigned char));
+
     if (map->data == NULL) {
-        free(map);
+        arenaRelease(arena, map);
         return NULL;
     }
-    
+
     return map;
 }
 
 // 释放访问标记数组
-void freeVisitedMap(VisitedMap* map) {
+void freeVisitedMap(VisitedMap* map, ScratchArena* arena) {
     if (map) {
-        if (map->data) free(map->data);
-        free(map);
+        if (map->data) arenaRelease(arena, map->data);
+        arenaRelease(arena, map);
     }
 }
 
@@ -92,1131 +396,11263 @@ unsigned char rgbToGray(unsigned char r, unsigned char g, unsigned char b) {
     return (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
 }
 
-// 绘制十字的函数
-void drawCross(unsigned char *buffer, int width, int height, int bitCount, int rowSize) {
+// 调色板项的灰度：灰阶项（R=G=B）直接取其值，彩色项按加权公式计算
+// （加权公式对部分灰阶值会因舍入少1，灰阶调色板的索引应与灰度一一对应）
+unsigned char paletteEntryGray(const RGBQUAD* entry) {
+    if (entry->rgbRed == entry->rgbGreen && entry->rgbGreen == entry->rgbBlue) return entry->rgbRed;
+    return rgbToGray(entry->rgbRed, entry->rgbGreen, entry->rgbBlue);
+}
+
+// ---- 像素格式访问器 ----
+// 所有按位深度区分的逐像素操作都通过以下访问器完成。bits必须是编译期常量（1/4/8/24/32），
+// 这样内联后switch被折叠，内层循环中不再有位深度判断。
+
+// 读取像素值：24/32位取红色通道（二值图中RGB相等），索引格式取索引并换算到0~255
+BMP_FORCEINLINE unsigned char pfGet(const unsigned char* row, int x, int bits) {
+    switch (bits) {
+    case 1:  return ((row[x >> 3] >> (7 - (x & 7))) & 1) ? 255 : 0;
+    case 4:  return (unsigned char)(((x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4)) * 17);
+    case 8:  return row[x];
+    case 24: return row[x * 3 + 2];
+    default: return row[x * 4 + 2];
+    }
+}
+
+// 写入索引（仅索引格式）
+BMP_FORCEINLINE void pfSetIndex(unsigned char* row, int x, unsigned char index, int bits) {
+    switch (bits) {
+    case 1: {
+        unsigned char bit = (unsigned char)(0x80 >> (x & 7));
+        row[x >> 3] = index ? (row[x >> 3] | bit) : (row[x >> 3] & ~bit);
+        break;
+    }
+    case 4:
+        row[x >> 1] = (x & 1) ? ((row[x >> 1] & 0xF0) | (index & 0x0F))
+                              : ((row[x >> 1] & 0x0F) | (unsigned char)(index << 4));
+        break;
+    default:
+        row[x] = index;
+        break;
+    }
+}
+
+// 写入灰度值：24/32位写入BGR三个通道（不改动Alpha），索引格式写入灰阶调色板中对应的索引
+BMP_FORCEINLINE void pfSetGray(unsigned char* row, int x, unsigned char value, int bits) {
+    switch (bits) {
+    case 1:  pfSetIndex(row, x, value >= 128, 1); break;
+    case 4:  pfSetIndex(row, x, (unsigned char)((value + 8) / 17), 4); break;
+    case 8:  row[x] = value; break;
+    case 24: row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = value; break;
+    default: row[x * 4] = row[x * 4 + 1] = row[x * 4 + 2] = value; break;
+    }
+}
+
+// 写入标记色：24/32位为红色，索引格式写入markIndex（由调用者在调色板中预留）
+BMP_FORCEINLINE void pfSetMark(unsigned char* row, int x, unsigned char markIndex, int bits) {
+    if (bits == 24 || bits == 32) {
+        unsigned char* pixel = row + x * (bits / 8);
+        pixel[2] = 255; // R
+        pixel[1] = 0;   // G
+        pixel[0] = 0;   // B
+    } else {
+        pfSetIndex(row, x, markIndex, bits);
+    }
+}
+
+// 把源行第sx个像素原样复制到目标行第dx个像素（同一位深度）
+BMP_FORCEINLINE void pfCopy(unsigned char* targetRow, int dx, const unsigned char* sourceRow, int sx, int bits) {
+    switch (bits) {
+    case 1:  pfSetIndex(targetRow, dx, (sourceRow[sx >> 3] >> (7 - (sx & 7))) & 1, 1); break;
+    case 4:  pfSetIndex(targetRow, dx, (sx & 1) ? (sourceRow[sx >> 1] & 0x0F) : (sourceRow[sx >> 1] >> 4), 4); break;
+    case 8:  targetRow[dx] = sourceRow[sx]; break;
+    case 24: memcpy(targetRow + dx * 3, sourceRow + sx * 3, 3); break;
+    default: memcpy(targetRow + dx * 4, sourceRow + sx * 4, 4); break;
+    }
+}
+
+// 是否为有效的位深度
+int isSupportedBitCount(int bitCount) {
+    return bitCount == 1 || bitCount == 4 || bitCount == 8 || bitCount == 24 || bitCount == 32;
+}
+
+// 为每种位深度实例化内核：由 name##Generic(..., bits) 生成 name##1 ... name##32 五个函数
+#define INSTANTIATE_PIXEL_KERNEL(ret, name, params, ...) \
+    ret name##1 params { return name##Generic(__VA_ARGS__, 1); } \
+    ret name##4 params { return name##Generic(__VA_ARGS__, 4); } \
+    ret name##8 params { return name##Generic(__VA_ARGS__, 8); } \
+    ret name##24 params { return name##Generic(__VA_ARGS__, 24); } \
+    ret name##32 params { return name##Generic(__VA_ARGS__, 32); }
+
+#define INSTANTIATE_PIXEL_KERNEL_VOID(name, params, ...) \
+    void name##1 params { name##Generic(__VA_ARGS__, 1); } \
+    void name##4 params { name##Generic(__VA_ARGS__, 4); } \
+    void name##8 params { name##Generic(__VA_ARGS__, 8); } \
+    void name##24 params { name##Generic(__VA_ARGS__, 24); } \
+    void name##32 params { name##Generic(__VA_ARGS__, 32); }
+
+// 按位深度从实例化的内核中选择一个，未知位深度返回NULL
+#define SELECT_PIXEL_KERNEL(name, bitCount) \
+    ((bitCount) == 1 ? name##1 : (bitCount) == 4 ? name##4 : (bitCount) == 8 ? name##8 : \
+     (bitCount) == 24 ? name##24 : (bitCount) == 32 ? name##32 : NULL)
+
+// 从灰度采样源读取灰度值
+unsigned char sampleGray(const GraySource* src, int x, int y) {
+    if (src->bitCount == 24 || src->bitCount == 32) {
+        const unsigned char* pixel = src->data + y * src->rowSize + x * (src->bitCount / 8);
+        return rgbToGray(pixel[2], pixel[1], pixel[0]);
+    }
+    unsigned char index = src->data[y * src->rowSize + x];
+    if (src->palette) {
+        return paletteEntryGray(&src->palette[index]);
+    }
+    return index;
+}
+
+// 设置默认检测选项
+void initDetectOptions(DetectOptions* options) {
+    options->minObjectSize = 50;
+    options->maxObjects = 50;
+    options->computeFeatures = FALSE;
+    options->grayPath = NULL;
+    options->pyramidFactor = 0;
+    options->pyramidExact = FALSE;
+    options->rleOutput = FALSE;
+}
+
+// 累积一个像素对物体特征的贡献
+void accumulateObjectFeatures(ObjectFeatures* features, int x, int y, int exposedEdges, unsigned char gray) {
+    double fx = (double)x;
+    double fy = (double)y;
+    features->m00 += 1.0;
+    features->m10 += fx;
+    features->m01 += fy;
+    features->m20 += fx * fx;
+    features->m11 += fx * fy;
+    features->m02 += fy * fy;
+    features->perimeter += exposedEdges;
+    features->intensitySum += gray;
+}
+
+// 由原始矩计算质心、中心矩、方向和平均灰度
+void finalizeObjectFeatures(ObjectFeatures* features) {
+    if (features->m00 <= 0) return;
+
+    features->centroidX = features->m10 / features->m00;
+    features->centroidY = features->m01 / features->m00;
+    features->mu20 = features->m20 - features->centroidX * features->m10;
+    features->mu11 = features->m11 - features->centroidX * features->m01;
+    features->mu02 = features->m02 - features->centroidY * features->m01;
+    features->orientation = 0.5 * atan2(2.0 * features->mu11, features->mu20 - features->mu02);
+    features->meanIntensity = features->intensitySum / features->m00;
+}
+
+// ---- 像素格式内核 ----
+
+// 绘制边界框（只写四条边）
+BMP_FORCEINLINE void drawBoxGeneric(unsigned char* buffer, int rowSize, BoundingBox box,
+                                    unsigned char markIndex, int bits) {
+    unsigned char* top = buffer + box.minY * rowSize;
+    unsigned char* bottom = buffer + box.maxY * rowSize;
+    for (int x = box.minX; x <= box.maxX; x++) {
+        pfSetMark(top, x, markIndex, bits);
+        pfSetMark(bottom, x, markIndex, bits);
+    }
+    for (int y = box.minY; y <= box.maxY; y++) {
+        unsigned char* row = buffer + y * rowSize;
+        pfSetMark(row, box.minX, markIndex, bits);
+        pfSetMark(row, box.maxX, markIndex, bits);
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(drawBox, (unsigned char* buffer, int rowSize, BoundingBox box, unsigned char markIndex),
+                              buffer, rowSize, box, markIndex)
+
+typedef void (*DrawBoxKernel)(unsigned char* buffer, int rowSize, BoundingBox box, unsigned char markIndex);
+
+// 绘制中心十字：只写十字所在的像素
+BMP_FORCEINLINE void drawCrossGeneric(unsigned char* buffer, int width, int height, int rowSize, int bits) {
     int centerX = width / 2;
     int centerY = height / 2;
     int crossSize = 10;
 
-    if (bitCount == 24) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                RGB *pixel = (RGB *)(buffer + y * rowSize + x * 3);
-                if ((y == centerY && abs(x - centerX) <= crossSize) ||
-                    (x == centerX && abs(y - centerY) <= crossSize)) {
-                    pixel->red = 255;
-                    pixel->green = 0;
-                    pixel->blue = 0;
-                }
-            }
-        }
+    unsigned char* centerRow = buffer + centerY * rowSize;
+    for (int x = max(0, centerX - crossSize); x <= min(width - 1, centerX + crossSize); x++) {
+        pfSetMark(centerRow, x, 0, bits);
     }
-    else if (bitCount == 32) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                unsigned char *pixel = buffer + y * rowSize + x * 4;
-                if ((y == centerY && abs(x - centerX) <= crossSize) ||
-                    (x == centerX && abs(y - centerY) <= crossSize)) {
-                    pixel[2] = 255; // R
-                    pixel[1] = 0;   // G
-                    pixel[0] = 0;   // B
-                }
-            }
-        }
+    for (int y = max(0, centerY - crossSize); y <= min(height - 1, centerY + crossSize); y++) {
+        pfSetMark(buffer + y * rowSize, centerX, 0, bits);
     }
 }
 
-// 绘制红色边框的函数
-void drawRedRectangle(unsigned char *buffer, int width, int height, int bitCount, int rowSize) {
-    // 寻找黑色区域的边界
+// 查找黑色像素(各通道<50)的边界，返回是否找到
+BMP_FORCEINLINE int findDarkBoundsGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                          BoundingBox* box, int bits) {
     int minX = width, maxX = 0, minY = height, maxY = 0;
-    int foundBlackPixel = 0;
-    
-    // 查找黑色像素的边界
-    if (bitCount == 24) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                RGB *pixel = (RGB *)(buffer + y * rowSize + x * 3);
-                // 检查是否为黑色像素 (RGB值都很低)
-                if (pixel->red < 50 && pixel->green < 50 && pixel->blue < 50) {
-                    foundBlackPixel = 1;
-                    if (x < minX) minX = x;
-                    if (x > maxX) maxX = x;
-                    if (y < minY) minY = y;
-                    if (y > maxY) maxY = y;
-                }
+    int found = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        for (int x = 0; x < width; x++) {
+            int dark;
+            if (bits == 24 || bits == 32) {
+                const unsigned char* pixel = row + x * (bits / 8);
+                dark = pixel[0] < 50 && pixel[1] < 50 && pixel[2] < 50;
+            } else {
+                dark = pfGet(row, x, bits) < 50;
             }
-        }
-    }
-    else if (bitCount == 32) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                unsigned char *pixel = buffer + y * rowSize + x * 4;
-                // 检查是否为黑色像素 (RGB值都很低)
-                if (pixel[0] < 50 && pixel[1] < 50 && pixel[2] < 50) {
-                    foundBlackPixel = 1;
-                    if (x < minX) minX = x;
-                    if (x > maxX) maxX = x;
-                    if (y < minY) minY = y;
-                    if (y > maxY) maxY = y;
-                }
+            if (dark) {
+                found = 1;
+                if (x < minX) minX = x;
+                if (x > maxX) maxX = x;
+                if (y < minY) minY = y;
+                if (y > maxY) maxY = y;
             }
         }
     }
-    else if (bitCount == 8) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                unsigned char pixel = buffer[y * rowSize + x];
-                // 检查是否为黑色像素 (灰度值很低)
-                if (pixel < 50) {
-                    foundBlackPixel = 1;
-                    if (x < minX) minX = x;
-                    if (x > maxX) maxX = x;
-                    if (y < minY) minY = y;
-                    if (y > maxY) maxY = y;
-                }
-            }
+    box->minX = minX;
+    box->minY = minY;
+    box->maxX = maxX;
+    box->maxY = maxY;
+    return found;
+}
+
+INSTANTIATE_PIXEL_KERNEL(int, findDarkBounds,
+                         (const unsigned char* buffer, int width, int height, int rowSize, BoundingBox* box),
+                         buffer, width, height, rowSize, box)
+
+// 二值化：值小于threshold的像素置黑，其余置白，返回黑色像素数
+BMP_FORCEINLINE int binarizeRowsGeneric(unsigned char* buffer, int width, int height, int rowSize,
+                                        int threshold, int bits) {
+    int blackCount = 0;
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = buffer + y * rowSize;
+        for (int x = 0; x < width; x++) {
+            int isBlack = pfGet(row, x, bits) < threshold;
+            pfSetGray(row, x, isBlack ? 0 : 255, bits);
+            blackCount += isBlack;
         }
     }
-    
-    // 如果找到黑色像素，则绘制红色边框
-    if (foundBlackPixel) {
-        // 添加一点边距
-        int margin = 5;
-        minX = (minX - margin) > 0 ? (minX - margin) : 0;
-        maxX = (maxX + margin) < width ? (maxX + margin) : (width - 1);
-        minY = (minY - margin) > 0 ? (minY - margin) : 0;
-        maxY = (maxY + margin) < height ? (maxY + margin) : (height - 1);
-        
-        // 绘制矩形边框
-        if (bitCount == 24) {
-            for (int y = minY; y <= maxY; y++) {
-                for (int x = minX; x <= maxX; x++) {
-                    // 只绘制边框
-                    if (x == minX || x == maxX || y == minY || y == maxY) {
-                        RGB *pixel = (RGB *)(buffer + y * rowSize + x * 3);
-                        pixel->red = 255;
-                        pixel->green = 0;
-                        pixel->blue = 0;
-                    }
-                }
-            }
-        }
-        else if (bitCount == 32) {
-            for (int y = minY; y <= maxY; y++) {
-                for (int x = minX; x <= maxX; x++) {
-                    // 只绘制边框
-                    if (x == minX || x == maxX || y == minY || y == maxY) {
-                        unsigned char *pixel = buffer + y * rowSize + x * 4;
-                        pixel[2] = 255; // R
-                        pixel[1] = 0;   // G
-                        pixel[0] = 0;   // B
-                    }
-                }
-            }
-        }
-        else if (bitCount == 8) {
-            // 对于8位图像，我们需要改变颜色索引
-            // 这里简化处理，将边框像素设置为一个较亮的值
-            for (int y = minY; y <= maxY; y++) {
-                for (int x = minX; x <= maxX; x++) {
-                    // 只绘制边框
-                    if (x == minX || x == maxX || y == minY || y == maxY) {
-                        buffer[y * rowSize + x] = 200; // 使用较亮的灰度值
-                    }
-                }
+    return blackCount;
+}
+
+INSTANTIATE_PIXEL_KERNEL(int, binarizeRows, (unsigned char* buffer, int width, int height, int rowSize, int threshold),
+                         buffer, width, height, rowSize, threshold)
+
+typedef int (*BinarizeKernel)(unsigned char* buffer, int width, int height, int rowSize, int threshold);
+
+// 比较两张二值图：不同的像素写标记色，相同的像素保留原值，返回差异像素数
+BMP_FORCEINLINE int compareRowsGeneric(const unsigned char* buffer1, const unsigned char* buffer2,
+                                       unsigned char* output, int width, int height, int rowSize,
+                                       unsigned char markIndex, int bits) {
+    int diffCount = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row1 = buffer1 + y * rowSize;
+        const unsigned char* row2 = buffer2 + y * rowSize;
+        unsigned char* out = output + y * rowSize;
+        for (int x = 0; x < width; x++) {
+            unsigned char value1 = pfGet(row1, x, bits);
+            unsigned char value2 = pfGet(row2, x, bits);
+            if (value1 != value2) {
+                pfSetMark(out, x, markIndex, bits);
+                diffCount++;
+            } else {
+                pfSetGray(out, x, value1, bits);
             }
+            if (bits == 32) out[x * 4 + 3] = 255; // A
         }
     }
+    return diffCount;
 }
 
-BOOL ConvertToGrayScale(const char *inputPath, const char *grayPath, const char *crossPath) {
-    FILE *inputFile = fopen(inputPath, "rb");
-    if (!inputFile) {
-        printf("无法打开输入文件！\n");
-        return FALSE;
-    }
+INSTANTIATE_PIXEL_KERNEL(int, compareRows,
+                         (const unsigned char* buffer1, const unsigned char* buffer2, unsigned char* output,
+                          int width, int height, int rowSize, unsigned char markIndex),
+                         buffer1, buffer2, output, width, height, rowSize, markIndex)
 
-    FILE *grayFile = fopen(grayPath, "wb");
-    if (!grayFile) {
-        fclose(inputFile);
-        printf("无法创建灰度输出文件！\n");
-        return FALSE;
-    }
+typedef int (*CompareKernel)(const unsigned char* buffer1, const unsigned char* buffer2, unsigned char* output,
+                             int width, int height, int rowSize, unsigned char markIndex);
 
-    FILE *crossFile = fopen(crossPath, "wb");
-    if (!crossFile) {
-        fclose(inputFile);
-        fclose(grayFile);
-        printf("无法创建带十字输出文件！\n");
-        return FALSE;
+// 将已二值化的图像打包为1位：值>=128的像素置1（白）
+BMP_FORCEINLINE void packBinaryRowsGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                           unsigned char* packed, int packedRowSize, int bits) {
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        unsigned char* out = packed + y * packedRowSize;
+        memset(out, 0, packedRowSize);
+        for (int x = 0; x < width; x++) {
+            if (pfGet(row, x, bits) >= 128) out[x >> 3] |= (unsigned char)(0x80 >> (x & 7));
+        }
     }
+}
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
+INSTANTIATE_PIXEL_KERNEL_VOID(packBinaryRows,
+                              (const unsigned char* buffer, int width, int height, int rowSize,
+                               unsigned char* packed, int packedRowSize),
+                              buffer, width, height, rowSize, packed, packedRowSize)
 
-    fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, inputFile);
-    fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, inputFile);
+// ---- 1位/4位打包格式 ----
+// 1位和4位图像不展开成逐像素数据，而是按字节查表：一次查表处理一个字节中的8个或2个像素。
+// 掩码中的像素顺序与字节内的像素顺序一致（最左侧像素在最高位）。
 
-    if (fileHeader.bfType != 0x4D42) {
-        fclose(inputFile);
-        fclose(grayFile);
-        fclose(crossFile);
-        printf("不是有效的BMP文件！\n");
-        return FALSE;
+// 字节中置位的位数
+#define POPCOUNT_2(n) n, n + 1, n + 1, n + 2
+#define POPCOUNT_4(n) POPCOUNT_2(n), POPCOUNT_2(n + 1), POPCOUNT_2(n + 1), POPCOUNT_2(n + 2)
+#define POPCOUNT_6(n) POPCOUNT_4(n), POPCOUNT_4(n + 1), POPCOUNT_4(n + 1), POPCOUNT_4(n + 2)
+static const unsigned char popCountTable[256] = {
+    POPCOUNT_6(0), POPCOUNT_6(1), POPCOUNT_6(1), POPCOUNT_6(2)
+};
+
+// 由调色板生成的查表
+typedef struct {
+    int bitCount;                   // 1或4
+    unsigned char isDark[16];       // 各索引是否为黑色（调色板灰度<128）
+    unsigned char darkMask[256];    // 字节中黑色像素的掩码（1位：8位掩码；4位：高半字节像素为bit1，低半字节为bit0）
+    unsigned char canonical[256];   // 规范化字节：黑色像素为索引0，白色像素为最大索引，与调色板无关
+} PackedTables;
+
+// 根据调色板生成1位/4位查表
+void buildPackedTables(PackedTables* tables, int bitCount, const RGBQUAD* palette) {
+    int indexCount = 1 << bitCount;
+    int pixelsPerByte = 8 / bitCount;
+    int indexMask = indexCount - 1;
+
+    tables->bitCount = bitCount;
+    memset(tables->isDark, 0, sizeof(tables->isDark));
+    for (int i = 0; i < indexCount; i++) {
+        tables->isDark[i] = paletteEntryGray(&palette[i]) < 128;
     }
 
-    if (infoHeader.biBitCount != 1 && infoHeader.biBitCount != 4 && 
-        infoHeader.biBitCount != 8 && infoHeader.biBitCount != 24 && 
-        infoHeader.biBitCount != 32) {
-        fclose(inputFile);
-        fclose(grayFile);
-        fclose(crossFile);
-        printf("不支持的位深度！\n");
-        return FALSE;
+    for (int b = 0; b < 256; b++) {
+        unsigned char mask = 0;
+        unsigned char canonical = 0;
+        for (int p = 0; p < pixelsPerByte; p++) {
+            int shift = (pixelsPerByte - 1 - p) * bitCount;
+            int index = (b >> shift) & indexMask;
+            if (tables->isDark[index]) {
+                mask |= (unsigned char)(1 << (pixelsPerByte - 1 - p));
+            } else {
+                canonical |= (unsigned char)(indexMask << shift);
+            }
+        }
+        tables->darkMask[b] = mask;
+        tables->canonical[b] = canonical;
     }
+}
 
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, grayFile);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, grayFile);
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, crossFile);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, crossFile);
+// 按查表逐字节转换打包数据
+void mapPackedBytes(const unsigned char* table, const unsigned char* src, unsigned char* dst, int size) {
+    for (int i = 0; i < size; i++) {
+        dst[i] = table[src[i]];
+    }
+}
 
-    int width = infoHeader.biWidth;
-    int height = abs(infoHeader.biHeight);
-    int paletteSize = (infoHeader.biBitCount <= 8) ? (1 << infoHeader.biBitCount) : 0;
+// 一行中最后一个字节的有效像素掩码（与darkMask的位顺序一致）
+unsigned char lastByteValidMask(int width, int bitCount) {
+    int pixelsPerByte = 8 / bitCount;
+    int remaining = width % pixelsPerByte;
+    if (remaining == 0) return (unsigned char)((1 << pixelsPerByte) - 1);
+    return (unsigned char)(((1 << remaining) - 1) << (pixelsPerByte - remaining));
+}
 
-    if (paletteSize > 0) {
-        RGBQUAD *palette = (RGBQUAD *)malloc(paletteSize * sizeof(RGBQUAD));
-        if (!palette) {
-            fclose(inputFile);
-            fclose(grayFile);
-            fclose(crossFile);
-            printf("内存分配失败！\n");
-            return FALSE;
+// 生成1位/4位二值化查表：调色板灰度小于threshold的像素映射为索引0（黑），其余映射为最大索引（白）
+void buildBinarizeTable(unsigned char table[256], int bitCount, const RGBQUAD* palette, int threshold) {
+    int indexCount = 1 << bitCount;
+    int pixelsPerByte = 8 / bitCount;
+    int indexMask = indexCount - 1;
+    unsigned char isWhite[16];
+    for (int i = 0; i < indexCount; i++) {
+        isWhite[i] = paletteEntryGray(&palette[i]) >= threshold;
+    }
+    for (int b = 0; b < 256; b++) {
+        unsigned char out = 0;
+        for (int p = 0; p < pixelsPerByte; p++) {
+            int shift = (pixelsPerByte - 1 - p) * bitCount;
+            if (isWhite[(b >> shift) & indexMask]) out |= (unsigned char)(indexMask << shift);
         }
+        table[b] = out;
+    }
+}
 
-        fread(palette, sizeof(RGBQUAD), paletteSize, inputFile);
-        for (int i = 0; i < paletteSize; i++) {
-            unsigned char gray = rgbToGray(palette[i].rgbRed, palette[i].rgbGreen, palette[i].rgbBlue);
-            palette[i].rgbRed = gray;
-            palette[i].rgbGreen = gray;
-            palette[i].rgbBlue = gray;
-            palette[i].rgbReserved = 0;
+// 1位字节展开为4位的4个字节：每个像素的索引0/1写入对应的半字节
+void buildExpand1To4Table(unsigned char table[256][4]) {
+    for (int b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            table[b][k] = (unsigned char)((((b >> (7 - 2 * k)) & 1) << 4) | ((b >> (6 - 2 * k)) & 1));
         }
-        fwrite(palette, sizeof(RGBQUAD), paletteSize, grayFile);
-        fwrite(palette, sizeof(RGBQUAD), paletteSize, crossFile);
-        free(palette);
     }
+}
 
-    int rowSize = ((width * infoHeader.biBitCount + 31) / 32) * 4;
-    unsigned char *rowBuffer = (unsigned char *)malloc(rowSize * height);
-    if (!rowBuffer) {
-        fclose(inputFile);
-        fclose(grayFile);
-        fclose(crossFile);
-        printf("内存分配失败！\n");
-        return FALSE;
+// 为4位图像选择标记色索引：使用图像中未出现的索引（有多个时取最大的），16个索引都已使用时返回-1
+int chooseMarkerIndex4(const unsigned char* buffer, int width, int height, int rowSize) {
+    int histogram[16] = {0};
+    int fullBytes = width / 2;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        for (int i = 0; i < fullBytes; i++) {
+            histogram[row[i] >> 4]++;
+            histogram[row[i] & 0x0F]++;
+        }
+        if (width & 1) histogram[row[fullBytes] >> 4]++;
     }
 
-    for (int y = 0; y < height; y++) {
-        fread(rowBuffer + y * rowSize, 1, rowSize, inputFile);
+    for (int i = 15; i >= 0; i--) {
+        if (histogram[i] == 0) return i;
     }
+    return -1;
+}
 
-    if (infoHeader.biBitCount == 24) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                RGB *pixel = (RGB *)(rowBuffer + y * rowSize + x * 3);
-                unsigned char gray = rgbToGray(pixel->red, pixel->green, pixel->blue);
-                pixel->red = gray;
-                pixel->green = gray;
-                pixel->blue = gray;
-            }
-            fwrite(rowBuffer + y * rowSize, 1, rowSize, grayFile);
+// 把4位图像逐像素展开为8位索引（索引值不变），target每行targetRowSize字节
+void expandRows4To8(const unsigned char* source, int width, int height, int rowSize, unsigned char* target,
+                    int targetRowSize) {
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = source + y * rowSize;
+        unsigned char* out = target + y * targetRowSize;
+        for (int x = 0; x < width; x++) {
+            out[x] = (unsigned char)((x & 1) ? (row[x / 2] & 0x0F) : (row[x / 2] >> 4));
         }
     }
-    else if (infoHeader.biBitCount == 32) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                unsigned char *pixel = rowBuffer + y * rowSize + x * 4;
-                unsigned char gray = rgbToGray(pixel[2], pixel[1], pixel[0]);
-                pixel[0] = gray; // B
-                pixel[1] = gray; // G
-                pixel[2] = gray; // R
-            }
-            fwrite(rowBuffer + y * rowSize, 1, rowSize, grayFile);
-        }
-    }
-    else {
-        for (int y = 0; y < height; y++) {
-            fwrite(rowBuffer + y * rowSize, 1, rowSize, grayFile);
-        }
+}
+
+// ---- 8位索引图像查表 ----
+// 8位图像的像素是调色板索引，不是灰度。二值化、"是否物体"和差异判断都先由调色板生成256项查表，
+// 逐像素操作只是一次查表，对任意调色板都正确；调色板为灰阶（索引即灰度）时结果与直接按像素值处理相同。
+
+// 由8位调色板生成的查表
+typedef struct {
+    unsigned char gray[256];        // 各索引的灰度
+    BOOL identity;                  // gray[i] == i：像素值就是灰度，可以直接按像素值处理
+} IndexTables;
+
+void buildIndexTables(IndexTables* tables, const RGBQUAD* palette) {
+    tables->identity = TRUE;
+    for (int i = 0; i < 256; i++) {
+        tables->gray[i] = paletteEntryGray(&palette[i]);
+        if (tables->gray[i] != i) tables->identity = FALSE;
     }
+}
 
-    if (infoHeader.biBitCount == 24 || infoHeader.biBitCount == 32) {
-        drawCross(rowBuffer, width, height, infoHeader.biBitCount, rowSize);
+// 阈值查表：灰度小于threshold的索引映射为below，其余映射为above
+void buildThresholdTable(unsigned char table[256], const IndexTables* tables, int threshold,
+                         unsigned char below, unsigned char above) {
+    for (int i = 0; i < 256; i++) {
+        table[i] = (tables->gray[i] < threshold) ? below : above;
     }
+}
+
+// 按查表逐像素转换8位图像，只处理每行的有效像素，不改动行尾填充
+void mapIndexRows(const unsigned char table[256], const unsigned char* src, unsigned char* dst,
+                  int width, int height, int rowSize) {
     for (int y = 0; y < height; y++) {
-        fwrite(rowBuffer + y * rowSize, 1, rowSize, crossFile);
+        const unsigned char* in = src + y * rowSize;
+        unsigned char* out = dst + y * rowSize;
+        for (int x = 0; x < width; x++) {
+            out[x] = table[in[x]];
+        }
     }
-
-    free(rowBuffer);
-    fclose(inputFile);
-    fclose(grayFile);
-    fclose(crossFile);
-    return TRUE;
 }
 
-BOOL DetectAndDrawRectangle(const char *inputPath, const char *outputPath) {
-    FILE *inputFile = fopen(inputPath, "rb");
-    if (!inputFile) {
-        printf("无法打开输入文件！\n");
-        return FALSE;
+// 比较两张8位索引图像：按各自调色板的灰度判断像素是否不同，不同的写markIndex，相同的沿用第一张图的索引
+// 返回差异像素数
+int compareIndexedRows(const unsigned char* buffer1, const unsigned char* buffer2,
+                       const IndexTables* tables1, const IndexTables* tables2,
+                       unsigned char* output, int width, int height, int rowSize, unsigned char markIndex) {
+    int diffCount = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row1 = buffer1 + y * rowSize;
+        const unsigned char* row2 = buffer2 + y * rowSize;
+        unsigned char* out = output + y * rowSize;
+        for (int x = 0; x < width; x++) {
+            int differs = tables1->gray[row1[x]] != tables2->gray[row2[x]];
+            out[x] = differs ? markIndex : row1[x];
+            diffCount += differs;
+        }
     }
+    return diffCount;
+}
 
-    FILE *outputFile = fopen(outputPath, "wb");
-    if (!outputFile) {
-        fclose(inputFile);
-        printf("无法创建输出文件！\n");
-        return FALSE;
-    }
+// ---- BMP文件头探测与校验 ----
+// 只读取文件开头的若干字节即可解析并校验文件头，得到规范化的图像描述：
+// 尺寸、行字节数、行顺序、像素格式、调色板和像素数据的偏移。
+// 支持BITMAPINFOHEADER及V2/V3/V4/V5信息头；压缩格式支持BI_RGB、8位BI_RLE8、4位BI_RLE4，
+// 以及掩码为标准BGRA的32位BI_BITFIELDS。
+// 所有尺寸计算用64位整数检查溢出，批处理可以在分配内存之前筛掉损坏或过大的文件。
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_PROBE_BYTES (BMP_FILE_HEADER_SIZE + 124 + 12)     // 文件头 + 最大的V5信息头 + 位域掩码
+#define BMP_MAX_IMAGE_BYTES 0x7FFFFFFFLL                     // 像素缓冲区按int寻址
+#define BMP_MAX_PIXELS (0x7FFFFFFFLL / 4)                    // 访问标记、队列等按像素分配的int数组
 
-    fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, inputFile);
-    fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, inputFile);
+typedef enum {
+    BMP_PROBE_OK,
+    BMP_PROBE_TRUNCATED,                // 文件头或像素数据不完整
+    BMP_PROBE_BAD_SIGNATURE,            // 不是"BM"开头
+    BMP_PROBE_BAD_HEADER,               // 信息头大小或biPlanes无效
+    BMP_PROBE_BAD_DIMENSIONS,           // 宽度或高度无效
+    BMP_PROBE_UNSUPPORTED_BITCOUNT,
+    BMP_PROBE_UNSUPPORTED_COMPRESSION,
+    BMP_PROBE_BAD_PALETTE,              // biClrUsed超过位深度允许的项数
+    BMP_PROBE_BAD_OFFSET,               // 像素数据偏移与文件头、调色板重叠
+    BMP_PROBE_TOO_LARGE                 // 尺寸计算溢出或超过缓冲区上限
+} BmpProbeStatus;
 
-    if (fileHeader.bfType != 0x4D42) {
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("不是有效的BMP文件！\n");
-        return FALSE;
+// 规范化的BMP图像描述
+typedef struct {
+    int width;
+    int height;                         // 行数（biHeight的绝对值）
+    BOOL topDown;                       // biHeight为负：第一行像素数据是图像的顶行
+    int bitCount;
+    DWORD compression;                  // 原始的biCompression
+    int headerSize;                     // 信息头大小：40/52/56/108/124
+    int paletteCount;                   // 文件中的调色板项数（biClrUsed，为0时取2^bitCount）
+    DWORD paletteOffset;                // 调色板在文件中的偏移
+    DWORD dataOffset;                   // 像素数据在文件中的偏移（bfOffBits）
+    DWORD dataSize;                     // 像素数据在文件中的字节数（RLE为压缩后的大小）
+    int rowSize;                        // 每行字节数（4字节对齐）
+    int imageSize;                      // rowSize * height（RLE为解码后的大小）
+    BITMAPINFOHEADER infoHeader;        // 规范化的40字节信息头：BI_RGB，biClrUsed=0，可直接作为输出模板
+} BmpDescriptor;
+
+const char* bmpProbeStatusText(BmpProbeStatus status) {
+    switch (status) {
+    case BMP_PROBE_OK: return "有效的BMP文件";
+    case BMP_PROBE_TRUNCATED: return "文件不完整！";
+    case BMP_PROBE_BAD_SIGNATURE: return "不是有效的BMP文件！";
+    case BMP_PROBE_BAD_HEADER: return "不支持的信息头格式！";
+    case BMP_PROBE_BAD_DIMENSIONS: return "图像尺寸无效！";
+    case BMP_PROBE_UNSUPPORTED_BITCOUNT: return "不支持的位深度！";
+    case BMP_PROBE_UNSUPPORTED_COMPRESSION: return "不支持的压缩格式！";
+    case BMP_PROBE_BAD_PALETTE: return "调色板项数无效！";
+    case BMP_PROBE_BAD_OFFSET: return "像素数据偏移无效！";
+    case BMP_PROBE_TOO_LARGE: return "图像过大！";
+    default: return "未知错误！";
     }
+}
 
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, outputFile);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, outputFile);
+// 按小端序读取，不依赖结构体的对齐方式
+WORD readLe16(const unsigned char* p) {
+    return (WORD)(p[0] | (p[1] << 8));
+}
 
-    int width = infoHeader.biWidth;
-    int height = abs(infoHeader.biHeight);
-    int paletteSize = (infoHeader.biBitCount <= 8) ? (1 << infoHeader.biBitCount) : 0;
+DWORD readLe32(const unsigned char* p) {
+    return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+}
 
-    // 处理调色板
-    if (paletteSize > 0) {
-        RGBQUAD *palette = (RGBQUAD *)malloc(paletteSize * sizeof(RGBQUAD));
-        if (!palette) {
-            fclose(inputFile);
-            fclose(outputFile);
-            printf("内存分配失败！\n");
-            return FALSE;
-        }
+// 从文件开头的size个字节解析并校验文件头；fileSize为文件总长度，未知时传-1（不检查像素数据是否完整）
+BmpProbeStatus ProbeBmpBytes(const unsigned char* bytes, size_t size, long long fileSize, BmpDescriptor* desc) {
+    memset(desc, 0, sizeof(BmpDescriptor));
+    if (size < BMP_FILE_HEADER_SIZE + 4) return BMP_PROBE_TRUNCATED;
+    if (bytes[0] != 'B' || bytes[1] != 'M') return BMP_PROBE_BAD_SIGNATURE;
 
-        fread(palette, sizeof(RGBQUAD), paletteSize, inputFile);
-        fwrite(palette, sizeof(RGBQUAD), paletteSize, outputFile);
-        free(palette);
+    const unsigned char* info = bytes + BMP_FILE_HEADER_SIZE;
+    DWORD headerSize = readLe32(info);
+    if (headerSize != 40 && headerSize != 52 && headerSize != 56 && headerSize != 108 && headerSize != 124) {
+        return BMP_PROBE_BAD_HEADER;
     }
+    if (size < BMP_FILE_HEADER_SIZE + 40) return BMP_PROBE_TRUNCATED;
 
-    int rowSize = ((width * infoHeader.biBitCount + 31) / 32) * 4;
-    unsigned char *rowBuffer = (unsigned char *)malloc(rowSize * height);
-    if (!rowBuffer) {
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("内存分配失败！\n");
-        return FALSE;
+    LONG width = (LONG)readLe32(info + 4);
+    LONG height = (LONG)readLe32(info + 8);
+    int bitCount = readLe16(info + 14);
+    DWORD compression = readLe32(info + 16);
+    DWORD colorsUsed = readLe32(info + 32);
+    if (readLe16(info + 12) != 1) return BMP_PROBE_BAD_HEADER;
+    if (width <= 0 || height == 0 || height == (LONG)0x80000000) return BMP_PROBE_BAD_DIMENSIONS;
+    if (!isSupportedBitCount(bitCount)) return BMP_PROBE_UNSUPPORTED_BITCOUNT;
+
+    // 位域掩码：V2及以上在信息头内，40字节信息头时紧跟在信息头之后
+    DWORD paletteOffset = BMP_FILE_HEADER_SIZE + headerSize;
+    if (compression == BI_BITFIELDS) {
+        const unsigned char* masks = info + 40;
+        if (headerSize == 40) paletteOffset += 12;
+        if (size < BMP_FILE_HEADER_SIZE + 40 + 12) return BMP_PROBE_TRUNCATED;
+        if (bitCount != 32 || readLe32(masks) != 0x00FF0000 || readLe32(masks + 4) != 0x0000FF00 ||
+            readLe32(masks + 8) != 0x000000FF) {
+            return BMP_PROBE_UNSUPPORTED_COMPRESSION;
+        }
+    } else if (compression == BI_RLE8 || compression == BI_RLE4) {
+        // RLE只能用于对应位深度的自下而上图像
+        if (bitCount != ((compression == BI_RLE8) ? 8 : 4) || height < 0) return BMP_PROBE_UNSUPPORTED_COMPRESSION;
+    } else if (compression != BI_RGB) {
+        return BMP_PROBE_UNSUPPORTED_COMPRESSION;
     }
 
-    for (int y = 0; y < height; y++) {
-        fread(rowBuffer + y * rowSize, 1, rowSize, inputFile);
+    int paletteCount = 0;
+    if (bitCount <= 8) {
+        if (colorsUsed > (DWORD)(1 << bitCount)) return BMP_PROBE_BAD_PALETTE;
+        paletteCount = colorsUsed ? (int)colorsUsed : (1 << bitCount);
     }
 
-    // 绘制红色边框
-    drawRedRectangle(rowBuffer, width, height, infoHeader.biBitCount, rowSize);
+    long long rowSize = (((long long)width * bitCount + 31) / 32) * 4;
+    long long rows = (height < 0) ? -(long long)height : height;
+    if (rowSize * rows > BMP_MAX_IMAGE_BYTES || (long long)width * rows > BMP_MAX_PIXELS) {
+        return BMP_PROBE_TOO_LARGE;
+    }
 
-    // 写入输出文件
-    for (int y = 0; y < height; y++) {
-        fwrite(rowBuffer + y * rowSize, 1, rowSize, outputFile);
+    DWORD dataOffset = readLe32(bytes + 10);
+    if (dataOffset < paletteOffset + paletteCount * sizeof(RGBQUAD)) return BMP_PROBE_BAD_OFFSET;
+    long long dataSize = rowSize * rows;
+    if (compression == BI_RLE8 || compression == BI_RLE4) {
+        // 压缩数据的大小取biSizeImage，为0时取到文件末尾
+        dataSize = readLe32(info + 20);
+        if (dataSize == 0 && fileSize >= 0) dataSize = fileSize - dataOffset;
+        if (dataSize <= 0) return BMP_PROBE_TRUNCATED;
     }
+    if (fileSize >= 0 && (long long)dataOffset + dataSize > fileSize) return BMP_PROBE_TRUNCATED;
 
-    free(rowBuffer);
-    fclose(inputFile);
-    fclose(outputFile);
-    return TRUE;
+    desc->width = width;
+    desc->height = (int)rows;
+    desc->topDown = height < 0;
+    desc->bitCount = bitCount;
+    desc->compression = compression;
+    desc->headerSize = (int)headerSize;
+    desc->paletteCount = paletteCount;
+    desc->paletteOffset = paletteOffset;
+    desc->dataOffset = dataOffset;
+    desc->dataSize = (DWORD)dataSize;
+    desc->rowSize = (int)rowSize;
+    desc->imageSize = (int)(rowSize * rows);
+
+    BITMAPINFOHEADER* normalized = &desc->infoHeader;
+    normalized->biSize = sizeof(BITMAPINFOHEADER);
+    normalized->biWidth = width;
+    normalized->biHeight = height;
+    normalized->biPlanes = 1;
+    normalized->biBitCount = (WORD)bitCount;
+    normalized->biCompression = BI_RGB;
+    normalized->biSizeImage = (DWORD)desc->imageSize;
+    normalized->biXPelsPerMeter = (LONG)readLe32(info + 24);
+    normalized->biYPelsPerMeter = (LONG)readLe32(info + 28);
+    normalized->biClrUsed = 0;
+    normalized->biClrImportant = 0;
+    return BMP_PROBE_OK;
 }
 
-// 比较两张二值图像并生成差异图
-BOOL CompareBinaryImages(const char *firstImagePath, const char *secondImagePath, const char *outputPath, int threshold) {
-    FILE *firstFile = fopen(firstImagePath, "rb");
-    if (!firstFile) {
-        printf("无法打开第一个输入文件！\n");
-        return FALSE;
-    }
+// 从打开的文件开头读取并校验文件头，同时按文件长度检查像素数据是否完整；文件位置不确定
+BmpProbeStatus probeBmpStream(FILE* file, BmpDescriptor* desc) {
+    unsigned char bytes[BMP_PROBE_BYTES];
+    memset(desc, 0, sizeof(BmpDescriptor));
+    if (_fseeki64(file, 0, SEEK_END) != 0) return BMP_PROBE_TRUNCATED;
+    long long fileSize = _ftelli64(file);
+    if (fileSize < 0 || _fseeki64(file, 0, SEEK_SET) != 0) return BMP_PROBE_TRUNCATED;
+    size_t size = fread(bytes, 1, sizeof(bytes), file);
+    return ProbeBmpBytes(bytes, size, fileSize, desc);
+}
 
-    FILE *secondFile = fopen(secondImagePath, "rb");
-    if (!secondFile) {
-        fclose(firstFile);
-        printf("无法打开第二个输入文件！\n");
-        return FALSE;
+// 探测文件：只读取文件头，不读取像素数据
+BmpProbeStatus ProbeBmpFile(const char* path, BmpDescriptor* desc) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        memset(desc, 0, sizeof(BmpDescriptor));
+        return BMP_PROBE_TRUNCATED;
     }
+    BmpProbeStatus status = probeBmpStream(file, desc);
+    fclose(file);
+    return status;
+}
 
-    FILE *outputFile = fopen(outputPath, "wb");
-    if (!outputFile) {
-        fclose(firstFile);
-        fclose(secondFile);
-        printf("无法创建输出文件！\n");
-        return FALSE;
+// 读取并校验文件头，读取调色板（不足2^bitCount项的部分补0，palette可为NULL），并定位到像素数据
+// 成功返回NULL，失败返回原因（不打印），供不在主线程打印的调用者使用
+const char* readBmpHeaderError(FILE* file, BmpDescriptor* desc, RGBQUAD* palette) {
+    BmpProbeStatus status = probeBmpStream(file, desc);
+    if (status != BMP_PROBE_OK) {
+        return bmpProbeStatusText(status);
     }
+    if (palette && desc->bitCount <= 8) {
+        memset(palette, 0, (1 << desc->bitCount) * sizeof(RGBQUAD));
+        if (fseek(file, desc->paletteOffset, SEEK_SET) != 0 ||
+            fread(palette, sizeof(RGBQUAD), desc->paletteCount, file) != (size_t)desc->paletteCount) {
+            return "读取调色板失败！";
+        }
+    }
+    if (fseek(file, desc->dataOffset, SEEK_SET) != 0) {
+        return bmpProbeStatusText(BMP_PROBE_TRUNCATED);
+    }
+    return NULL;
+}
 
-    // 读取第一个文件的头信息
-    BITMAPFILEHEADER fileHeader1;
-    BITMAPINFOHEADER infoHeader1;
-    fread(&fileHeader1, sizeof(BITMAPFILEHEADER), 1, firstFile);
-    fread(&infoHeader1, sizeof(BITMAPINFOHEADER), 1, firstFile);
-
-    // 读取第二个文件的头信息
-    BITMAPFILEHEADER fileHeader2;
-    BITMAPINFOHEADER infoHeader2;
-    fread(&fileHeader2, sizeof(BITMAPFILEHEADER), 1, secondFile);
-    fread(&infoHeader2, sizeof(BITMAPINFOHEADER), 1, secondFile);
-
-    // 检查文件格式
-    if (fileHeader1.bfType != 0x4D42 || fileHeader2.bfType != 0x4D42) {
-        fclose(firstFile);
-        fclose(secondFile);
-        fclose(outputFile);
-        printf("输入的不是有效的BMP文件！\n");
+// 同readBmpHeaderError，失败时打印原因
+BOOL readBmpHeader(FILE* file, BmpDescriptor* desc, RGBQUAD* palette) {
+    const char* error = readBmpHeaderError(file, desc, palette);
+    if (error) {
+        printf("%s\n", error);
         return FALSE;
     }
+    return TRUE;
+}
 
-    // 检查图像尺寸是否一致
-    if (infoHeader1.biWidth != infoHeader2.biWidth || 
-        abs(infoHeader1.biHeight) != abs(infoHeader2.biHeight) ||
-        infoHeader1.biBitCount != infoHeader2.biBitCount) {
-        fclose(firstFile);
-        fclose(secondFile);
-        fclose(outputFile);
-        printf("两张图像的尺寸或位深度不一致！\n");
-        return FALSE;
+// 写入BMP文件头、信息头和调色板
+// 以templateHeader为模板，按输出的位深度和调色板重新计算偏移和大小
+void writeBmpHeaders(FILE* file, const BITMAPINFOHEADER* templateHeader, int bitCount,
+                     const RGBQUAD* palette, int paletteCount, int rowSize, int height) {
+    BITMAPINFOHEADER infoHeader = *templateHeader;
+    if (infoHeader.biBitCount != bitCount) {
+        infoHeader.biBitCount = (WORD)bitCount;
+        infoHeader.biClrUsed = 0;
+        infoHeader.biClrImportant = 0;
+        infoHeader.biSizeImage = rowSize * height;
+    } else if (infoHeader.biSizeImage != 0) {
+        infoHeader.biSizeImage = rowSize * height;
     }
+    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    infoHeader.biCompression = BI_RGB;
 
-    // 检查位深度
-    if (infoHeader1.biBitCount != 24 && infoHeader1.biBitCount != 32) {
-        fclose(firstFile);
-        fclose(secondFile);
-        fclose(outputFile);
-        printf("只支持24位和32位BMP图像！\n");
-        return FALSE;
+    BITMAPFILEHEADER fileHeader;
+    fileHeader.bfType = 0x4D42;
+    fileHeader.bfReserved1 = 0;
+    fileHeader.bfReserved2 = 0;
+    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + paletteCount * sizeof(RGBQUAD);
+    fileHeader.bfSize = fileHeader.bfOffBits + rowSize * height;
+
+    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, file);
+    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, file);
+    if (paletteCount > 0) {
+        fwrite(palette, sizeof(RGBQUAD), paletteCount, file);
     }
+}
 
-    // 写入文件头和信息头到输出文件
-    fwrite(&fileHeader1, sizeof(BITMAPFILEHEADER), 1, outputFile);
-    fwrite(&infoHeader1, sizeof(BITMAPINFOHEADER), 1, outputFile);
+// ---- RLE压缩像素数据 ----
+// BI_RLE8/BI_RLE4按行流式解码到未压缩的缓冲区，后续处理与BI_RGB完全相同；
+// 8位和4位输出可选按行编码为RLE，近乎全黑或全白的二值图、标记图和差异图通常能压缩数十倍。
+// 行内的每个片段为"重复次数+值"（编码模式），或"0+像素数+原始像素"（绝对模式，按2字节对齐）；
+// 0,0为行结束，0,1为图像结束，0,2,dx,dy为跳过（跳过的像素为索引0）。
 
-    int width = infoHeader1.biWidth;
-    int height = abs(infoHeader1.biHeight);
-    int rowSize = ((width * infoHeader1.biBitCount + 31) / 32) * 4;
-    int bytesPerPixel = infoHeader1.biBitCount / 8;
+// 流式解码状态：每次解码一行
+typedef struct {
+    FILE* file;
+    int width;
+    int bitCount;               // 8为BI_RLE8，4为BI_RLE4
+    BOOL endOfBitmap;           // 已遇到图像结束标记，后续行全为0
+    int skipRows;               // 跳过标记留下的、待输出的全0行数
+    int startX;                 // 跳过标记之后下一行的起始列
+} RleDecoder;
 
-    // 分配内存
-    unsigned char *buffer1 = (unsigned char *)malloc(rowSize * height);
-    unsigned char *buffer2 = (unsigned char *)malloc(rowSize * height);
-    unsigned char *outputBuffer = (unsigned char *)malloc(rowSize * height);
-
-    if (!buffer1 || !buffer2 || !outputBuffer) {
-        if (buffer1) free(buffer1);
-        if (buffer2) free(buffer2);
-        if (outputBuffer) free(outputBuffer);
-        fclose(firstFile);
-        fclose(secondFile);
-        fclose(outputFile);
-        printf("内存分配失败！\n");
-        return FALSE;
+void initRleDecoder(RleDecoder* decoder, FILE* file, int width, int bitCount) {
+    decoder->file = file;
+    decoder->width = width;
+    decoder->bitCount = bitCount;
+    decoder->endOfBitmap = FALSE;
+    decoder->skipRows = 0;
+    decoder->startX = 0;
+}
+
+// 解码一行到row（rowSize字节，未覆盖的像素为0）；数据提前结束或损坏时返回FALSE
+BOOL decodeRleRow(RleDecoder* decoder, unsigned char* row, int rowSize) {
+    memset(row, 0, rowSize);
+    if (decoder->endOfBitmap) return TRUE;
+    if (decoder->skipRows > 0) {
+        decoder->skipRows--;
+        return TRUE;
     }
 
-    // 读取图像数据
-    fseek(firstFile, fileHeader1.bfOffBits, SEEK_SET);
-    fseek(secondFile, fileHeader2.bfOffBits, SEEK_SET);
+    int width = decoder->width;
+    int bits = decoder->bitCount;
+    int x = decoder->startX;
+    decoder->startX = 0;
+    for (;;) {
+        int count = getc(decoder->file);
+        int value = getc(decoder->file);
+        if (count == EOF || value == EOF) return FALSE;
 
-    fread(buffer1, 1, rowSize * height, firstFile);
-    fread(buffer2, 1, rowSize * height, secondFile);
+        if (count > 0) {
+            // 编码模式：4位时两个半字节交替
+            for (int i = 0; i < count && x < width; i++, x++) {
+                int index = (bits == 8) ? value : ((i & 1) ? (value & 0x0F) : (value >> 4));
+                pfSetIndex(row, x, (unsigned char)index, bits);
+            }
+            continue;
+        }
 
-    // 计算差异
-    int diffPixelCount = 0;
-    int totalPixels = width * height;
+        if (value == 0) return TRUE;
+        if (value == 1) {
+            decoder->endOfBitmap = TRUE;
+            return TRUE;
+        }
+        if (value == 2) {
+            int dx = getc(decoder->file);
+            int dy = getc(decoder->file);
+            if (dx == EOF || dy == EOF) return FALSE;
+            if (dy == 0) {
+                x += dx;
+                continue;
+            }
+            decoder->skipRows = dy - 1;
+            decoder->startX = min(x + dx, width);
+            return TRUE;
+        }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            // 获取两个图像对应位置的像素值
-            unsigned char pixel1Value, pixel2Value;
-            
-            if (infoHeader1.biBitCount == 24) {
-                RGB* pixel1 = (RGB*)(buffer1 + y * rowSize + x * 3);
-                RGB* pixel2 = (RGB*)(buffer2 + y * rowSize + x * 3);
-                RGB* outputPixel = (RGB*)(outputBuffer + y * rowSize + x * 3);
-                
-                // 在二值图中，RGB通常相等，所以只比较一个通道
-                pixel1Value = pixel1->red;
-                pixel2Value = pixel2->red;
-                
-                // 计算差异
-                if (pixel1Value != pixel2Value) {
-                    // 差异像素标记为红色
-                    outputPixel->red = 255;
-                    outputPixel->green = 0;
-                    outputPixel->blue = 0;
-                    diffPixelCount++;
-                } else {
-                    // 相同像素保持原值（白或黑）
-                    outputPixel->red = pixel1Value;
-                    outputPixel->green = pixel1Value;
-                    outputPixel->blue = pixel1Value;
-                }
-            } else { // 32位
-                unsigned char* pixel1 = buffer1 + y * rowSize + x * 4;
-                unsigned char* pixel2 = buffer2 + y * rowSize + x * 4;
-                unsigned char* outputPixel = outputBuffer + y * rowSize + x * 4;
-                
-                pixel1Value = pixel1[2]; // R值
-                pixel2Value = pixel2[2]; // R值
-                
-                if (pixel1Value != pixel2Value) {
-                    // 差异像素标记为红色
-                    outputPixel[0] = 0;    // B
-                    outputPixel[1] = 0;    // G
-                    outputPixel[2] = 255;  // R
-                    outputPixel[3] = 255;  // A
-                    diffPixelCount++;
-                } else {
-                    // 相同像素保持原值
-                    outputPixel[0] = pixel1Value; // B
-                    outputPixel[1] = pixel1Value; // G
-                    outputPixel[2] = pixel1Value; // R
-                    outputPixel[3] = 255;         // A
+        // 绝对模式：value个像素，数据按2字节对齐
+        int byteCount = (bits == 8) ? value : (value + 1) / 2;
+        for (int i = 0; i < byteCount; i++) {
+            int data = getc(decoder->file);
+            if (data == EOF) return FALSE;
+            if (bits == 8) {
+                if (x < width) pfSetIndex(row, x, (unsigned char)data, 8);
+                x++;
+            } else {
+                for (int half = 0; half < 2 && i * 2 + half < value; half++, x++) {
+                    if (x < width) pfSetIndex(row, x, (unsigned char)(half ? (data & 0x0F) : (data >> 4)), 4);
                 }
             }
         }
+        if (byteCount & 1) getc(decoder->file);
     }
+}
 
-    // 写入差异图像
-    fwrite(outputBuffer, 1, rowSize * height, outputFile);
-
-    // 计算差异百分比
-    double diffPercentage = (double)diffPixelCount / totalPixels * 100.0;
-    printf("差异像素数量: %d (%.2f%%)\n", diffPixelCount, diffPercentage);
-
-    // 根据阈值判断是否有新物品
-    if (diffPercentage > threshold) {
-        printf("检测到新物品进入！差异超过阈值 %.2f%%\n", (double)threshold);
-    } else {
-        printf("未检测到明显变化，差异低于阈值 %.2f%%\n", (double)threshold);
+// 读取像素数据到buffer（imageSize字节，按文件中的行顺序），文件位置需在像素数据开头
+// RLE数据逐行解码，不需要整块压缩数据的缓冲区
+BOOL readBmpPixelData(FILE* file, const BmpDescriptor* desc, unsigned char* buffer) {
+    if (desc->compression != BI_RLE8 && desc->compression != BI_RLE4) {
+        return fread(buffer, 1, desc->imageSize, file) == (size_t)desc->imageSize;
     }
 
-    // 释放资源
-    free(buffer1);
-    free(buffer2);
-    free(outputBuffer);
-    fclose(firstFile);
-    fclose(secondFile);
-    fclose(outputFile);
+    RleDecoder decoder;
+    initRleDecoder(&decoder, file, desc->width, desc->bitCount);
+    for (int y = 0; y < desc->height; y++) {
+        if (!decodeRleRow(&decoder, buffer + y * desc->rowSize, desc->rowSize)) return FALSE;
+    }
     return TRUE;
 }
 
-// 将BMP转换为二值图像
-BOOL ConvertToBinary(const char *inputPath, const char *outputPath, int threshold) {
-    FILE *inputFile = fopen(inputPath, "rb");
-    if (!inputFile) {
-        printf("无法打开输入文件！\n");
-        return FALSE;
+// 按相反的行顺序复制像素数据（自上而下与自下而上互换）
+void copyRowsReversed(const unsigned char* source, unsigned char* target, int rowSize, int height) {
+    for (int y = 0; y < height; y++) {
+        memcpy(target + (size_t)(height - 1 - y) * rowSize, source + (size_t)y * rowSize, rowSize);
     }
+}
 
-    FILE *outputFile = fopen(outputPath, "wb");
-    if (!outputFile) {
-        fclose(inputFile);
-        printf("无法创建输出文件！\n");
-        return FALSE;
-    }
+// 读取一个像素的调色板索引（4位或8位）
+BMP_FORCEINLINE int rleIndexAt(const unsigned char* row, int x, int bits) {
+    return (bits == 8) ? row[x] : ((x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4));
+}
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
+// 将一行编码为RLE，写入out（至少2*width+2字节），返回字节数（不含行结束标记）
+// 连续3个以上相同的像素用编码模式，其余像素尽量合并为绝对模式（不足3个时逐个用编码模式）
+int encodeRleRow(const unsigned char* row, int width, int bits, unsigned char* out) {
+    int length = 0;
+    int x = 0;
+    while (x < width) {
+        int index = rleIndexAt(row, x, bits);
+        int run = 1;
+        while (x + run < width && run < 255 && rleIndexAt(row, x + run, bits) == index) run++;
+        if (run >= 3) {
+            out[length++] = (unsigned char)run;
+            out[length++] = (unsigned char)((bits == 8) ? index : (index << 4) | index);
+            x += run;
+            continue;
+        }
+
+        // 收集到下一个长度>=3的重复段之前的像素
+        int literal = 0;
+        while (x + literal < width && literal < 255) {
+            int next = rleIndexAt(row, x + literal, bits);
+            if (x + literal + 2 < width && rleIndexAt(row, x + literal + 1, bits) == next &&
+                rleIndexAt(row, x + literal + 2, bits) == next) {
+                break;
+            }
+            literal++;
+        }
+        if (literal < 3) {
+            for (int i = 0; i < max(literal, 1); i++, x++) {
+                int single = rleIndexAt(row, x, bits);
+                out[length++] = 1;
+                out[length++] = (unsigned char)((bits == 8) ? single : single << 4);
+            }
+            continue;
+        }
 
-    fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, inputFile);
-    fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, inputFile);
+        out[length++] = 0;
+        out[length++] = (unsigned char)literal;
+        int byteCount = (bits == 8) ? literal : (literal + 1) / 2;
+        for (int i = 0; i < byteCount; i++) {
+            if (bits == 8) {
+                out[length++] = (unsigned char)rleIndexAt(row, x + i, 8);
+            } else {
+                int high = rleIndexAt(row, x + i * 2, 4);
+                int low = (i * 2 + 1 < literal) ? rleIndexAt(row, x + i * 2 + 1, 4) : 0;
+                out[length++] = (unsigned char)((high << 4) | low);
+            }
+        }
+        if (byteCount & 1) out[length++] = 0;
+        x += literal;
+    }
+    return length;
+}
 
-    if (fileHeader.bfType != 0x4D42) {
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("不是有效的BMP文件！\n");
-        return FALSE;
+// 写入完整的BMP文件（文件头、信息头、调色板和像素数据），返回写入的像素数据字节数，失败返回-1
+// rle为TRUE且输出为4位或8位自下而上的图像时按行编码为BI_RLE4/BI_RLE8，写完后回填文件大小和压缩后的数据大小
+int writeBmpImage(FILE* file, const BITMAPINFOHEADER* templateHeader, int bitCount,
+                  const RGBQUAD* palette, int paletteCount, const unsigned char* pixels,
+                  int rowSize, int width, int height, BOOL rle) {
+    long start = ftell(file);
+    writeBmpHeaders(file, templateHeader, bitCount, palette, paletteCount, rowSize, height);
+    if (!rle || (bitCount != 4 && bitCount != 8) || templateHeader->biHeight < 0) {
+        return (fwrite(pixels, 1, rowSize * height, file) == (size_t)(rowSize * height)) ? rowSize * height : -1;
     }
 
-    if (infoHeader.biBitCount != 24 && infoHeader.biBitCount != 32) {
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("只支持24位和32位BMP图像！\n");
-        return FALSE;
+    unsigned char* encoded = (unsigned char*)malloc(2 * width + 4);
+    if (!encoded) return -1;
+    DWORD dataSize = 0;
+    for (int y = 0; y < height; y++) {
+        int length = encodeRleRow(pixels + y * rowSize, width, bitCount, encoded);
+        encoded[length++] = 0;
+        encoded[length++] = (y == height - 1) ? 1 : 0;
+        if (fwrite(encoded, 1, length, file) != (size_t)length) {
+            free(encoded);
+            return -1;
+        }
+        dataSize += length;
     }
+    free(encoded);
 
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, outputFile);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, outputFile);
+    // 回填bfSize、biCompression和biSizeImage
+    long end = ftell(file);
+    DWORD fileSize = (DWORD)(end - start);
+    DWORD compression = (bitCount == 8) ? BI_RLE8 : BI_RLE4;
+    fseek(file, start + 2, SEEK_SET);
+    fwrite(&fileSize, sizeof(DWORD), 1, file);
+    fseek(file, start + BMP_FILE_HEADER_SIZE + 16, SEEK_SET);
+    fwrite(&compression, sizeof(DWORD), 1, file);
+    fwrite(&dataSize, sizeof(DWORD), 1, file);
+    fseek(file, end, SEEK_SET);
+    return (int)dataSize;
+}
 
-    int width = infoHeader.biWidth;
-    int height = abs(infoHeader.biHeight);
-    int rowSize = ((width * infoHeader.biBitCount + 31) / 32) * 4;
-    int bytesPerPixel = infoHeader.biBitCount / 8;
+// ---- 直方图与统计 ----
+// 一遍扫描统计R、G、B三个通道和亮度（与灰度图相同的加权灰度）的直方图；最小/最大值、均值、标准差、
+// 暗像素比例和建议阈值都由直方图导出，不再扫描像素。24/32位每次用SSE2计算4个像素的亮度，
+// 索引格式只统计各索引的像素数，合并时按调色板换算到各通道。
 
-    unsigned char *buffer = (unsigned char *)malloc(rowSize * height);
-    if (!buffer) {
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("内存分配失败！\n");
-        return FALSE;
-    }
+#define STATS_CHANNELS 4            // R、G、B、亮度
+#define STATS_LUMA 3
 
-    // 读取图像数据
-    for (int y = 0; y < height; y++) {
-        fread(buffer + y * rowSize, 1, rowSize, inputFile);
-    }
+typedef struct {
+    int bitCount;
+    long long pixelCount;
+    long long histogram[STATS_CHANNELS][256];
+} ImageStats;
 
-    // 处理图像
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            unsigned char pixelValue;
-            if (infoHeader.biBitCount == 24) {
-                RGB* pixel = (RGB*)(buffer + y * rowSize + x * 3);
-                pixelValue = pixel->red;
-            } else { // 32位
-                unsigned char* pixel = buffer + y * rowSize + x * 4;
-                pixelValue = pixel[2]; // R值
-            }
-            
-            if (pixelValue < threshold) {
-                if (infoHeader.biBitCount == 24) {
-                    RGB* pixel = (RGB*)(buffer + y * rowSize + x * 3);
-                    pixel->red = 0;
-                    pixel->green = 0;
-                    pixel->blue = 0;
-                } else { // 32位
-                    unsigned char* pixel = buffer + y * rowSize + x * 4;
-                    pixel[0] = 0;
-                    pixel[1] = 0;
-                    pixel[2] = 0;
-                }
-            } else {
-                if (infoHeader.biBitCount == 24) {
-                    RGB* pixel = (RGB*)(buffer + y * rowSize + x * 3);
-                    pixel->red = 255;
-                    pixel->green = 255;
-                    pixel->blue = 255;
-                } else { // 32位
-                    unsigned char* pixel = buffer + y * rowSize + x * 4;
-                    pixel[0] = 255;
-                    pixel[1] = 255;
-                    pixel[2] = 255;
-                }
-            }
+// 一个线程（或一次灰度转换）的部分直方图；索引格式只用counts[0]记录各索引的像素数
+typedef struct {
+    unsigned int counts[STATS_CHANNELS][256];
+} StatsPartial;
+
+#ifdef BMP_USE_SSE2
+// 4个像素的加权灰度：与rgbToGray相同的双精度运算顺序并截断取整，结果逐像素一致
+static __m128i grayQuad(__m128i r, __m128i g, __m128i b) {
+    __m128d weightRed = _mm_set1_pd(0.299);
+    __m128d weightGreen = _mm_set1_pd(0.587);
+    __m128d weightBlue = _mm_set1_pd(0.114);
+    __m128d low = _mm_add_pd(_mm_add_pd(_mm_mul_pd(weightRed, _mm_cvtepi32_pd(r)),
+                                        _mm_mul_pd(weightGreen, _mm_cvtepi32_pd(g))),
+                             _mm_mul_pd(weightBlue, _mm_cvtepi32_pd(b)));
+    r = _mm_shuffle_epi32(r, _MM_SHUFFLE(3, 2, 3, 2));
+    g = _mm_shuffle_epi32(g, _MM_SHUFFLE(3, 2, 3, 2));
+    b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 2, 3, 2));
+    __m128d high = _mm_add_pd(_mm_add_pd(_mm_mul_pd(weightRed, _mm_cvtepi32_pd(r)),
+                                         _mm_mul_pd(weightGreen, _mm_cvtepi32_pd(g))),
+                              _mm_mul_pd(weightBlue, _mm_cvtepi32_pd(b)));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+}
+#endif
+
+// 统计一行24/32位像素；writeGray为TRUE时同时把像素转为灰度（与grayPixelRows的结果相同）
+BMP_FORCEINLINE void accumulateStatsRowGeneric(unsigned char* row, int width, StatsPartial* partial,
+                                               BOOL writeGray, int bits) {
+    int bytes = bits / 8;
+    int x = 0;
+#ifdef BMP_USE_SSE2
+    // 24位按4字节读取每个像素，会多读下一个像素的第一个字节，所以最后一个像素留给标量部分
+    __m128i byteMask = _mm_set1_epi32(0xFF);
+    for (; x + 4 + (bits == 24) <= width; x += 4) {
+        unsigned char* quad = row + x * bytes;
+        __m128i word;
+        if (bits == 32) {
+            word = _mm_loadu_si128((const __m128i*)quad);
+        } else {
+            DWORD pixels[4];
+            for (int k = 0; k < 4; k++) memcpy(&pixels[k], quad + k * 3, 4);
+            word = _mm_loadu_si128((const __m128i*)pixels);
         }
+        int gray[4];
+        _mm_storeu_si128((__m128i*)gray, grayQuad(_mm_and_si128(_mm_srli_epi32(word, 16), byteMask),
+                                                   _mm_and_si128(_mm_srli_epi32(word, 8), byteMask),
+                                                   _mm_and_si128(word, byteMask)));
+        for (int k = 0; k < 4; k++) {
+            unsigned char* pixel = quad + k * bytes;
+            partial->counts[0][pixel[2]]++;
+            partial->counts[1][pixel[1]]++;
+            partial->counts[2][pixel[0]]++;
+            partial->counts[STATS_LUMA][gray[k]]++;
+            if (writeGray) pixel[0] = pixel[1] = pixel[2] = (unsigned char)gray[k];
+        }
+    }
+#endif
+    for (; x < width; x++) {
+        unsigned char* pixel = row + x * bytes;
+        unsigned char gray = rgbToGray(pixel[2], pixel[1], pixel[0]);
+        partial->counts[0][pixel[2]]++;
+        partial->counts[1][pixel[1]]++;
+        partial->counts[2][pixel[0]]++;
+        partial->counts[STATS_LUMA][gray]++;
+        if (writeGray) pixel[0] = pixel[1] = pixel[2] = gray;
     }
+}
 
-    // 写入处理后的图像数据
-    for (int y = 0; y < height; y++) {
-        fwrite(buffer + y * rowSize, 1, rowSize, outputFile);
+// 统计[firstRow, lastRow)行，结果累加到partial；writeGray只对24/32位有效（索引格式的灰度图只改调色板）
+void accumulateStatsRows(unsigned char* buffer, int width, int bitCount, int rowSize, int firstRow, int lastRow,
+                         StatsPartial* partial, BOOL writeGray) {
+    for (int y = firstRow; y < lastRow; y++) {
+        unsigned char* row = buffer + y * rowSize;
+        if (bitCount == 32) {
+            accumulateStatsRowGeneric(row, width, partial, writeGray, 32);
+        } else if (bitCount == 24) {
+            accumulateStatsRowGeneric(row, width, partial, writeGray, 24);
+        } else if (bitCount == 8) {
+            for (int x = 0; x < width; x++) partial->counts[0][row[x]]++;
+        } else if (bitCount == 4) {
+            for (int x = 0; x < width; x++) partial->counts[0][(x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4)]++;
+        } else {
+            for (int x = 0; x < width; x++) partial->counts[0][(row[x >> 3] >> (7 - (x & 7))) & 1]++;
+        }
     }
+}
 
-    free(buffer);
-    fclose(inputFile);
-    fclose(outputFile);
-    return TRUE;
+void initImageStats(ImageStats* stats, int bitCount) {
+    memset(stats, 0, sizeof(ImageStats));
+    stats->bitCount = bitCount;
 }
 
-// 将JPG转换为BMP - 使用命令行工具
-BOOL ConvertJpgToBmp(const char *jpgPath, const char *bmpPath) {
-    FILE *originalFile = fopen(jpgPath, "rb");
-    if (!originalFile) {
-        printf("无法打开JPG文件！\n");
-        return FALSE;
+// 把部分直方图合并到stats；索引格式按调色板（转换前的原始调色板）换算各通道和亮度
+void mergeStatsPartial(ImageStats* stats, const StatsPartial* partial, const RGBQUAD* palette) {
+    if (stats->bitCount > 8) {
+        for (int c = 0; c < STATS_CHANNELS; c++) {
+            for (int v = 0; v < 256; v++) stats->histogram[c][v] += partial->counts[c][v];
+        }
+        for (int v = 0; v < 256; v++) stats->pixelCount += partial->counts[STATS_LUMA][v];
+        return;
     }
-    fclose(originalFile);
-    
-    // 使用系统画图工具，但不使用start命令，避免创建新进程导致闪烁
-    char command[600] = {0};
-    sprintf(command, "mspaint \"%s\"", jpgPath);
-    
-    printf("系统将打开图片 %s\n", jpgPath);
-    printf("请在打开的画图程序中执行:\n");
-    printf("1. 点击'文件'>'另存为'\n");
-    printf("2. 选择保存类型为'24位位图(*.bmp;*.dib)'\n");
-    printf("3. 文件名输入: %s\n", bmpPath);
-    printf("4. 点击'保存'\n");
-    printf("5. 关闭画图程序\n\n");
-    printf("按任意键打开图片...\n");
-    getchar();
-    
-    // 执行命令
-    system(command);
-    
-    // 检查文件是否已创建
-    FILE *outFile = fopen(bmpPath, "rb");
-    if (outFile) {
-        fclose(outFile);
-        printf("检测到BMP文件已创建: %s\n", bmpPath);
-        return TRUE;
-    } else {
-        printf("未检测到BMP文件，可能转换失败\n");
+    for (int i = 0; i < (1 << stats->bitCount); i++) {
+        unsigned int count = partial->counts[0][i];
+        stats->histogram[0][palette[i].rgbRed] += count;
+        stats->histogram[1][palette[i].rgbGreen] += count;
+        stats->histogram[2][palette[i].rgbBlue] += count;
+        stats->histogram[STATS_LUMA][paletteEntryGray(&palette[i])] += count;
+        stats->pixelCount += count;
+    }
+}
+
+// 二值化和物体检测比较的像素值的直方图：24/32位为红色通道，索引格式为调色板项的灰度
+const long long* thresholdHistogram(const ImageStats* stats) {
+    return stats->histogram[(stats->bitCount > 8) ? 0 : STATS_LUMA];
+}
+
+// ---- 二值图的游程表示 ----
+// 每行按列顺序记录黑色像素的游程[start, end)，由阈值化一遍扫描直接生成。
+// 连通区域标记和二值差异图在游程上进行，处理量与边缘数量成正比而不是与像素数量成正比，适合稀疏场景。
+
+typedef struct {
+    int start;                  // 游程的第一列
+    int end;                    // 游程最后一列的下一列
+} PixelRun;
+
+typedef struct {
+    int width;
+    int height;
+    int* rowStart;              // 第y行的游程为runs[rowStart[y]] .. runs[rowStart[y + 1] - 1]
+    PixelRun* runs;
+    int runCount;
+} RunImage;
+
+// 按最坏情况（每行(width+1)/2个游程）分配，生成过程中不再扩容
+BOOL createRunImage(RunImage* image, int width, int height, ScratchArena* arena) {
+    image->width = width;
+    image->height = height;
+    image->runCount = 0;
+    image->rowStart = (int*)arenaAlloc(arena, (height + 1) * sizeof(int));
+    image->runs = (PixelRun*)arenaAlloc(arena, (size_t)height * ((width + 1) / 2) * sizeof(PixelRun));
+    if (!image->rowStart || !image->runs) {
+        if (image->rowStart) arenaRelease(arena, image->rowStart);
+        if (image->runs) arenaRelease(arena, image->runs);
         return FALSE;
     }
+    return TRUE;
 }
 
-// 使用广度优先搜索查找连通区域
-void findConnectedComponent(unsigned char* buffer, int width, int height, int bitCount, int rowSize, 
-                            int startX, int startY, VisitedMap* visited, BoundingBox* bbox, int* pixelCount) {
-    
-    // 只支持24位和32位图
-    if (bitCount != 24 && bitCount != 32) return;
-    
-    int pixelsPerByte = 8 / bitCount;
-    int bytesPerPixel = bitCount / 8;
-    
-    // 初始化
-    *pixelCount = 0;
-    bbox->minX = width;
-    bbox->minY = height;
-    bbox->maxX = 0;
-    bbox->maxY = 0;
-    
-    // 创建队列
-    Point* queue = (Point*)malloc(width * height * sizeof(Point));
-    if (!queue) return;
-    
-    int front = 0;
-    int rear = 0;
-    
-    // 添加起始点
-    queue[rear].x = startX;
-    queue[rear].y = startY;
-    rear++;
-    markVisited(visited, startX, startY);
-    
-    // 方向数组，表示8个方向
-    int dx[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
-    int dy[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
+void freeRunImage(RunImage* image, ScratchArena* arena) {
+    arenaRelease(arena, image->runs);
+    arenaRelease(arena, image->rowStart);
+}
+
+// 一段像素数据是否全为value（size为1或16的倍数）；32位时不比较Alpha字节
+BMP_FORCEINLINE int isUniformChunk(const unsigned char* data, int size, unsigned char value, int bits) {
+    if (size == 1) return data[0] == value;
+#ifdef BMP_USE_SSE2
+    __m128i maskVector = (bits == 32) ? _mm_set1_epi32(0x00FFFFFF) : _mm_set1_epi8((char)0xFF);
+    __m128i patternVector = value ? maskVector : _mm_setzero_si128();
+    for (int i = 0; i < size; i += 16) {
+        __m128i word = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + i)), maskVector);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(word, patternVector)) != 0xFFFF) return 0;
+    }
+    return 1;
+#else
+    unsigned long long mask = (bits == 32) ? 0x00FFFFFF00FFFFFFULL : ~0ULL;
+    unsigned long long pattern = value ? mask : 0ULL;
+    for (int i = 0; i < size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, data + i, 8);
+        if ((word & mask) != pattern) return 0;
+    }
+    return 1;
+#endif
+}
+
+// 阈值化为游程：像素值(pfGet) < threshold 为黑色，threshold需在1..255之间
+// 按块（打包格式1字节，其余16个像素）跳过全白的块和游程内全黑的块；返回所有像素是否只有0和255两种值
+BMP_FORCEINLINE int thresholdToRunsGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                           int threshold, RunImage* image, int bits) {
+    int binary = 1;
+    int count = 0;
+    int chunkPixels = (bits < 8) ? 8 / bits : 16;
+    int chunkBytes = (bits < 8) ? 1 : bits * 2;
+    PixelRun* runs = image->runs;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        image->rowStart[y] = count;
+        int runStart = -1;
+        for (int x = 0; x < width; x++) {
+            if ((x % chunkPixels) == 0 && x + chunkPixels <= width) {
+                const unsigned char* chunk = row + x * bits / 8;
+                if (isUniformChunk(chunk, chunkBytes, 0xFF, bits)) {
+                    if (runStart >= 0) {
+                        runs[count].start = runStart;
+                        runs[count++].end = x;
+                        runStart = -1;
+                    }
+                    x += chunkPixels - 1;
+                    continue;
+                }
+                if (runStart >= 0 && isUniformChunk(chunk, chunkBytes, 0x00, bits)) {
+                    x += chunkPixels - 1;
+                    continue;
+                }
+            }
+            unsigned char value = pfGet(row, x, bits);
+            if (value != 0 && value != 255) binary = 0;
+            if (value < threshold) {
+                if (runStart < 0) runStart = x;
+            } else if (runStart >= 0) {
+                runs[count].start = runStart;
+                runs[count++].end = x;
+                runStart = -1;
+            }
+        }
+        if (runStart >= 0) {
+            runs[count].start = runStart;
+            runs[count++].end = width;
+        }
+    }
+    image->rowStart[height] = count;
+    image->runCount = count;
+    return binary;
+}
+
+INSTANTIATE_PIXEL_KERNEL(int, thresholdToRuns,
+                         (const unsigned char* buffer, int width, int height, int rowSize,
+                          int threshold, RunImage* image),
+                         buffer, width, height, rowSize, threshold, image)
+
+typedef int (*ThresholdRunsKernel)(const unsigned char* buffer, int width, int height, int rowSize,
+                                   int threshold, RunImage* image);
+
+// 在一行输出中把[start, end)写为灰度值
+void fillGrayRun(unsigned char* row, int start, int end, unsigned char value, int bitCount) {
+    if (bitCount == 8) {
+        memset(row + start, value, end - start);
+    } else if (bitCount == 24 || value == 255) {
+        memset(row + start * (bitCount / 8), value, (end - start) * (bitCount / 8));
+    } else {
+        // 32位：BGR为灰度值，Alpha为255
+        DWORD pixel = 0xFF000000u | ((DWORD)value << 16) | ((DWORD)value << 8) | value;
+        for (int x = start; x < end; x++) memcpy(row + x * 4, &pixel, 4);
+    }
+}
+
+// 由两张二值图（像素值只有0和255）的游程生成8/24/32位差异图，返回差异像素数
+// 相同像素写第一张图的值，黑色游程的对称差写标记色；逐行合并两张图的游程边界
+int compareRunImages(const RunImage* runs1, const RunImage* runs2, unsigned char* output, int rowSize,
+                     unsigned char markIndex, int bitCount) {
+    int width = runs1->width;
+    int diffCount = 0;
+    for (int y = 0; y < runs1->height; y++) {
+        unsigned char* out = output + y * rowSize;
+        const PixelRun* row1 = runs1->runs + runs1->rowStart[y];
+        const PixelRun* row2 = runs2->runs + runs2->rowStart[y];
+        int count1 = runs1->rowStart[y + 1] - runs1->rowStart[y];
+        int count2 = runs2->rowStart[y + 1] - runs2->rowStart[y];
+
+        fillGrayRun(out, 0, width, 255, bitCount);
+        for (int i = 0; i < count1; i++) {
+            fillGrayRun(out, row1[i].start, row1[i].end, 0, bitCount);
+        }
+
+        // 游程边界按start0,end0,start1,...排列；边界处两张图的黑白奇偶性之异或即差异状态
+        int index1 = 0;
+        int index2 = 0;
+        int diffStart = -1;
+        while (index1 < count1 * 2 || index2 < count2 * 2) {
+            int next1 = width + 1;
+            int next2 = width + 1;
+            if (index1 < count1 * 2) next1 = (index1 & 1) ? row1[index1 / 2].end : row1[index1 / 2].start;
+            if (index2 < count2 * 2) next2 = (index2 & 1) ? row2[index2 / 2].end : row2[index2 / 2].start;
+            int position = min(next1, next2);
+            if (next1 == position) index1++;
+            if (next2 == position) index2++;
+            BOOL differs = ((index1 ^ index2) & 1) != 0;
+            if (differs && diffStart < 0) {
+                diffStart = position;
+            } else if (!differs && diffStart >= 0) {
+                for (int x = diffStart; x < position; x++) pfSetMark(out, x, markIndex, bitCount);
+                diffCount += position - diffStart;
+                diffStart = -1;
+            }
+        }
+    }
+    return diffCount;
+}
+
+// 比较两张1位/4位打包图像，结果写为4位图像：相同像素沿用第一张图的索引，差异像素写markIndex
+// 1位输入先通过查表展开为4位（索引0/1不变）；返回差异像素数
+int comparePackedImages(const unsigned char* buffer1, const unsigned char* buffer2,
+                        const PackedTables* tables1, const PackedTables* tables2,
+                        int width, int height, int rowSize, int bitCount,
+                        unsigned char* output, int outputRowSize, unsigned char markIndex) {
+    int bytesPerRow = (width * bitCount + 7) / 8;
+    unsigned char validMask = lastByteValidMask(width, bitCount);
+    unsigned char markByte = (unsigned char)((markIndex << 4) | markIndex);
+    int diffCount = 0;
+
+    unsigned char expand[256][4];
+    if (bitCount == 1) buildExpand1To4Table(expand);
+
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row1 = buffer1 + y * rowSize;
+        const unsigned char* row2 = buffer2 + y * rowSize;
+        unsigned char* out = output + y * outputRowSize;
+        for (int i = 0; i < bytesPerRow; i++) {
+            unsigned char diff = tables1->darkMask[row1[i]] ^ tables2->darkMask[row2[i]];
+            if (i == bytesPerRow - 1) diff &= validMask;
+            diffCount += popCountTable[diff];
+
+            if (bitCount == 1) {
+                for (int k = 0; k < 4; k++) {
+                    unsigned char diffNibbles = (unsigned char)(expand[diff][k] * 15);
+                    out[i * 4 + k] = (unsigned char)((expand[row1[i]][k] & ~diffNibbles) | (markByte & diffNibbles));
+                }
+            } else {
+                unsigned char diffNibbles = (unsigned char)(((diff & 2) ? 0xF0 : 0) | ((diff & 1) ? 0x0F : 0));
+                out[i] = (unsigned char)((row1[i] & ~diffNibbles) | (markByte & diffNibbles));
+            }
+        }
+    }
+    return diffCount;
+}
+
+// 比较两张4位图像，差异图为8位：相同像素沿用第一张图的索引，不同像素写markIndex（16个索引都已使用时的输出）
+int comparePacked4To8(const unsigned char* buffer1, const unsigned char* buffer2,
+                      const PackedTables* tables1, const PackedTables* tables2, int width, int height, int rowSize,
+                      unsigned char* output, int outputRowSize, unsigned char markIndex) {
+    int diffCount = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row1 = buffer1 + y * rowSize;
+        const unsigned char* row2 = buffer2 + y * rowSize;
+        unsigned char* out = output + y * outputRowSize;
+        for (int x = 0; x < width; x++) {
+            int shift = (x & 1) ? 0 : 4;
+            int index1 = (row1[x / 2] >> shift) & 0x0F;
+            int index2 = (row2[x / 2] >> shift) & 0x0F;
+            if (tables1->isDark[index1] != tables2->isDark[index2]) {
+                out[x] = markIndex;
+                diffCount++;
+            } else {
+                out[x] = (unsigned char)index1;
+            }
+        }
+    }
+    return diffCount;
+}
+
+// 绘制十字的函数
+void drawCross(unsigned char *buffer, int width, int height, int bitCount, int rowSize) {
+    if (bitCount == 24) {
+        drawCrossGeneric(buffer, width, height, rowSize, 24);
+    } else if (bitCount == 32) {
+        drawCrossGeneric(buffer, width, height, rowSize, 32);
+    }
+}
+
+// 绘制红色边框的函数
+void drawRedRectangle(unsigned char *buffer, int width, int height, int bitCount, int rowSize) {
+    if (bitCount != 8 && bitCount != 24 && bitCount != 32) return;
+
+    // 寻找黑色区域的边界
+    BoundingBox box;
+    int foundBlackPixel = SELECT_PIXEL_KERNEL(findDarkBounds, bitCount)(buffer, width, height, rowSize, &box);
     
-    while (front < rear) {
-        Point current = queue[front++];
-        int x = current.x;
-        int y = current.y;
-        
-        // 更新边界框
-        if (x < bbox->minX) bbox->minX = x;
-        if (y < bbox->minY) bbox->minY = y;
-        if (x > bbox->maxX) bbox->maxX = x;
-        if (y > bbox->maxY) bbox->maxY = y;
-        
-        (*pixelCount)++;
+    // 如果找到黑色像素，则绘制红色边框
+    if (foundBlackPixel) {
+        // 添加一点边距
+        int margin = 5;
+        box.minX = (box.minX - margin) > 0 ? (box.minX - margin) : 0;
+        box.maxX = (box.maxX + margin) < width ? (box.maxX + margin) : (width - 1);
+        box.minY = (box.minY - margin) > 0 ? (box.minY - margin) : 0;
+        box.maxY = (box.maxY + margin) < height ? (box.maxY + margin) : (height - 1);
         
-        // 检查周围8个方向
-        for (int i = 0; i < 8; i++) {
-            int newX = x + dx[i];
-            int newY = y + dy[i];
-            
-            // 检查边界
-            if (newX < 0 || newX >= width || newY < 0 || newY >= height) continue;
-            
-            // 检查是否已访问
-            if (isVisited(visited, newX, newY)) continue;
-            
-            // 检查是否是黑色像素（二值图中物体通常为黑色）
-            unsigned char pixelValue;
-            if (bitCount == 24) {
-                RGB* pixel = (RGB*)(buffer + newY * rowSize + newX * 3);
-                pixelValue = pixel->red; // 在二值图中，r=g=b
-            } else { // bitCount == 32
-                unsigned char* pixel = buffer + newY * rowSize + newX * 4;
-                pixelValue = pixel[2]; // R值
+        // 对于8位图像，这里简化处理，将边框像素设置为一个较亮的灰度值
+        SELECT_PIXEL_KERNEL(drawBox, bitCount)(buffer, rowSize, box, 200);
+    }
+}
+
+// 调色板各项转为灰度（索引图像只需转换调色板）
+void grayPaletteEntries(RGBQUAD* palette, int paletteCount) {
+    for (int i = 0; i < paletteCount; i++) {
+        unsigned char gray = paletteEntryGray(&palette[i]);
+        palette[i].rgbRed = gray;
+        palette[i].rgbGreen = gray;
+        palette[i].rgbBlue = gray;
+        palette[i].rgbReserved = 0;
+    }
+}
+
+// 24/32位像素逐个转为灰度，索引图像的像素不变
+void grayPixelRows(unsigned char* buffer, int width, int height, int bitCount, int rowSize) {
+    if (bitCount == 24) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                RGB *pixel = (RGB *)(buffer + y * rowSize + x * 3);
+                unsigned char gray = rgbToGray(pixel->red, pixel->green, pixel->blue);
+                pixel->red = gray;
+                pixel->green = gray;
+                pixel->blue = gray;
             }
-            
-            // 如果是黑色像素（值小于128，二值图中通常为0）
-            if (pixelValue < 128) {
-                queue[rear].x = newX;
-                queue[rear].y = newY;
-                rear++;
-                markVisited(visited, newX, newY);
+        }
+    }
+    else if (bitCount == 32) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                unsigned char *pixel = buffer + y * rowSize + x * 4;
+                unsigned char gray = rgbToGray(pixel[2], pixel[1], pixel[0]);
+                pixel[0] = gray; // B
+                pixel[1] = gray; // G
+                pixel[2] = gray; // R
             }
         }
     }
-    
-    free(queue);
 }
 
-// 分析并标记二值图中的物体
-BOOL MarkObjectsInBinaryImage(const char *inputPath, const char *outputPath) {
+// 转换为灰度图，并另存一份带中心十字的灰度图
+// stats不为NULL时在灰度转换的同一遍扫描中统计直方图（由调用者初始化）
+// arena不为NULL时临时内存从内存池分配，由调用者在处理完后重置
+BOOL ConvertToGrayScaleStats(const char *inputPath, const char *grayPath, const char *crossPath, ImageStats *stats,
+                             ScratchArena *arena) {
+    METRICS_TIMER_START(timer);
     FILE *inputFile = fopen(inputPath, "rb");
     if (!inputFile) {
         printf("无法打开输入文件！\n");
         return FALSE;
     }
 
-    // 读取文件头和信息头
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
-    size_t readSize;
-    
-    readSize = fread(&fileHeader, sizeof(BITMAPFILEHEADER), 1, inputFile);
-    if (readSize != 1) {
-        printf("读取文件头失败！\n");
+    FILE *grayFile = fopen(grayPath, "wb");
+    if (!grayFile) {
         fclose(inputFile);
+        printf("无法创建灰度输出文件！\n");
         return FALSE;
     }
-    
-    readSize = fread(&infoHeader, sizeof(BITMAPINFOHEADER), 1, inputFile);
-    if (readSize != 1) {
-        printf("读取信息头失败！\n");
+
+    FILE *crossFile = fopen(crossPath, "wb");
+    if (!crossFile) {
+        fclose(inputFile);
+        fclose(grayFile);
+        printf("无法创建带十字输出文件！\n");
+        return FALSE;
+    }
+
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    if (!readBmpHeader(inputFile, &desc, palette)) {
+        fclose(inputFile);
+        fclose(grayFile);
+        fclose(crossFile);
+        return FALSE;
+    }
+
+    int width = desc.width;
+    int height = desc.height;
+    int rowSize = desc.rowSize;
+    int paletteSize = (desc.bitCount <= 8) ? (1 << desc.bitCount) : 0;
+    BITMAPINFOHEADER infoHeader = desc.infoHeader;
+    RGBQUAD sourcePalette[256];
+    memcpy(sourcePalette, palette, sizeof(sourcePalette));
+
+    grayPaletteEntries(palette, paletteSize);
+    writeBmpHeaders(grayFile, &infoHeader, desc.bitCount, palette, paletteSize, rowSize, height);
+    writeBmpHeaders(crossFile, &infoHeader, desc.bitCount, palette, paletteSize, rowSize, height);
+    METRICS_LAP(timer, STAGE_HEADER);
+    unsigned char *rowBuffer = (unsigned char *)arenaAlloc(arena, rowSize * height);
+    if (!rowBuffer) {
+        fclose(inputFile);
+        fclose(grayFile);
+        fclose(crossFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    if (!readBmpPixelData(inputFile, &desc, rowBuffer)) {
+        arenaRelease(arena, rowBuffer);
+        fclose(inputFile);
+        fclose(grayFile);
+        fclose(crossFile);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)desc.dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+
+    if (stats) {
+        StatsPartial partial;
+        memset(&partial, 0, sizeof(partial));
+        stats->bitCount = desc.bitCount;
+        accumulateStatsRows(rowBuffer, width, desc.bitCount, rowSize, 0, height, &partial, TRUE);
+        mergeStatsPartial(stats, &partial, sourcePalette);
+    } else {
+        grayPixelRows(rowBuffer, width, height, infoHeader.biBitCount, rowSize);
+    }
+    METRICS_LAP(timer, STAGE_COMPUTE);
+
+    fwrite(rowBuffer, 1, rowSize * height, grayFile);
+    METRICS_LAP(timer, STAGE_WRITE);
+
+    if (infoHeader.biBitCount == 24 || infoHeader.biBitCount == 32) {
+        drawCross(rowBuffer, width, height, infoHeader.biBitCount, rowSize);
+    }
+    METRICS_LAP(timer, STAGE_DRAW);
+
+    fwrite(rowBuffer, 1, rowSize * height, crossFile);
+    METRICS_COUNT(COUNTER_BYTES_WRITTEN, 2LL * rowSize * height);
+    METRICS_COUNT(COUNTER_IMAGES, 1);
+
+    arenaRelease(arena, rowBuffer);
+    fclose(inputFile);
+    fclose(grayFile);
+    fclose(crossFile);
+    METRICS_LAP(timer, STAGE_WRITE);
+    return TRUE;
+}
+
+BOOL ConvertToGrayScaleEx(const char *inputPath, const char *grayPath, const char *crossPath, ScratchArena *arena) {
+    return ConvertToGrayScaleStats(inputPath, grayPath, crossPath, NULL, arena);
+}
+
+BOOL ConvertToGrayScale(const char *inputPath, const char *grayPath, const char *crossPath) {
+    return ConvertToGrayScaleEx(inputPath, grayPath, crossPath, NULL);
+}
+
+BOOL DetectAndDrawRectangle(const char *inputPath, const char *outputPath) {
+    FILE *inputFile = fopen(inputPath, "rb");
+    if (!inputFile) {
+        printf("无法打开输入文件！\n");
+        return FALSE;
+    }
+
+    FILE *outputFile = fopen(outputPath, "wb");
+    if (!outputFile) {
+        fclose(inputFile);
+        printf("无法创建输出文件！\n");
+        return FALSE;
+    }
+
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    if (!readBmpHeader(inputFile, &desc, palette)) {
         fclose(inputFile);
+        fclose(outputFile);
         return FALSE;
     }
 
-    if (fileHeader.bfType != 0x4D42) {
-        fclose(inputFile);
-        printf("不是有效的BMP文件！\n");
-        return FALSE;
+    BITMAPINFOHEADER infoHeader = desc.infoHeader;
+    int width = desc.width;
+    int height = desc.height;
+    int rowSize = desc.rowSize;
+    int paletteSize = (desc.bitCount <= 8) ? (1 << desc.bitCount) : 0;
+    writeBmpHeaders(outputFile, &infoHeader, desc.bitCount, palette, paletteSize, rowSize, height);
+
+    unsigned char *rowBuffer = (unsigned char *)malloc(rowSize * height);
+    if (!rowBuffer) {
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    if (!readBmpPixelData(inputFile, &desc, rowBuffer)) {
+        free(rowBuffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+
+    // 绘制红色边框
+    drawRedRectangle(rowBuffer, width, height, infoHeader.biBitCount, rowSize);
+
+    // 写入输出文件
+    for (int y = 0; y < height; y++) {
+        fwrite(rowBuffer + y * rowSize, 1, rowSize, outputFile);
+    }
+
+    free(rowBuffer);
+    fclose(inputFile);
+    fclose(outputFile);
+    return TRUE;
+}
+
+// 差异图的位深度：1位/4位图像的差异图输出为4位，以便用调色板中的红色标记差异；
+// 4位图像的16个索引都已使用时没有可改为红色的索引，输出为8位（buffer为第一张图）
+int compareOutputBitCount(const unsigned char* buffer, int width, int height, int bitCount, int rowSize) {
+    if (bitCount == 4 && chooseMarkerIndex4(buffer, width, height, rowSize) < 0) return 8;
+    return (bitCount == 1 || bitCount == 4) ? 4 : bitCount;
+}
+
+// 比较两张已读入的图像，差异图写入outputBuffer（outputBitCount位，由compareOutputBitCount确定，每行outputRowSize字节），
+// 调色板写入outputPalette（256项）；返回差异像素数
+int compareImageBuffers(unsigned char* buffer1, const RGBQUAD* palette1, unsigned char* buffer2,
+                        const RGBQUAD* palette2, int width, int height, int bitCount, int rowSize,
+                        unsigned char* outputBuffer, int outputBitCount, int outputRowSize, RGBQUAD* outputPalette,
+                        ScratchArena* arena) {
+    int paletteCount = (bitCount <= 8) ? (1 << bitCount) : 0;
+    int diffPixelCount;
+    unsigned char markIndex;
+    memset(outputBuffer, 0, outputRowSize * height);
+    memset(outputPalette, 0, 256 * sizeof(RGBQUAD));
+
+    if (bitCount == 1 || bitCount == 4) {
+        // 打包格式：按字节查表比较黑白掩码
+        PackedTables tables1, tables2;
+        buildPackedTables(&tables1, bitCount, palette1);
+        buildPackedTables(&tables2, bitCount, palette2);
+
+        memcpy(outputPalette, palette1, paletteCount * sizeof(RGBQUAD));
+        if (outputBitCount == 8) {
+            // 16个索引都已使用：输出8位，索引0~15不变，索引16为红色
+            markIndex = 16;
+            diffPixelCount = comparePacked4To8(buffer1, buffer2, &tables1, &tables2, width, height, rowSize,
+                                               outputBuffer, outputRowSize, markIndex);
+        } else {
+            markIndex = (bitCount == 1) ? 2 : (unsigned char)chooseMarkerIndex4(buffer1, width, height, rowSize);
+            diffPixelCount = comparePackedImages(buffer1, buffer2, &tables1, &tables2, width, height, rowSize,
+                                                 bitCount, outputBuffer, outputRowSize, markIndex);
+        }
+    } else {
+        // 8位图像沿用第一张图的调色板，并预留索引240作为红色差异标记
+        markIndex = 240;
+        BOOL grayPalettes = TRUE;
+        IndexTables indexTables1, indexTables2;
+        if (bitCount == 8) {
+            memcpy(outputPalette, palette1, 256 * sizeof(RGBQUAD));
+            buildIndexTables(&indexTables1, palette1);
+            buildIndexTables(&indexTables2, palette2);
+            grayPalettes = indexTables1.identity && indexTables2.identity;
+        }
+
+        // 8位图像两张都是二值图（像素值只有0和255）时合并游程生成差异图，否则逐像素比较；
+        // 调色板不是灰阶时像素值不是灰度，按两张图各自的灰度查表比较；
+        // 24/32位像素较宽，提取游程的开销超过直接比较，始终逐像素比较
+        // 按位深度选择一次内核，内层循环中不再判断位深度
+        RunImage runs1, runs2;
+        BOOL haveRuns1 = (bitCount == 8) && grayPalettes && createRunImage(&runs1, width, height, arena);
+        BOOL haveRuns2 = haveRuns1 && createRunImage(&runs2, width, height, arena);
+        ThresholdRunsKernel runsKernel = SELECT_PIXEL_KERNEL(thresholdToRuns, bitCount);
+        if (haveRuns2 && runsKernel(buffer1, width, height, rowSize, 128, &runs1) &&
+            runsKernel(buffer2, width, height, rowSize, 128, &runs2)) {
+            diffPixelCount = compareRunImages(&runs1, &runs2, outputBuffer, rowSize, markIndex, bitCount);
+        } else if (!grayPalettes) {
+            diffPixelCount = compareIndexedRows(buffer1, buffer2, &indexTables1, &indexTables2, outputBuffer,
+                                                width, height, rowSize, markIndex);
+        } else {
+            CompareKernel compareKernel = SELECT_PIXEL_KERNEL(compareRows, bitCount);
+            diffPixelCount = compareKernel(buffer1, buffer2, outputBuffer, width, height, rowSize, markIndex);
+        }
+        if (haveRuns2) freeRunImage(&runs2, arena);
+        if (haveRuns1) freeRunImage(&runs1, arena);
+    }
+
+    if (bitCount <= 8) {
+        outputPalette[markIndex].rgbRed = 255;
+        outputPalette[markIndex].rgbGreen = 0;
+        outputPalette[markIndex].rgbBlue = 0;
+        outputPalette[markIndex].rgbReserved = 0;
+    }
+    return diffPixelCount;
+}
+
+// 输出差异像素比例，并按阈值（百分比）判断是否有新物品进入
+void reportDifference(int diffPixelCount, int totalPixels, int threshold) {
+    double diffPercentage = (double)diffPixelCount / totalPixels * 100.0;
+    printf("差异像素数量: %d (%.2f%%)\n", diffPixelCount, diffPercentage);
+
+    // 根据阈值判断是否有新物品
+    if (diffPercentage > threshold) {
+        printf("检测到新物品进入！差异超过阈值 %.2f%%\n", (double)threshold);
+    } else {
+        printf("未检测到明显变化，差异低于阈值 %.2f%%\n", (double)threshold);
+    }
+}
+
+// 比较两张二值图像并生成差异图
+// rleOutput为TRUE时4位/8位差异图按RLE压缩；outDiffCount不为NULL时写入差异像素数
+// arena不为NULL时临时内存从内存池分配，由调用者在处理完后重置
+BOOL CompareBinaryImagesEx(const char *firstImagePath, const char *secondImagePath, const char *outputPath,
+                           int threshold, BOOL rleOutput, int *outDiffCount, ScratchArena *arena) {
+    METRICS_TIMER_START(timer);
+    FILE *firstFile = fopen(firstImagePath, "rb");
+    if (!firstFile) {
+        printf("无法打开第一个输入文件！\n");
+        return FALSE;
+    }
+
+    FILE *secondFile = fopen(secondImagePath, "rb");
+    if (!secondFile) {
+        fclose(firstFile);
+        printf("无法打开第二个输入文件！\n");
+        return FALSE;
+    }
+
+    FILE *outputFile = fopen(outputPath, "wb");
+    if (!outputFile) {
+        fclose(firstFile);
+        fclose(secondFile);
+        printf("无法创建输出文件！\n");
+        return FALSE;
+    }
+
+    // 读取并校验两个文件的头信息和调色板（两张图的调色板可以不同，1位/4位图像按各自的调色板判断黑白）
+    BmpDescriptor desc1, desc2;
+    RGBQUAD palette1[256];
+    RGBQUAD palette2[256];
+    if (!readBmpHeader(firstFile, &desc1, palette1) || !readBmpHeader(secondFile, &desc2, palette2)) {
+        fclose(firstFile);
+        fclose(secondFile);
+        fclose(outputFile);
+        return FALSE;
+    }
+
+    // 检查图像尺寸是否一致
+    if (desc1.width != desc2.width || desc1.height != desc2.height || desc1.bitCount != desc2.bitCount) {
+        fclose(firstFile);
+        fclose(secondFile);
+        fclose(outputFile);
+        printf("两张图像的尺寸或位深度不一致！\n");
+        return FALSE;
+    }
+
+    BITMAPINFOHEADER infoHeader1 = desc1.infoHeader;
+    int bitCount = desc1.bitCount;
+    int width = desc1.width;
+    int height = desc1.height;
+    int rowSize = desc1.rowSize;
+
+    METRICS_LAP(timer, STAGE_HEADER);
+
+    // 分配内存
+    unsigned char *buffer1 = (unsigned char *)arenaAlloc(arena, rowSize * height);
+    unsigned char *buffer2 = (unsigned char *)arenaAlloc(arena, rowSize * height);
+
+    if (!buffer1 || !buffer2) {
+        if (buffer1) arenaRelease(arena, buffer1);
+        if (buffer2) arenaRelease(arena, buffer2);
+        fclose(firstFile);
+        fclose(secondFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    // 读取图像数据
+    fseek(firstFile, desc1.dataOffset, SEEK_SET);
+    fseek(secondFile, desc2.dataOffset, SEEK_SET);
+    if (!readBmpPixelData(firstFile, &desc1, buffer1) || !readBmpPixelData(secondFile, &desc2, buffer2)) {
+        arenaRelease(arena, buffer1);
+        arenaRelease(arena, buffer2);
+        fclose(firstFile);
+        fclose(secondFile);
+        fclose(outputFile);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)desc1.dataSize + desc2.dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+
+    // 行顺序不同时把第二张图改为第一张图的行顺序，按显示位置逐行比较
+    if (desc1.topDown != desc2.topDown) {
+        unsigned char *flipped = (unsigned char *)arenaAlloc(arena, rowSize * height);
+        if (!flipped) {
+            arenaRelease(arena, buffer1);
+            arenaRelease(arena, buffer2);
+            fclose(firstFile);
+            fclose(secondFile);
+            fclose(outputFile);
+            printf("内存分配失败！\n");
+            return FALSE;
+        }
+        copyRowsReversed(buffer2, flipped, rowSize, height);
+        arenaRelease(arena, buffer2);
+        buffer2 = flipped;
+    }
+
+    // 4位图像要看像素中是否有未使用的索引，读入后才能确定差异图的位深度
+    int outputBitCount = compareOutputBitCount(buffer1, width, height, bitCount, rowSize);
+    int outputRowSize = ((width * outputBitCount + 31) / 32) * 4;
+    unsigned char *outputBuffer = (unsigned char *)arenaAlloc(arena, outputRowSize * height);
+    if (!outputBuffer) {
+        arenaRelease(arena, buffer1);
+        arenaRelease(arena, buffer2);
+        fclose(firstFile);
+        fclose(secondFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    // 计算差异
+    int totalPixels = width * height;
+    RGBQUAD outputPalette[256];
+    int diffPixelCount = compareImageBuffers(buffer1, palette1, buffer2, palette2, width, height, bitCount, rowSize,
+                                             outputBuffer, outputBitCount, outputRowSize, outputPalette, arena);
+    int outputPaletteCount = (outputBitCount <= 8) ? (1 << outputBitCount) : 0;
+    METRICS_LAP(timer, STAGE_COMPUTE);
+
+    // 写入文件头、信息头、调色板和差异图像
+    int writtenBytes = writeBmpImage(outputFile, &infoHeader1, outputBitCount, outputPalette, outputPaletteCount,
+                                     outputBuffer, outputRowSize, width, height, rleOutput);
+    METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)max(writtenBytes, 0));
+
+    // 计算差异百分比并按阈值判断
+    reportDifference(diffPixelCount, totalPixels, threshold);
+    if (outDiffCount) *outDiffCount = diffPixelCount;
+
+    // 释放资源
+    arenaRelease(arena, buffer1);
+    arenaRelease(arena, buffer2);
+    arenaRelease(arena, outputBuffer);
+    fclose(firstFile);
+    fclose(secondFile);
+    fclose(outputFile);
+    METRICS_COUNT(COUNTER_IMAGES, 1);
+    METRICS_LAP(timer, STAGE_WRITE);
+    return TRUE;
+}
+
+BOOL CompareBinaryImages(const char *firstImagePath, const char *secondImagePath, const char *outputPath, int threshold) {
+    return CompareBinaryImagesEx(firstImagePath, secondImagePath, outputPath, threshold, FALSE, NULL, NULL);
+}
+
+// 按阈值二值化已读入的图像，并把索引图像的调色板改为灰阶
+void binarizeImageBuffer(unsigned char* buffer, RGBQUAD* palette, int width, int height, int bitCount, int rowSize,
+                         int threshold) {
+    int paletteCount = (bitCount <= 8) ? (1 << bitCount) : 0;
+    if (bitCount == 1 || bitCount == 4) {
+        // 按调色板灰度生成查表，每个字节一次查表完成8个或2个像素的二值化
+        unsigned char binarizeTable[256];
+        buildBinarizeTable(binarizeTable, bitCount, palette, threshold);
+        mapPackedBytes(binarizeTable, buffer, buffer, rowSize * height);
+    } else if (bitCount == 8) {
+        // 按调色板灰度生成查表，每个像素一次查表
+        IndexTables indexTables;
+        unsigned char binarizeTable[256];
+        buildIndexTables(&indexTables, palette);
+        buildThresholdTable(binarizeTable, &indexTables, threshold, 0, 255);
+        mapIndexRows(binarizeTable, buffer, buffer, width, height, rowSize);
+    } else {
+        // 按位深度选择一次内核，内层循环中不再判断位深度
+        BinarizeKernel binarizeKernel = SELECT_PIXEL_KERNEL(binarizeRows, bitCount);
+        binarizeKernel(buffer, width, height, rowSize, threshold);
+    }
+
+    // 索引图像输出灰阶调色板，使索引0和最大索引分别对应黑和白
+    for (int i = 0; i < paletteCount; i++) {
+        BYTE gray = (BYTE)(i * 255 / (paletteCount - 1));
+        palette[i].rgbRed = palette[i].rgbGreen = palette[i].rgbBlue = gray;
+        palette[i].rgbReserved = 0;
+    }
+}
+
+// 将BMP转换为二值图像
+// outputBitCount为0时输出与输入相同的位深度，为1时输出打包的1位二值图
+// rleOutput为TRUE时4位/8位输出按RLE压缩
+// arena不为NULL时临时内存从内存池分配，由调用者在处理完后重置
+BOOL ConvertToBinaryEx(const char *inputPath, const char *outputPath, int threshold, int outputBitCount,
+                       BOOL rleOutput, ScratchArena *arena) {
+    METRICS_TIMER_START(timer);
+    FILE *inputFile = fopen(inputPath, "rb");
+    if (!inputFile) {
+        printf("无法打开输入文件！\n");
+        return FALSE;
+    }
+
+    FILE *outputFile = fopen(outputPath, "wb");
+    if (!outputFile) {
+        fclose(inputFile);
+        printf("无法创建输出文件！\n");
+        return FALSE;
+    }
+
+    // 读取并校验文件头和调色板
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    if (!readBmpHeader(inputFile, &desc, palette)) {
+        fclose(inputFile);
+        fclose(outputFile);
+        return FALSE;
+    }
+
+    BITMAPINFOHEADER infoHeader = desc.infoHeader;
+    int bitCount = desc.bitCount;
+    int paletteCount = (bitCount <= 8) ? (1 << bitCount) : 0;
+    int width = desc.width;
+    int height = desc.height;
+    int rowSize = desc.rowSize;
+    METRICS_LAP(timer, STAGE_HEADER);
+
+    unsigned char *buffer = (unsigned char *)arenaAlloc(arena, rowSize * height);
+    if (!buffer) {
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    // 读取图像数据
+    fseek(inputFile, desc.dataOffset, SEEK_SET);
+    if (!readBmpPixelData(inputFile, &desc, buffer)) {
+        arenaRelease(arena, buffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)desc.dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+
+    // 处理图像
+    binarizeImageBuffer(buffer, palette, width, height, bitCount, rowSize, threshold);
+
+    if (outputBitCount == 1 && bitCount != 1) {
+        // 打包为1位二值图
+        int packedRowSize = ((width + 31) / 32) * 4;
+        unsigned char *packed = (unsigned char *)arenaAlloc(arena, packedRowSize * height);
+        if (!packed) {
+            arenaRelease(arena, buffer);
+            fclose(inputFile);
+            fclose(outputFile);
+            printf("内存分配失败！\n");
+            return FALSE;
+        }
+        SELECT_PIXEL_KERNEL(packBinaryRows, bitCount)(buffer, width, height, rowSize, packed, packedRowSize);
+        METRICS_LAP(timer, STAGE_COMPUTE);
+
+        RGBQUAD binaryPalette[2] = { {0, 0, 0, 0}, {255, 255, 255, 0} };
+        writeBmpHeaders(outputFile, &infoHeader, 1, binaryPalette, 2, packedRowSize, height);
+        fwrite(packed, 1, packedRowSize * height, outputFile);
+        METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)packedRowSize * height);
+        arenaRelease(arena, packed);
+    } else {
+        // 写入处理后的图像数据
+        METRICS_LAP(timer, STAGE_COMPUTE);
+        int writtenBytes = writeBmpImage(outputFile, &infoHeader, bitCount, palette, paletteCount,
+                                         buffer, rowSize, width, height, rleOutput);
+        METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)max(writtenBytes, 0));
+    }
+
+    arenaRelease(arena, buffer);
+    fclose(inputFile);
+    fclose(outputFile);
+    METRICS_COUNT(COUNTER_IMAGES, 1);
+    METRICS_LAP(timer, STAGE_WRITE);
+    return TRUE;
+}
+
+// 将BMP转换为与输入位深度相同的二值图像
+BOOL ConvertToBinary(const char *inputPath, const char *outputPath, int threshold) {
+    return ConvertToBinaryEx(inputPath, outputPath, threshold, 0, FALSE, NULL);
+}
+
+// 将JPG转换为BMP - 使用命令行工具
+BOOL ConvertJpgToBmp(const char *jpgPath, const char *bmpPath) {
+    FILE *originalFile = fopen(jpgPath, "rb");
+    if (!originalFile) {
+        printf("无法打开JPG文件！\n");
+        return FALSE;
+    }
+    fclose(originalFile);
+    
+    // 使用系统画图工具，但不使用start命令，避免创建新进程导致闪烁
+    char command[600] = {0};
+    sprintf(command, "mspaint \"%s\"", jpgPath);
+    
+    printf("系统将打开图片 %s\n", jpgPath);
+    printf("请在打开的画图程序中执行:\n");
+    printf("1. 点击'文件'>'另存为'\n");
+    printf("2. 选择保存类型为'24位位图(*.bmp;*.dib)'\n");
+    printf("3. 文件名输入: %s\n", bmpPath);
+    printf("4. 点击'保存'\n");
+    printf("5. 关闭画图程序\n\n");
+    printf("按任意键打开图片...\n");
+    getchar();
+    
+    // 执行命令
+    system(command);
+    
+    // 检查文件是否已创建
+    FILE *outFile = fopen(bmpPath, "rb");
+    if (outFile) {
+        fclose(outFile);
+        printf("检测到BMP文件已创建: %s\n", bmpPath);
+        return TRUE;
+    } else {
+        printf("未检测到BMP文件，可能转换失败\n");
+        return FALSE;
+    }
+}
+
+// 使用广度优先搜索查找连通区域（通用实现，bits为常量）
+// queue由调用者提供，容量至少为width*height，可在同一次检测的多个连通区域间复用
+// features不为NULL时，在出队时累积该像素的矩、周长和灰度（灰度取自graySource，为NULL时取自buffer本身）
+BMP_FORCEINLINE void findConnectedComponentGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                                   int startX, int startY, VisitedMap* visited, Point* queue,
+                                                   BoundingBox* bbox, int* pixelCount,
+                                                   const GraySource* graySource, ObjectFeatures* features, int bits) {
+    unsigned char* visitedData = visited->data;
+    
+    // 初始化
+    *pixelCount = 0;
+    bbox->minX = width;
+    bbox->minY = height;
+    bbox->maxX = 0;
+    bbox->maxY = 0;
+    if (features) memset(features, 0, sizeof(ObjectFeatures));
+    
+    int front = 0;
+    int rear = 0;
+    
+    // 添加起始点
+    queue[rear].x = startX;
+    queue[rear].y = startY;
+    rear++;
+    visitedData[startY * width + startX] = 1;
+    
+    // 方向数组，表示8个方向
+    static const int dx[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
+    static const int dy[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
+    
+    while (front < rear) {
+        Point current = queue[front++];
+        int x = current.x;
+        int y = current.y;
+        const unsigned char* row = buffer + y * rowSize;
+        
+        // 更新边界框
+        if (x < bbox->minX) bbox->minX = x;
+        if (y < bbox->minY) bbox->minY = y;
+        if (x > bbox->maxX) bbox->maxX = x;
+        if (y > bbox->maxY) bbox->maxY = y;
+        
+        (*pixelCount)++;
+        
+        // 累积特征：周长按4邻域中非物体像素（含图像边界）的边数计算
+        if (features) {
+            int exposedEdges = 0;
+            if (x == 0 || pfGet(row, x - 1, bits) >= 128) exposedEdges++;
+            if (x == width - 1 || pfGet(row, x + 1, bits) >= 128) exposedEdges++;
+            if (y == 0 || pfGet(row - rowSize, x, bits) >= 128) exposedEdges++;
+            if (y == height - 1 || pfGet(row + rowSize, x, bits) >= 128) exposedEdges++;
+            
+            unsigned char gray = graySource ? sampleGray(graySource, x, y) : pfGet(row, x, bits);
+            accumulateObjectFeatures(features, x, y, exposedEdges, gray);
+        }
+        
+        // 检查周围8个方向
+        for (int i = 0; i < 8; i++) {
+            int newX = x + dx[i];
+            int newY = y + dy[i];
+            
+            // 检查边界
+            if (newX < 0 || newX >= width || newY < 0 || newY >= height) continue;
+            
+            // 检查是否已访问
+            if (visitedData[newY * width + newX]) continue;
+            
+            // 如果是黑色像素（值小于128，二值图中通常为0）
+            if (pfGet(buffer + newY * rowSize, newX, bits) < 128) {
+                queue[rear].x = newX;
+                queue[rear].y = newY;
+                rear++;
+                visitedData[newY * width + newX] = 1;
+            }
+        }
+    }
+    
+    if (features) finalizeObjectFeatures(features);
+    METRICS_COUNT(COUNTER_COMPONENTS, 1);
+    METRICS_COUNT(COUNTER_PIXELS_VISITED, *pixelCount);
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(findConnectedComponent,
+                              (const unsigned char* buffer, int width, int height, int rowSize,
+                               int startX, int startY, VisitedMap* visited, Point* queue,
+                               BoundingBox* bbox, int* pixelCount,
+                               const GraySource* graySource, ObjectFeatures* features),
+                              buffer, width, height, rowSize, startX, startY, visited, queue,
+                              bbox, pixelCount, graySource, features)
+
+// 填写物体记录
+void recordObject(ObjectInfo* object, const BoundingBox* bbox, int pixelCount, const ObjectFeatures* features) {
+    object->bbox = *bbox;
+    object->pixelCount = pixelCount;
+    object->pixelCountEstimated = FALSE;
+    if (features) {
+        object->features = *features;
+    } else {
+        memset(&object->features, 0, sizeof(ObjectFeatures));
+    }
+}
+
+// 读取与输入图像同尺寸的灰度图，用于计算物体平均灰度
+// 成功时*data和*palette需由调用者用arenaRelease释放（palette可能为NULL）
+BOOL loadGraySource(const char* grayPath, int width, int height, GraySource* source,
+                    unsigned char** data, RGBQUAD** palette, ScratchArena* arena) {
+    FILE* grayFile = fopen(grayPath, "rb");
+    if (!grayFile) {
+        printf("无法打开灰度图！\n");
+        return FALSE;
+    }
+
+    BmpDescriptor desc;
+    BmpProbeStatus status = probeBmpStream(grayFile, &desc);
+    if (status != BMP_PROBE_OK) {
+        fclose(grayFile);
+        printf("灰度图: %s\n", bmpProbeStatusText(status));
+        return FALSE;
+    }
+
+    int bitCount = desc.bitCount;
+    if (desc.width != width || desc.height != height ||
+        (bitCount != 8 && bitCount != 24 && bitCount != 32)) {
+        fclose(grayFile);
+        printf("灰度图尺寸与输入图像不一致或位深度不支持！\n");
+        return FALSE;
+    }
+
+    *palette = NULL;
+    if (bitCount == 8) {
+        *palette = (RGBQUAD*)arenaCalloc(arena, 256, sizeof(RGBQUAD));
+        if (!*palette || fseek(grayFile, desc.paletteOffset, SEEK_SET) != 0 ||
+            fread(*palette, sizeof(RGBQUAD), desc.paletteCount, grayFile) != (size_t)desc.paletteCount) {
+            if (*palette) arenaRelease(arena, *palette);
+            fclose(grayFile);
+            printf("读取灰度图调色板失败！\n");
+            return FALSE;
+        }
+    }
+
+    int rowSize = desc.rowSize;
+    *data = (unsigned char*)arenaAlloc(arena, rowSize * height);
+    if (!*data) {
+        if (*palette) arenaRelease(arena, *palette);
+        fclose(grayFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    fseek(grayFile, desc.dataOffset, SEEK_SET);
+    if (!readBmpPixelData(grayFile, &desc, *data)) {
+        arenaRelease(arena, *data);
+        if (*palette) arenaRelease(arena, *palette);
+        fclose(grayFile);
+        printf("读取灰度图数据失败！\n");
+        return FALSE;
+    }
+    fclose(grayFile);
+
+    source->data = *data;
+    source->bitCount = bitCount;
+    source->rowSize = rowSize;
+    source->palette = *palette;
+    return TRUE;
+}
+
+// 在内存中的二值图上查找物体（全分辨率BFS，通用实现）
+BMP_FORCEINLINE int detectObjectsGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                         const DetectOptions* options, const GraySource* graySource,
+                                         VisitedMap* visited, Point* queue,
+                                         ObjectInfo* objects, int maxObjects, int* objectCount, int bits) {
+    ObjectFeatures features;
+    ObjectFeatures* featuresPtr = options->computeFeatures ? &features : NULL;
+    unsigned char* visitedData = visited->data;
+    int foundCount = 0;
+
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        unsigned char* visitedRow = visitedData + y * width;
+        for (int x = 0; x < width; x++) {
+            // 1位/4位规范化数据：整字节全白时一次跳过该字节内的所有像素
+            if (bits == 1 || bits == 4) {
+                int perByte = 8 / bits;
+                if ((x % perByte) == 0 && x + perByte <= width && row[x / perByte] == 0xFF) {
+                    memset(visitedRow + x, 1, perByte);
+                    x += perByte - 1;
+                    continue;
+                }
+            }
+
+            // 检查像素是否已访问
+            if (visitedRow[x]) continue;
+
+            // 如果是黑色像素(值小于128)
+            if (pfGet(row, x, bits) < 128) {
+                BoundingBox bbox;
+                int pixelCount = 0;
+
+                // 查找连通区域
+                findConnectedComponentGeneric(buffer, width, height, rowSize, x, y, visited, queue,
+                                              &bbox, &pixelCount, graySource, featuresPtr, bits);
+
+                // 过滤小区域
+                if (pixelCount >= options->minObjectSize) {
+                    if (*objectCount < maxObjects) {
+                        recordObject(&objects[(*objectCount)++], &bbox, pixelCount, featuresPtr);
+                    }
+                    foundCount++;
+                }
+            } else {
+                // 标记白色区域为已访问，加速处理
+                visitedRow[x] = 1;
+            }
+        }
+    }
+    return foundCount;
+}
+
+INSTANTIATE_PIXEL_KERNEL(int, detectObjects,
+                         (const unsigned char* buffer, int width, int height, int rowSize,
+                          const DetectOptions* options, const GraySource* graySource,
+                          VisitedMap* visited, Point* queue, ObjectInfo* objects, int maxObjects, int* objectCount),
+                         buffer, width, height, rowSize, options, graySource, visited, queue,
+                         objects, maxObjects, objectCount)
+
+// 并查集查找（路径减半）
+int findRunRoot(int* parent, int index) {
+    while (parent[index] != index) {
+        parent[index] = parent[parent[index]];
+        index = parent[index];
+    }
+    return index;
+}
+
+// 合并时以较小的游程序号为根，根即区域在行优先顺序中的第一个游程
+void unionRuns(int* parent, int a, int b) {
+    int rootA = findRunRoot(parent, a);
+    int rootB = findRunRoot(parent, b);
+    if (rootA < rootB) {
+        parent[rootB] = rootA;
+    } else if (rootB < rootA) {
+        parent[rootA] = rootB;
+    }
+}
+
+// 在游程上标记8连通区域（并查集），相邻两行中列范围重叠或对角相接的游程属于同一区域
+// 区域按第一个游程（即第一个像素）的行优先顺序编号，结果与逐像素BFS完全相同
+// 返回超过最小尺寸的物体总数，其中前maxObjects个写入objects；内存不足时返回-1
+// starts不为NULL时同时写入各物体的第一个像素（行优先），即外轮廓跟踪的起点
+int labelRunComponents(const RunImage* image, const DetectOptions* options, ObjectInfo* objects, Point* starts,
+                       int maxObjects, int* objectCount, ScratchArena* arena) {
+    int runCount = image->runCount;
+    *objectCount = 0;
+    if (runCount == 0) return 0;
+
+    int* parent = (int*)arenaAlloc(arena, runCount * sizeof(int));
+    int* label = (int*)arenaAlloc(arena, runCount * sizeof(int));
+    BoundingBox* boxes = (BoundingBox*)arenaAlloc(arena, runCount * sizeof(BoundingBox));
+    int* pixelCounts = (int*)arenaAlloc(arena, runCount * sizeof(int));
+    Point* firstPixels = starts ? (Point*)arenaAlloc(arena, runCount * sizeof(Point)) : NULL;
+    if (!parent || !label || !boxes || !pixelCounts || (starts && !firstPixels)) {
+        if (firstPixels) arenaRelease(arena, firstPixels);
+        if (parent) arenaRelease(arena, parent);
+        if (label) arenaRelease(arena, label);
+        if (boxes) arenaRelease(arena, boxes);
+        if (pixelCounts) arenaRelease(arena, pixelCounts);
+        return -1;
+    }
+    for (int i = 0; i < runCount; i++) parent[i] = i;
+
+    // 逐行与上一行的游程双指针合并
+    for (int y = 1; y < image->height; y++) {
+        int above = image->rowStart[y - 1];
+        int aboveEnd = image->rowStart[y];
+        int current = image->rowStart[y];
+        int currentEnd = image->rowStart[y + 1];
+        while (above < aboveEnd && current < currentEnd) {
+            const PixelRun* a = &image->runs[above];
+            const PixelRun* b = &image->runs[current];
+            if (a->start <= b->end && b->start <= a->end) unionRuns(parent, above, current);
+            if (a->end < b->end) {
+                above++;
+            } else {
+                current++;
+            }
+        }
+    }
+
+    // 按游程顺序给每个根分配区域编号，并累计边界框和像素数
+    int componentCount = 0;
+    long long pixelsVisited = 0;
+    for (int y = 0; y < image->height; y++) {
+        for (int i = image->rowStart[y]; i < image->rowStart[y + 1]; i++) {
+            const PixelRun* run = &image->runs[i];
+            int root = findRunRoot(parent, i);
+            int component;
+            if (root == i) {
+                component = componentCount++;
+                boxes[component].minX = run->start;
+                boxes[component].maxX = run->end - 1;
+                boxes[component].minY = y;
+                boxes[component].maxY = y;
+                pixelCounts[component] = 0;
+                if (firstPixels) {
+                    firstPixels[component].x = run->start;
+                    firstPixels[component].y = y;
+                }
+            } else {
+                component = label[root];
+                BoundingBox* box = &boxes[component];
+                if (run->start < box->minX) box->minX = run->start;
+                if (run->end - 1 > box->maxX) box->maxX = run->end - 1;
+                box->maxY = y;
+            }
+            label[i] = component;
+            pixelCounts[component] += run->end - run->start;
+            pixelsVisited += run->end - run->start;
+        }
+    }
+
+    int foundCount = 0;
+    for (int i = 0; i < componentCount; i++) {
+        if (pixelCounts[i] < options->minObjectSize) continue;
+        if (*objectCount < maxObjects) {
+            if (starts) starts[*objectCount] = firstPixels[i];
+            recordObject(&objects[(*objectCount)++], &boxes[i], pixelCounts[i], NULL);
+        }
+        foundCount++;
+    }
+    METRICS_COUNT(COUNTER_COMPONENTS, componentCount);
+    METRICS_COUNT(COUNTER_PIXELS_VISITED, pixelsVisited);
+
+    if (firstPixels) arenaRelease(arena, firstPixels);
+    arenaRelease(arena, pixelCounts);
+    arenaRelease(arena, boxes);
+    arenaRelease(arena, label);
+    arenaRelease(arena, parent);
+    return foundCount;
+}
+
+// 在内存中的二值图上查找物体（全分辨率）
+// 不需要物体特征时在游程上用并查集标记，否则逐像素BFS；两者的物体列表完全相同
+// 返回超过最小尺寸的物体总数，其中前maxObjects个写入objects，记录数写入*objectCount；内存不足时返回-1
+int detectObjectsInBuffer(unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                          const DetectOptions* options, const GraySource* graySource,
+                          ObjectInfo* objects, int maxObjects, int* objectCount, ScratchArena* arena) {
+    *objectCount = 0;
+    if (!isSupportedBitCount(bitCount)) return 0;
+
+    if (!options->computeFeatures && !graySource) {
+        RunImage runs;
+        if (!createRunImage(&runs, width, height, arena)) return -1;
+        SELECT_PIXEL_KERNEL(thresholdToRuns, bitCount)(buffer, width, height, rowSize, 128, &runs);
+        int foundCount = labelRunComponents(&runs, options, objects, NULL, maxObjects, objectCount, arena);
+        freeRunImage(&runs, arena);
+        return foundCount;
+    }
+
+    // 创建访问标记地图和BFS队列（所有连通区域共用）
+    VisitedMap* visited = createVisitedMap(width, height, arena);
+    Point* queue = (Point*)arenaAlloc(arena, width * height * sizeof(Point));
+    if (!visited || !queue) {
+        if (visited) freeVisitedMap(visited, arena);
+        if (queue) arenaRelease(arena, queue);
+        return -1;
+    }
+
+    int foundCount = SELECT_PIXEL_KERNEL(detectObjects, bitCount)(buffer, width, height, rowSize, options,
+                                                                  graySource, visited, queue,
+                                                                  objects, maxObjects, objectCount);
+
+    arenaRelease(arena, queue);
+    freeVisitedMap(visited, arena);
+    return foundCount;
+}
+
+// 比较两个物体列表（边界框和像素数，顺序必须一致），返回第一个不同的物体序号，完全一致时返回-1
+int compareObjectLists(const ObjectInfo* expected, int expectedCount, const ObjectInfo* actual, int actualCount) {
+    for (int i = 0; i < min(expectedCount, actualCount); i++) {
+        if (memcmp(&expected[i].bbox, &actual[i].bbox, sizeof(BoundingBox)) != 0 ||
+            expected[i].pixelCount != actual[i].pixelCount) {
+            return i;
+        }
+    }
+    return (expectedCount == actualCount) ? -1 : min(expectedCount, actualCount);
+}
+
+// 图像金字塔：第k层为原图按 2^k 缩小后的灰度图（第0层即原图，不单独保存）
+#define PYRAMID_MAX_LEVELS 3
+
+typedef struct {
+    int levels;                                 // 已构建的缩小层数
+    int width[PYRAMID_MAX_LEVELS];
+    int height[PYRAMID_MAX_LEVELS];
+    unsigned char* data[PYRAMID_MAX_LEVELS];    // 第i项为第i+1层，行宽即宽度
+} GrayPyramid;
+
+// 缩小factor倍后仍可能含有黑色像素(<128)的最暗阈值：
+// 一个factor*factor块中只要有一个像素<128，块均值(含逐级向上取整)就不会超过该值，保证候选区域不漏检
+int pyramidCandidateLevel(int factor) {
+    return 255 - 128 / (factor * factor) + 1;
+}
+
+// 由原图直接生成2x缩小的灰度层。像素值与全分辨率标记一样取自pfGet（24/32位为红色通道），
+// 否则按亮度缩小时，红色暗而绿/蓝亮的像素会被算作背景，候选区域漏检
+BMP_FORCEINLINE void buildFirstPyramidLevelGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                                   unsigned char* out, int outWidth, int outHeight, int bits) {
+    for (int oy = 0; oy < outHeight; oy++) {
+        const unsigned char* row0 = buffer + (2 * oy) * rowSize;
+        const unsigned char* row1 = (2 * oy + 1 < height) ? row0 + rowSize : row0;
+        unsigned char* dst = out + oy * outWidth;
+        for (int ox = 0; ox < outWidth; ox++) {
+            int x0 = 2 * ox;
+            int x1 = (x0 + 1 < width) ? x0 + 1 : x0;
+            int sum = pfGet(row0, x0, bits) + pfGet(row0, x1, bits) + pfGet(row1, x0, bits) + pfGet(row1, x1, bits);
+            dst[ox] = (unsigned char)((sum + 2) >> 2);
+        }
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(buildFirstPyramidLevel,
+                              (const unsigned char* buffer, int width, int height, int rowSize,
+                               unsigned char* out, int outWidth, int outHeight),
+                              buffer, width, height, rowSize, out, outWidth, outHeight)
+
+// 将灰度层按2x2盒式滤波缩小一半（逐级取平均并向上取整，SIMD与标量路径结果一致）
+void downsampleGray2x(const unsigned char* src, int srcWidth, int srcHeight,
+                      unsigned char* dst, int dstWidth, int dstHeight) {
+    for (int oy = 0; oy < dstHeight; oy++) {
+        const unsigned char* row0 = src + (2 * oy) * srcWidth;
+        const unsigned char* row1 = (2 * oy + 1 < srcHeight) ? row0 + srcWidth : row0;
+        unsigned char* out = dst + oy * dstWidth;
+        int ox = 0;
+#ifdef BMP_USE_SSE2
+        // 每次处理32个源像素，输出16个像素
+        const __m128i lowMask = _mm_set1_epi16(0x00FF);
+        for (; ox + 16 <= srcWidth / 2; ox += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(row0 + 2 * ox));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(row0 + 2 * ox + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(row1 + 2 * ox));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(row1 + 2 * ox + 16));
+            __m128i v0 = _mm_avg_epu8(a0, b0);
+            __m128i v1 = _mm_avg_epu8(a1, b1);
+            __m128i h0 = _mm_avg_epu16(_mm_and_si128(v0, lowMask), _mm_srli_epi16(v0, 8));
+            __m128i h1 = _mm_avg_epu16(_mm_and_si128(v1, lowMask), _mm_srli_epi16(v1, 8));
+            _mm_storeu_si128((__m128i*)(out + ox), _mm_packus_epi16(h0, h1));
+        }
+#endif
+        for (; ox < dstWidth; ox++) {
+            int x0 = 2 * ox;
+            int x1 = (x0 + 1 < srcWidth) ? x0 + 1 : x0;
+            int left = (row0[x0] + row1[x0] + 1) >> 1;
+            int right = (row0[x1] + row1[x1] + 1) >> 1;
+            out[ox] = (unsigned char)((left + right + 1) >> 1);
+        }
+    }
+}
+
+// 释放金字塔
+void freeGrayPyramid(GrayPyramid* pyramid, ScratchArena* arena) {
+    for (int i = 0; i < pyramid->levels; i++) {
+        arenaRelease(arena, pyramid->data[i]);
+    }
+    pyramid->levels = 0;
+}
+
+// 构建缩小factor倍（2或4）所需的金字塔层
+BOOL buildGrayPyramid(const unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                      int factor, GrayPyramid* pyramid, ScratchArena* arena) {
+    pyramid->levels = 0;
+    int levels = (factor >= 4) ? 2 : 1;
+    int srcWidth = width;
+    int srcHeight = height;
+    for (int i = 0; i < levels; i++) {
+        int w = (srcWidth + 1) / 2;
+        int h = (srcHeight + 1) / 2;
+        // 多分配16字节，SIMD读取时不会越界
+        unsigned char* level = (unsigned char*)arenaAlloc(arena, w * h + 16);
+        if (!level) {
+            freeGrayPyramid(pyramid, arena);
+            return FALSE;
+        }
+        if (i == 0) {
+            SELECT_PIXEL_KERNEL(buildFirstPyramidLevel, bitCount)(buffer, width, height, rowSize, level, w, h);
+        } else {
+            downsampleGray2x(pyramid->data[i - 1], srcWidth, srcHeight, level, w, h);
+        }
+        pyramid->width[i] = w;
+        pyramid->height[i] = h;
+        pyramid->data[i] = level;
+        pyramid->levels++;
+        srcWidth = w;
+        srcHeight = h;
+    }
+    return TRUE;
+}
+
+// 在全分辨率图像的[x0,x1]x[y0,y1]区域内查找黑色像素的精确边界
+// 从区域四边向内扫描，代价与物体边缘带宽度成正比；区域内没有黑色像素时返回FALSE
+BMP_FORCEINLINE BOOL refineBoundingBoxGeneric(const unsigned char* buffer, int rowSize,
+                                              int x0, int y0, int x1, int y1, BoundingBox* bbox, int bits) {
+    int minY = -1, maxY = -1, minX = -1, maxX = -1;
+
+    for (int y = y0; y <= y1 && minY < 0; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        for (int x = x0; x <= x1; x++) {
+            if (pfGet(row, x, bits) < 128) { minY = y; break; }
+        }
+    }
+    if (minY < 0) return FALSE;
+    for (int y = y1; y >= minY && maxY < 0; y--) {
+        const unsigned char* row = buffer + y * rowSize;
+        for (int x = x0; x <= x1; x++) {
+            if (pfGet(row, x, bits) < 128) { maxY = y; break; }
+        }
+    }
+    for (int x = x0; x <= x1 && minX < 0; x++) {
+        for (int y = minY; y <= maxY; y++) {
+            if (pfGet(buffer + y * rowSize, x, bits) < 128) { minX = x; break; }
+        }
+    }
+    for (int x = x1; x >= minX && maxX < 0; x--) {
+        for (int y = minY; y <= maxY; y++) {
+            if (pfGet(buffer + y * rowSize, x, bits) < 128) { maxX = x; break; }
+        }
+    }
+
+    bbox->minX = minX;
+    bbox->minY = minY;
+    bbox->maxX = maxX;
+    bbox->maxY = maxY;
+    return TRUE;
+}
+
+INSTANTIATE_PIXEL_KERNEL(BOOL, refineBoundingBox,
+                         (const unsigned char* buffer, int rowSize, int x0, int y0, int x1, int y1, BoundingBox* bbox),
+                         buffer, rowSize, x0, y0, x1, y1, bbox)
+
+// 全分辨率扫描，只检查落在候选块内的像素，保持与全分辨率路径相同的扫描顺序
+BMP_FORCEINLINE int detectInCandidatesGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                              const unsigned char* mask, int maskWidth, int factor,
+                                              const DetectOptions* options, const GraySource* graySource,
+                                              VisitedMap* visited, Point* queue,
+                                              ObjectInfo* objects, int maxObjects, int* objectCount, int bits) {
+    ObjectFeatures features;
+    ObjectFeatures* featuresPtr = options->computeFeatures ? &features : NULL;
+    int foundCount = 0;
+
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        const unsigned char* maskRow = mask + (y / factor) * maskWidth;
+        unsigned char* visitedRow = visited->data + y * width;
+        for (int cx = 0; cx < maskWidth; cx++) {
+            if (maskRow[cx]) continue;
+            int xEnd = min(width, (cx + 1) * factor);
+            for (int x = cx * factor; x < xEnd; x++) {
+                if (visitedRow[x]) continue;
+                if (pfGet(row, x, bits) < 128) {
+                    BoundingBox bbox;
+                    int pixelCount = 0;
+                    findConnectedComponentGeneric(buffer, width, height, rowSize, x, y, visited, queue,
+                                                  &bbox, &pixelCount, graySource, featuresPtr, bits);
+                    if (pixelCount >= options->minObjectSize) {
+                        if (*objectCount < maxObjects) {
+                            recordObject(&objects[(*objectCount)++], &bbox, pixelCount, featuresPtr);
+                        }
+                        foundCount++;
+                    }
+                }
+            }
+        }
+    }
+    return foundCount;
+}
+
+INSTANTIATE_PIXEL_KERNEL(int, detectInCandidates,
+                         (const unsigned char* buffer, int width, int height, int rowSize,
+                          const unsigned char* mask, int maskWidth, int factor,
+                          const DetectOptions* options, const GraySource* graySource,
+                          VisitedMap* visited, Point* queue, ObjectInfo* objects, int maxObjects, int* objectCount),
+                         buffer, width, height, rowSize, mask, maskWidth, factor, options, graySource,
+                         visited, queue, objects, maxObjects, objectCount)
+
+// 由粗到细的物体检测：先在缩小factor倍的金字塔层上标记候选区域，再回到全分辨率处理候选区域
+// options->pyramidExact（或需要计算特征）时，只在候选块内做全分辨率BFS，结果与全分辨率路径一致；
+// 否则只在候选框四边细化边界框，像素数由缩小图的灰度估计（记录中标记为估计值，最小尺寸也按估计值过滤），
+// 距离小于factor的相邻物体可能被合并
+// 返回值含义与detectObjectsInBuffer相同
+int detectObjectsPyramid(unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                         const DetectOptions* options, const GraySource* graySource,
+                         ObjectInfo* objects, int maxObjects, int* objectCount, ScratchArena* arena) {
+    *objectCount = 0;
+    if (!isSupportedBitCount(bitCount)) return 0;
+
+    int factor = (options->pyramidFactor >= 4) ? 4 : 2;
+    GrayPyramid pyramid;
+    if (!buildGrayPyramid(buffer, width, height, bitCount, rowSize, factor, &pyramid, arena)) return -1;
+
+    int level = pyramid.levels - 1;
+    int coarseWidth = pyramid.width[level];
+    int coarseHeight = pyramid.height[level];
+    unsigned char* coarse = pyramid.data[level];
+
+    // 候选掩码：0表示候选（可能含黑色像素），255表示背景
+    int candidateLevel = pyramidCandidateLevel(factor);
+    unsigned char* mask = (unsigned char*)arenaAlloc(arena, coarseWidth * coarseHeight);
+    if (!mask) {
+        freeGrayPyramid(&pyramid, arena);
+        return -1;
+    }
+    for (int i = 0; i < coarseWidth * coarseHeight; i++) {
+        mask[i] = (coarse[i] <= candidateLevel) ? 0 : 255;
+    }
+
+    int foundCount = 0;
+    if (options->pyramidExact || options->computeFeatures) {
+        VisitedMap* visited = createVisitedMap(width, height, arena);
+        Point* queue = (Point*)arenaAlloc(arena, width * height * sizeof(Point));
+        if (!visited || !queue) {
+            if (visited) freeVisitedMap(visited, arena);
+            if (queue) arenaRelease(arena, queue);
+            arenaRelease(arena, mask);
+            freeGrayPyramid(&pyramid, arena);
+            return -1;
+        }
+        foundCount = SELECT_PIXEL_KERNEL(detectInCandidates, bitCount)(buffer, width, height, rowSize,
+                                                                       mask, coarseWidth, factor, options,
+                                                                       graySource, visited, queue,
+                                                                       objects, maxObjects, objectCount);
+        arenaRelease(arena, queue);
+        freeVisitedMap(visited, arena);
+    } else {
+        // 在缩小图上标记候选连通区域，平均灰度用于估计全分辨率的黑色像素数
+        VisitedMap* visited = createVisitedMap(coarseWidth, coarseHeight, arena);
+        Point* queue = (Point*)arenaAlloc(arena, coarseWidth * coarseHeight * sizeof(Point));
+        if (!visited || !queue) {
+            if (visited) freeVisitedMap(visited, arena);
+            if (queue) arenaRelease(arena, queue);
+            arenaRelease(arena, mask);
+            freeGrayPyramid(&pyramid, arena);
+            return -1;
+        }
+        GraySource coarseSource = { coarse, 8, coarseWidth, NULL };
+        ObjectFeatures features;
+
+        for (int cy = 0; cy < coarseHeight; cy++) {
+            for (int cx = 0; cx < coarseWidth; cx++) {
+                if (visited->data[cy * coarseWidth + cx]) continue;
+                if (mask[cy * coarseWidth + cx]) {
+                    visited->data[cy * coarseWidth + cx] = 1;
+                    continue;
+                }
+
+                BoundingBox coarseBox;
+                int coarseCount = 0;
+                findConnectedComponent8(mask, coarseWidth, coarseHeight, coarseWidth, cx, cy, visited, queue,
+                                        &coarseBox, &coarseCount, &coarseSource, &features);
+
+                // 每个缩小像素代表factor*factor个原像素，按其灰度估计黑色像素比例
+                int estimatedCount = (int)(coarseCount * factor * factor *
+                                           (255.0 - features.meanIntensity) / 255.0 + 0.5);
+                if (estimatedCount < options->minObjectSize) continue;
+
+                BoundingBox bbox;
+                if (!SELECT_PIXEL_KERNEL(refineBoundingBox, bitCount)(buffer, rowSize,
+                        coarseBox.minX * factor, coarseBox.minY * factor,
+                        min(width - 1, coarseBox.maxX * factor + factor - 1),
+                        min(height - 1, coarseBox.maxY * factor + factor - 1), &bbox)) {
+                    continue;
+                }
+
+                if (*objectCount < maxObjects) {
+                    recordObject(&objects[*objectCount], &bbox, estimatedCount, NULL);
+                    objects[(*objectCount)++].pixelCountEstimated = TRUE;
+                }
+                foundCount++;
+            }
+        }
+        arenaRelease(arena, queue);
+        freeVisitedMap(visited, arena);
+    }
+
+    arenaRelease(arena, mask);
+    freeGrayPyramid(&pyramid, arena);
+    return foundCount;
+}
+
+// 计算两个边界框的交并比
+double boundingBoxIoU(const BoundingBox* a, const BoundingBox* b) {
+    int ix0 = max(a->minX, b->minX);
+    int iy0 = max(a->minY, b->minY);
+    int ix1 = min(a->maxX, b->maxX);
+    int iy1 = min(a->maxY, b->maxY);
+    if (ix1 < ix0 || iy1 < iy0) return 0.0;
+
+    double inter = (double)(ix1 - ix0 + 1) * (iy1 - iy0 + 1);
+    double areaA = (double)(a->maxX - a->minX + 1) * (a->maxY - a->minY + 1);
+    double areaB = (double)(b->maxX - b->minX + 1) * (b->maxY - b->minY + 1);
+    return inter / (areaA + areaB - inter);
+}
+
+// 1位/4位图像按调色板查表规范化为"黑色=索引0，白色=最大索引"的打包数据，8位图像的调色板不是灰阶时
+// 规范化为0/255，返回新分配的缓冲区；其他情况直接返回buffer。内存不足返回NULL
+unsigned char* canonicalizeLabelBuffer(unsigned char* buffer, const RGBQUAD* palette, int bitCount, int rowSize,
+                                       int height, ScratchArena* arena) {
+    if (bitCount == 8) {
+        IndexTables indexTables;
+        buildIndexTables(&indexTables, palette);
+        if (indexTables.identity) return buffer;
+        unsigned char canonicalTable[256];
+        buildThresholdTable(canonicalTable, &indexTables, 128, 0, 255);
+        unsigned char* labelBuffer = (unsigned char*)arenaAlloc(arena, rowSize * height);
+        if (!labelBuffer) return NULL;
+        mapPackedBytes(canonicalTable, buffer, labelBuffer, rowSize * height);
+        return labelBuffer;
+    }
+    if (bitCount != 1 && bitCount != 4) return buffer;
+    PackedTables packedTables;
+    buildPackedTables(&packedTables, bitCount, palette);
+    unsigned char* labelBuffer = (unsigned char*)arenaAlloc(arena, rowSize * height);
+    if (!labelBuffer) return NULL;
+    mapPackedBytes(packedTables.canonical, buffer, labelBuffer, rowSize * height);
+    return labelBuffer;
+}
+
+// 按选项在全分辨率图像上或先在金字塔上查找物体，返回值与detectObjectsInBuffer相同
+int detectObjectsWithOptions(unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                             const DetectOptions* options, const GraySource* graySource,
+                             ObjectInfo* objects, int maxObjects, int* objectCount, ScratchArena* arena) {
+    if (options->pyramidFactor >= 2) {
+        return detectObjectsPyramid(buffer, width, height, bitCount, rowSize, options,
+                                    graySource, objects, maxObjects, objectCount, arena);
+    }
+    return detectObjectsInBuffer(buffer, width, height, bitCount, rowSize, options,
+                                 graySource, objects, maxObjects, objectCount, arena);
+}
+
+// 准备输出图像并用红色框标记物体：索引图像需要在调色板中预留一个红色索引用于边框，*paletteCount更新为输出的调色板项数
+// 输出图像通过outputBuffer等返回，除1位图像和索引用满的4位图像（展开为8位）外就是buffer本身；
+// 返回红色索引（24/32位为0），内存不足返回-1
+int drawObjectMarks(unsigned char* buffer, RGBQUAD* palette, int* paletteCount, int width, int height,
+                    int bitCount, int rowSize, const ObjectInfo* objects, int objectCount,
+                    unsigned char** outputBuffer, int* outputBitCount, int* outputRowSize, ScratchArena* arena) {
+    // 1位图像无法容纳第三种颜色，展开为4位输出（索引0/1不变，索引2为红色）
+    *outputBitCount = bitCount;
+    *outputRowSize = rowSize;
+    *outputBuffer = buffer;
+    int redIndex = 0;
+    if (bitCount == 1) {
+        *outputBitCount = 4;
+        *outputRowSize = ((width * 4 + 31) / 32) * 4;
+        *outputBuffer = (unsigned char*)arenaCalloc(arena, *outputRowSize * height, 1);
+        if (!*outputBuffer) return -1;
+        unsigned char expand[256][4];
+        buildExpand1To4Table(expand);
+        int bytesPerRow = (width + 7) / 8;
+        for (int y = 0; y < height; y++) {
+            for (int i = 0; i < bytesPerRow; i++) {
+                memcpy(*outputBuffer + y * *outputRowSize + i * 4, expand[buffer[y * rowSize + i]], 4);
+            }
+        }
+        for (int i = 2; i < 16; i++) {
+            memset(&palette[i], 0, sizeof(RGBQUAD));
+        }
+        *paletteCount = 16;
+        redIndex = 2;
+    } else if (bitCount == 4) {
+        redIndex = chooseMarkerIndex4(buffer, width, height, rowSize);
+        if (redIndex < 0) {
+            // 16个索引都已使用，改任何一个为红色都会把该颜色的像素染红：展开为8位输出（索引0~15不变，索引16为红色）
+            *outputBitCount = 8;
+            *outputRowSize = ((width * 8 + 31) / 32) * 4;
+            *outputBuffer = (unsigned char*)arenaCalloc(arena, *outputRowSize * height, 1);
+            if (!*outputBuffer) return -1;
+            expandRows4To8(buffer, width, height, rowSize, *outputBuffer, *outputRowSize);
+            for (int i = 16; i < 256; i++) {
+                memset(&palette[i], 0, sizeof(RGBQUAD));
+            }
+            *paletteCount = 256;
+            redIndex = 16;
+        }
+    } else if (bitCount == 8) {
+        // 保留一个调色板索引用于红色边框（选择索引240）
+        redIndex = 240;
+    }
+    if (*paletteCount > 0) {
+        palette[redIndex].rgbRed = 255;     // 设置为红色
+        palette[redIndex].rgbGreen = 0;
+        palette[redIndex].rgbBlue = 0;
+        palette[redIndex].rgbReserved = 0;
+    }
+
+    // 用红色框标记物体（按位深度选择一次绘制内核）
+    DrawBoxKernel drawBoxKernel = SELECT_PIXEL_KERNEL(drawBox, *outputBitCount);
+    for (int i = 0; i < objectCount; i++) {
+        BoundingBox bbox = objects[i].bbox;
+
+        // 边界框扩展
+        int padding = 2;
+        bbox.minX = max(0, bbox.minX - padding);
+        bbox.minY = max(0, bbox.minY - padding);
+        bbox.maxX = min(width - 1, bbox.maxX + padding);
+        bbox.maxY = min(height - 1, bbox.maxY + padding);
+
+        drawBoxKernel(*outputBuffer, *outputRowSize, bbox, (unsigned char)redIndex);
+    }
+    return redIndex;
+}
+
+// 分析并标记二值图中的物体
+// outObjects不为NULL时，复制最多options->maxObjects个物体记录，实际数量写入*outCount
+// arena不为NULL时所有临时内存从内存池分配，由调用者在处理完后重置
+BOOL MarkObjectsInBinaryImageEx(const char *inputPath, const char *outputPath, const DetectOptions *options,
+                                ObjectInfo *outObjects, int *outCount, ScratchArena *arena) {
+    if (outCount) *outCount = 0;
+    METRICS_TIMER_START(timer);
+
+    FILE *inputFile = fopen(inputPath, "rb");
+    if (!inputFile) {
+        printf("无法打开输入文件！\n");
+        return FALSE;
+    }
+
+    // 读取并校验文件头和调色板（如果有）
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    if (!readBmpHeader(inputFile, &desc, palette)) {
+        fclose(inputFile);
+        return FALSE;
+    }
+
+    // 获取图像信息
+    BITMAPINFOHEADER infoHeader = desc.infoHeader;
+    int width = desc.width;
+    int height = desc.height;
+    int bitCount = desc.bitCount;
+    int rowSize = desc.rowSize;
+    int paletteCount = (bitCount <= 8) ? (1 << bitCount) : 0;
+    
+    printf("图片信息: 宽度=%d, 高度=%d, 位深=%d\n", width, height, bitCount);
+    
+    // 创建输出文件
+    FILE *outputFile = fopen(outputPath, "wb");
+    if (!outputFile) {
+        fclose(inputFile);
+        printf("无法创建输出文件！\n");
+        return FALSE;
+    }
+    
+    METRICS_LAP(timer, STAGE_HEADER);
+
+    // 创建缓冲区
+    unsigned char *buffer = (unsigned char*)arenaAlloc(arena, rowSize * height);
+    if (!buffer) {
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    
+    // 读取图像数据
+    fseek(inputFile, desc.dataOffset, SEEK_SET);
+    if (!readBmpPixelData(inputFile, &desc, buffer)) {
+        arenaRelease(arena, buffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)desc.dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+    
+    // 1位/4位图像：按调色板查表规范化为"黑色=索引0，白色=最大索引"的打包数据，直接在打包数据上标记
+    unsigned char *labelBuffer = canonicalizeLabelBuffer(buffer, palette, bitCount, rowSize, height, arena);
+    if (!labelBuffer) {
+        arenaRelease(arena, buffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    if (labelBuffer != buffer) METRICS_LAP(timer, STAGE_COMPUTE);
+    
+    // 查找并标记物体
+    int maxObjects = options->maxObjects;           // 最大物体数量
+    ObjectInfo* objects = (ObjectInfo*)arenaAlloc(arena, maxObjects * sizeof(ObjectInfo));
+    if (!objects) {
+        if (labelBuffer != buffer) arenaRelease(arena, labelBuffer);
+        arenaRelease(arena, buffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    
+    // 加载用于计算平均灰度的灰度图（可选）
+    GraySource graySource;
+    GraySource* graySourcePtr = NULL;
+    unsigned char* grayData = NULL;
+    RGBQUAD* grayPalette = NULL;
+    if (options->computeFeatures && options->grayPath) {
+        if (!loadGraySource(options->grayPath, width, height, &graySource, &grayData, &grayPalette, arena)) {
+            arenaRelease(arena, objects);
+            if (labelBuffer != buffer) arenaRelease(arena, labelBuffer);
+            arenaRelease(arena, buffer);
+            fclose(inputFile);
+            fclose(outputFile);
+            return FALSE;
+        }
+        graySourcePtr = &graySource;
+        METRICS_LAP(timer, STAGE_READ);
+    }
+    
+    printf("开始分析图像...\n");
+    
+    int objectCount = 0;
+    if (options->pyramidFactor >= 2) {
+        printf("使用 %dx 金字塔先检测候选区域%s\n", options->pyramidFactor,
+               (options->pyramidExact || options->computeFeatures) ? "（候选区域内全分辨率标记）" : "（仅细化边界框）");
+    }
+    int foundCount = detectObjectsWithOptions(labelBuffer, width, height, bitCount, rowSize, options,
+                                              graySourcePtr, objects, maxObjects, &objectCount, arena);
+    if (labelBuffer != buffer) arenaRelease(arena, labelBuffer);
+    METRICS_LAP(timer, STAGE_LABEL);
+    if (foundCount < 0) {
+        if (grayData) arenaRelease(arena, grayData);
+        if (grayPalette) arenaRelease(arena, grayPalette);
+        arenaRelease(arena, objects);
+        arenaRelease(arena, buffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    
+    for (int i = 0; i < objectCount; i++) {
+        BoundingBox* bbox = &objects[i].bbox;
+        printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %s%d像素\n", 
+               i + 1, bbox->minX, bbox->minY, bbox->maxX, bbox->maxY, objects[i].pixelCountEstimated ? "约" : "",
+               objects[i].pixelCount);
+    }
+    if (foundCount > objectCount) {
+        printf("共 %d 个物体超过最小尺寸，仅记录前 %d 个\n", foundCount, objectCount);
+    }
+    
+    printf("找到 %d 个物体\n", objectCount);
+    
+    // 输出物体特征
+    if (options->computeFeatures) {
+        for (int i = 0; i < objectCount; i++) {
+            ObjectFeatures* f = &objects[i].features;
+            printf("物体 #%d 特征: 质心(%.1f,%.1f), 方向 %.1f度, 周长 %d, 平均灰度 %.1f, 中心矩(%.0f,%.0f,%.0f)\n",
+                   i + 1, f->centroidX, f->centroidY, f->orientation * 180.0 / 3.14159265358979,
+                   f->perimeter, f->meanIntensity, f->mu20, f->mu11, f->mu02);
+        }
+    }
+    
+    // 准备输出图像并用红色框标记物体
+    int outputBitCount;
+    int outputRowSize;
+    unsigned char *outputBuffer;
+    int redIndex = drawObjectMarks(buffer, palette, &paletteCount, width, height, bitCount, rowSize, objects,
+                                   objectCount, &outputBuffer, &outputBitCount, &outputRowSize, arena);
+    if (redIndex < 0) {
+        if (grayData) arenaRelease(arena, grayData);
+        if (grayPalette) arenaRelease(arena, grayPalette);
+        arenaRelease(arena, objects);
+        arenaRelease(arena, buffer);
+        fclose(inputFile);
+        fclose(outputFile);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    if (paletteCount > 0) {
+        printf("为%d位图像预留调色板索引 %d 用于红色边框\n", bitCount, redIndex);
+    }
+    
+    METRICS_LAP(timer, STAGE_DRAW);
+
+    // 写入文件头、信息头、调色板和处理后的图像数据
+    int writtenBytes = writeBmpImage(outputFile, &infoHeader, outputBitCount, palette, paletteCount,
+                                     outputBuffer, outputRowSize, width, height, options->rleOutput);
+    METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)max(writtenBytes, 0));
+    
+    // 返回物体记录
+    if (outObjects) {
+        memcpy(outObjects, objects, objectCount * sizeof(ObjectInfo));
+    }
+    if (outCount) *outCount = objectCount;
+    
+    // 释放资源
+    if (outputBuffer != buffer) arenaRelease(arena, outputBuffer);
+    if (grayData) arenaRelease(arena, grayData);
+    if (grayPalette) arenaRelease(arena, grayPalette);
+    arenaRelease(arena, objects);
+    arenaRelease(arena, buffer);
+    fclose(inputFile);
+    fclose(outputFile);
+    METRICS_COUNT(COUNTER_IMAGES, 1);
+    METRICS_LAP(timer, STAGE_WRITE);
+    
+    return TRUE;
+}
+
+// 读取BMP的像素数据和调色板（palette可为NULL）到内存（用于不需要输出文件的分析）
+// 成功时*buffer需由调用者释放
+BOOL readBmpPixels(const char* path, int* width, int* height, int* bitCount, int* rowSize, unsigned char** buffer,
+                   RGBQUAD* palette) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("无法打开输入文件！\n");
+        return FALSE;
+    }
+
+    BmpDescriptor desc;
+    if (!readBmpHeader(file, &desc, palette)) {
+        fclose(file);
+        return FALSE;
+    }
+
+    *width = desc.width;
+    *height = desc.height;
+    *bitCount = desc.bitCount;
+    *rowSize = desc.rowSize;
+    *buffer = (unsigned char*)malloc(*rowSize * *height);
+    if (!*buffer) {
+        fclose(file);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    if (!readBmpPixelData(file, &desc, *buffer)) {
+        free(*buffer);
+        fclose(file);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    fclose(file);
+    return TRUE;
+}
+
+// 对比金字塔检测与全分辨率检测的精度和吞吐量
+// 以全分辨率结果为基准，按IoU>=0.5贪心匹配物体，输出召回率、精确率和平均IoU
+BOOL ComparePyramidDetection(const char* inputPath, int factor, int repetitions) {
+    int width, height, bitCount, rowSize;
+    unsigned char* buffer;
+    RGBQUAD palette[256];
+    if (!readBmpPixels(inputPath, &width, &height, &bitCount, &rowSize, &buffer, palette)) return FALSE;
+    // 索引图像与标记时一样先按调色板规范化，各模式都在规范化后的数据上检测
+    unsigned char* labelBuffer = canonicalizeLabelBuffer(buffer, palette, bitCount, rowSize, height, NULL);
+    if (!labelBuffer) {
+        free(buffer);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    if (labelBuffer != buffer) {
+        free(buffer);
+        buffer = labelBuffer;
+    }
+    if (repetitions < 1) repetitions = 1;
+
+    int maxObjects = 4096;
+    ObjectInfo* reference = (ObjectInfo*)malloc(maxObjects * sizeof(ObjectInfo));
+    ObjectInfo* candidates = (ObjectInfo*)malloc(maxObjects * sizeof(ObjectInfo));
+    unsigned char* matched = (unsigned char*)malloc(maxObjects);
+    if (!reference || !candidates || !matched) {
+        if (reference) free(reference);
+        if (candidates) free(candidates);
+        if (matched) free(matched);
+        free(buffer);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    const char* modeNames[3] = { "全分辨率", "金字塔+候选区域BFS", "金字塔+边界细化" };
+    int referenceCount = 0;
+    ScratchArena arena;                 // 每次重复后重置，计时循环内不向系统申请内存
+    initScratchArena(&arena);
+    double megaPixels = (double)width * height / 1e6;
+
+    printf("图片: %dx%d, 位深=%d, 缩小倍数=%d, 重复次数=%d\n", width, height, bitCount, factor, repetitions);
+    printf("%-22s %10s %12s %8s %8s %8s %8s\n", "模式", "耗时(ms)", "吞吐(Mpix/s)", "物体数", "召回率", "精确率", "平均IoU");
+
+    for (int mode = 0; mode < 3; mode++) {
+        DetectOptions options;
+        initDetectOptions(&options);
+        options.maxObjects = maxObjects;
+        options.pyramidFactor = (mode == 0) ? 0 : factor;
+        options.pyramidExact = (mode == 1);
+
+        ObjectInfo* objects = (mode == 0) ? reference : candidates;
+        int objectCount = 0;
+        double start = getMonotonicSeconds();
+        for (int r = 0; r < repetitions; r++) {
+            int found;
+            if (mode == 0) {
+                found = detectObjectsInBuffer(buffer, width, height, bitCount, rowSize, &options,
+                                              NULL, objects, maxObjects, &objectCount, &arena);
+            } else {
+                found = detectObjectsPyramid(buffer, width, height, bitCount, rowSize, &options,
+                                             NULL, objects, maxObjects, &objectCount, &arena);
+            }
+            resetScratchArena(&arena);
+            if (found < 0) {
+                freeScratchArena(&arena);
+                free(reference);
+                free(candidates);
+                free(matched);
+                free(buffer);
+                printf("内存分配失败！\n");
+                return FALSE;
+            }
+        }
+        double elapsed = (getMonotonicSeconds() - start) / repetitions;
+        if (mode == 0) referenceCount = objectCount;
+
+        // 贪心匹配
+        int matchCount = 0;
+        double iouSum = 0.0;
+        memset(matched, 0, maxObjects);
+        for (int i = 0; i < referenceCount; i++) {
+            int best = -1;
+            double bestIoU = 0.5;
+            for (int j = 0; j < objectCount; j++) {
+                if (matched[j]) continue;
+                double iou = boundingBoxIoU(&reference[i].bbox, &objects[j].bbox);
+                if (iou >= bestIoU) {
+                    bestIoU = iou;
+                    best = j;
+                }
+            }
+            if (best >= 0) {
+                matched[best] = 1;
+                matchCount++;
+                iouSum += bestIoU;
+            }
+        }
+
+        double recall = referenceCount ? (double)matchCount / referenceCount : 1.0;
+        double precision = objectCount ? (double)matchCount / objectCount : 1.0;
+        printf("%-22s %10.3f %12.1f %8d %7.1f%% %7.1f%% %8.3f\n", modeNames[mode], elapsed * 1000.0,
+               elapsed > 0 ? megaPixels / elapsed : 0.0, objectCount,
+               recall * 100.0, precision * 100.0, matchCount ? iouSum / matchCount : 0.0);
+    }
+
+    freeScratchArena(&arena);
+    free(reference);
+    free(candidates);
+    free(matched);
+    free(buffer);
+    return TRUE;
+}
+
+// 使用默认选项分析并标记二值图中的物体
+BOOL MarkObjectsInBinaryImage(const char *inputPath, const char *outputPath) {
+    DetectOptions options;
+    initDetectOptions(&options);
+    return MarkObjectsInBinaryImageEx(inputPath, outputPath, &options, NULL, NULL, NULL);
+}
+
+// ---- 批处理 ----
+// 命令行: bmp2gray batch <gray|binary|mark|compare> [--metrics prom|json] [--rle] [--jobs N|auto]
+//                       [--cache 目录] [--cache-mb N] [--cache-results-only] <文件1> [文件2 ...]
+// 输出文件名与交互菜单一致；compare将每个文件与下一个文件比较。
+// 所有图像共用一个内存池，每张图像处理完后重置，第一张图像之后不再向系统申请临时内存。
+typedef enum {
+    BATCH_GRAY,
+    BATCH_BINARY,
+    BATCH_MARK,
+    BATCH_COMPARE,
+    BATCH_INVALID
+} BatchOperation;
+
+typedef struct {
+    BatchOperation operation;
+    const char* metricsFormat;      // 结束后输出运行指标的格式："prom"、"json"，NULL表示不输出
+    BOOL rleOutput;                 // 4位/8位输出按RLE压缩
+    int jobs;                       // 流水线的计算线程数，0表示在主线程中逐个处理
+    const char* cacheDirectory;     // 结果缓存目录，NULL表示不使用缓存
+    int cacheMegabytes;             // 缓存目录中输出文件的总大小上限
+    BOOL cacheResultsOnly;          // 只缓存结果摘要，命中时不恢复输出文件
+    int shardIndex;                 // 只处理分到第shardIndex个分片的项（共shardCount个，1表示不分片）
+    int shardCount;
+    const char* resultsPath;        // 每项结果写入的结果文件，NULL表示不写
+} BatchOptions;
+
+#define BATCH_BINARY_THRESHOLD 100  // binary的灰度阈值
+#define BATCH_COMPARE_THRESHOLD 5   // compare判断有新物品的差异百分比
+#define BATCH_MAX_OBJECTS 50        // mark记录的物体数上限（与initDetectOptions的默认值相同）
+
+// 一个文件的处理结果摘要
+typedef struct {
+    int diffPixels;                 // compare的差异像素数
+    int objectCount;                // mark记录的物体数
+    ObjectInfo objects[BATCH_MAX_OBJECTS];
+} BatchItemResult;
+
+BatchOperation parseBatchOperation(const char* name) {
+    if (strcmp(name, "gray") == 0) return BATCH_GRAY;
+    if (strcmp(name, "binary") == 0) return BATCH_BINARY;
+    if (strcmp(name, "mark") == 0) return BATCH_MARK;
+    if (strcmp(name, "compare") == 0) return BATCH_COMPARE;
+    return BATCH_INVALID;
+}
+
+const char* batchOperationName(BatchOperation operation) {
+    switch (operation) {
+    case BATCH_GRAY: return "gray";
+    case BATCH_BINARY: return "binary";
+    case BATCH_MARK: return "mark";
+    case BATCH_COMPARE: return "compare";
+    default: return "invalid";
+    }
+}
+
+// 在输入路径后追加后缀生成输出路径（outputPath至少260字节）
+void makeOutputPath(char* outputPath, const char* inputPath, const char* suffix) {
+    size_t keep = 260 - strlen(suffix) - 1;
+    strncpy(outputPath, inputPath, keep);
+    outputPath[keep] = '\0';
+    strcat(outputPath, suffix);
+}
+
+// 目录/文件名+后缀（path至少260字节，filePath中的目录部分被去掉）。总长超出时返回FALSE而不截断：
+// 截断后的输出路径可能落到另一个文件的输出上，截断后的输入路径则指向不存在的文件
+BOOL makeDirectoryPath(char* path, const char* directory, const char* filePath, const char* suffix) {
+    const char* name = filePath;
+    for (const char* p = filePath; *p; p++) {
+        if (*p == '\\' || *p == '/') name = p + 1;
+    }
+    if (strlen(directory) + 1 + strlen(name) + strlen(suffix) >= 260) return FALSE;
+    sprintf(path, "%s/%s%s", directory, name, suffix);
+    return TRUE;
+}
+
+// 各操作的第index个输出文件的后缀，没有时返回NULL
+const char* batchOutputSuffix(BatchOperation operation, int index) {
+    switch (operation) {
+    case BATCH_GRAY:    return (index == 0) ? "_gray.bmp" : (index == 1) ? "_gray_cross.bmp" : NULL;
+    case BATCH_BINARY:  return (index == 0) ? "_binary.bmp" : NULL;
+    case BATCH_MARK:    return (index == 0) ? "_objects.bmp" : NULL;
+    case BATCH_COMPARE: return (index == 0) ? "_diff.bmp" : NULL;
+    default:            return NULL;
+    }
+}
+
+// 处理一个文件，nextPath仅用于compare；result不为NULL时写入结果摘要（物体列表、差异像素数）
+BOOL processBatchItem(BatchOperation operation, const char* path, const char* nextPath, BOOL rleOutput,
+                      BatchItemResult* result, ScratchArena* arena) {
+    char outputPath[260];
+    char crossPath[260];
+    const char* suffix = batchOutputSuffix(operation, 0);
+    if (!suffix) return FALSE;
+    if (result) memset(result, 0, sizeof(BatchItemResult));
+    makeOutputPath(outputPath, path, suffix);
+
+    switch (operation) {
+    case BATCH_GRAY:
+        makeOutputPath(crossPath, path, batchOutputSuffix(operation, 1));
+        return ConvertToGrayScaleEx(path, outputPath, crossPath, arena);
+    case BATCH_BINARY:
+        return ConvertToBinaryEx(path, outputPath, BATCH_BINARY_THRESHOLD, 0, rleOutput, arena);
+    case BATCH_MARK: {
+        DetectOptions options;
+        initDetectOptions(&options);
+        options.maxObjects = BATCH_MAX_OBJECTS;
+        options.rleOutput = rleOutput;
+        return MarkObjectsInBinaryImageEx(path, outputPath, &options, result ? result->objects : NULL,
+                                          result ? &result->objectCount : NULL, arena);
+    }
+    case BATCH_COMPARE:
+        return CompareBinaryImagesEx(path, nextPath, outputPath, BATCH_COMPARE_THRESHOLD, rleOutput,
+                                     result ? &result->diffPixels : NULL, arena);
+    default:
+        return FALSE;
+    }
+}
+
+// 探测文件列表，每个文件输出一行key=value描述，返回无效的文件数
+int RunProbe(char** paths, int count) {
+    int rejected = 0;
+    for (int i = 0; i < count; i++) {
+        BmpDescriptor desc;
+        BmpProbeStatus status = ProbeBmpFile(paths[i], &desc);
+        if (status != BMP_PROBE_OK) {
+            printf("file=%s status=%d reason=%s\n", paths[i], (int)status, bmpProbeStatusText(status));
+            rejected++;
+            continue;
+        }
+        printf("file=%s status=0 width=%d height=%d bits=%d compression=%lu header=%d orientation=%s "
+               "palette=%d data_offset=%lu data_bytes=%lu stride=%d image_bytes=%d\n",
+               paths[i], desc.width, desc.height, desc.bitCount, (unsigned long)desc.compression, desc.headerSize,
+               desc.topDown ? "top-down" : "bottom-up", desc.paletteCount, (unsigned long)desc.dataOffset,
+               (unsigned long)desc.dataSize, desc.rowSize, desc.imageSize);
+    }
+    return rejected;
+}
+
+// 按格式输出批处理的运行指标
+void writeBatchMetrics(const char* format, const MetricsBlock* metrics) {
+    if (strcmp(format, "json") == 0) {
+        MetricsWriteJson(stdout, metrics);
+    } else {
+        MetricsWritePrometheus(stdout, metrics);
+    }
+}
+
+// ---- 流水线批处理 ----
+// 命令行: bmp2gray batch <操作> --jobs N|auto <文件1> [文件2 ...]
+// 读取线程（打开、解码）→ N个计算线程 → 写出线程（编码、写入，由主线程担任），磁盘读写与计算同时进行。
+// 线程之间用有界的无锁单生产者单消费者队列连接：读取线程把第i个任务放入第i%N个计算线程的输入队列，
+// 写出线程按同样的顺序从各计算线程的输出队列取结果，所以每个队列只有一个生产者和一个消费者，
+// 输出文件与逐个处理时逐字节相同，打印顺序也与文件顺序一致。队列容量限制了同时在内存中的图像数量，
+// 写出完成的图像经回收队列（写出线程 → 读取线程）交还读取线程，像素缓冲区可重复使用。
+
+#define PIPELINE_QUEUE_CAPACITY 4       // 每个队列的槽位数，必须是2的幂
+#define PIPELINE_MAX_WORKERS 64
+
+// 有界单生产者单消费者环形队列：tail只由生产者写，head只由消费者写，槽位内容通过内存屏障先于索引发布
+typedef struct {
+    void* slots[PIPELINE_QUEUE_CAPACITY];
+    volatile LONG head;                 // 下一个出队位置
+    char padding[64];                   // head和tail分处不同的缓存行
+    volatile LONG tail;                 // 下一个入队位置
+    long long pushes;                   // 以下四项只由生产者写
+    long long depthTotal;               // 每次入队后的深度之和
+    int maxDepth;
+    long long fullStalls;
+    long long emptyStalls;              // 只由消费者写
+} SpscQueue;
+
+// 队列满或空时的等待：先自旋，再让出时间片，最后短暂休眠
+void pipelineBackoff(int attempt) {
+    if (attempt < 64) {
+        YieldProcessor();
+    } else if (attempt < 128) {
+        SwitchToThread();
+    } else {
+        Sleep(1);
+    }
+}
+
+// 入队，队列满时等待消费者取走一项
+void spscPush(SpscQueue* queue, void* item) {
+    LONG tail = queue->tail;
+    LONG head = queue->head;
+    MemoryBarrier();
+    if (tail - head >= PIPELINE_QUEUE_CAPACITY) {
+        METRICS_TIMER_START(timer);
+        queue->fullStalls++;
+        METRICS_COUNT(COUNTER_QUEUE_FULL_STALLS, 1);
+        for (int attempt = 0; tail - head >= PIPELINE_QUEUE_CAPACITY; attempt++) {
+            pipelineBackoff(attempt);
+            head = queue->head;
+            MemoryBarrier();
+        }
+        METRICS_LAP(timer, STAGE_QUEUE_WAIT);
+    }
+
+    queue->slots[tail & (PIPELINE_QUEUE_CAPACITY - 1)] = item;
+    MemoryBarrier();                    // 槽位内容先于新的tail可见
+    queue->tail = tail + 1;
+
+    int depth = (int)(tail + 1 - head);
+    queue->pushes++;
+    queue->depthTotal += depth;
+    if (depth > queue->maxDepth) queue->maxDepth = depth;
+    METRICS_COUNT(COUNTER_QUEUE_PUSHES, 1);
+    METRICS_COUNT(COUNTER_QUEUE_DEPTH, depth);
+}
+
+// 不等待的入队，队列满时返回FALSE
+BOOL spscTryPush(SpscQueue* queue, void* item) {
+    LONG tail = queue->tail;
+    LONG head = queue->head;
+    MemoryBarrier();
+    if (tail - head >= PIPELINE_QUEUE_CAPACITY) return FALSE;
+    queue->slots[tail & (PIPELINE_QUEUE_CAPACITY - 1)] = item;
+    MemoryBarrier();
+    queue->tail = tail + 1;
+    return TRUE;
+}
+
+// 不等待的出队，队列空时返回NULL
+void* spscTryPop(SpscQueue* queue) {
+    LONG head = queue->head;
+    LONG tail = queue->tail;
+    MemoryBarrier();
+    if (head == tail) return NULL;
+    void* item = queue->slots[head & (PIPELINE_QUEUE_CAPACITY - 1)];
+    MemoryBarrier();
+    queue->head = head + 1;
+    return item;
+}
+
+// 出队，队列空时等待生产者放入一项
+void* spscPop(SpscQueue* queue) {
+    LONG head = queue->head;
+    LONG tail = queue->tail;
+    MemoryBarrier();                    // 读到tail之后才读槽位
+    if (head == tail) {
+        METRICS_TIMER_START(timer);
+        queue->emptyStalls++;
+        METRICS_COUNT(COUNTER_QUEUE_EMPTY_STALLS, 1);
+        for (int attempt = 0; head == tail; attempt++) {
+            pipelineBackoff(attempt);
+            tail = queue->tail;
+            MemoryBarrier();
+        }
+        METRICS_LAP(timer, STAGE_QUEUE_WAIT);
+    }
+
+    void* item = queue->slots[head & (PIPELINE_QUEUE_CAPACITY - 1)];
+    MemoryBarrier();                    // 读完槽位后才把它交还给生产者
+    queue->head = head + 1;
+    return item;
+}
+
+// 读取线程解码好的图像；compare时同一张图像被相邻的两个任务共用
+typedef struct {
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    unsigned char* pixels;
+    size_t capacity;                    // pixels的字节数，回收后可装下不超过它的图像
+    unsigned char* scratch;             // 以本图像为输入的任务单独的输出缓冲区，由计算线程按需扩大
+    size_t scratchCapacity;
+    int references;                     // 还未写出的引用它的任务数，只由写出线程递减
+} PipelineImage;
+
+// 一个待写出的输出文件
+typedef struct {
+    char path[260];
+    BITMAPINFOHEADER header;            // 输出文件头的模板
+    int bitCount;
+    RGBQUAD palette[256];
+    int paletteCount;
+    unsigned char* pixels;
+    BOOL ownsPixels;                    // pixels是单独分配的，否则指向输入图像
+    int rowSize;
+    BOOL rle;
+} PipelineOutput;
+
+typedef struct {
+    int index;                          // 在文件列表中的位置
+    PipelineImage* first;               // 输入图像，加载失败或文件无效时为NULL
+    PipelineImage* second;              // compare的下一张图像
+    BOOL ok;
+    const char* loadErrors[2];          // 读取线程加载first/second失败的原因，由写出线程按文件顺序打印
+    BmpDescriptor header;               // mark中first的文件头，像素读取失败时也有效（读到文件头之前失败时width为0）
+    const char* error;                  // 计算线程中失败的原因，由写出线程打印
+    PipelineOutput outputs[2];
+    int outputCount;
+    int result;                         // compare为差异像素数，mark为记录的物体数
+    int foundCount;                     // mark中超过最小尺寸的物体数
+    ObjectInfo* objects;                // mark记录的物体（result个），由写出线程打印
+    int markIndex;                      // mark中索引图像的红色边框索引
+    double startTime;                   // 开始读取的时刻，用于统计单张图像的延迟
+} PipelineItem;
+
+typedef struct {
+    BatchOperation operation;
+    BOOL rleOutput;
+    char** paths;
+    const BOOL* valid;                  // 文件头检查的结果
+    int count;
+    int itemCount;
+    int workerCount;
+    SpscQueue* inputQueues;             // 读取线程 → 第i个计算线程
+    SpscQueue* outputQueues;            // 第i个计算线程 → 写出线程
+    SpscQueue recycleQueue;             // 写出线程 → 读取线程，交还可重复使用的图像
+    ScratchArena* arenas;               // 每个计算线程一个内存池
+    MetricsBlock* metrics;              // 线程退出前保存的指标：[0]为读取线程，[1..N]为计算线程
+} PipelineContext;
+
+typedef struct {
+    PipelineContext* context;
+    int worker;
+} PipelineWorkerArgs;
+
+void freePipelineImage(PipelineImage* image) {
+    free(image->pixels);
+    free(image->scratch);
+    free(image);
+}
+
+// 打开并解码一张图像，优先重复使用回收的图像，失败返回NULL并把原因写入*error（不打印）
+// header不为NULL时，文件头读取成功后复制到*header
+PipelineImage* loadPipelineImage(const char* path, int references, SpscQueue* recycleQueue, const char** error,
+                                 BmpDescriptor* header) {
+    METRICS_TIMER_START(timer);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        *error = "无法打开输入文件！";
+        return NULL;
+    }
+
+    PipelineImage* image = (PipelineImage*)spscTryPop(recycleQueue);
+    if (!image) image = (PipelineImage*)calloc(1, sizeof(PipelineImage));
+    if (!image) {
+        fclose(file);
+        *error = "内存分配失败！";
+        return NULL;
+    }
+    *error = readBmpHeaderError(file, &image->desc, image->palette);
+    if (*error) {
+        freePipelineImage(image);
+        fclose(file);
+        return NULL;
+    }
+    if (header) *header = image->desc;
+    METRICS_LAP(timer, STAGE_HEADER);
+
+    if (image->capacity < (size_t)image->desc.imageSize) {
+        free(image->pixels);
+        image->pixels = (unsigned char*)malloc(image->desc.imageSize);
+        image->capacity = image->pixels ? image->desc.imageSize : 0;
+    }
+    if (!image->pixels) {
+        freePipelineImage(image);
+        fclose(file);
+        *error = "内存分配失败！";
+        return NULL;
+    }
+    if (!readBmpPixelData(file, &image->desc, image->pixels)) {
+        freePipelineImage(image);
+        fclose(file);
+        *error = "读取图像数据失败！";
+        return NULL;
+    }
+    fclose(file);
+    image->references = references;
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)image->desc.dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+    return image;
+}
+
+// 写出线程释放一个引用，最后一个引用释放后交还读取线程，回收队列满时直接释放
+void releasePipelineImage(PipelineImage* image, SpscQueue* recycleQueue) {
+    if (image && --image->references == 0 && !spscTryPush(recycleQueue, image)) {
+        freePipelineImage(image);
+    }
+}
+
+// 取得图像的单独输出缓冲区（至少size字节），内存不足返回NULL
+unsigned char* pipelineScratch(PipelineImage* image, size_t size) {
+    if (image->scratchCapacity < size) {
+        free(image->scratch);
+        image->scratch = (unsigned char*)malloc(size);
+        image->scratchCapacity = image->scratch ? size : 0;
+    }
+    return image->scratch;
+}
+
+// 设置一个输出文件，palette为NULL时没有调色板
+void setPipelineOutput(PipelineOutput* output, const char* inputPath, const char* suffix,
+                       const PipelineImage* image, int bitCount, const RGBQUAD* palette, int paletteCount,
+                       unsigned char* pixels, int rowSize, BOOL rle) {
+    makeOutputPath(output->path, inputPath, suffix);
+    output->header = image->desc.infoHeader;
+    output->bitCount = bitCount;
+    output->paletteCount = paletteCount;
+    if (paletteCount > 0) memcpy(output->palette, palette, paletteCount * sizeof(RGBQUAD));
+    output->pixels = pixels;
+    output->ownsPixels = (pixels != image->pixels && pixels != image->scratch);
+    output->rowSize = rowSize;
+    output->rle = rle;
+}
+
+// 在计算线程中处理一个任务，结果留在item->outputs中由写出线程写入
+// 临时内存从arena分配；输出缓冲区要在内存池重置之后继续使用，放在输入图像的scratch中
+BOOL runPipelineItem(const PipelineContext* context, PipelineItem* item, ScratchArena* arena) {
+    PipelineImage* image = item->first;
+    if (!image || (context->operation == BATCH_COMPARE && !item->second)) return FALSE;
+
+    METRICS_TIMER_START(timer);
+    const char* path = context->paths[item->index];
+    int width = image->desc.width;
+    int height = image->desc.height;
+    int bitCount = image->desc.bitCount;
+    int rowSize = image->desc.rowSize;
+    int paletteCount = (bitCount <= 8) ? (1 << bitCount) : 0;
+
+    switch (context->operation) {
+    case BATCH_GRAY: {
+        grayPaletteEntries(image->palette, paletteCount);
+        grayPixelRows(image->pixels, width, height, bitCount, rowSize);
+        METRICS_LAP(timer, STAGE_COMPUTE);
+
+        // 只有24/32位图像画十字，索引图像两个输出共用同一块像素数据
+        unsigned char* crossPixels = image->pixels;
+        if (bitCount == 24 || bitCount == 32) {
+            crossPixels = pipelineScratch(image, image->desc.imageSize);
+            if (!crossPixels) {
+                item->error = "内存分配失败！";
+                return FALSE;
+            }
+            memcpy(crossPixels, image->pixels, image->desc.imageSize);
+            drawCross(crossPixels, width, height, bitCount, rowSize);
+        }
+        METRICS_LAP(timer, STAGE_DRAW);
+        setPipelineOutput(&item->outputs[0], path, "_gray.bmp", image, bitCount, image->palette, paletteCount,
+                          image->pixels, rowSize, FALSE);
+        setPipelineOutput(&item->outputs[1], path, "_gray_cross.bmp", image, bitCount, image->palette, paletteCount,
+                          crossPixels, rowSize, FALSE);
+        item->outputCount = 2;
+        return TRUE;
+    }
+    case BATCH_BINARY:
+        binarizeImageBuffer(image->pixels, image->palette, width, height, bitCount, rowSize, BATCH_BINARY_THRESHOLD);
+        METRICS_LAP(timer, STAGE_COMPUTE);
+        setPipelineOutput(&item->outputs[0], path, "_binary.bmp", image, bitCount, image->palette, paletteCount,
+                          image->pixels, rowSize, context->rleOutput);
+        item->outputCount = 1;
+        return TRUE;
+    case BATCH_MARK: {
+        DetectOptions options;
+        initDetectOptions(&options);
+        unsigned char* labelBuffer = canonicalizeLabelBuffer(image->pixels, image->palette, bitCount, rowSize,
+                                                             height, arena);
+        ObjectInfo* objects = (ObjectInfo*)arenaAlloc(arena, options.maxObjects * sizeof(ObjectInfo));
+        if (!labelBuffer || !objects) {
+            item->error = "内存分配失败！";
+            return FALSE;
+        }
+        item->foundCount = detectObjectsWithOptions(labelBuffer, width, height, bitCount, rowSize, &options, NULL,
+                                                    objects, options.maxObjects, &item->result, arena);
+        METRICS_LAP(timer, STAGE_LABEL);
+        if (item->foundCount < 0) {
+            item->error = "内存分配失败！";
+            return FALSE;
+        }
+
+        // 物体列表要在内存池重置之后由写出线程打印，单独复制一份
+        if (item->result > 0) {
+            item->objects = (ObjectInfo*)malloc(item->result * sizeof(ObjectInfo));
+            if (!item->objects) {
+                item->error = "内存分配失败！";
+                return FALSE;
+            }
+            memcpy(item->objects, objects, item->result * sizeof(ObjectInfo));
+        }
+
+        unsigned char* outputBuffer;
+        int outputBitCount;
+        int outputRowSize;
+        item->markIndex = drawObjectMarks(image->pixels, image->palette, &paletteCount, width, height, bitCount,
+                                          rowSize, objects, item->result, &outputBuffer, &outputBitCount,
+                                          &outputRowSize, NULL);
+        if (item->markIndex < 0) {
+            item->error = "内存分配失败！";
+            return FALSE;
+        }
+        METRICS_LAP(timer, STAGE_DRAW);
+        setPipelineOutput(&item->outputs[0], path, "_objects.bmp", image, outputBitCount, image->palette,
+                          paletteCount, outputBuffer, outputRowSize, context->rleOutput);
+        item->outputCount = 1;
+        return TRUE;
+    }
+    case BATCH_COMPARE: {
+        PipelineImage* second = item->second;
+        if (second->desc.width != width || second->desc.height != height || second->desc.bitCount != bitCount) {
+            item->error = "两张图像的尺寸或位深度不一致！";
+            return FALSE;
+        }
+        int outputBitCount = compareOutputBitCount(image->pixels, width, height, bitCount, rowSize);
+        int outputRowSize = ((width * outputBitCount + 31) / 32) * 4;
+        unsigned char* outputBuffer = pipelineScratch(image, (size_t)outputRowSize * height);
+        if (!outputBuffer) {
+            item->error = "内存分配失败！";
+            return FALSE;
+        }
+        // 下一张图像同时被另一个任务引用，行顺序不同时复制一份再比较
+        unsigned char* secondPixels = second->pixels;
+        if (second->desc.topDown != image->desc.topDown) {
+            secondPixels = (unsigned char*)arenaAlloc(arena, (size_t)rowSize * height);
+            if (!secondPixels) {
+                item->error = "内存分配失败！";
+                return FALSE;
+            }
+            copyRowsReversed(second->pixels, secondPixels, rowSize, height);
+        }
+        RGBQUAD outputPalette[256];
+        item->result = compareImageBuffers(image->pixels, image->palette, secondPixels, second->palette,
+                                           width, height, bitCount, rowSize, outputBuffer, outputBitCount,
+                                           outputRowSize, outputPalette, arena);
+        if (secondPixels != second->pixels) arenaRelease(arena, secondPixels);
+        METRICS_LAP(timer, STAGE_COMPUTE);
+        setPipelineOutput(&item->outputs[0], path, "_diff.bmp", image, outputBitCount, outputPalette,
+                          (outputBitCount <= 8) ? (1 << outputBitCount) : 0, outputBuffer, outputRowSize,
+                          context->rleOutput);
+        item->outputCount = 1;
+        return TRUE;
+    }
+    default:
+        return FALSE;
+    }
+}
+
+// 读取线程：按文件顺序解码图像并轮流分给各计算线程，最后给每个计算线程发送NULL表示结束
+DWORD WINAPI pipelineReaderThread(LPVOID parameter) {
+    PipelineContext* context = (PipelineContext*)parameter;
+    BOOL compare = (context->operation == BATCH_COMPARE);
+    PipelineImage* current = NULL;
+    const char* currentError = NULL;
+
+    for (int i = 0; i < context->itemCount; i++) {
+        PipelineItem* item = (PipelineItem*)calloc(1, sizeof(PipelineItem));
+        if (!item) {
+            // 停止读取，写出线程收到NULL后把剩余的文件记为失败
+            printf("内存分配失败！\n");
+            break;
+        }
+        item->index = i;
+        item->startTime = getMonotonicSeconds();
+        if (compare) {
+            // 第j张图像被第j-1和第j个任务引用，首尾两张只被一个任务引用
+            // 加载失败的原因同时记在引用这张图像的两个任务中，与逐个处理时一样在两个任务中各打印一次
+            if (i == 0) {
+                current = context->valid[0] ?
+                    loadPipelineImage(context->paths[0], 1, &context->recycleQueue, &currentError, NULL) : NULL;
+            }
+            const char* nextError = NULL;
+            PipelineImage* next = context->valid[i + 1] ?
+                loadPipelineImage(context->paths[i + 1], (i + 1 < context->itemCount) ? 2 : 1,
+                                  &context->recycleQueue, &nextError, NULL) : NULL;
+            item->first = current;
+            item->second = next;
+            item->loadErrors[0] = currentError;
+            item->loadErrors[1] = nextError;
+            current = next;
+            currentError = nextError;
+        } else {
+            item->first = context->valid[i] ?
+                loadPipelineImage(context->paths[i], 1, &context->recycleQueue, &item->loadErrors[0],
+                                  &item->header) : NULL;
+        }
+        spscPush(&context->inputQueues[i % context->workerCount], item);
+    }
+
+    for (int w = 0; w < context->workerCount; w++) {
+        spscPush(&context->inputQueues[w], NULL);
+    }
+    MetricsSnapshot(&context->metrics[0]);
+    return 0;
+}
+
+// 计算线程：处理自己输入队列中的任务，原样转发NULL后退出
+DWORD WINAPI pipelineWorkerThread(LPVOID parameter) {
+    PipelineWorkerArgs* args = (PipelineWorkerArgs*)parameter;
+    PipelineContext* context = args->context;
+    SpscQueue* input = &context->inputQueues[args->worker];
+    SpscQueue* output = &context->outputQueues[args->worker];
+    ScratchArena* arena = &context->arenas[args->worker];
+
+    for (;;) {
+        PipelineItem* item = (PipelineItem*)spscPop(input);
+        if (!item) {
+            spscPush(output, NULL);
+            break;
+        }
+        item->ok = runPipelineItem(context, item, arena);
+        resetScratchArena(arena);
+        spscPush(output, item);
+    }
+    MetricsSnapshot(&context->metrics[1 + args->worker]);
+    return 0;
+}
+
+// 在写出线程中写入一个任务的全部输出文件
+BOOL writePipelineItem(PipelineItem* item) {
+    METRICS_TIMER_START(timer);
+    PipelineImage* image = item->first;
+    for (int i = 0; i < item->outputCount; i++) {
+        PipelineOutput* output = &item->outputs[i];
+        FILE* file = fopen(output->path, "wb");
+        if (!file) {
+            printf("无法创建输出文件！\n");
+            return FALSE;
+        }
+        int writtenBytes = writeBmpImage(file, &output->header, output->bitCount, output->palette,
+                                         output->paletteCount, output->pixels, output->rowSize,
+                                         image->desc.width, image->desc.height, output->rle);
+        fclose(file);
+        if (writtenBytes < 0) {
+            printf("写入输出文件失败！\n");
+            return FALSE;
+        }
+        METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)writtenBytes);
+    }
+    METRICS_COUNT(COUNTER_IMAGES, 1);
+    METRICS_LAP(timer, STAGE_WRITE);
+    return TRUE;
+}
+
+void freePipelineItem(PipelineItem* item, SpscQueue* recycleQueue) {
+    for (int i = 0; i < item->outputCount; i++) {
+        if (item->outputs[i].ownsPixels) free(item->outputs[i].pixels);
+    }
+    releasePipelineImage(item->first, recycleQueue);
+    releasePipelineImage(item->second, recycleQueue);
+    free(item->objects);
+    free(item);
+}
+
+// 打印一组队列的统计
+void printQueueStats(const char* name, const SpscQueue* queues, int count) {
+    long long pushes = 0;
+    long long depthTotal = 0;
+    long long fullStalls = 0;
+    long long emptyStalls = 0;
+    int maxDepth = 0;
+    for (int i = 0; i < count; i++) {
+        pushes += queues[i].pushes;
+        depthTotal += queues[i].depthTotal;
+        fullStalls += queues[i].fullStalls;
+        emptyStalls += queues[i].emptyStalls;
+        maxDepth = max(maxDepth, queues[i].maxDepth);
+    }
+    printf("队列 %s: 平均深度 %.2f, 最大深度 %d/%d, 队列满等待 %lld 次, 队列空等待 %lld 次\n", name,
+           pushes ? (double)depthTotal / pushes : 0.0, maxDepth, PIPELINE_QUEUE_CAPACITY, fullStalls, emptyStalls);
+}
+
+// 用读取→计算→写出流水线处理文件列表，返回失败的文件数；valid为文件头检查的结果
+// 结束后打印吞吐量、单张延迟和各级队列的深度与等待次数
+int RunPipeline(const BatchOptions* options, char** paths, int count, const BOOL* valid) {
+    PipelineContext context;
+    memset(&context, 0, sizeof(context));
+    context.operation = options->operation;
+    context.rleOutput = options->rleOutput;
+    context.paths = paths;
+    context.valid = valid;
+    context.count = count;
+    context.itemCount = (options->operation == BATCH_COMPARE) ? count - 1 : count;
+    context.workerCount = min(options->jobs, PIPELINE_MAX_WORKERS);
+
+    int workerCount = context.workerCount;
+    context.inputQueues = (SpscQueue*)calloc(workerCount, sizeof(SpscQueue));
+    context.outputQueues = (SpscQueue*)calloc(workerCount, sizeof(SpscQueue));
+    context.arenas = (ScratchArena*)calloc(workerCount, sizeof(ScratchArena));
+    context.metrics = (MetricsBlock*)calloc(workerCount + 1, sizeof(MetricsBlock));
+    PipelineWorkerArgs* args = (PipelineWorkerArgs*)calloc(workerCount, sizeof(PipelineWorkerArgs));
+    HANDLE* workers = (HANDLE*)calloc(workerCount, sizeof(HANDLE));
+    if (!context.inputQueues || !context.outputQueues || !context.arenas || !context.metrics || !args || !workers) {
+        if (context.inputQueues) free(context.inputQueues);
+        if (context.outputQueues) free(context.outputQueues);
+        if (context.arenas) free(context.arenas);
+        if (context.metrics) free(context.metrics);
+        if (args) free(args);
+        if (workers) free(workers);
+        printf("内存分配失败！\n");
+        return context.itemCount;
+    }
+
+    // 先启动计算线程，读取线程只向已启动的计算线程分发任务
+    double start = getMonotonicSeconds();
+    int started = 0;
+    for (int w = 0; w < workerCount; w++) {
+        initScratchArena(&context.arenas[w]);
+        args[w].context = &context;
+        args[w].worker = w;
+        workers[w] = CreateThread(NULL, 0, pipelineWorkerThread, &args[w], 0, NULL);
+        if (!workers[w]) break;
+        started++;
+    }
+    context.workerCount = started;
+    HANDLE reader = started > 0 ? CreateThread(NULL, 0, pipelineReaderThread, &context, 0, NULL) : NULL;
+    if (!reader) {
+        // 由主线程代替读取线程通知计算线程结束
+        for (int w = 0; w < started; w++) spscPush(&context.inputQueues[w], NULL);
+        printf("无法创建流水线线程！\n");
+    }
+    printf("流水线: 1 个读取线程, %d 个计算线程, 每个队列 %d 个槽位\n", started, PIPELINE_QUEUE_CAPACITY);
+
+    int failures = 0;
+    int written = 0;
+    double latencyTotal = 0.0;
+    double latencyMax = 0.0;
+    BOOL stopped = (reader == NULL);
+
+    // 写出线程：按文件顺序轮流从各计算线程的输出队列取结果
+    for (int i = 0; i < context.itemCount; i++) {
+        PipelineItem* item = stopped ? NULL : (PipelineItem*)spscPop(&context.outputQueues[i % started]);
+        if (!item) {
+            stopped = TRUE;
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+            continue;
+        }
+        if (!valid[i] || (context.operation == BATCH_COMPARE && !valid[i + 1])) {
+            failures++;
+            freePipelineItem(item, &context.recycleQueue);
+            continue;
+        }
+
+        // 按文件顺序打印读取和计算线程留下的信息，与逐个处理时的输出一致
+        printf("[%d/%d] %s\n", i + 1, context.itemCount, paths[i]);
+        if (context.operation == BATCH_MARK && item->header.width > 0) {
+            printf("图片信息: 宽度=%d, 高度=%d, 位深=%d\n", item->header.width, item->header.height,
+                   item->header.bitCount);
+        }
+        for (int k = 0; k < 2; k++) {
+            if (item->loadErrors[k]) printf("%s\n", item->loadErrors[k]);
+        }
+        if (context.operation == BATCH_MARK && item->first) printf("开始分析图像...\n");
+        if (item->error) printf("%s\n", item->error);
+        if (!item->ok || !writePipelineItem(item)) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+        } else if (context.operation == BATCH_COMPARE) {
+            reportDifference(item->result, item->first->desc.width * item->first->desc.height,
+                             BATCH_COMPARE_THRESHOLD);
+        } else if (context.operation == BATCH_MARK) {
+            for (int k = 0; k < item->result; k++) {
+                BoundingBox* bbox = &item->objects[k].bbox;
+                printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n",
+                       k + 1, bbox->minX, bbox->minY, bbox->maxX, bbox->maxY, item->objects[k].pixelCount);
+            }
+            if (item->foundCount > item->result) {
+                printf("共 %d 个物体超过最小尺寸，仅记录前 %d 个\n", item->foundCount, item->result);
+            }
+            printf("找到 %d 个物体\n", item->result);
+            if (item->first->desc.bitCount <= 8) {
+                printf("为%d位图像预留调色板索引 %d 用于红色边框\n", item->first->desc.bitCount, item->markIndex);
+            }
+        }
+
+        double latency = getMonotonicSeconds() - item->startTime;
+        latencyTotal += latency;
+        latencyMax = max(latencyMax, latency);
+        written++;
+        freePipelineItem(item, &context.recycleQueue);
+    }
+
+    if (reader) {
+        WaitForSingleObject(reader, INFINITE);
+        CloseHandle(reader);
+    }
+    for (int w = 0; w < started; w++) {
+        WaitForSingleObject(workers[w], INFINITE);
+        CloseHandle(workers[w]);
+    }
+    // 读取线程已退出，由主线程取出回收队列中剩余的图像
+    PipelineImage* recycled;
+    while ((recycled = (PipelineImage*)spscTryPop(&context.recycleQueue)) != NULL) {
+        freePipelineImage(recycled);
+    }
+
+    double elapsed = getMonotonicSeconds() - start;
+    size_t highWater = 0;
+    for (int w = 0; w < workerCount; w++) {
+        highWater += context.arenas[w].highWater;
+        freeScratchArena(&context.arenas[w]);
+    }
+    printf("批处理完成: %d 个文件, 失败 %d 个, 耗时 %.3f 秒, 吞吐量 %.1f 张/秒\n", context.itemCount, failures,
+           elapsed, elapsed > 0 ? written / elapsed : 0.0);
+    printf("单张延迟（读取开始到写出完成）: 平均 %.1f ms, 最大 %.1f ms\n",
+           written ? latencyTotal / written * 1000.0 : 0.0, latencyMax * 1000.0);
+    printQueueStats("读取→计算", context.inputQueues, started);
+    printQueueStats("计算→写出", context.outputQueues, started);
+    printf("内存池: 各计算线程高水位合计 %.1f MB\n", highWater / (1024.0 * 1024.0));
+
+    if (options->metricsFormat) {
+        // 汇总主线程（写出）、读取线程和各计算线程的指标
+        MetricsBlock metrics;
+        MetricsSnapshot(&metrics);
+        for (int i = 0; i <= started; i++) {
+            MetricsMerge(&metrics, &context.metrics[i]);
+        }
+        writeBatchMetrics(options->metricsFormat, &metrics);
+    }
+
+    free(context.inputQueues);
+    free(context.outputQueues);
+    free(context.arenas);
+    free(context.metrics);
+    free(args);
+    free(workers);
+    return failures;
+}
+
+// ---- 结果缓存 ----
+// 命令行: bmp2gray batch <操作> --cache <目录> [--cache-mb N] [--cache-results-only] <文件...>
+// 以像素数据和处理参数的哈希为键缓存每个文件的处理结果（物体列表、差异像素数）和输出文件，
+// 重复出现的相同图像（静止场景的连续帧、重新提交的批次等）直接取回结果，不再二值化、标记或比较。
+// 索引以文本形式保存在缓存目录的index.txt中；输出文件总大小超过上限时按最近最少使用淘汰。
+// 内存中按键的哈希桶查找，各项按使用先后串成双向链表，查找、更新使用时间和淘汰都不扫描全部项。
+#define CACHE_INDEX_VERSION 1
+#define CACHE_MAX_ENTRIES 65536             // 只缓存结果摘要时项数的上限
+#define CACHE_MAX_OUTPUTS 2                 // 每个文件最多的输出文件数（gray有两个）
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+// 缓存的物体记录（只保存边界框和像素数，批处理不计算特征）
+typedef struct {
+    BoundingBox bbox;
+    int pixelCount;
+} CachedObject;
+
+typedef struct {
+    unsigned long long key;
+    unsigned long long lastUsed;        // 最近一次使用时的逻辑时钟
+    int operation;
+    int outputCount;                    // 缓存目录中保存的输出文件数，0表示只有结果摘要
+    long long bytes;                    // 保存的输出文件总字节数
+    int totalPixels;                    // compare的像素总数（第一张图像的宽×高）
+    int diffPixels;
+    int objectCount;
+    CachedObject* objects;
+    int hashNext;                       // 同一哈希桶中的下一项（下标），-1表示没有
+    int older;                          // 使用链表中前一次使用的项（下标），-1表示没有
+    int newer;                          // 使用链表中后一次使用的项（下标），-1表示没有
+} CacheEntry;
+
+typedef struct {
+    char directory[260];
+    long long maxBytes;                 // 输出文件总大小上限
+    BOOL storeOutputs;                  // 是否保存并恢复输出文件
+    CacheEntry* entries;
+    int count;
+    int capacity;
+    int* buckets;                       // 哈希桶：每桶中第一项的下标，-1表示空；桶数为2的幂
+    int bucketCount;
+    int oldest;                         // 使用链表两端的项，淘汰从oldest开始，-1表示没有
+    int newest;
+    unsigned long long clock;
+    long long totalBytes;
+    int hits;
+    int misses;
+    int evictions;
+    BOOL dirty;                         // 索引有改动，需要写回
+} ResultCache;
+
+unsigned long long rotateLeft64(unsigned long long value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+unsigned long long hashRound64(unsigned long long acc, unsigned long long input) {
+    acc += input * HASH_PRIME2;
+    acc = rotateLeft64(acc, 31);
+    return acc * HASH_PRIME1;
+}
+
+unsigned long long hashMergeRound64(unsigned long long acc, unsigned long long lane) {
+    acc ^= hashRound64(0, lane);
+    return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+// 64位非加密哈希（XXH64算法）：32字节一组分4路并行乘加，吞吐量接近内存带宽
+// seed可传入上一段数据的哈希值，把多段数据串联成一个键
+unsigned long long hashBytes64(const void* data, size_t size, unsigned long long seed) {
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    unsigned long long hash;
+    unsigned long long word;
+
+    if (size >= 32) {
+        unsigned long long v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        unsigned long long v2 = seed + HASH_PRIME2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - HASH_PRIME1;
+        const unsigned char* limit = end - 32;
+        do {
+            memcpy(&word, p, 8);      v1 = hashRound64(v1, word);
+            memcpy(&word, p + 8, 8);  v2 = hashRound64(v2, word);
+            memcpy(&word, p + 16, 8); v3 = hashRound64(v3, word);
+            memcpy(&word, p + 24, 8); v4 = hashRound64(v4, word);
+            p += 32;
+        } while (p <= limit);
+        hash = rotateLeft64(v1, 1) + rotateLeft64(v2, 7) + rotateLeft64(v3, 12) + rotateLeft64(v4, 18);
+        hash = hashMergeRound64(hash, v1);
+        hash = hashMergeRound64(hash, v2);
+        hash = hashMergeRound64(hash, v3);
+        hash = hashMergeRound64(hash, v4);
+    } else {
+        hash = seed + HASH_PRIME5;
+    }
+    hash += (unsigned long long)size;
+
+    while (p + 8 <= end) {
+        memcpy(&word, p, 8);
+        hash ^= hashRound64(0, word);
+        hash = rotateLeft64(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        unsigned int half;
+        memcpy(&half, p, 4);
+        hash ^= (unsigned long long)half * HASH_PRIME1;
+        hash = rotateLeft64(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        hash ^= (*p++) * HASH_PRIME5;
+        hash = rotateLeft64(hash, 11) * HASH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// 计算BMP文件内容的哈希：规范化的信息头、行顺序、调色板和解码后的像素（不含行尾填充）
+// RLE压缩与否、文件头中无关字段不同但像素相同的文件得到相同的哈希；outPixels返回宽×高
+BOOL hashBmpContent(const char* path, ScratchArena* arena, unsigned long long* outHash, int* outPixels) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("无法打开文件: %s\n", path);
+        return FALSE;
+    }
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    if (!readBmpHeader(file, &desc, palette)) {
+        fclose(file);
+        return FALSE;
+    }
+    unsigned char* buffer = (unsigned char*)arenaAlloc(arena, desc.imageSize);
+    if (!buffer) {
+        fclose(file);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    if (!readBmpPixelData(file, &desc, buffer)) {
+        arenaRelease(arena, buffer);
+        fclose(file);
+        printf("读取像素数据失败！\n");
+        return FALSE;
+    }
+    fclose(file);
+
+    int topDown = desc.topDown ? 1 : 0;
+    unsigned long long hash = hashBytes64(&desc.infoHeader, sizeof(BITMAPINFOHEADER), 0);
+    hash = hashBytes64(&topDown, sizeof(topDown), hash);
+    if (desc.bitCount <= 8) hash = hashBytes64(palette, (1 << desc.bitCount) * sizeof(RGBQUAD), hash);
+    // 最后一个字节中无效的像素位不参与计算，避免行尾的随机位影响命中
+    int usedBytes = (desc.width * desc.bitCount + 7) / 8;
+    unsigned char lastMask = (desc.bitCount < 8) ? lastByteValidMask(desc.width, desc.bitCount) : 0xFF;
+    for (int y = 0; y < desc.height; y++) {
+        unsigned char* row = buffer + y * desc.rowSize;
+        row[usedBytes - 1] &= lastMask;
+        hash = hashBytes64(row, usedBytes, hash);
+    }
+    arenaRelease(arena, buffer);
+
+    *outHash = hash;
+    *outPixels = desc.width * desc.height;
+    return TRUE;
+}
+
+// 由内容哈希和处理参数组合出缓存键；参数中任何一项变化都得到不同的键
+unsigned long long makeCacheKey(BatchOperation operation, BOOL rleOutput,
+                                unsigned long long firstHash, unsigned long long secondHash) {
+    DetectOptions detect;
+    initDetectOptions(&detect);
+    int params[7];
+    params[0] = CACHE_INDEX_VERSION;
+    params[1] = (int)operation;
+    params[2] = rleOutput ? 1 : 0;
+    params[3] = BATCH_BINARY_THRESHOLD;
+    params[4] = BATCH_COMPARE_THRESHOLD;
+    params[5] = detect.minObjectSize;
+    params[6] = BATCH_MAX_OBJECTS;
+    unsigned long long key = hashBytes64(params, sizeof(params), 0);
+    key = hashBytes64(&firstHash, sizeof(firstHash), key);
+    if (operation == BATCH_COMPARE) key = hashBytes64(&secondHash, sizeof(secondHash), key);
+    return key;
+}
+
+// 缓存目录中第index个输出文件的路径（path至少260字节）
+void makeCacheFilePath(char* path, const ResultCache* cache, unsigned long long key, int index) {
+    sprintf(path, "%.200s/%016llx_%d.bmp", cache->directory, key, index);
+}
+
+long long fileLength(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+    long long length = (_fseeki64(file, 0, SEEK_END) == 0) ? _ftelli64(file) : -1;
+    fclose(file);
+    return length;
+}
+
+// 键所在的哈希桶（键本身是哈希值，直接取低位）
+int cacheBucketOf(const ResultCache* cache, unsigned long long key) {
+    return (int)(key & (unsigned long long)(cache->bucketCount - 1));
+}
+
+// 按各项当前的下标重新填写哈希桶
+void rehashCacheEntries(ResultCache* cache) {
+    for (int i = 0; i < cache->bucketCount; i++) cache->buckets[i] = -1;
+    for (int i = 0; i < cache->count; i++) {
+        int bucket = cacheBucketOf(cache, cache->entries[i].key);
+        cache->entries[i].hashNext = cache->buckets[bucket];
+        cache->buckets[bucket] = i;
+    }
+}
+
+// 改为bucketCount个桶，内存不足返回FALSE（原有的桶不变）
+BOOL resizeCacheBuckets(ResultCache* cache, int bucketCount) {
+    int* buckets = (int*)malloc(bucketCount * sizeof(int));
+    if (!buckets) return FALSE;
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucketCount = bucketCount;
+    rehashCacheEntries(cache);
+    return TRUE;
+}
+
+// 把第index项接到使用链表的最新一端
+void linkNewestCacheEntry(ResultCache* cache, int index) {
+    CacheEntry* entry = &cache->entries[index];
+    entry->older = cache->newest;
+    entry->newer = -1;
+    if (cache->newest >= 0) {
+        cache->entries[cache->newest].newer = index;
+    } else {
+        cache->oldest = index;
+    }
+    cache->newest = index;
+}
+
+// 从使用链表中取下第index项
+void unlinkCacheEntry(ResultCache* cache, int index) {
+    CacheEntry* entry = &cache->entries[index];
+    if (entry->older >= 0) {
+        cache->entries[entry->older].newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    if (entry->newer >= 0) {
+        cache->entries[entry->newer].older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+}
+
+// 哈希桶链表中指向第index项的位置
+int* findCacheLink(ResultCache* cache, int index) {
+    int* link = &cache->buckets[cacheBucketOf(cache, cache->entries[index].key)];
+    while (*link != index) link = &cache->entries[*link].hashNext;
+    return link;
+}
+
+CacheEntry* findCacheEntry(ResultCache* cache, unsigned long long key) {
+    if (cache->bucketCount == 0) return NULL;
+    for (int i = cache->buckets[cacheBucketOf(cache, key)]; i >= 0; i = cache->entries[i].hashNext) {
+        if (cache->entries[i].key == key) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// 记录一次使用：更新逻辑时钟并移到使用链表的最新一端
+void touchCacheEntry(ResultCache* cache, CacheEntry* entry) {
+    int index = (int)(entry - cache->entries);
+    entry->lastUsed = cache->clock++;
+    unlinkCacheEntry(cache, index);
+    linkNewestCacheEntry(cache, index);
+    cache->dirty = TRUE;
+}
+
+// 删除一项及其输出文件，最后一项移到空出的位置（同时改写哈希桶和使用链表中指向它的下标）
+void removeCacheEntry(ResultCache* cache, CacheEntry* entry) {
+    char path[260];
+    for (int i = 0; i < entry->outputCount; i++) {
+        makeCacheFilePath(path, cache, entry->key, i);
+        remove(path);
+    }
+    cache->totalBytes -= entry->bytes;
+    free(entry->objects);
+
+    int index = (int)(entry - cache->entries);
+    int* link = findCacheLink(cache, index);
+    *link = entry->hashNext;
+    unlinkCacheEntry(cache, index);
+
+    int last = --cache->count;
+    if (index != last) {
+        *findCacheLink(cache, last) = index;
+        CacheEntry* moved = &cache->entries[last];
+        if (moved->older >= 0) {
+            cache->entries[moved->older].newer = index;
+        } else {
+            cache->oldest = index;
+        }
+        if (moved->newer >= 0) {
+            cache->entries[moved->newer].older = index;
+        } else {
+            cache->newest = index;
+        }
+        *entry = *moved;
+    }
+    cache->dirty = TRUE;
+}
+
+// 按最近最少使用淘汰，直到总大小和项数都不超过上限
+void evictCacheEntries(ResultCache* cache) {
+    while (cache->count > 0 && (cache->totalBytes > cache->maxBytes || cache->count > CACHE_MAX_ENTRIES)) {
+        removeCacheEntry(cache, &cache->entries[cache->oldest]);
+        cache->evictions++;
+    }
+}
+
+// 追加一项（objects由缓存接管）作为最近使用的项，空间不足时扩容；项数超过桶数时桶数加倍
+CacheEntry* appendCacheEntry(ResultCache* cache, const CacheEntry* entry) {
+    if (cache->count == cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 64;
+        CacheEntry* entries = (CacheEntry*)realloc(cache->entries, capacity * sizeof(CacheEntry));
+        if (!entries) return NULL;
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    if (cache->count >= cache->bucketCount &&
+        !resizeCacheBuckets(cache, cache->bucketCount ? cache->bucketCount * 2 : 64)) {
+        return NULL;
+    }
+    int index = cache->count++;
+    CacheEntry* added = &cache->entries[index];
+    *added = *entry;
+    int bucket = cacheBucketOf(cache, added->key);
+    added->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = index;
+    linkNewestCacheEntry(cache, index);
+    cache->totalBytes += entry->bytes;
+    cache->dirty = TRUE;
+    return added;
+}
+
+int compareCacheEntriesByUse(const void* a, const void* b) {
+    unsigned long long x = ((const CacheEntry*)a)->lastUsed;
+    unsigned long long y = ((const CacheEntry*)b)->lastUsed;
+    return (x > y) - (x < y);
+}
+
+// 读入的各项按索引文件中的顺序追加，按使用时间排序后重建哈希桶和使用链表
+void sortCacheEntriesByUse(ResultCache* cache) {
+    qsort(cache->entries, cache->count, sizeof(CacheEntry), compareCacheEntriesByUse);
+    rehashCacheEntries(cache);
+    cache->oldest = cache->newest = -1;
+    for (int i = 0; i < cache->count; i++) linkNewestCacheEntry(cache, i);
+}
+
+void freeResultCache(ResultCache* cache) {
+    for (int i = 0; i < cache->count; i++) free(cache->entries[i].objects);
+    free(cache->entries);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->count = cache->capacity = cache->bucketCount = 0;
+    cache->oldest = cache->newest = -1;
+}
+
+// 读取缓存目录中的索引；目录不存在时创建，索引不存在时从空缓存开始
+// 索引格式不符时丢弃全部内容（保留的输出文件会在之后被覆盖）
+BOOL openResultCache(ResultCache* cache, const char* directory, int megabytes, BOOL storeOutputs) {
+    memset(cache, 0, sizeof(ResultCache));
+    cache->oldest = cache->newest = -1;
+    sprintf(cache->directory, "%.200s", directory);
+    cache->maxBytes = (long long)megabytes * 1024 * 1024;
+    cache->storeOutputs = storeOutputs;
+    CreateDirectoryA(directory, NULL);
+
+    char indexPath[260];
+    sprintf(indexPath, "%.200s/index.txt", directory);
+    FILE* file = fopen(indexPath, "r");
+    if (!file) return TRUE;
+
+    int version = 0;
+    BOOL valid = (fscanf(file, "bmp2gray-cache %d", &version) == 1 && version == CACHE_INDEX_VERSION);
+    while (valid) {
+        CacheEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        int fields = fscanf(file, "%llx %llu %d %d %lld %d %d %d", &entry.key, &entry.lastUsed, &entry.operation,
+                            &entry.outputCount, &entry.bytes, &entry.totalPixels, &entry.diffPixels,
+                            &entry.objectCount);
+        if (fields == EOF) break;
+        if (fields != 8 || entry.operation < 0 || entry.operation >= BATCH_INVALID ||
+            entry.outputCount < 0 || entry.outputCount > CACHE_MAX_OUTPUTS || entry.bytes < 0 ||
+            entry.objectCount < 0 || entry.objectCount > BATCH_MAX_OBJECTS) {
+            valid = FALSE;
+            break;
+        }
+        if (entry.objectCount > 0) {
+            entry.objects = (CachedObject*)malloc(entry.objectCount * sizeof(CachedObject));
+            if (!entry.objects) {
+                valid = FALSE;
+                break;
+            }
+        }
+        for (int i = 0; i < entry.objectCount && valid; i++) {
+            CachedObject* object = &entry.objects[i];
+            valid = (fscanf(file, "%d %d %d %d %d", &object->bbox.minX, &object->bbox.minY,
+                            &object->bbox.maxX, &object->bbox.maxY, &object->pixelCount) == 5);
+        }
+        if (!valid || !appendCacheEntry(cache, &entry)) {
+            free(entry.objects);
+            valid = FALSE;
+            break;
+        }
+        if (entry.lastUsed >= cache->clock) cache->clock = entry.lastUsed + 1;
+    }
+    fclose(file);
+
+    if (!valid) {
+        printf("缓存索引格式错误，已清空: %s\n", indexPath);
+        freeResultCache(cache);
+        cache->totalBytes = 0;
+        cache->clock = 0;
+    } else {
+        sortCacheEntriesByUse(cache);
+    }
+    cache->dirty = !valid;
+    // 上限可能比上次运行时小
+    evictCacheEntries(cache);
+    return TRUE;
+}
+
+// 把索引写回缓存目录：先写临时文件再替换，中途失败不会留下半个索引
+BOOL saveResultCache(ResultCache* cache) {
+    if (!cache->dirty) return TRUE;
+    char indexPath[260];
+    char tempPath[260];
+    sprintf(indexPath, "%.200s/index.txt", cache->directory);
+    sprintf(tempPath, "%.200s/index.tmp", cache->directory);
+    FILE* file = fopen(tempPath, "w");
+    if (!file) {
+        printf("无法写入缓存索引: %s\n", tempPath);
+        return FALSE;
+    }
+    fprintf(file, "bmp2gray-cache %d\n", CACHE_INDEX_VERSION);
+    for (int i = 0; i < cache->count; i++) {
+        const CacheEntry* entry = &cache->entries[i];
+        fprintf(file, "%016llx %llu %d %d %lld %d %d %d", entry->key, entry->lastUsed, entry->operation,
+                entry->outputCount, entry->bytes, entry->totalPixels, entry->diffPixels, entry->objectCount);
+        for (int j = 0; j < entry->objectCount; j++) {
+            const CachedObject* object = &entry->objects[j];
+            fprintf(file, " %d %d %d %d %d", object->bbox.minX, object->bbox.minY,
+                    object->bbox.maxX, object->bbox.maxY, object->pixelCount);
+        }
+        fprintf(file, "\n");
+    }
+    BOOL ok = (fclose(file) == 0) && MoveFileExA(tempPath, indexPath, MOVEFILE_REPLACE_EXISTING);
+    if (!ok) {
+        printf("无法写入缓存索引: %s\n", indexPath);
+        remove(tempPath);
+        return FALSE;
+    }
+    cache->dirty = FALSE;
+    return TRUE;
+}
+
+// 命中时恢复输出文件并输出与实际处理相同的摘要；输出文件缺失或恢复失败时删除该项，返回FALSE按未命中处理
+BOOL restoreCachedItem(ResultCache* cache, CacheEntry* entry, BatchOperation operation, const char* path) {
+    if (cache->storeOutputs) {
+        char source[260];
+        char target[260];
+        for (int i = 0; batchOutputSuffix(operation, i); i++) {
+            makeCacheFilePath(source, cache, entry->key, i);
+            makeOutputPath(target, path, batchOutputSuffix(operation, i));
+            if (i >= entry->outputCount || !CopyFileA(source, target, FALSE)) {
+                removeCacheEntry(cache, entry);
+                return FALSE;
+            }
+        }
+    }
+    touchCacheEntry(cache, entry);
+
+    printf("缓存命中: %016llx\n", entry->key);
+    if (operation == BATCH_MARK) {
+        for (int i = 0; i < entry->objectCount; i++) {
+            BoundingBox* bbox = &entry->objects[i].bbox;
+            printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n",
+                   i + 1, bbox->minX, bbox->minY, bbox->maxX, bbox->maxY, entry->objects[i].pixelCount);
+        }
+        printf("找到 %d 个物体\n", entry->objectCount);
+    } else if (operation == BATCH_COMPARE) {
+        reportDifference(entry->diffPixels, entry->totalPixels, BATCH_COMPARE_THRESHOLD);
+    }
+    return TRUE;
+}
+
+// 处理成功后存入缓存：复制输出文件到缓存目录，记录结果摘要，然后按上限淘汰
+void storeCachedItem(ResultCache* cache, unsigned long long key, BatchOperation operation, const char* path,
+                     const BatchItemResult* result, int totalPixels) {
+    CacheEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key = key;
+    entry.lastUsed = cache->clock++;
+    entry.operation = (int)operation;
+    entry.totalPixels = totalPixels;
+    entry.diffPixels = result->diffPixels;
+    entry.objectCount = result->objectCount;
+    if (entry.objectCount > 0) {
+        entry.objects = (CachedObject*)malloc(entry.objectCount * sizeof(CachedObject));
+        if (!entry.objects) return;
+        for (int i = 0; i < entry.objectCount; i++) {
+            entry.objects[i].bbox = result->objects[i].bbox;
+            entry.objects[i].pixelCount = result->objects[i].pixelCount;
+        }
+    }
+    if (cache->storeOutputs) {
+        char source[260];
+        char target[260];
+        for (int i = 0; batchOutputSuffix(operation, i); i++) {
+            makeOutputPath(source, path, batchOutputSuffix(operation, i));
+            makeCacheFilePath(target, cache, key, i);
+            long long length = fileLength(source);
+            if (length < 0 || !CopyFileA(source, target, FALSE)) break;
+            entry.bytes += length;
+            entry.outputCount++;
+        }
+    }
+    if (!appendCacheEntry(cache, &entry)) {
+        free(entry.objects);
+        return;
+    }
+    evictCacheEntries(cache);
+}
+
+// 通过缓存处理一个文件：命中时直接取回结果，未命中时正常处理后存入；result与processBatchItem相同
+// hashes缓存每个文件的内容哈希（hashed[i]为FALSE表示尚未计算），compare的后一个文件在下一轮复用
+BOOL processCachedBatchItem(ResultCache* cache, BatchOperation operation, char** paths, int index,
+                            BOOL rleOutput, unsigned long long* hashes, BOOL* hashed, int* pixels,
+                            BatchItemResult* result, ScratchArena* arena) {
+    int fileCount = (operation == BATCH_COMPARE) ? 2 : 1;
+    for (int i = index; i < index + fileCount; i++) {
+        if (!hashed[i]) {
+            if (!hashBmpContent(paths[i], arena, &hashes[i], &pixels[i])) return FALSE;
+            hashed[i] = TRUE;
+        }
+    }
+    unsigned long long key = makeCacheKey(operation, rleOutput, hashes[index],
+                                          (operation == BATCH_COMPARE) ? hashes[index + 1] : 0);
+
+    CacheEntry* entry = findCacheEntry(cache, key);
+    if (entry && cache->storeOutputs && entry->outputCount == 0) {
+        // 只有结果摘要的项无法恢复输出文件
+        removeCacheEntry(cache, entry);
+        entry = NULL;
+    }
+    if (entry && restoreCachedItem(cache, entry, operation, paths[index])) {
+        cache->hits++;
+        METRICS_COUNT(COUNTER_CACHE_HITS, 1);
+        if (result) {
+            memset(result, 0, sizeof(BatchItemResult));
+            result->diffPixels = entry->diffPixels;
+            result->objectCount = entry->objectCount;
+            for (int i = 0; i < entry->objectCount; i++) {
+                recordObject(&result->objects[i], &entry->objects[i].bbox, entry->objects[i].pixelCount, NULL);
+            }
+        }
+        return TRUE;
+    }
+
+    cache->misses++;
+    METRICS_COUNT(COUNTER_CACHE_MISSES, 1);
+    BatchItemResult local;
+    if (!result) result = &local;
+    if (!processBatchItem(operation, paths[index], (operation == BATCH_COMPARE) ? paths[index + 1] : NULL,
+                          rleOutput, result, arena)) {
+        return FALSE;
+    }
+    storeCachedItem(cache, key, operation, paths[index], result, pixels[index]);
+    return TRUE;
+}
+
+// ---- 分片批处理 ----
+// 命令行: bmp2gray batch <操作> --shard i/N [--results 结果文件] <文件...>
+//         bmp2gray merge <输出文件> <结果文件1> <结果文件2> ...
+// 把同一个文件列表交给N个进程（或N台机器）处理，各进程之间只共享文件系统：
+// 每一项按其（第一个）输入路径的哈希值对N取模分配到分片，与列表顺序和机器无关，列表增减时已有的项不会换分片。
+// 每个分片把每一项的结果（状态、物体列表、差异像素数）按行写入自己的结果文件，
+// merge检查各分片来自同一个列表且齐全、没有重复，再按原列表顺序合并为一个结果文件。
+#define RESULTS_VERSION 1
+#define RESULTS_LINE_SIZE 4096
+
+// 一项属于哪个分片
+int shardOfPath(const char* path, int shardCount) {
+    return (int)(hashBytes64(path, strlen(path), 0) % (unsigned long long)shardCount);
+}
+
+// 文件列表的哈希，用于确认各分片处理的是同一个列表
+unsigned long long hashPathList(char** paths, int count) {
+    unsigned long long hash = hashBytes64(&count, sizeof(count), 0);
+    for (int i = 0; i < count; i++) hash = hashBytes64(paths[i], strlen(paths[i]) + 1, hash);
+    return hash;
+}
+
+// 结果文件的首行：版本、操作、分片、总项数、列表哈希
+void writeResultsHeader(FILE* file, BatchOperation operation, int shardIndex, int shardCount, int itemCount,
+                        unsigned long long listHash) {
+    fprintf(file, "bmp2gray-results %d %s %d/%d %d %016llx\n", RESULTS_VERSION, batchOperationName(operation),
+            shardIndex, shardCount, itemCount, listHash);
+}
+
+// 一项的结果：序号、状态、物体数、差异像素数、像素总数、物体列表（x0,y0,x1,y1,像素数;...，没有时为-）、路径
+// 路径放在最后，可以包含空格
+void writeResultRecord(FILE* file, int index, BOOL ok, const BatchItemResult* result, int totalPixels,
+                       const char* path) {
+    fprintf(file, "%d\t%s\t%d\t%d\t%d\t", index, ok ? "ok" : "failed", ok ? result->objectCount : 0,
+            ok ? result->diffPixels : 0, totalPixels);
+    if (!ok || result->objectCount == 0) {
+        fprintf(file, "-");
+    }
+    for (int i = 0; ok && i < result->objectCount; i++) {
+        const BoundingBox* bbox = &result->objects[i].bbox;
+        fprintf(file, "%s%d,%d,%d,%d,%d", i > 0 ? ";" : "", bbox->minX, bbox->minY, bbox->maxX, bbox->maxY,
+                result->objects[i].pixelCount);
+    }
+    fprintf(file, "\t%s\n", path);
+}
+
+// 读入一个结果文件的首行和各项；records[index]为该项去掉序号后的内容（由调用者释放）
+// 格式、操作、分片数、总项数或列表哈希与先前读入的文件不一致时返回FALSE
+BOOL readResultsFile(const char* path, char* operation, int* shardIndex, int* shardCount, int* itemCount,
+                     unsigned long long* listHash, char*** records, int* recordCount) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        printf("无法打开结果文件: %s\n", path);
+        return FALSE;
+    }
+    char line[RESULTS_LINE_SIZE];
+    int version = 0;
+    char fileOperation[16];
+    int fileShard = 0;
+    int fileShardCount = 0;
+    int fileItems = 0;
+    unsigned long long fileHash = 0;
+    if (!fgets(line, sizeof(line), file) ||
+        sscanf(line, "bmp2gray-results %d %15s %d/%d %d %llx", &version, fileOperation, &fileShard,
+               &fileShardCount, &fileItems, &fileHash) != 6 ||
+        version != RESULTS_VERSION || fileShardCount < 1 || fileShard < 0 || fileShard >= fileShardCount ||
+        fileItems < 0) {
+        fclose(file);
+        printf("不是有效的结果文件: %s\n", path);
+        return FALSE;
+    }
+    if (!*records) {
+        strcpy(operation, fileOperation);
+        *shardCount = fileShardCount;
+        *itemCount = fileItems;
+        *listHash = fileHash;
+        *records = (char**)calloc(fileItems + 1, sizeof(char*));
+        if (!*records) {
+            fclose(file);
+            printf("内存分配失败！\n");
+            return FALSE;
+        }
+    } else if (strcmp(operation, fileOperation) != 0 || *shardCount != fileShardCount ||
+               *itemCount != fileItems || *listHash != fileHash) {
+        fclose(file);
+        printf("结果文件与其他分片的操作或文件列表不一致: %s\n", path);
+        return FALSE;
+    }
+    *shardIndex = fileShard;
+
+    // 最后一行为end及本分片的项数，缺少时说明该分片没有正常结束
+    BOOL complete = FALSE;
+    int count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        int expected = 0;
+        if (sscanf(line, "end %d", &expected) == 1) {
+            complete = (expected == count);
+            break;
+        }
+        char* tab = strchr(line, '\t');
+        int index = atoi(line);
+        if (!tab || index < 0 || index >= fileItems || line[strlen(line) - 1] != '\n') {
+            printf("结果文件格式错误: %s\n", path);
+            fclose(file);
+            return FALSE;
+        }
+        if ((*records)[index]) {
+            printf("第 %d 项在多个分片中出现: %s\n", index + 1, path);
+            fclose(file);
+            return FALSE;
+        }
+        size_t length = strlen(tab + 1) + 1;
+        (*records)[index] = (char*)malloc(length);
+        if ((*records)[index]) memcpy((*records)[index], tab + 1, length);
+        if (!(*records)[index]) {
+            fclose(file);
+            printf("内存分配失败！\n");
+            return FALSE;
+        }
+        count++;
+    }
+    fclose(file);
+    if (!complete) {
+        printf("结果文件不完整（分片未正常结束）: %s\n", path);
+        return FALSE;
+    }
+    *recordCount += count;
+    return TRUE;
+}
+
+// 合并各分片的结果文件，返回失败的项数；分片不齐全或不一致时返回所有项数
+int RunMerge(const char* outputPath, char** paths, int count) {
+    char operation[16] = "";
+    int shardCount = 0;
+    int itemCount = 0;
+    unsigned long long listHash = 0;
+    char** records = NULL;
+    int recordCount = 0;
+    BOOL* seenShards = NULL;
+    BOOL ok = TRUE;
+    for (int i = 0; i < count && ok; i++) {
+        int shardIndex;
+        ok = readResultsFile(paths[i], operation, &shardIndex, &shardCount, &itemCount, &listHash,
+                             &records, &recordCount);
+        if (ok && !seenShards) {
+            seenShards = (BOOL*)calloc(shardCount, sizeof(BOOL));
+            ok = seenShards != NULL;
+        }
+        if (ok && seenShards[shardIndex]) {
+            printf("分片 %d/%d 重复: %s\n", shardIndex, shardCount, paths[i]);
+            ok = FALSE;
+        }
+        if (ok) seenShards[shardIndex] = TRUE;
+    }
+    for (int s = 0; ok && s < shardCount; s++) {
+        if (!seenShards[s]) {
+            printf("缺少分片 %d/%d 的结果文件\n", s, shardCount);
+            ok = FALSE;
+        }
+    }
+    if (ok && recordCount != itemCount) {
+        printf("结果项数 %d 与文件列表的 %d 项不一致\n", recordCount, itemCount);
+        ok = FALSE;
+    }
+
+    int failures = 0;
+    long long objects = 0;
+    FILE* output = ok ? fopen(outputPath, "w") : NULL;
+    if (ok && !output) {
+        printf("无法创建输出文件: %s\n", outputPath);
+        ok = FALSE;
+    }
+    if (ok) {
+        // 合并后的文件本身就是一个完整的单分片结果文件
+        writeResultsHeader(output, parseBatchOperation(operation), 0, 1, itemCount, listHash);
+        for (int i = 0; i < itemCount; i++) {
+            fprintf(output, "%d\t%s", i, records[i]);
+            if (strncmp(records[i], "ok\t", 3) != 0) failures++;
+            objects += atoi(strchr(records[i], '\t') + 1);
+        }
+        fprintf(output, "end %d %d\n", itemCount, failures);
+        ok = fclose(output) == 0;
+        if (!ok) printf("无法写入输出文件: %s\n", outputPath);
+    }
+    if (ok) {
+        printf("合并完成: %s, %d 个分片, %d 项, 失败 %d 项, 物体 %lld 个\n", outputPath, shardCount, itemCount,
+               failures, objects);
+    }
+
+    for (int i = 0; records && i < itemCount; i++) free(records[i]);
+    free(records);
+    free(seenShards);
+    return ok ? failures : max(itemCount, 1);
+}
+
+// 依次处理文件列表，返回失败的文件数
+// 处理前先只读文件头筛查所有文件，无效的文件直接跳过，不分配内存；options->jobs大于0时交给流水线处理
+// options->cacheDirectory不为NULL时经结果缓存处理；options->shardCount大于1时只处理本分片的项（仅逐个处理模式）
+int RunBatch(const BatchOptions* options, char** paths, int count) {
+    BatchOperation operation = options->operation;
+    int itemCount = (operation == BATCH_COMPARE) ? count - 1 : count;
+    BOOL* valid = (BOOL*)malloc(count * sizeof(BOOL));
+    BOOL* selected = (BOOL*)calloc(count, sizeof(BOOL));
+    int* areas = (int*)calloc(count, sizeof(int));
+    if (!valid || !selected || !areas) {
+        printf("内存分配失败！\n");
+        free(valid);
+        free(selected);
+        free(areas);
+        return count;
+    }
+    int shardItems = 0;
+    for (int i = 0; i < itemCount; i++) {
+        selected[i] = options->shardCount <= 1 || shardOfPath(paths[i], options->shardCount) == options->shardIndex;
+        if (selected[i]) shardItems++;
+    }
+    // 只检查本分片用到的文件：各项的文件，以及compare的后一个文件
+    int rejected = 0;
+    for (int i = 0; i < count; i++) {
+        valid[i] = FALSE;
+        if (!selected[i] && !(operation == BATCH_COMPARE && i > 0 && selected[i - 1])) continue;
+        BmpDescriptor desc;
+        BmpProbeStatus status = ProbeBmpFile(paths[i], &desc);
+        valid[i] = (status == BMP_PROBE_OK);
+        if (!valid[i]) {
+            printf("跳过 %s: %s\n", paths[i], bmpProbeStatusText(status));
+            rejected++;
+        } else {
+            areas[i] = desc.width * desc.height;
+        }
+    }
+    if (rejected > 0) printf("文件头检查: %d 个文件无效\n", rejected);
+
+    if (options->jobs > 0) {
+        int failures = RunPipeline(options, paths, count, valid);
+        free(valid);
+        free(selected);
+        free(areas);
+        return failures;
+    }
+
+    FILE* results = NULL;
+    if (options->resultsPath) {
+        results = fopen(options->resultsPath, "w");
+        if (!results) {
+            printf("无法创建结果文件: %s\n", options->resultsPath);
+            free(valid);
+            free(selected);
+            free(areas);
+            return count;
+        }
+        writeResultsHeader(results, operation, options->shardIndex, options->shardCount, itemCount,
+                           hashPathList(paths, count));
+    }
+
+    ScratchArena arena;
+    initScratchArena(&arena);
+
+    ResultCache cache;
+    unsigned long long* hashes = NULL;
+    BOOL* hashed = NULL;
+    int* pixels = NULL;
+    if (options->cacheDirectory) {
+        openResultCache(&cache, options->cacheDirectory, options->cacheMegabytes, !options->cacheResultsOnly);
+        hashes = (unsigned long long*)malloc(count * sizeof(unsigned long long));
+        hashed = (BOOL*)calloc(count, sizeof(BOOL));
+        pixels = (int*)malloc(count * sizeof(int));
+        if (!hashes || !hashed || !pixels) {
+            printf("内存分配失败！\n");
+            free(hashes);
+            free(hashed);
+            free(pixels);
+            freeResultCache(&cache);
+            freeScratchArena(&arena);
+            free(valid);
+            free(selected);
+            free(areas);
+            if (results) fclose(results);
+            return count;
+        }
+    }
+
+    int failures = 0;
+    int steadyAllocations = 0;          // 第一张图像之后向系统申请内存的次数
+    int processed = 0;
+    double start = getMonotonicSeconds();
+
+    int position = 0;
+    for (int i = 0; i < itemCount; i++) {
+        if (!selected[i]) continue;
+        position++;
+        int allocationsBefore = arena.systemAllocations;
+        BatchItemResult result;
+        if (!valid[i] || (operation == BATCH_COMPARE && !valid[i + 1])) {
+            if (results) writeResultRecord(results, i, FALSE, NULL, 0, paths[i]);
+            failures++;
+            continue;
+        }
+        printf("[%d/%d] %s\n", position, shardItems, paths[i]);
+        BOOL ok = options->cacheDirectory
+            ? processCachedBatchItem(&cache, operation, paths, i, options->rleOutput, hashes, hashed, pixels,
+                                     &result, &arena)
+            : processBatchItem(operation, paths[i], (operation == BATCH_COMPARE) ? paths[i + 1] : NULL,
+                               options->rleOutput, &result, &arena);
+        if (!ok) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+        }
+        if (results) writeResultRecord(results, i, ok, &result, areas[i], paths[i]);
+        resetScratchArena(&arena);
+        if (processed++ > 0) steadyAllocations += arena.systemAllocations - allocationsBefore;
+    }
+
+    double elapsed = getMonotonicSeconds() - start;
+    if (options->shardCount > 1) {
+        printf("分片 %d/%d: 共 %d 项中的 %d 项\n", options->shardIndex, options->shardCount, itemCount, shardItems);
+    }
+    printf("批处理完成: %d 个文件, 失败 %d 个, 耗时 %.3f 秒\n", shardItems, failures, elapsed);
+    printf("内存池: 高水位 %.1f MB, 向系统申请 %d 次（第一张图像之后 %d 次）\n",
+           arena.highWater / (1024.0 * 1024.0), arena.systemAllocations, steadyAllocations);
+    if (options->cacheDirectory) {
+        printf("结果缓存: 命中 %d, 未命中 %d, 淘汰 %d, 共 %d 项 %.1f MB\n", cache.hits, cache.misses,
+               cache.evictions, cache.count, cache.totalBytes / (1024.0 * 1024.0));
+        saveResultCache(&cache);
+        freeResultCache(&cache);
+        free(hashes);
+        free(hashed);
+        free(pixels);
+    }
+
+    if (options->metricsFormat) {
+        MetricsBlock metrics;
+        MetricsSnapshot(&metrics);
+        writeBatchMetrics(options->metricsFormat, &metrics);
+    }
+
+    if (results) {
+        fprintf(results, "end %d %d\n", shardItems, failures);
+        if (fclose(results) != 0) {
+            printf("无法写入结果文件: %s\n", options->resultsPath);
+            failures = max(failures, 1);
+        }
+    }
+
+    freeScratchArena(&arena);
+    free(valid);
+    free(selected);
+    free(areas);
+    return failures;
+}
+
+// ---- 性能基准 ----
+// 命令行: bmp2gray bench [选项]
+// 生成确定性的合成BMP（随机圆形物体+椒盐噪声），按尺寸和位深度分别对各项操作计时。
+// 每项先预热再重复测量，输出p50/p99延迟、吞吐量(Mpix/s)和进程峰值内存；
+// 每行结果的字段顺序固定（key=value），便于脚本长期跟踪。
+
+typedef struct {
+    const char* name;
+    int width;
+    int height;
+} BenchSize;
+
+const BenchSize benchSizes[] = {
+    { "vga", 640, 480 },
+    { "hd", 1280, 720 },
+    { "fhd", 1920, 1080 },
+    { "4k", 3840, 2160 },
+    { "8k", 7680, 4320 },
+    { "16k", 15360, 8640 },
+};
+#define BENCH_SIZE_COUNT ((int)(sizeof(benchSizes) / sizeof(benchSizes[0])))
+#define BENCH_MAX_ITEMS 16
+
+// 合成图像参数
+typedef struct {
+    int blobCount;                  // 物体数量
+    int blobRadius;                 // 物体最大半径（实际半径在[radius/2, radius]之间），0表示按图像高度的1/20
+    double noise;                   // 噪声像素比例（0~1），被选中的像素黑白翻转
+    unsigned int seed;              // 随机种子，相同参数生成的图像逐字节相同
+    BOOL topDown;                   // 写为自上而下的图像（biHeight为负）
+    BOOL randomColors;              // 黑/白像素分别取[0,127]/[128,255]内的随机值（24/32位各通道独立，含Alpha）
+} SyntheticSpec;
+
+typedef struct {
+    BenchSize sizes[BENCH_MAX_ITEMS];
+    int sizeCount;
+    int bits[BENCH_MAX_ITEMS];
+    int bitsCount;
+    BatchOperation operations[BENCH_MAX_ITEMS];
+    int operationCount;
+    const char* directory;          // 合成图像和输出文件的临时目录
+    int warmup;
+    int repetitions;
+    SyntheticSpec spec;
+} BenchOptions;
+
+// xorshift32伪随机数，跨平台结果一致
+unsigned int nextRandom(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// 生成合成图像：白色背景上的黑色实心圆，再按比例翻转随机像素
+// 支持1/4/8/24/32位，索引格式使用灰阶调色板
+BOOL GenerateSyntheticBmp(const char* path, int width, int height, int bitCount, const SyntheticSpec* spec) {
+    if (!isSupportedBitCount(bitCount) || width <= 0 || height <= 0) {
+        printf("不支持的合成图像参数！\n");
+        return FALSE;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("无法创建合成图像: %s\n", path);
+        return FALSE;
+    }
+
+    int rowSize = ((width * bitCount + 31) / 32) * 4;
+    int blobCount = max(spec->blobCount, 0);
+    int* blobs = (int*)malloc((blobCount * 3 + 1) * sizeof(int));
+    unsigned char* gray = (unsigned char*)malloc(width);
+    unsigned char* row = (unsigned char*)calloc(rowSize, 1);
+    if (!blobs || !gray || !row) {
+        if (blobs) free(blobs);
+        if (gray) free(gray);
+        if (row) free(row);
+        fclose(file);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+
+    unsigned int state = spec->seed ? spec->seed : 1;
+    int maxRadius = spec->blobRadius > 0 ? spec->blobRadius : max(2, height / 20);
+    for (int i = 0; i < blobCount; i++) {
+        blobs[i * 3] = nextRandom(&state) % width;
+        blobs[i * 3 + 1] = nextRandom(&state) % height;
+        blobs[i * 3 + 2] = maxRadius / 2 + nextRandom(&state) % (maxRadius - maxRadius / 2 + 1);
+    }
+
+    BITMAPINFOHEADER infoHeader;
+    memset(&infoHeader, 0, sizeof(infoHeader));
+    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    infoHeader.biWidth = width;
+    infoHeader.biHeight = spec->topDown ? -height : height;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = (WORD)bitCount;
+    infoHeader.biCompression = BI_RGB;
+    infoHeader.biSizeImage = rowSize * height;
+
+    RGBQUAD palette[256];
+    int paletteCount = (bitCount <= 8) ? (1 << bitCount) : 0;
+    for (int i = 0; i < paletteCount; i++) {
+        BYTE value = (BYTE)(i * 255 / (paletteCount - 1));
+        palette[i].rgbRed = palette[i].rgbGreen = palette[i].rgbBlue = value;
+        palette[i].rgbReserved = 0;
+    }
+    writeBmpHeaders(file, &infoHeader, bitCount, palette, paletteCount, rowSize, height);
+
+    unsigned int noiseThreshold = (unsigned int)(min(max(spec->noise, 0.0), 1.0) * 4294967295.0);
+    for (int y = 0; y < height; y++) {
+        memset(gray, 255, width);
+        for (int i = 0; i < blobCount; i++) {
+            int dy = y - blobs[i * 3 + 1];
+            int radius = blobs[i * 3 + 2];
+            if (dy < -radius || dy > radius) continue;
+            int half = (int)sqrt((double)(radius * radius - dy * dy));
+            int x0 = max(0, blobs[i * 3] - half);
+            int x1 = min(width - 1, blobs[i * 3] + half);
+            if (x0 <= x1) memset(gray + x0, 0, x1 - x0 + 1);
+        }
+        if (noiseThreshold > 0) {
+            for (int x = 0; x < width; x++) {
+                if (nextRandom(&state) < noiseThreshold) gray[x] = (unsigned char)(255 - gray[x]);
+            }
+        }
+        for (int x = 0; x < width; x++) {
+            if (!spec->randomColors || bitCount == 1) {
+                pfSetGray(row, x, gray[x], bitCount);
+            } else if (bitCount == 24 || bitCount == 32) {
+                unsigned char* pixel = row + x * (bitCount / 8);
+                for (int c = 0; c < bitCount / 8; c++) {
+                    unsigned char value = (unsigned char)(nextRandom(&state) & 0x7F);
+                    pixel[c] = (c < 3 && gray[x] >= 128) ? (unsigned char)(value | 0x80) : value;
+                }
+            } else {
+                unsigned char value = (unsigned char)(nextRandom(&state) & 0x7F);
+                pfSetGray(row, x, (gray[x] >= 128) ? (unsigned char)(value | 0x80) : value, bitCount);
+            }
+        }
+        fwrite(row, 1, rowSize, file);
+    }
+
+    free(blobs);
+    free(gray);
+    free(row);
+    fclose(file);
+    return TRUE;
+}
+
+// 进程峰值内存（MB）
+double getPeakMemoryMB(void) {
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0.0;
+    return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+}
+
+// 计时期间把标准输出重定向到NUL，避免逐物体的打印影响测量；返回保存的句柄供恢复
+int suppressStdout(void) {
+    fflush(stdout);
+    int saved = _dup(_fileno(stdout));
+    int nul = _open("NUL", _O_WRONLY);
+    if (nul >= 0) {
+        _dup2(nul, _fileno(stdout));
+        _close(nul);
+    }
+    return saved;
+}
+
+void restoreStdout(int saved) {
+    fflush(stdout);
+    if (saved >= 0) {
+        _dup2(saved, _fileno(stdout));
+        _close(saved);
+    }
+}
+
+int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// 已排序样本的百分位数（最近秩法）
+double percentileOfSorted(const double* sorted, int count, double percentile) {
+    int rank = (int)ceil(percentile / 100.0 * count);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+// 删除processBatchItem为path生成的输出文件
+void removeBatchOutputs(BatchOperation operation, const char* path) {
+    char outputPath[260];
+    switch (operation) {
+    case BATCH_GRAY:
+        makeOutputPath(outputPath, path, "_gray.bmp");
+        remove(outputPath);
+        makeOutputPath(outputPath, path, "_gray_cross.bmp");
+        break;
+    case BATCH_BINARY:
+        makeOutputPath(outputPath, path, "_binary.bmp");
+        break;
+    case BATCH_MARK:
+        makeOutputPath(outputPath, path, "_objects.bmp");
+        break;
+    case BATCH_COMPARE:
+        makeOutputPath(outputPath, path, "_diff.bmp");
+        break;
+    default:
+        return;
+    }
+    remove(outputPath);
+}
+
+// 运行基准测试，返回失败的测量项数
+int RunBenchmark(const BenchOptions* options) {
+    ScratchArena arena;
+    initScratchArena(&arena);
+    double* samples = (double*)malloc(max(options->repetitions, 1) * sizeof(double));
+    if (!samples) {
+        printf("内存分配失败！\n");
+        return 1;
+    }
+
+    printf("# bmp2gray bench format=1 warmup=%d reps=%d blobs=%d radius=%d noise=%.4f seed=%u\n",
+           options->warmup, options->repetitions, options->spec.blobCount, options->spec.blobRadius,
+           options->spec.noise, options->spec.seed);
+
+    int failures = 0;
+    for (int s = 0; s < options->sizeCount; s++) {
+        const BenchSize* size = &options->sizes[s];
+        for (int b = 0; b < options->bitsCount; b++) {
+            int bitCount = options->bits[b];
+            char pathA[260];
+            char pathB[260];
+            sprintf(pathA, "%.200s/bench_%dx%d_%d_a.bmp", options->directory, size->width, size->height, bitCount);
+            sprintf(pathB, "%.200s/bench_%dx%d_%d_b.bmp", options->directory, size->width, size->height, bitCount);
+
+            // 第二张图像换一个种子，供compare使用
+            SyntheticSpec specB = options->spec;
+            specB.seed = options->spec.seed + 1;
+            if (!GenerateSyntheticBmp(pathA, size->width, size->height, bitCount, &options->spec) ||
+                !GenerateSyntheticBmp(pathB, size->width, size->height, bitCount, &specB)) {
+                failures++;
+                continue;
+            }
+
+            for (int o = 0; o < options->operationCount; o++) {
+                BatchOperation operation = options->operations[o];
+                BOOL ok = TRUE;
+
+                int savedStdout = suppressStdout();
+                for (int r = 0; r < options->warmup && ok; r++) {
+                    ok = processBatchItem(operation, pathA, pathB, FALSE, NULL, &arena);
+                    resetScratchArena(&arena);
+                }
+                for (int r = 0; r < options->repetitions && ok; r++) {
+                    double start = getMonotonicSeconds();
+                    ok = processBatchItem(operation, pathA, pathB, FALSE, NULL, &arena);
+                    samples[r] = getMonotonicSeconds() - start;
+                    resetScratchArena(&arena);
+                }
+                restoreStdout(savedStdout);
+                removeBatchOutputs(operation, pathA);
+
+                if (!ok) {
+                    printf("op=%s bits=%d size=%s width=%d height=%d status=failed\n",
+                           batchOperationName(operation), bitCount, size->name, size->width, size->height);
+                    failures++;
+                    continue;
+                }
+
+                qsort(samples, options->repetitions, sizeof(double), compareDoubles);
+                double p50 = percentileOfSorted(samples, options->repetitions, 50.0);
+                double p99 = percentileOfSorted(samples, options->repetitions, 99.0);
+                double megaPixels = (double)size->width * size->height / 1e6;
+                printf("op=%s bits=%d size=%s width=%d height=%d p50_ms=%.3f p99_ms=%.3f mpix_s=%.1f peak_rss_mb=%.1f\n",
+                       batchOperationName(operation), bitCount, size->name, size->width, size->height,
+                       p50 * 1000.0, p99 * 1000.0, p50 > 0 ? megaPixels / p50 : 0.0, getPeakMemoryMB());
+                fflush(stdout);
+            }
+
+            remove(pathA);
+            remove(pathB);
+        }
+    }
+
+    printf("# arena_high_water_mb=%.1f arena_system_allocations=%d failures=%d\n",
+           arena.highWater / (1024.0 * 1024.0), arena.systemAllocations, failures);
+    free(samples);
+    freeScratchArena(&arena);
+    return failures;
+}
+
+// 解析逗号分隔的尺寸列表：预设名（vga/hd/fhd/4k/8k/16k/all）或"宽x高"
+BOOL parseBenchSizes(const char* text, BenchOptions* options) {
+    char list[256];
+    strncpy(list, text, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    options->sizeCount = 0;
+    for (char* token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+        if (strcmp(token, "all") == 0) {
+            for (int i = 0; i < BENCH_SIZE_COUNT && options->sizeCount < BENCH_MAX_ITEMS; i++) {
+                options->sizes[options->sizeCount++] = benchSizes[i];
+            }
+            continue;
+        }
+        if (options->sizeCount >= BENCH_MAX_ITEMS) return FALSE;
+        BenchSize* size = &options->sizes[options->sizeCount];
+        int found = 0;
+        for (int i = 0; i < BENCH_SIZE_COUNT; i++) {
+            if (strcmp(token, benchSizes[i].name) == 0) {
+                *size = benchSizes[i];
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            if (sscanf(token, "%dx%d", &size->width, &size->height) != 2 || size->width <= 0 || size->height <= 0) {
+                return FALSE;
+            }
+            size->name = "custom";
+        }
+        options->sizeCount++;
+    }
+    return options->sizeCount > 0;
+}
+
+BOOL parseBenchBits(const char* text, BenchOptions* options) {
+    char list[256];
+    strncpy(list, text, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    options->bitsCount = 0;
+    for (char* token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+        int bitCount = atoi(token);
+        if (!isSupportedBitCount(bitCount) || options->bitsCount >= BENCH_MAX_ITEMS) return FALSE;
+        options->bits[options->bitsCount++] = bitCount;
+    }
+    return options->bitsCount > 0;
+}
+
+BOOL parseBenchOperations(const char* text, BenchOptions* options) {
+    char list[256];
+    strncpy(list, text, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+    options->operationCount = 0;
+    for (char* token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+        BatchOperation operation = parseBatchOperation(token);
+        if (operation == BATCH_INVALID || options->operationCount >= BENCH_MAX_ITEMS) return FALSE;
+        options->operations[options->operationCount++] = operation;
+    }
+    return options->operationCount > 0;
+}
+
+// 解析bench子命令参数，成功时返回TRUE
+BOOL parseBenchOptions(int argc, char* argv[], BenchOptions* options) {
+    memset(options, 0, sizeof(BenchOptions));
+    options->directory = ".";
+    options->warmup = 2;
+    options->repetitions = 10;
+    options->spec.blobCount = 40;
+    options->spec.blobRadius = 0;
+    options->spec.noise = 0.001;
+    options->spec.seed = 1;
+    parseBenchSizes("vga,hd,fhd,4k", options);
+    parseBenchBits("1,8,24,32", options);
+    parseBenchOperations("gray,binary,mark,compare", options);
+
+    for (int i = 0; i < argc; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!value) return FALSE;
+        if (strcmp(argv[i], "--sizes") == 0) {
+            if (!parseBenchSizes(value, options)) return FALSE;
+        } else if (strcmp(argv[i], "--bits") == 0) {
+            if (!parseBenchBits(value, options)) return FALSE;
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            if (!parseBenchOperations(value, options)) return FALSE;
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            options->directory = value;
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            options->warmup = max(0, atoi(value));
+        } else if (strcmp(argv[i], "--reps") == 0) {
+            options->repetitions = max(1, atoi(value));
+        } else if (strcmp(argv[i], "--blobs") == 0) {
+            options->spec.blobCount = max(0, atoi(value));
+        } else if (strcmp(argv[i], "--radius") == 0) {
+            options->spec.blobRadius = max(0, atoi(value));
+        } else if (strcmp(argv[i], "--noise") == 0) {
+            options->spec.noise = atof(value);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            options->spec.seed = (unsigned int)strtoul(value, NULL, 10);
+        } else {
+            return FALSE;
+        }
+        i++;
+    }
+    return TRUE;
+}
+
+// ---- 监视目录 ----
+// 命令行: bmp2gray watch <目录> [--chain gray,binary,mark|compare] [--out 输出目录] [--jobs N] [--backlog N]
+//                    [--overload drop-newest|drop-oldest] [--max-age 毫秒] [--limit N] [--rle] [--metrics prom|json]
+// 用ReadDirectoryChangesW监视目录中新到达的BMP。写入方关闭文件（可以独占打开）后把文件放入有界积压队列，
+// 常驻的工作线程各自保留内存池，对每个文件依次执行操作链，每一步的输出写入输出目录。
+// 过载时积压队列满则按策略丢弃最新或最旧的文件；设置了最大等待时间时，关闭后等待超时仍未开始处理的文件被跳过。
+// 等待关闭的文件已满时新到达的通知被丢弃，路径超过260字节的文件被跳过，两者都逐个报告并在结束时计数。
+// 端到端延迟从文件的最后写入时间（写入方关闭文件时确定）计到结果输出。Ctrl+C结束监视，已排队的文件处理完后退出。
+
+#define WATCH_MAX_CHAIN 8
+#define WATCH_MAX_WORKERS 16
+#define WATCH_PENDING_CAPACITY 256      // 等待写入方关闭的文件数上限
+#define WATCH_RECENT_CAPACITY 64        // 记住最近入队的文件，忽略同一次写入产生的重复通知
+#define WATCH_LATENCY_SAMPLES 1024      // 计算延迟百分位数所用的最近样本数
+#define WATCH_POLL_MS 20                // 有文件等待关闭时的轮询间隔
+#define WATCH_IDLE_MS 250
+
+typedef enum {
+    WATCH_DROP_NEWEST,                  // 队列满时丢弃新到达的文件
+    WATCH_DROP_OLDEST                   // 队列满时丢弃排队最久的文件，优先处理最新的
+} WatchOverloadPolicy;
+
+typedef struct {
+    const char* directory;
+    char outputDirectory[260];
+    BatchOperation chain[WATCH_MAX_CHAIN];
+    int chainLength;
+    int workers;
+    int backlog;                        // 积压队列容量
+    WatchOverloadPolicy overload;
+    int maxAgeMs;                       // 0表示不限制
+    long long limit;                    // 到达这么多文件后退出，0表示一直运行
+    BOOL rleOutput;
+    const char* metricsFormat;
+} WatchOptions;
+
+typedef struct {
+    char path[260];
+    char previousPath[260];             // compare用的上一个到达的文件，空字符串表示没有
+    ULONGLONG closeTime;                // 最后写入时间（FILETIME，100纳秒）
+    double queuedAt;                    // 入队时刻（单调时钟）
+} WatchTask;
+
+typedef struct {
+    const WatchOptions* options;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE notEmpty;
+    WatchTask* tasks;                   // 环形积压队列
+    int head;
+    int count;
+    BOOL stopping;
+    // 以下统计受lock保护
+    long long arrived;
+    long long processed;
+    long long failed;
+    long long dropped;
+    long long expired;
+    int maxCount;
+    double latencies[WATCH_LATENCY_SAMPLES];
+    long long latencyCount;
+    double latencySum;
+    double latencyMax;
+    MetricsBlock* metrics;              // 工作线程退出前保存的指标
+} WatchContext;
+
+typedef struct {
+    WatchContext* context;
+    int worker;
+} WatchWorkerArgs;
+
+// 监视过程中处理的一张图像
+typedef struct {
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    int paletteCount;
+    int bitCount;
+    int rowSize;
+    unsigned char* pixels;
+} WatchImage;
+
+volatile LONG watchStopRequested = 0;
+
+BOOL WINAPI watchCtrlHandler(DWORD ctrlType) {
+    if (ctrlType == CTRL_C_EVENT || ctrlType == CTRL_BREAK_EVENT) {
+        watchStopRequested = 1;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+ULONGLONG currentFileTime(void) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+// 距closeTime过去的毫秒数
+double millisecondsSince(ULONGLONG closeTime) {
+    ULONGLONG now = currentFileTime();
+    return now > closeTime ? (now - closeTime) / 10000.0 : 0.0;
+}
+
+// 写入方关闭文件后才能独占打开；成功时返回最后写入时间，*missing表示文件已不存在
+BOOL tryOpenClosedFile(const char* path, ULONGLONG* closeTime, BOOL* missing) {
+    *missing = FALSE;
+    HANDLE file = CreateFileA(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        DWORD error = GetLastError();
+        *missing = (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND);
+        return FALSE;
+    }
+    FILETIME lastWrite;
+    BOOL ok = GetFileTime(file, NULL, NULL, &lastWrite);
+    CloseHandle(file);
+    *closeTime = ((ULONGLONG)lastWrite.dwHighDateTime << 32) | lastWrite.dwLowDateTime;
+    return ok;
+}
+
+// 文件名的扩展名是否为ext（不区分大小写）
+BOOL hasExtension(const char* name, const char* ext) {
+    size_t nameLength = strlen(name);
+    size_t extLength = strlen(ext);
+    return nameLength > extLength && _stricmp(name + nameLength - extLength, ext) == 0;
+}
+
+// 读取图像，像素数据从内存池分配
+BOOL loadWatchImage(const char* path, WatchImage* image, ScratchArena* arena) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("无法打开输入文件！\n");
+        return FALSE;
+    }
+    if (!readBmpHeader(file, &image->desc, image->palette)) {
+        fclose(file);
+        return FALSE;
+    }
+    image->bitCount = image->desc.bitCount;
+    image->rowSize = image->desc.rowSize;
+    image->paletteCount = (image->bitCount <= 8) ? (1 << image->bitCount) : 0;
+    image->pixels = (unsigned char*)arenaAlloc(arena, image->desc.imageSize);
+    if (!image->pixels || !readBmpPixelData(file, &image->desc, image->pixels)) {
+        fclose(file);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    fclose(file);
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)image->desc.dataSize);
+    return TRUE;
+}
+
+// 写出一步的结果
+BOOL writeWatchImage(const char* path, const WatchImage* image, BOOL rle) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("无法创建输出文件: %s\n", path);
+        return FALSE;
+    }
+    int writtenBytes = writeBmpImage(file, &image->desc.infoHeader, image->bitCount, image->palette,
+                                     image->paletteCount, image->pixels, image->rowSize,
+                                     image->desc.width, image->desc.height, rle);
+    fclose(file);
+    METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)max(writtenBytes, 0));
+    return writtenBytes >= 0;
+}
+
+// 对一个文件依次执行操作链，summary（至少160字节）中写入一行结果摘要
+BOOL runWatchChain(const WatchOptions* options, const WatchTask* task, ScratchArena* arena,
+                   char* summary) {
+    METRICS_TIMER_START(timer);
+    WatchImage image;
+    int length = 0;
+    summary[0] = '\0';
+    if (!loadWatchImage(task->path, &image, arena)) {
+        sprintf(summary, "读取失败");
+        return FALSE;
+    }
+    METRICS_LAP(timer, STAGE_READ);
+
+    int width = image.desc.width;
+    int height = image.desc.height;
+    char outputPath[260];
+    for (int step = 0; step < options->chainLength; step++) {
+        const char* suffix = NULL;
+        switch (options->chain[step]) {
+        case BATCH_GRAY:
+            grayPaletteEntries(image.palette, image.paletteCount);
+            grayPixelRows(image.pixels, width, height, image.bitCount, image.rowSize);
+            METRICS_LAP(timer, STAGE_COMPUTE);
+            suffix = "_gray.bmp";
+            break;
+        case BATCH_BINARY:
+            binarizeImageBuffer(image.pixels, image.palette, width, height, image.bitCount, image.rowSize,
+                                BATCH_BINARY_THRESHOLD);
+            METRICS_LAP(timer, STAGE_COMPUTE);
+            suffix = "_binary.bmp";
+            break;
+        case BATCH_MARK: {
+            DetectOptions detectOptions;
+            initDetectOptions(&detectOptions);
+            unsigned char* labelBuffer = canonicalizeLabelBuffer(image.pixels, image.palette, image.bitCount,
+                                                                 image.rowSize, height, arena);
+            ObjectInfo* objects = (ObjectInfo*)arenaAlloc(arena, detectOptions.maxObjects * sizeof(ObjectInfo));
+            int objectCount = 0;
+            int found = (labelBuffer && objects) ?
+                detectObjectsWithOptions(labelBuffer, width, height, image.bitCount, image.rowSize, &detectOptions,
+                                         NULL, objects, detectOptions.maxObjects, &objectCount, arena) : -1;
+            METRICS_LAP(timer, STAGE_LABEL);
+            if (found < 0 || drawObjectMarks(image.pixels, image.palette, &image.paletteCount, width, height,
+                                             image.bitCount, image.rowSize, objects, objectCount, &image.pixels,
+                                             &image.bitCount, &image.rowSize, arena) < 0) {
+                sprintf(summary + length, "内存分配失败");
+                return FALSE;
+            }
+            METRICS_LAP(timer, STAGE_DRAW);
+            length += sprintf(summary + length, "%s物体 %d", length ? ", " : "", found);
+            suffix = "_objects.bmp";
+            break;
+        }
+        case BATCH_COMPARE: {
+            // 与上一个到达的文件比较，差异图单独输出，不改变当前图像
+            if (!task->previousPath[0]) {
+                length += sprintf(summary + length, "%s没有上一张图像", length ? ", " : "");
+                continue;
+            }
+            WatchImage previous;
+            if (!loadWatchImage(task->previousPath, &previous, arena)) {
+                sprintf(summary + length, "读取上一张图像失败");
+                return FALSE;
+            }
+            if (previous.desc.width != width || previous.desc.height != height ||
+                previous.bitCount != image.bitCount) {
+                sprintf(summary + length, "与上一张图像的尺寸或位深度不一致");
+                return FALSE;
+            }
+            if (previous.desc.topDown != image.desc.topDown) {
+                unsigned char* flipped = (unsigned char*)arenaAlloc(arena, (size_t)previous.rowSize * height);
+                if (!flipped) {
+                    sprintf(summary + length, "内存分配失败");
+                    return FALSE;
+                }
+                copyRowsReversed(previous.pixels, flipped, previous.rowSize, height);
+                previous.pixels = flipped;
+            }
+            METRICS_LAP(timer, STAGE_READ);
+            WatchImage diff = image;
+            diff.bitCount = compareOutputBitCount(previous.pixels, width, height, previous.bitCount, previous.rowSize);
+            diff.rowSize = ((width * diff.bitCount + 31) / 32) * 4;
+            diff.paletteCount = (diff.bitCount <= 8) ? (1 << diff.bitCount) : 0;
+            diff.pixels = (unsigned char*)arenaAlloc(arena, diff.rowSize * height);
+            if (!diff.pixels) {
+                sprintf(summary + length, "内存分配失败");
+                return FALSE;
+            }
+            int diffPixels = compareImageBuffers(previous.pixels, previous.palette, image.pixels, image.palette,
+                                                 width, height, image.bitCount, image.rowSize, diff.pixels,
+                                                 diff.bitCount, diff.rowSize, diff.palette, arena);
+            METRICS_LAP(timer, STAGE_COMPUTE);
+            length += sprintf(summary + length, "%s差异 %.2f%%", length ? ", " : "",
+                                (double)diffPixels / ((double)width * height) * 100.0);
+            if (!makeDirectoryPath(outputPath, options->outputDirectory, task->path, "_diff.bmp")) {
+                sprintf(summary + length, "%s输出路径过长", length ? ", " : "");
+                return FALSE;
+            }
+            if (!writeWatchImage(outputPath, &diff, options->rleOutput)) return FALSE;
+            METRICS_LAP(timer, STAGE_WRITE);
+            continue;
+        }
+        default:
+            return FALSE;
+        }
+
+        if (!makeDirectoryPath(outputPath, options->outputDirectory, task->path, suffix)) {
+            sprintf(summary + length, "%s输出路径过长", length ? ", " : "");
+            return FALSE;
+        }
+        if (!writeWatchImage(outputPath, &image, options->rleOutput)) return FALSE;
+        METRICS_LAP(timer, STAGE_WRITE);
+    }
+    if (!summary[0]) sprintf(summary, "完成");
+    METRICS_COUNT(COUNTER_IMAGES, 1);
+    return TRUE;
+}
+
+// 常驻工作线程：从积压队列取文件处理，内存池在线程存活期间一直保留
+DWORD WINAPI watchWorkerThread(LPVOID parameter) {
+    WatchWorkerArgs* args = (WatchWorkerArgs*)parameter;
+    WatchContext* context = args->context;
+    const WatchOptions* options = context->options;
+    ScratchArena arena;
+    initScratchArena(&arena);
+
+    for (;;) {
+        EnterCriticalSection(&context->lock);
+        while (context->count == 0 && !context->stopping) {
+            SleepConditionVariableCS(&context->notEmpty, &context->lock, INFINITE);
+        }
+        if (context->count == 0) {
+            LeaveCriticalSection(&context->lock);
+            break;
+        }
+        WatchTask task = context->tasks[context->head];
+        context->head = (context->head + 1) % options->backlog;
+        context->count--;
+        LeaveCriticalSection(&context->lock);
+
+        double started = getMonotonicSeconds();
+        double ageMs = millisecondsSince(task.closeTime);
+        if (options->maxAgeMs > 0 && ageMs > options->maxAgeMs) {
+            printf("[跳过] %s: 关闭后已等待 %.0f ms\n", task.path, ageMs);
+            EnterCriticalSection(&context->lock);
+            context->expired++;
+            LeaveCriticalSection(&context->lock);
+            continue;
+        }
+
+        char summary[160];
+        BOOL ok = runWatchChain(options, &task, &arena, summary);
+        resetScratchArena(&arena);
+        double finished = getMonotonicSeconds();
+        double latencyMs = millisecondsSince(task.closeTime);
+        printf("%s %s: %s, 延迟 %.1f ms（排队 %.1f ms, 处理 %.1f ms）\n", ok ? "[完成]" : "[失败]", task.path,
+               summary, latencyMs, (started - task.queuedAt) * 1000.0, (finished - started) * 1000.0);
+
+        EnterCriticalSection(&context->lock);
+        if (ok) {
+            context->processed++;
+            context->latencies[context->latencyCount % WATCH_LATENCY_SAMPLES] = latencyMs;
+            context->latencyCount++;
+            context->latencySum += latencyMs;
+            if (latencyMs > context->latencyMax) context->latencyMax = latencyMs;
+        } else {
+            context->failed++;
+        }
+        LeaveCriticalSection(&context->lock);
+    }
+
+    freeScratchArena(&arena);
+    MetricsSnapshot(&context->metrics[args->worker]);
+    return 0;
+}
+
+// 把关闭的文件放入积压队列，队列满时按策略丢弃
+void enqueueWatchTask(WatchContext* context, const char* path, const char* previousPath, ULONGLONG closeTime) {
+    const WatchOptions* options = context->options;
+    WatchTask task;
+    strncpy(task.path, path, sizeof(task.path) - 1);
+    task.path[sizeof(task.path) - 1] = '\0';
+    strncpy(task.previousPath, previousPath, sizeof(task.previousPath) - 1);
+    task.previousPath[sizeof(task.previousPath) - 1] = '\0';
+    task.closeTime = closeTime;
+    task.queuedAt = getMonotonicSeconds();
+
+    const char* droppedPath = NULL;
+    char evicted[260];
+    EnterCriticalSection(&context->lock);
+    context->arrived++;
+    if (context->count == options->backlog) {
+        context->dropped++;
+        if (options->overload == WATCH_DROP_NEWEST) {
+            droppedPath = path;
+        } else {
+            strcpy(evicted, context->tasks[context->head].path);
+            droppedPath = evicted;
+            context->head = (context->head + 1) % options->backlog;
+            context->count--;
+        }
+    }
+    if (context->count < options->backlog) {
+        context->tasks[(context->head + context->count) % options->backlog] = task;
+        context->count++;
+        if (context->count > context->maxCount) context->maxCount = context->count;
+        WakeConditionVariable(&context->notEmpty);
+    }
+    LeaveCriticalSection(&context->lock);
+    if (droppedPath) printf("[丢弃] %s: 积压队列已满（%d）\n", droppedPath, options->backlog);
+}
+
+// 监视目录直到Ctrl+C或到达options->limit个文件，返回处理失败的文件数
+int RunWatch(const WatchOptions* options) {
+    if (!CreateDirectoryA(options->outputDirectory, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        printf("无法创建输出目录: %s\n", options->outputDirectory);
+        return 1;
+    }
+    HANDLE directory = CreateFileA(options->directory, FILE_LIST_DIRECTORY,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                                   FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (directory == INVALID_HANDLE_VALUE) {
+        printf("无法监视目录: %s\n", options->directory);
+        return 1;
+    }
+
+    WatchContext* context = (WatchContext*)calloc(1, sizeof(WatchContext));
+    WatchWorkerArgs* args = (WatchWorkerArgs*)calloc(options->workers, sizeof(WatchWorkerArgs));
+    HANDLE* workers = (HANDLE*)calloc(options->workers, sizeof(HANDLE));
+    DWORD* notifyBuffer = (DWORD*)malloc(64 * 1024);          // 通知记录要求DWORD对齐
+    char (*pending)[260] = (char (*)[260])malloc(WATCH_PENDING_CAPACITY * 260);
+    HANDLE event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (context) {
+        context->tasks = (WatchTask*)malloc(options->backlog * sizeof(WatchTask));
+        context->metrics = (MetricsBlock*)calloc(options->workers, sizeof(MetricsBlock));
+    }
+    if (!context || !context->tasks || !context->metrics || !args || !workers || !notifyBuffer || !pending || !event) {
+        if (context) {
+            if (context->tasks) free(context->tasks);
+            if (context->metrics) free(context->metrics);
+            free(context);
+        }
+        if (args) free(args);
+        if (workers) free(workers);
+        if (notifyBuffer) free(notifyBuffer);
+        if (pending) free(pending);
+        if (event) CloseHandle(event);
+        CloseHandle(directory);
+        printf("内存分配失败！\n");
+        return 1;
+    }
+    context->options = options;
+    InitializeCriticalSection(&context->lock);
+    InitializeConditionVariable(&context->notEmpty);
+
+    int started = 0;
+    for (int w = 0; w < options->workers; w++) {
+        args[w].context = context;
+        args[w].worker = w;
+        workers[w] = CreateThread(NULL, 0, watchWorkerThread, &args[w], 0, NULL);
+        if (!workers[w]) break;
+        started++;
+    }
+
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = event;
+    DWORD notifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE;
+    BOOL watching = started > 0 &&
+        ReadDirectoryChangesW(directory, notifyBuffer, 64 * 1024, FALSE, notifyFilter, NULL, &overlapped, NULL);
+    if (!watching) {
+        printf("无法监视目录: %s\n", options->directory);
+    } else {
+        SetConsoleCtrlHandler(watchCtrlHandler, TRUE);
+        printf("开始监视 %s，输出到 %s，%d 个工作线程，积压队列 %d，按Ctrl+C结束\n",
+               options->directory, options->outputDirectory, started, options->backlog);
+    }
+
+    int pendingCount = 0;
+    struct {
+        char path[260];
+        ULONGLONG closeTime;
+    } recent[WATCH_RECENT_CAPACITY];
+    int recentCount = 0;
+    char previousPath[260] = "";       // 最近到达的文件和它之前到达的另一个文件，compare用
+    char earlierPath[260] = "";
+    long long arrivals = 0;
+    long long jpegSkipped = 0;
+    long long overflows = 0;
+    long long tooLong = 0;              // 文件名或拼接后的路径超过260字节
+    long long pendingDropped = 0;       // 等待关闭的文件已满时丢弃的新通知
+
+    while (watching && !watchStopRequested && (options->limit == 0 || arrivals < options->limit)) {
+        DWORD wait = WaitForSingleObject(event, pendingCount > 0 ? WATCH_POLL_MS : WATCH_IDLE_MS);
+        if (wait == WAIT_OBJECT_0) {
+            DWORD bytes = 0;
+            if (!GetOverlappedResult(directory, &overlapped, &bytes, FALSE)) {
+                printf("读取目录通知失败\n");
+                break;
+            }
+            if (bytes == 0) {
+                // 缓冲区溢出时系统丢弃了这一批通知
+                overflows++;
+                printf("目录通知缓冲区溢出，部分文件可能未被发现\n");
+            }
+            const BYTE* record = (const BYTE*)notifyBuffer;
+            while (bytes > 0) {
+                const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)record;
+                char name[260];
+                int nameLength = WideCharToMultiByte(CP_ACP, 0, info->FileName, info->FileNameLength / sizeof(WCHAR),
+                                                     name, sizeof(name) - 1, NULL, NULL);
+                name[nameLength] = '\0';
+                BOOL arrival = (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_MODIFIED ||
+                                info->Action == FILE_ACTION_RENAMED_NEW_NAME);
+                // 路径过长的文件只在新建或改名时报告一次，之后的修改通知直接忽略
+                BOOL created = (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME);
+                char path[260];
+                if (arrival && nameLength == 0 && info->FileNameLength > 0) {
+                    if (created) {
+                        tooLong++;
+                        printf("[跳过] 文件名过长\n");
+                    }
+                } else if (arrival && hasExtension(name, ".bmp")) {
+                    if (!makeDirectoryPath(path, options->directory, name, "")) {
+                        if (created) {
+                            tooLong++;
+                            printf("[跳过] %s: 路径过长\n", name);
+                        }
+                    } else {
+                        BOOL known = FALSE;
+                        for (int i = 0; i < pendingCount && !known; i++) known = (strcmp(pending[i], path) == 0);
+                        if (!known && pendingCount == WATCH_PENDING_CAPACITY) {
+                            pendingDropped++;
+                            printf("[丢弃] %s: 等待关闭的文件已达 %d 个\n", name, WATCH_PENDING_CAPACITY);
+                        } else if (!known) {
+                            strcpy(pending[pendingCount++], path);
+                        }
+                    }
+                } else if (info->Action == FILE_ACTION_ADDED &&
+                           (hasExtension(name, ".jpg") || hasExtension(name, ".jpeg"))) {
+                    // JPEG需要先转换为BMP（交互菜单中的转换依赖画图程序），监视模式不处理
+                    jpegSkipped++;
+                    printf("[跳过] %s: 监视模式只处理BMP\n", name);
+                }
+                if (info->NextEntryOffset == 0) break;
+                record += info->NextEntryOffset;
+            }
+            ResetEvent(event);
+            if (!ReadDirectoryChangesW(directory, notifyBuffer, 64 * 1024, FALSE, notifyFilter, NULL,
+                                       &overlapped, NULL)) {
+                printf("读取目录通知失败\n");
+                break;
+            }
+        }
+
+        // 按到达顺序检查等待关闭的文件，关闭的放入积压队列
+        for (int i = 0; i < pendingCount;) {
+            ULONGLONG closeTime;
+            BOOL missing;
+            if (!tryOpenClosedFile(pending[i], &closeTime, &missing) && !missing) {
+                i++;
+                continue;
+            }
+            if (!missing) {
+                // 同一次写入可能产生多条通知，最后写入时间相同的只处理一次
+                BOOL duplicate = FALSE;
+                for (int r = 0; r < min(recentCount, WATCH_RECENT_CAPACITY) && !duplicate; r++) {
+                    duplicate = (recent[r].closeTime == closeTime && strcmp(recent[r].path, pending[i]) == 0);
+                }
+                if (!duplicate) {
+                    int slot = recentCount++ % WATCH_RECENT_CAPACITY;
+                    strcpy(recent[slot].path, pending[i]);
+                    recent[slot].closeTime = closeTime;
+                    // 同名文件被重新写入时与之前的另一个文件比较，而不是与自己比较
+                    if (strcmp(previousPath, pending[i]) != 0) {
+                        strcpy(earlierPath, previousPath);
+                        strcpy(previousPath, pending[i]);
+                    }
+                    enqueueWatchTask(context, pending[i], earlierPath, closeTime);
+                    arrivals++;
+                }
+            }
+            memmove(pending[i], pending[i + 1], (size_t)(pendingCount - i - 1) * 260);
+            pendingCount--;
+        }
+    }
+
+    // 停止监视，等工作线程处理完已排队的文件
+    if (watching) CancelIo(directory);
+    EnterCriticalSection(&context->lock);
+    context->stopping = TRUE;
+    WakeAllConditionVariable(&context->notEmpty);
+    LeaveCriticalSection(&context->lock);
+    for (int w = 0; w < started; w++) {
+        WaitForSingleObject(workers[w], INFINITE);
+        CloseHandle(workers[w]);
+    }
+
+    int sampleCount = (int)min(context->latencyCount, (long long)WATCH_LATENCY_SAMPLES);
+    qsort(context->latencies, sampleCount, sizeof(double), compareDoubles);
+    printf("监视结束: 到达 %lld 个, 处理 %lld 个, 失败 %lld 个, 积压满丢弃 %lld 个, 等待关闭已满丢弃 %lld 个, "
+           "超时跳过 %lld 个, 路径过长跳过 %lld 个, 跳过JPEG %lld 个, 通知溢出 %lld 次, 积压最多 %d 个\n",
+           context->arrived, context->processed, context->failed, context->dropped, pendingDropped, context->expired,
+           tooLong, jpegSkipped, overflows, context->maxCount);
+    if (sampleCount > 0) {
+        printf("端到端延迟（文件关闭到结果输出）: 平均 %.1f ms, p50 %.1f ms, p99 %.1f ms, 最大 %.1f ms\n",
+               context->latencySum / context->latencyCount, percentileOfSorted(context->latencies, sampleCount, 50.0),
+               percentileOfSorted(context->latencies, sampleCount, 99.0), context->latencyMax);
+    }
+    if (options->metricsFormat) {
+        MetricsBlock metrics;
+        MetricsSnapshot(&metrics);
+        for (int w = 0; w < started; w++) {
+            MetricsMerge(&metrics, &context->metrics[w]);
+        }
+        writeBatchMetrics(options->metricsFormat, &metrics);
+    }
+
+    int failures = (int)context->failed + (watching ? 0 : 1);
+    DeleteCriticalSection(&context->lock);
+    CloseHandle(event);
+    CloseHandle(directory);
+    free(context->tasks);
+    free(context->metrics);
+    free(context);
+    free(args);
+    free(workers);
+    free(notifyBuffer);
+    free(pending);
+    return failures;
+}
+
+// 解析watch子命令参数，成功时返回TRUE
+BOOL parseWatchOptions(int argc, char* argv[], WatchOptions* options) {
+    if (argc < 1) return FALSE;
+    memset(options, 0, sizeof(WatchOptions));
+    options->directory = argv[0];
+    sprintf(options->outputDirectory, "%.200s/out", argv[0]);
+    options->chain[0] = BATCH_GRAY;
+    options->chain[1] = BATCH_BINARY;
+    options->chain[2] = BATCH_MARK;
+    options->chainLength = 3;
+    options->workers = 1;
+    options->backlog = 16;
+    options->overload = WATCH_DROP_OLDEST;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--rle") == 0) {
+            options->rleOutput = TRUE;
+            continue;
+        }
+        if (!value) return FALSE;
+        if (strcmp(argv[i], "--chain") == 0) {
+            // 逗号分隔的操作，compare只能单独使用
+            char list[128];
+            strncpy(list, value, sizeof(list) - 1);
+            list[sizeof(list) - 1] = '\0';
+            options->chainLength = 0;
+            for (char* token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+                BatchOperation operation = parseBatchOperation(token);
+                if (operation == BATCH_INVALID || options->chainLength == WATCH_MAX_CHAIN) return FALSE;
+                options->chain[options->chainLength++] = operation;
+            }
+            for (int s = 0; s < options->chainLength; s++) {
+                if (options->chain[s] == BATCH_COMPARE && options->chainLength > 1) return FALSE;
+            }
+            if (options->chainLength == 0) return FALSE;
+        } else if (strcmp(argv[i], "--out") == 0) {
+            sprintf(options->outputDirectory, "%.200s", value);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            options->workers = atoi(value);
+            if (options->workers < 1 || options->workers > WATCH_MAX_WORKERS) return FALSE;
+        } else if (strcmp(argv[i], "--backlog") == 0) {
+            options->backlog = atoi(value);
+            if (options->backlog < 1) return FALSE;
+        } else if (strcmp(argv[i], "--overload") == 0) {
+            if (strcmp(value, "drop-newest") == 0) {
+                options->overload = WATCH_DROP_NEWEST;
+            } else if (strcmp(value, "drop-oldest") == 0) {
+                options->overload = WATCH_DROP_OLDEST;
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--max-age") == 0) {
+            options->maxAgeMs = max(0, atoi(value));
+        } else if (strcmp(argv[i], "--limit") == 0) {
+            options->limit = max(0, atoi(value));
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (strcmp(value, "prom") != 0 && strcmp(value, "json") != 0) return FALSE;
+            options->metricsFormat = value;
+        } else {
+            return FALSE;
+        }
+        i++;
+    }
+    return TRUE;
+}
+
+// ---- 多帧时间差分 ----
+// 命令行: bmp2gray temporal [--lag K] [--threshold T] [--event 百分比] [--min-region N]
+//                          [--diff-out 目录] [--metrics prom|json] <帧1> <帧2> ...
+// 按顺序一次读入各帧，每帧按灰度阈值打包为1位亮度掩码（亮为1，统一为自下而上的行顺序）存入环形缓冲区，
+// 与上一帧和前第K帧逐字节异或比较：输出变化像素比例、由暗变亮/由亮变暗的像素数以及变化区域的边界框。
+// 与上一帧的变化超过事件阈值时报告亮起或熄灭事件。环形缓冲区只保存K+1帧的打包掩码，
+// 只有指定--diff-out时才把差异掩码写为1位BMP（变化像素为黑色）。
+
+#define TEMPORAL_MAX_LAG 64
+#define TEMPORAL_MAX_REGIONS 16         // 每次比较最多输出的变化区域数
+
+typedef struct {
+    int lag;                            // 除上一帧外再与前第lag帧比较，1表示只与上一帧比较
+    int threshold;                      // 灰度不小于threshold的像素为亮
+    double eventPercent;                // 与上一帧的变化比例超过它时报告事件
+    int minRegion;                      // 变化区域的最小像素数
+    const char* diffDirectory;          // 差异掩码的输出目录，NULL表示不输出
+    const char* metricsFormat;
+} TemporalOptions;
+
+// 把一帧按灰度阈值打包为1位亮度掩码：brightTable为索引图像各索引是否为亮，24/32位按加权灰度与threshold比较
+// flip为TRUE时（自上而下的图像）行顺序颠倒，使掩码始终自下而上
+BMP_FORCEINLINE void packFrameRowsGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                          const unsigned char* brightTable, int threshold, BOOL flip,
+                                          unsigned char* packed, int packedRowSize, int bits) {
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        unsigned char* out = packed + (flip ? height - 1 - y : y) * packedRowSize;
+        memset(out, 0, packedRowSize);
+        for (int x = 0; x < width; x++) {
+            int bright;
+            if (bits == 24 || bits == 32) {
+                const unsigned char* pixel = row + x * (bits / 8);
+                bright = rgbToGray(pixel[2], pixel[1], pixel[0]) >= threshold;
+            } else if (bits == 8) {
+                bright = brightTable[row[x]];
+            } else if (bits == 4) {
+                bright = brightTable[(x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4)];
+            } else {
+                bright = brightTable[(row[x >> 3] >> (7 - (x & 7))) & 1];
+            }
+            if (bright) out[x >> 3] |= (unsigned char)(0x80 >> (x & 7));
+        }
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(packFrameRows,
+                              (const unsigned char* buffer, int width, int height, int rowSize,
+                               const unsigned char* brightTable, int threshold, BOOL flip,
+                               unsigned char* packed, int packedRowSize),
+                              buffer, width, height, rowSize, brightTable, threshold, flip, packed, packedRowSize)
+
+// 比较两帧的亮度掩码，changed写入取反的异或掩码（变化像素为0，可直接作为1位二值图查找变化区域）
+// 返回变化像素数，*turnedOn/*turnedOff为由暗变亮和由亮变暗的像素数
+int diffPackedFrames(const unsigned char* current, const unsigned char* previous, unsigned char* changed,
+                     int width, int height, int packedRowSize, int* turnedOn, int* turnedOff) {
+    int bytesPerRow = (width + 7) / 8;
+    unsigned char validMask = lastByteValidMask(width, 1);
+    int on = 0;
+    int off = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* rowCurrent = current + y * packedRowSize;
+        const unsigned char* rowPrevious = previous + y * packedRowSize;
+        unsigned char* out = changed + y * packedRowSize;
+        for (int i = 0; i < bytesPerRow; i++) {
+            unsigned char valid = (i == bytesPerRow - 1) ? validMask : 0xFF;
+            unsigned char becameBright = (unsigned char)(rowCurrent[i] & ~rowPrevious[i] & valid);
+            unsigned char becameDark = (unsigned char)(rowPrevious[i] & ~rowCurrent[i] & valid);
+            on += popCountTable[becameBright];
+            off += popCountTable[becameDark];
+            out[i] = (unsigned char)~(becameBright | becameDark);
+        }
+        memset(out + bytesPerRow, 0xFF, packedRowSize - bytesPerRow);
+    }
+    *turnedOn = on;
+    *turnedOff = off;
+    return on + off;
+}
+
+// 读入一帧并打包为亮度掩码；*buffer为可重复使用的像素缓冲区（容量*capacity，按需扩大）
+BOOL loadTemporalFrame(const char* path, const TemporalOptions* options, unsigned char** buffer, size_t* capacity,
+                       BmpDescriptor* desc, unsigned char* packed, int expectedWidth, int expectedHeight) {
+    METRICS_TIMER_START(timer);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("无法打开输入文件: %s\n", path);
+        return FALSE;
+    }
+    RGBQUAD palette[256];
+    if (!readBmpHeader(file, desc, palette)) {
+        fclose(file);
+        return FALSE;
+    }
+    if (expectedWidth > 0 && (desc->width != expectedWidth || desc->height != expectedHeight)) {
+        fclose(file);
+        printf("帧尺寸不一致: %s 为 %dx%d，第一帧为 %dx%d\n", path, desc->width, desc->height,
+               expectedWidth, expectedHeight);
+        return FALSE;
+    }
+    METRICS_LAP(timer, STAGE_HEADER);
+
+    if (*capacity < (size_t)desc->imageSize) {
+        free(*buffer);
+        *buffer = (unsigned char*)malloc(desc->imageSize);
+        *capacity = *buffer ? desc->imageSize : 0;
+    }
+    if (!*buffer) {
+        fclose(file);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    if (!readBmpPixelData(file, desc, *buffer)) {
+        fclose(file);
+        printf("读取图像数据失败！\n");
+        return FALSE;
+    }
+    fclose(file);
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)desc->dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+
+    // 索引图像按调色板灰度生成亮度查表
+    unsigned char brightTable[256];
+    int paletteCount = (desc->bitCount <= 8) ? (1 << desc->bitCount) : 0;
+    for (int i = 0; i < paletteCount; i++) {
+        brightTable[i] = paletteEntryGray(&palette[i]) >= options->threshold;
+    }
+    int packedRowSize = ((desc->width + 31) / 32) * 4;
+    SELECT_PIXEL_KERNEL(packFrameRows, desc->bitCount)(*buffer, desc->width, desc->height, desc->rowSize,
+                                                        brightTable, options->threshold, desc->topDown,
+                                                        packed, packedRowSize);
+    METRICS_LAP(timer, STAGE_COMPUTE);
+    return TRUE;
+}
+
+// 比较当前帧与一个较早的帧，打印一行结果和变化区域；返回变化比例（百分比），内存不足返回-1
+// *turnedOn/*turnedOff与diffPackedFrames相同
+double reportTemporalDiff(const TemporalOptions* options, const char* path, const char* label, const char* suffix,
+                          const unsigned char* current, const unsigned char* previous, unsigned char* changed,
+                          int width, int height, const BITMAPINFOHEADER* templateHeader, ScratchArena* arena,
+                          int* turnedOn, int* turnedOff) {
+    METRICS_TIMER_START(timer);
+    int packedRowSize = ((width + 31) / 32) * 4;
+    int changedPixels = diffPackedFrames(current, previous, changed, width, height, packedRowSize,
+                                         turnedOn, turnedOff);
+    double percent = (double)changedPixels / ((double)width * height) * 100.0;
+    METRICS_LAP(timer, STAGE_COMPUTE);
+
+    ObjectInfo regions[TEMPORAL_MAX_REGIONS];
+    int regionCount = 0;
+    int found = 0;
+    if (changedPixels > 0) {
+        DetectOptions detectOptions;
+        initDetectOptions(&detectOptions);
+        detectOptions.minObjectSize = options->minRegion;
+        detectOptions.maxObjects = TEMPORAL_MAX_REGIONS;
+        found = detectObjectsWithOptions(changed, width, height, 1, packedRowSize, &detectOptions, NULL,
+                                         regions, TEMPORAL_MAX_REGIONS, &regionCount, arena);
+        if (found < 0) return -1.0;
+        METRICS_LAP(timer, STAGE_LABEL);
+    }
+
+    printf("    %s: 变化 %.2f%%（变亮 %d, 变暗 %d）, 区域 %d 个\n", label, percent, *turnedOn, *turnedOff, found);
+    for (int i = 0; i < regionCount; i++) {
+        const BoundingBox* box = &regions[i].bbox;
+        printf("        区域 %d: (%d, %d) - (%d, %d), %d 像素\n", i + 1, box->minX, box->minY, box->maxX, box->maxY,
+               regions[i].pixelCount);
+    }
+
+    if (options->diffDirectory) {
+        // 变化像素为黑色的1位二值图
+        char outputPath[260];
+        if (!makeDirectoryPath(outputPath, options->diffDirectory, path, suffix)) {
+            printf("输出路径过长: %s\n", path);
+            return percent;
+        }
+        FILE* file = fopen(outputPath, "wb");
+        if (!file) {
+            printf("无法创建输出文件: %s\n", outputPath);
+        } else {
+            RGBQUAD binaryPalette[2] = { {0, 0, 0, 0}, {255, 255, 255, 0} };
+            writeBmpHeaders(file, templateHeader, 1, binaryPalette, 2, packedRowSize, height);
+            fwrite(changed, 1, packedRowSize * height, file);
+            fclose(file);
+            METRICS_COUNT(COUNTER_BYTES_WRITTEN, (long long)packedRowSize * height);
+            METRICS_LAP(timer, STAGE_WRITE);
+        }
+    }
+    return percent;
+}
+
+// 按顺序处理各帧，返回处理失败的帧数
+int RunTemporal(const TemporalOptions* options, char** paths, int count) {
+    double started = getMonotonicSeconds();
+    BmpDescriptor desc;
+    unsigned char* buffer = NULL;
+    size_t capacity = 0;
+    unsigned char* ring = NULL;         // lag+1帧的亮度掩码
+    unsigned char* changed = NULL;
+    int ringSize = options->lag + 1;
+    int width = 0;
+    int height = 0;
+    size_t frameSize = 0;
+    BITMAPINFOHEADER templateHeader;
+    ScratchArena arena;
+    initScratchArena(&arena);
+
+    int processed = 0;
+    int failed = 0;
+    int events = 0;
+    int previousFrame = -1;             // 环形缓冲区中最近一帧的序号，-1表示还没有
+    for (int i = 0; i < count; i++) {
+        if (!ring) {
+            // 由第一帧的尺寸分配环形缓冲区
+            FILE* file = fopen(paths[i], "rb");
+            RGBQUAD palette[256];
+            BOOL ok = file && readBmpHeader(file, &desc, palette);
+            if (file) fclose(file);
+            if (!ok) {
+                printf("[失败] %s: 无法读取文件头\n", paths[i]);
+                failed++;
+                continue;
+            }
+            width = desc.width;
+            height = desc.height;
+            frameSize = (size_t)((width + 31) / 32) * 4 * height;
+            ring = (unsigned char*)malloc(frameSize * ringSize);
+            changed = (unsigned char*)malloc(frameSize);
+            if (!ring || !changed) {
+                printf("内存分配失败！\n");
+                failed += count - i;
+                break;
+            }
+            templateHeader = desc.infoHeader;
+            templateHeader.biHeight = height;           // 掩码统一为自下而上
+        }
+
+        int frame = processed;
+        unsigned char* current = ring + (size_t)(frame % ringSize) * frameSize;
+        if (!loadTemporalFrame(paths[i], options, &buffer, &capacity, &desc, current, width, height)) {
+            printf("[失败] %s\n", paths[i]);
+            failed++;
+            continue;
+        }
+
+        printf("帧 %d %s\n", frame + 1, paths[i]);
+        int turnedOn, turnedOff;
+        if (previousFrame >= 0) {
+            const unsigned char* previous = ring + (size_t)(previousFrame % ringSize) * frameSize;
+            double percent = reportTemporalDiff(options, paths[i], "与上一帧", "_tdiff1.bmp", current, previous,
+                                                changed, width, height, &templateHeader, &arena,
+                                                &turnedOn, &turnedOff);
+            resetScratchArena(&arena);
+            if (percent < 0) {
+                printf("内存分配失败！\n");
+                failed += count - i;
+                break;
+            }
+            if (percent > options->eventPercent) {
+                // 由暗变亮的像素多于由亮变暗的像素为亮起
+                printf("    事件: %s（变化 %.2f%% 超过阈值 %.2f%%）\n", turnedOn >= turnedOff ? "亮起" : "熄灭",
+                       percent, options->eventPercent);
+                events++;
+            }
+        }
+        if (options->lag > 1 && frame >= options->lag) {
+            char label[32];
+            char suffix[32];
+            sprintf(label, "与前第%d帧", options->lag);
+            sprintf(suffix, "_tdiff%d.bmp", options->lag);
+            const unsigned char* earlier = ring + (size_t)((frame - options->lag) % ringSize) * frameSize;
+            if (reportTemporalDiff(options, paths[i], label, suffix, current, earlier, changed, width, height,
+                                   &templateHeader, &arena, &turnedOn, &turnedOff) < 0) {
+                printf("内存分配失败！\n");
+                failed += count - i;
+                break;
+            }
+            resetScratchArena(&arena);
+        }
+        previousFrame = frame;
+        processed++;
+        METRICS_COUNT(COUNTER_IMAGES, 1);
+    }
+
+    double seconds = getMonotonicSeconds() - started;
+    printf("时间差分完成: %d 帧, 失败 %d 帧, 事件 %d 个, 用时 %.3f 秒（%.1f 帧/秒）\n", processed, failed, events,
+           seconds, seconds > 0 ? processed / seconds : 0.0);
+    if (options->metricsFormat) {
+        MetricsBlock metrics;
+        MetricsSnapshot(&metrics);
+        writeBatchMetrics(options->metricsFormat, &metrics);
+    }
+
+    freeScratchArena(&arena);
+    if (buffer) free(buffer);
+    if (ring) free(ring);
+    if (changed) free(changed);
+    return failed;
+}
+
+// 解析temporal子命令的选项，*first返回第一个帧文件的下标
+BOOL parseTemporalOptions(int argc, char* argv[], TemporalOptions* options, int* first) {
+    options->lag = 1;
+    options->threshold = 128;
+    options->eventPercent = BATCH_COMPARE_THRESHOLD;
+    options->minRegion = 10;
+    options->diffDirectory = NULL;
+    options->metricsFormat = NULL;
+    int i = 0;
+    while (i + 1 < argc && strncmp(argv[i], "--", 2) == 0) {
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--lag") == 0) {
+            options->lag = atoi(value);
+            if (options->lag < 1 || options->lag > TEMPORAL_MAX_LAG) return FALSE;
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            options->threshold = atoi(value);
+            if (options->threshold < 1 || options->threshold > 255) return FALSE;
+        } else if (strcmp(argv[i], "--event") == 0) {
+            options->eventPercent = atof(value);
+        } else if (strcmp(argv[i], "--min-region") == 0) {
+            options->minRegion = max(1, atoi(value));
+        } else if (strcmp(argv[i], "--diff-out") == 0) {
+            options->diffDirectory = value;
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (strcmp(value, "prom") != 0 && strcmp(value, "json") != 0) return FALSE;
+            options->metricsFormat = value;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 2;
+}
+
+// ---- 增量标记 ----
+// 命令行: bmp2gray relabel [--min-size N] [--check] [--metrics prom|json] <帧1> <帧2> ...
+// 连续帧只有一小块区域变化时不必整帧重新标记：保存上一帧的游程、每个游程的区域槽位和区域表，
+// 新帧先逐行比较规范化的像素字节，相邻的脏行合并为脏矩形；只重新阈值化脏行，
+// 只对与脏矩形（外扩1像素）相接的区域重新做并查集标记，其余区域的游程和统计原样保留。
+// 与外扩后的脏矩形不相交的游程在两帧中完全相同，且不会与被重新标记的游程相邻，所以结果与整帧标记一致；
+// 阈值化和并查集的开销与变化面积（加上受影响区域的游程数）成正比，其余行只按游程复制。
+#define RELABEL_FULL_FRACTION 2             // 脏行超过总行数的1/RELABEL_FULL_FRACTION时整帧重新标记
+
+// 区域表中的一项，pixelCount为0表示槽位空闲
+typedef struct {
+    BoundingBox bbox;
+    int pixelCount;
+    int firstX;                             // 第一个像素（行优先），决定物体的输出顺序
+    int firstY;
+} LabelComponent;
+
+// 上一帧的标记结果，跨帧保存（从系统分配，不放在每帧重置的内存池中）
+typedef struct {
+    int width;
+    int height;
+    int bitCount;
+    int rowSize;
+    unsigned char* pixels;                  // 上一帧的规范化像素数据，用于求脏行
+    int* rowStart;                          // 上一帧的游程，格式与RunImage相同
+    PixelRun* runs;
+    int* runLabel;                          // 每个游程所属区域的槽位
+    int runCount;
+    int runCapacity;
+    LabelComponent* components;
+    int* freeSlots;
+    int componentCount;                     // 已使用的槽位数（含空闲槽位）
+    int componentCapacity;
+    int freeCount;
+} LabelState;
+
+typedef struct {
+    BOOL full;                              // 整帧重新标记（第一帧、尺寸变化或变化过多）
+    int dirtyRects;
+    int dirtyRows;
+    int relabeledRuns;
+    int totalRuns;
+    int affectedComponents;                 // 被拆除后重新标记的旧区域数
+} RelabelStats;
+
+// updateLabelState的临时数组
+typedef struct {
+    int* dirtyMin;                          // 外扩后的脏矩形在每行覆盖的列范围，-1表示该行不相交
+    int* dirtyMax;
+    BoundingBox* rects;
+    unsigned char* dirtyRow;                // 该行字节有变化，需要重新阈值化
+    unsigned char* affected;                // 旧区域是否被拆除
+    int* rowStart;                          // 新一帧的游程
+    PixelRun* runs;
+    int* runLabel;
+    int* parent;
+    unsigned char* rowActive;               // 该行有需要重新标记的游程
+} RelabelScratch;
+
+void releaseRelabelScratch(RelabelScratch* scratch, ScratchArena* arena) {
+    if (scratch->rowActive) arenaRelease(arena, scratch->rowActive);
+    if (scratch->parent) arenaRelease(arena, scratch->parent);
+    if (scratch->runLabel) arenaRelease(arena, scratch->runLabel);
+    if (scratch->runs) arenaRelease(arena, scratch->runs);
+    if (scratch->rowStart) arenaRelease(arena, scratch->rowStart);
+    if (scratch->affected) arenaRelease(arena, scratch->affected);
+    if (scratch->dirtyRow) arenaRelease(arena, scratch->dirtyRow);
+    if (scratch->rects) arenaRelease(arena, scratch->rects);
+    if (scratch->dirtyMax) arenaRelease(arena, scratch->dirtyMax);
+    if (scratch->dirtyMin) arenaRelease(arena, scratch->dirtyMin);
+}
+
+void initLabelState(LabelState* state) {
+    memset(state, 0, sizeof(LabelState));
+}
+
+void freeLabelState(LabelState* state) {
+    free(state->pixels);
+    free(state->rowStart);
+    free(state->runs);
+    free(state->runLabel);
+    free(state->components);
+    free(state->freeSlots);
+    initLabelState(state);
+}
+
+// 分配一个区域槽位，优先复用空闲槽位；内存不足返回-1
+int allocComponentSlot(LabelState* state) {
+    if (state->freeCount > 0) return state->freeSlots[--state->freeCount];
+    if (state->componentCount == state->componentCapacity) {
+        int capacity = state->componentCapacity ? state->componentCapacity * 2 : 256;
+        LabelComponent* components = (LabelComponent*)realloc(state->components, capacity * sizeof(LabelComponent));
+        if (!components) return -1;
+        state->components = components;
+        int* freeSlots = (int*)realloc(state->freeSlots, capacity * sizeof(int));
+        if (!freeSlots) return -1;
+        state->freeSlots = freeSlots;
+        state->componentCapacity = capacity;
+    }
+    return state->componentCount++;
+}
+
+void releaseComponentSlot(LabelState* state, int slot) {
+    state->components[slot].pixelCount = 0;
+    state->freeSlots[state->freeCount++] = slot;
+}
+
+// 把一行中字节范围[first, last]换算为像素范围
+void byteSpanToPixels(int first, int last, int width, int bitCount, int* minX, int* maxX) {
+    if (bitCount < 8) {
+        int perByte = 8 / bitCount;
+        *minX = first * perByte;
+        *maxX = min(width - 1, (last + 1) * perByte - 1);
+    } else {
+        *minX = first / (bitCount / 8);
+        *maxX = last / (bitCount / 8);
+    }
+}
+
+// 增量标记一帧，临时数组记入scratch由调用者释放
+BOOL relabelFrame(LabelState* state, const unsigned char* buffer, int width, int height, int bitCount,
+                  int rowSize, RelabelStats* stats, RelabelScratch* scratch, ScratchArena* arena) {
+    if (width <= 0 || height <= 0) return FALSE;
+    int usedBytes = (width * bitCount + 7) / 8;
+    int* dirtyMin = scratch->dirtyMin = (int*)arenaAlloc(arena, (size_t)height * sizeof(int));
+    int* dirtyMax = scratch->dirtyMax = (int*)arenaAlloc(arena, (size_t)height * sizeof(int));
+    BoundingBox* rects = scratch->rects =
+        (BoundingBox*)arenaAlloc(arena, (size_t)((height + 1) / 2) * sizeof(BoundingBox));
+    unsigned char* dirtyRow = scratch->dirtyRow = (unsigned char*)arenaAlloc(arena, (size_t)height);
+    if (!dirtyMin || !dirtyMax || !rects || !dirtyRow) return FALSE;
+
+    // 1. 逐行比较字节，相邻的脏行合并为一个脏矩形（列范围取各行的并集）
+    BOOL full = !state->pixels || state->width != width || state->height != height ||
+                state->bitCount != bitCount || state->rowSize != rowSize;
+    int rectCount = 0;
+    if (!full) {
+        for (int y = 0; y < height; y++) {
+            const unsigned char* row = buffer + y * rowSize;
+            const unsigned char* previous = state->pixels + y * rowSize;
+            dirtyRow[y] = memcmp(row, previous, usedBytes) != 0;
+            if (!dirtyRow[y]) continue;
+            int first = 0;
+            int last = usedBytes - 1;
+            while (row[first] == previous[first]) first++;
+            while (row[last] == previous[last]) last--;
+            int minX, maxX;
+            byteSpanToPixels(first, last, width, bitCount, &minX, &maxX);
+            if (y > 0 && dirtyRow[y - 1]) {
+                BoundingBox* rect = &rects[rectCount - 1];
+                rect->minX = min(rect->minX, minX);
+                rect->maxX = max(rect->maxX, maxX);
+                rect->maxY = y;
+            } else {
+                BoundingBox* rect = &rects[rectCount++];
+                rect->minX = minX;
+                rect->maxX = maxX;
+                rect->minY = y;
+                rect->maxY = y;
+            }
+            stats->dirtyRows++;
+        }
+        full = stats->dirtyRows * RELABEL_FULL_FRACTION > height;
+    }
+    if (full) {
+        memset(dirtyRow, 1, (size_t)height);
+        rects[0].minX = 0;
+        rects[0].maxX = width - 1;
+        rects[0].minY = 0;
+        rects[0].maxY = height - 1;
+        rectCount = 1;
+        stats->dirtyRows = height;
+        state->componentCount = 0;
+        state->freeCount = 0;
+        state->runCount = 0;
+    }
+    stats->full = full;
+    stats->dirtyRects = rectCount;
+    if (rectCount == 0) {
+        stats->totalRuns = state->runCount;
+        return TRUE;
+    }
+
+    // 脏矩形各向外扩1像素：8连通的相邻关系只可能跨过这一圈
+    for (int y = 0; y < height; y++) dirtyMin[y] = -1;
+    for (int r = 0; r < rectCount; r++) {
+        const BoundingBox* rect = &rects[r];
+        int minX = max(rect->minX - 1, 0);
+        int maxX = min(rect->maxX + 1, width - 1);
+        for (int y = max(rect->minY - 1, 0); y <= min(rect->maxY + 1, height - 1); y++) {
+            if (dirtyMin[y] < 0) {
+                dirtyMin[y] = minX;
+                dirtyMax[y] = maxX;
+            } else {
+                dirtyMin[y] = min(dirtyMin[y], minX);
+                dirtyMax[y] = max(dirtyMax[y], maxX);
+            }
+        }
+    }
+
+    // 2. 与外扩脏矩形相交的旧区域整个拆除，释放槽位
+    unsigned char* affected = scratch->affected = (unsigned char*)arenaCalloc(arena, state->componentCount + 1, 1);
+    if (!affected) return FALSE;
+    for (int y = 0; y < height && !full; y++) {
+        if (dirtyMin[y] < 0) continue;
+        for (int i = state->rowStart[y]; i < state->rowStart[y + 1]; i++) {
+            const PixelRun* run = &state->runs[i];
+            if (run->start > dirtyMax[y] || run->end - 1 < dirtyMin[y]) continue;
+            int slot = state->runLabel[i];
+            if (!affected[slot]) {
+                affected[slot] = 1;
+                releaseComponentSlot(state, slot);
+                stats->affectedComponents++;
+            }
+        }
+    }
+
+    // 3. 生成新一帧的游程：干净行复制旧游程和槽位，脏行重新阈值化；需要重新标记的游程槽位记为-1
+    size_t maxRunsPerRow = (size_t)(width + 1) / 2;
+    size_t bound = (size_t)state->runCount + (size_t)stats->dirtyRows * maxRunsPerRow;
+    int* rowStart = scratch->rowStart = (int*)arenaAlloc(arena, (height + 1) * sizeof(int));
+    PixelRun* runs = scratch->runs = (PixelRun*)arenaAlloc(arena, bound * sizeof(PixelRun));
+    int* runLabel = scratch->runLabel = (int*)arenaAlloc(arena, bound * sizeof(int));
+    int* parent = scratch->parent = (int*)arenaAlloc(arena, bound * sizeof(int));
+    unsigned char* rowActive = scratch->rowActive = (unsigned char*)arenaCalloc(arena, height, 1);
+    if (!rowStart || !runs || !runLabel || !parent || !rowActive) return FALSE;
+    ThresholdRunsKernel thresholdKernel = SELECT_PIXEL_KERNEL(thresholdToRuns, bitCount);
+    int count = 0;
+    int y = 0;
+    while (y < height) {
+        if (!dirtyRow[y]) {
+            int oldStart = state->rowStart[y];
+            int oldEnd = state->rowStart[y + 1];
+            rowStart[y] = count;
+            memcpy(runs + count, state->runs + oldStart, (oldEnd - oldStart) * sizeof(PixelRun));
+            for (int i = oldStart; i < oldEnd; i++, count++) {
+                int slot = state->runLabel[i];
+                runLabel[count] = affected[slot] ? -1 : slot;
+                if (affected[slot]) rowActive[y] = 1;
+            }
+            y++;
+            continue;
+        }
+
+        // 连续的脏行一次阈值化，游程直接写到新游程数组的末尾
+        int bandEnd = y;
+        while (bandEnd + 1 < height && dirtyRow[bandEnd + 1]) bandEnd++;
+        RunImage band;
+        band.width = width;
+        band.height = bandEnd - y + 1;
+        band.rowStart = rowStart + y;
+        band.runs = runs + count;
+        thresholdKernel(buffer + (size_t)y * rowSize, width, band.height, rowSize, 128, &band);
+        for (int row = y; row <= bandEnd; row++) {
+            rowStart[row] += count;
+            int end = (row < bandEnd) ? rowStart[row + 1] + count : count + band.runCount;
+            // 外扩脏矩形以外的游程与上一帧同一行的某个游程完全相同，沿用其槽位
+            int oldIndex = full ? 0 : state->rowStart[row];
+            int oldEnd = full ? 0 : state->rowStart[row + 1];
+            for (int i = rowStart[row]; i < end; i++) {
+                const PixelRun* run = &runs[i];
+                runLabel[i] = -1;
+                if (!full && (dirtyMin[row] < 0 || run->start > dirtyMax[row] || run->end - 1 < dirtyMin[row])) {
+                    while (oldIndex < oldEnd && state->runs[oldIndex].start < run->start) oldIndex++;
+                    if (oldIndex < oldEnd && state->runs[oldIndex].end == run->end &&
+                        state->runs[oldIndex].start == run->start && !affected[state->runLabel[oldIndex]]) {
+                        runLabel[i] = state->runLabel[oldIndex];
+                    }
+                }
+                if (runLabel[i] < 0) rowActive[row] = 1;
+            }
+        }
+        count += band.runCount;
+        y = bandEnd + 1;
+    }
+    rowStart[height] = count;
+
+    // 4. 只在需要重新标记的游程之间做并查集（它们不会与保留的游程相邻）
+    int activeRuns = 0;
+    for (int i = 0; i < count; i++) {
+        if (runLabel[i] < 0) {
+            parent[i] = i;
+            activeRuns++;
+        }
+    }
+    for (y = 1; y < height; y++) {
+        if (!rowActive[y] || !rowActive[y - 1]) continue;
+        int above = rowStart[y - 1];
+        int aboveEnd = rowStart[y];
+        int current = rowStart[y];
+        int currentEnd = rowStart[y + 1];
+        while (above < aboveEnd && current < currentEnd) {
+            const PixelRun* a = &runs[above];
+            const PixelRun* b = &runs[current];
+            if (runLabel[above] < 0 && runLabel[current] < 0 && a->start <= b->end && b->start <= a->end) {
+                unionRuns(parent, above, current);
+            }
+            if (a->end < b->end) {
+                above++;
+            } else {
+                current++;
+            }
+        }
+    }
+
+    // 5. 按游程顺序给每个根分配槽位并累计边界框和像素数（根是区域的第一个游程，先于其余游程出现）
+    int created = 0;
+    for (y = 0; y < height; y++) {
+        if (!rowActive[y]) continue;
+        for (int i = rowStart[y]; i < rowStart[y + 1]; i++) {
+            if (runLabel[i] >= 0) continue;
+            const PixelRun* run = &runs[i];
+            int root = findRunRoot(parent, i);
+            int slot;
+            if (root == i) {
+                slot = allocComponentSlot(state);
+                if (slot < 0) return FALSE;
+                LabelComponent* component = &state->components[slot];
+                component->bbox.minX = run->start;
+                component->bbox.maxX = run->end - 1;
+                component->bbox.minY = y;
+                component->bbox.maxY = y;
+                component->pixelCount = 0;
+                component->firstX = run->start;
+                component->firstY = y;
+                created++;
+            } else {
+                slot = runLabel[root];
+                BoundingBox* box = &state->components[slot].bbox;
+                if (run->start < box->minX) box->minX = run->start;
+                if (run->end - 1 > box->maxX) box->maxX = run->end - 1;
+                box->maxY = y;
+            }
+            runLabel[i] = slot;
+            state->components[slot].pixelCount += run->end - run->start;
+        }
+    }
+    METRICS_COUNT(COUNTER_COMPONENTS, created);
+    stats->relabeledRuns = activeRuns;
+    stats->totalRuns = count;
+
+    // 6. 保存新一帧的游程和像素数据（增量时只复制脏行）
+    if (count > state->runCapacity) {
+        int capacity = max(count, state->runCapacity * 2);
+        PixelRun* newRuns = (PixelRun*)realloc(state->runs, (size_t)capacity * sizeof(PixelRun));
+        if (newRuns) state->runs = newRuns;
+        int* newLabels = newRuns ? (int*)realloc(state->runLabel, (size_t)capacity * sizeof(int)) : NULL;
+        if (newLabels) state->runLabel = newLabels;
+        if (!newRuns || !newLabels) return FALSE;
+        state->runCapacity = capacity;
+    }
+    if (full) {
+        free(state->pixels);
+        free(state->rowStart);
+        state->pixels = (unsigned char*)malloc((size_t)rowSize * height);
+        state->rowStart = (int*)malloc((height + 1) * sizeof(int));
+        if (!state->pixels || !state->rowStart) return FALSE;
+        memcpy(state->pixels, buffer, (size_t)rowSize * height);
+        state->width = width;
+        state->height = height;
+        state->bitCount = bitCount;
+        state->rowSize = rowSize;
+    } else {
+        for (y = 0; y < height; y++) {
+            if (dirtyRow[y]) memcpy(state->pixels + y * rowSize, buffer + y * rowSize, usedBytes);
+        }
+    }
+    memcpy(state->rowStart, rowStart, (height + 1) * sizeof(int));
+    memcpy(state->runs, runs, count * sizeof(PixelRun));
+    memcpy(state->runLabel, runLabel, count * sizeof(int));
+    state->runCount = count;
+    return TRUE;
+}
+
+// 用新一帧的规范化像素数据（与MarkObjectsInBinaryImageEx标记前的数据相同）更新标记结果，stats返回本帧的统计
+// arena为NULL时临时内存从系统分配并在返回前释放；内存不足或图像尺寸为0时返回FALSE，此时state被清空，下一帧整帧标记
+BOOL updateLabelState(LabelState* state, const unsigned char* buffer, int width, int height, int bitCount,
+                      int rowSize, RelabelStats* stats, ScratchArena* arena) {
+    RelabelScratch scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    memset(stats, 0, sizeof(RelabelStats));
+    BOOL ok = relabelFrame(state, buffer, width, height, bitCount, rowSize, stats, &scratch, arena);
+    releaseRelabelScratch(&scratch, arena);
+    if (!ok) freeLabelState(state);
+    return ok;
+}
+
+// 按第一个像素的行优先顺序排列的区域键：高32位为位置，低32位为槽位
+int compareLongLongs(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+// 从区域表生成物体列表，顺序与整帧标记（detectObjectsInBuffer）相同
+// 返回超过最小尺寸的物体总数，其中前maxObjects个写入objects；内存不足时返回-1
+int collectLabelObjects(const LabelState* state, const DetectOptions* options,
+                        ObjectInfo* objects, int maxObjects, int* objectCount, ScratchArena* arena) {
+    *objectCount = 0;
+    long long* keys = (long long*)arenaAlloc(arena, (state->componentCount + 1) * sizeof(long long));
+    if (!keys) return -1;
+    int minSize = max(options->minObjectSize, 1);
+    int found = 0;
+    for (int slot = 0; slot < state->componentCount; slot++) {
+        const LabelComponent* component = &state->components[slot];
+        if (component->pixelCount < minSize) continue;
+        long long position = (long long)component->firstY * state->width + component->firstX;
+        keys[found++] = (position << 32) | slot;
+    }
+    qsort(keys, found, sizeof(long long), compareLongLongs);
+    for (int i = 0; i < found && *objectCount < maxObjects; i++) {
+        const LabelComponent* component = &state->components[keys[i] & 0xFFFFFFFF];
+        recordObject(&objects[(*objectCount)++], &component->bbox, component->pixelCount, NULL);
+    }
+    arenaRelease(arena, keys);
+    return found;
+}
+
+#define RELABEL_MAX_OBJECTS 4096
+
+typedef struct {
+    int minObjectSize;
+    BOOL check;                             // 每帧再整帧标记一次，核对物体列表
+    const char* metricsFormat;
+} RelabelOptions;
+
+// 读入一帧并规范化为标记用的像素数据，返回的缓冲区从arena分配
+unsigned char* loadRelabelFrame(const char* path, BmpDescriptor* desc, ScratchArena* arena) {
+    METRICS_TIMER_START(timer);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("无法打开输入文件: %s\n", path);
+        return NULL;
+    }
+    RGBQUAD palette[256];
+    if (!readBmpHeader(file, desc, palette)) {
+        fclose(file);
+        return NULL;
+    }
+    METRICS_LAP(timer, STAGE_HEADER);
+    unsigned char* buffer = (unsigned char*)arenaAlloc(arena, desc->imageSize);
+    if (!buffer) {
+        fclose(file);
+        printf("内存分配失败！\n");
+        return NULL;
+    }
+    if (!readBmpPixelData(file, desc, buffer)) {
+        fclose(file);
+        printf("读取图像数据失败！\n");
+        return NULL;
+    }
+    fclose(file);
+    METRICS_COUNT(COUNTER_BYTES_READ, (long long)desc->dataSize);
+    METRICS_LAP(timer, STAGE_READ);
+    unsigned char* labelBuffer = canonicalizeLabelBuffer(buffer, palette, desc->bitCount, desc->rowSize,
+                                                         desc->height, arena);
+    if (!labelBuffer) printf("内存分配失败！\n");
+    return labelBuffer;
+}
+
+// 按顺序增量标记各帧，返回失败的帧数（--check时核对不一致的帧也计入）
+int RunRelabel(const RelabelOptions* options, char** paths, int count) {
+    double started = getMonotonicSeconds();
+    ObjectInfo* objects = (ObjectInfo*)malloc(RELABEL_MAX_OBJECTS * sizeof(ObjectInfo));
+    ObjectInfo* expected = options->check ? (ObjectInfo*)malloc(RELABEL_MAX_OBJECTS * sizeof(ObjectInfo)) : NULL;
+    if (!objects || (options->check && !expected)) {
+        free(objects);
+        free(expected);
+        printf("内存分配失败！\n");
+        return count;
+    }
+    DetectOptions detectOptions;
+    initDetectOptions(&detectOptions);
+    detectOptions.minObjectSize = options->minObjectSize;
+    detectOptions.maxObjects = RELABEL_MAX_OBJECTS;
+
+    LabelState state;
+    initLabelState(&state);
+    ScratchArena arena;
+    initScratchArena(&arena);
+    int failed = 0;
+    int processed = 0;
+    double labelSeconds = 0.0;
+    for (int i = 0; i < count; i++) {
+        BmpDescriptor desc;
+        unsigned char* labelBuffer = loadRelabelFrame(paths[i], &desc, &arena);
+        if (!labelBuffer) {
+            printf("[失败] %s\n", paths[i]);
+            failed++;
+            resetScratchArena(&arena);
+            continue;
+        }
+
+        METRICS_TIMER_START(timer);
+        double labelStart = getMonotonicSeconds();
+        RelabelStats stats;
+        int objectCount = 0;
+        int found = -1;
+        if (updateLabelState(&state, labelBuffer, desc.width, desc.height, desc.bitCount, desc.rowSize,
+                             &stats, &arena)) {
+            found = collectLabelObjects(&state, &detectOptions, objects, RELABEL_MAX_OBJECTS, &objectCount, &arena);
+        }
+        labelSeconds += getMonotonicSeconds() - labelStart;
+        METRICS_LAP(timer, STAGE_LABEL);
+        if (found < 0) {
+            printf("内存分配失败！\n");
+            failed++;
+            resetScratchArena(&arena);
+            continue;
+        }
+
+        printf("帧 %d %s: 物体 %d 个, ", i + 1, paths[i], found);
+        if (stats.full) {
+            printf("整帧标记 %d 个游程\n", stats.totalRuns);
+        } else {
+            printf("脏矩形 %d 个（%d 行）, 重新标记游程 %d/%d, 受影响区域 %d 个\n", stats.dirtyRects,
+                   stats.dirtyRows, stats.relabeledRuns, stats.totalRuns, stats.affectedComponents);
+        }
+        for (int k = 0; k < objectCount; k++) {
+            const BoundingBox* bbox = &objects[k].bbox;
+            printf("    物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n", k + 1, bbox->minX, bbox->minY,
+                   bbox->maxX, bbox->maxY, objects[k].pixelCount);
+        }
+
+        if (options->check) {
+            int expectedCount = 0;
+            int expectedFound = detectObjectsInBuffer(labelBuffer, desc.width, desc.height, desc.bitCount,
+                                                      desc.rowSize, &detectOptions, NULL, expected,
+                                                      RELABEL_MAX_OBJECTS, &expectedCount, &arena);
+            int index = compareObjectLists(expected, expectedCount, objects, objectCount);
+            if (expectedFound != found || index >= 0) {
+                printf("    核对失败: 整帧标记 %d 个物体，第 %d 个物体不同\n", expectedFound, index + 1);
+                failed++;
+            }
+        }
+        processed++;
+        METRICS_COUNT(COUNTER_IMAGES, 1);
+        resetScratchArena(&arena);
+    }
+
+    double seconds = getMonotonicSeconds() - started;
+    printf("增量标记完成: %d 帧, 失败 %d 帧, 用时 %.3f 秒（标记 %.3f 秒）\n", processed, failed, seconds,
+           labelSeconds);
+    if (options->metricsFormat) {
+        MetricsBlock metrics;
+        MetricsSnapshot(&metrics);
+        writeBatchMetrics(options->metricsFormat, &metrics);
+    }
+
+    freeScratchArena(&arena);
+    freeLabelState(&state);
+    free(objects);
+    free(expected);
+    return failed;
+}
+
+// 解析relabel子命令的选项，*first返回第一个帧文件的下标
+BOOL parseRelabelOptions(int argc, char* argv[], RelabelOptions* options, int* first) {
+    DetectOptions defaults;
+    initDetectOptions(&defaults);
+    options->minObjectSize = defaults.minObjectSize;
+    options->check = FALSE;
+    options->metricsFormat = NULL;
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--check") == 0) {
+            options->check = TRUE;
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc) return FALSE;
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--min-size") == 0) {
+            options->minObjectSize = atoi(value);
+            if (options->minObjectSize < 1) return FALSE;
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (strcmp(value, "prom") != 0 && strcmp(value, "json") != 0) return FALSE;
+            options->metricsFormat = value;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 拼图总览 ----
+// 命令行: bmp2gray montage [--out 文件] [--cols N] [--tile 宽[x高]] [--gap N] [--jobs N] <文件1> [文件2 ...]
+// 把多张图像（通常是_objects.bmp、_diff.bmp）按网格缩小拼成一张24位BMP，便于一次浏览整批结果。
+// 每张源图按行流式读取（RLE按行解码），逐行做面积平均缩小到瓦片中，不需要整张源图驻留内存；
+// 多个工作线程并行解码各瓦片，主线程按网格行自下而上写出，同时最多保留MONTAGE_ROWS_IN_FLIGHT行瓦片。
+#define MONTAGE_MAX_WORKERS 16
+#define MONTAGE_ROWS_IN_FLIGHT 2            // 同时解码中或待写出的网格行数
+#define MONTAGE_BACKGROUND 48               // 瓦片空白处和间隔的灰度
+
+typedef struct {
+    const char* outputPath;
+    int columns;                            // 0表示按文件数取接近正方形的列数
+    int tileWidth;
+    int tileHeight;
+    int gap;                                // 瓦片之间及四周的间隔像素数
+    int jobs;
+} MontageOptions;
+
+typedef struct {
+    const MontageOptions* options;
+    char** paths;
+    int count;
+    int columns;
+    int rows;
+    int tileRowSize;                        // 瓦片每行字节数（24位，不对齐）
+    unsigned char* tiles;                   // MONTAGE_ROWS_IN_FLIGHT * columns 个瓦片，行自上而下
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+    int nextTask;                           // 下一个要解码的瓦片序号（按写出顺序：网格行自下而上）
+    int writtenRows;                        // 已写出的网格行数
+    int doneTiles[MONTAGE_ROWS_IN_FLIGHT];  // 各槽位网格行已完成的瓦片数
+    int failed;
+} MontageContext;
+
+typedef struct {
+    MontageContext* context;
+    int worker;
+} MontageWorkerArgs;
+
+// 缩小时每个输出像素覆盖的源像素范围：[first, last]，两端的像素按覆盖比例加权，中间的权重为1
+typedef struct {
+    int first;
+    int last;
+    float firstWeight;
+    float lastWeight;
+} AreaSpan;
+
+// 把源图的一行展开为BGR字节
+void expandRowToBgr(const unsigned char* row, int width, int bitCount, const RGBQUAD* palette, unsigned char* bgr) {
+    if (bitCount == 24) {
+        memcpy(bgr, row, width * 3);
+        return;
+    }
+    for (int x = 0; x < width; x++) {
+        if (bitCount == 32) {
+            bgr[x * 3] = row[x * 4];
+            bgr[x * 3 + 1] = row[x * 4 + 1];
+            bgr[x * 3 + 2] = row[x * 4 + 2];
+            continue;
+        }
+        int index;
+        if (bitCount == 8) {
+            index = row[x];
+        } else if (bitCount == 4) {
+            index = (x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4);
+        } else {
+            index = (row[x >> 3] >> (7 - (x & 7))) & 1;
+        }
+        bgr[x * 3] = palette[index].rgbBlue;
+        bgr[x * 3 + 1] = palette[index].rgbGreen;
+        bgr[x * 3 + 2] = palette[index].rgbRed;
+    }
+}
+
+// 计算把sourceSize个像素缩小为targetSize个像素时各输出像素的覆盖范围
+void buildAreaSpans(AreaSpan* spans, int sourceSize, int targetSize) {
+    double scale = (double)sourceSize / targetSize;
+    for (int i = 0; i < targetSize; i++) {
+        double left = i * scale;
+        double right = (i + 1 == targetSize) ? sourceSize : (i + 1) * scale;
+        int first = (int)left;
+        int last = min((int)ceil(right) - 1, sourceSize - 1);
+        spans[i].first = first;
+        spans[i].last = last;
+        if (first == last) {
+            spans[i].firstWeight = (float)(right - left);
+            spans[i].lastWeight = 0.0f;
+        } else {
+            spans[i].firstWeight = (float)(first + 1 - left);
+            spans[i].lastWeight = (float)(right - last);
+        }
+    }
+}
+
+// 水平方向面积求和：sums[i*3+c]为第i个输出像素覆盖的源像素之和（按覆盖比例加权）
+void sumAreaSpans(const unsigned char* bgr, const AreaSpan* spans, int targetWidth, float* sums) {
+    for (int i = 0; i < targetWidth; i++) {
+        const AreaSpan* span = &spans[i];
+        const unsigned char* first = bgr + span->first * 3;
+        float b = first[0] * span->firstWeight;
+        float g = first[1] * span->firstWeight;
+        float r = first[2] * span->firstWeight;
+        for (int x = span->first + 1; x < span->last; x++) {
+            b += bgr[x * 3];
+            g += bgr[x * 3 + 1];
+            r += bgr[x * 3 + 2];
+        }
+        if (span->last > span->first) {
+            const unsigned char* last = bgr + span->last * 3;
+            b += last[0] * span->lastWeight;
+            g += last[1] * span->lastWeight;
+            r += last[2] * span->lastWeight;
+        }
+        sums[i * 3] = b;
+        sums[i * 3 + 1] = g;
+        sums[i * 3 + 2] = r;
+    }
+}
+
+// 垂直方向累加：accumulator += sums * weight
+void accumulateAreaRow(float* accumulator, const float* sums, float weight, int count) {
+    int i = 0;
+#ifdef BMP_USE_SSE2
+    __m128 weightVector = _mm_set1_ps(weight);
+    for (; i + 4 <= count; i += 4) {
+        __m128 value = _mm_mul_ps(_mm_loadu_ps(sums + i), weightVector);
+        _mm_storeu_ps(accumulator + i, _mm_add_ps(_mm_loadu_ps(accumulator + i), value));
+    }
+#endif
+    for (; i < count; i++) accumulator[i] += sums[i] * weight;
+}
+
+// 输出一行：accumulator * scale四舍五入为字节
+void emitAreaRow(const float* accumulator, float scale, unsigned char* out, int count) {
+    int i = 0;
+#ifdef BMP_USE_SSE2
+    __m128 scaleVector = _mm_set1_ps(scale);
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(accumulator + i), scaleVector));
+        __m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(accumulator + i + 4), scaleVector));
+        __m128i c = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(accumulator + i + 8), scaleVector));
+        __m128i d = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(accumulator + i + 12), scaleVector));
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+#endif
+    for (; i < count; i++) {
+        int value = (int)(accumulator[i] * scale + 0.5f);
+        out[i] = (unsigned char)(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+}
+
+// 流式读取一张源图并按面积平均缩小到瓦片中央（保持宽高比，不放大），瓦片其余部分为背景色
+// tile为tileWidth*tileHeight的24位像素，行自上而下；临时内存从arena分配
+BOOL renderMontageTile(const char* path, int tileWidth, int tileHeight, unsigned char* tile, ScratchArena* arena) {
+    int tileRowSize = tileWidth * 3;
+    memset(tile, MONTAGE_BACKGROUND, (size_t)tileRowSize * tileHeight);
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("无法打开输入文件: %s\n", path);
+        return FALSE;
+    }
+    BmpDescriptor desc;
+    RGBQUAD palette[256];
+    if (!readBmpHeader(file, &desc, palette)) {
+        fclose(file);
+        return FALSE;
+    }
+
+    int width = desc.width;
+    int height = desc.height;
+    double scale = max(1.0, max((double)width / tileWidth, (double)height / tileHeight));
+    int targetWidth = max(1, min(tileWidth, (int)(width / scale + 0.5)));
+    int targetHeight = max(1, min(tileHeight, (int)(height / scale + 0.5)));
+    int offsetX = (tileWidth - targetWidth) / 2;
+    int offsetY = (tileHeight - targetHeight) / 2;
+    int channels = targetWidth * 3;
+
+    unsigned char* row = (unsigned char*)arenaAlloc(arena, desc.rowSize);
+    unsigned char* bgr = (unsigned char*)arenaAlloc(arena, (size_t)width * 3);
+    AreaSpan* spans = (AreaSpan*)arenaAlloc(arena, targetWidth * sizeof(AreaSpan));
+    float* sums = (float*)arenaAlloc(arena, channels * sizeof(float));
+    float* accumulator = (float*)arenaCalloc(arena, channels, sizeof(float));
+    if (!row || !bgr || !spans || !sums || !accumulator) {
+        fclose(file);
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    buildAreaSpans(spans, width, targetWidth);
+
+    RleDecoder decoder;
+    BOOL rle = desc.compression == BI_RLE8 || desc.compression == BI_RLE4;
+    if (rle) initRleDecoder(&decoder, file, width, desc.bitCount);
+
+    // 按文件中的行顺序累加；一个源行最多跨过一个输出行的边界（不放大）
+    double rowScale = (double)height / targetHeight;
+    float normalize = (float)(1.0 / (((double)width / targetWidth) * rowScale));
+    double boundary = rowScale;
+    int target = 0;
+    BOOL ok = TRUE;
+    for (int y = 0; y < height && target < targetHeight; y++) {
+        if (rle ? !decodeRleRow(&decoder, row, desc.rowSize) : fread(row, 1, desc.rowSize, file) != (size_t)desc.rowSize) {
+            printf("读取图像数据失败: %s\n", path);
+            ok = FALSE;
+            break;
+        }
+        expandRowToBgr(row, width, desc.bitCount, palette, bgr);
+        sumAreaSpans(bgr, spans, targetWidth, sums);
+        if (target + 1 == targetHeight) boundary = height;
+        if (y + 1 < boundary) {
+            accumulateAreaRow(accumulator, sums, 1.0f, channels);
+            continue;
+        }
+        // 本行完成当前输出行，超出边界的部分计入下一输出行
+        float inside = (float)(boundary - y);
+        accumulateAreaRow(accumulator, sums, inside, channels);
+        int tileY = offsetY + (desc.topDown ? target : targetHeight - 1 - target);
+        emitAreaRow(accumulator, normalize, tile + (size_t)tileY * tileRowSize + offsetX * 3, channels);
+        memset(accumulator, 0, channels * sizeof(float));
+        if (inside < 1.0f) accumulateAreaRow(accumulator, sums, 1.0f - inside, channels);
+        target++;
+        boundary = (target + 1) * rowScale;
+    }
+    fclose(file);
+
+    arenaRelease(arena, accumulator);
+    arenaRelease(arena, sums);
+    arenaRelease(arena, spans);
+    arenaRelease(arena, bgr);
+    arenaRelease(arena, row);
+    return ok;
+}
+
+// 工作线程：按写出顺序领取瓦片，槽位仍被未写出的网格行占用时等待
+DWORD WINAPI montageWorkerThread(LPVOID parameter) {
+    MontageWorkerArgs* args = (MontageWorkerArgs*)parameter;
+    MontageContext* context = args->context;
+    const MontageOptions* options = context->options;
+    int tileSize = context->tileRowSize * options->tileHeight;
+    ScratchArena arena;
+    initScratchArena(&arena);
+
+    for (;;) {
+        EnterCriticalSection(&context->lock);
+        int task = context->nextTask;
+        if (task >= context->rows * context->columns) {
+            LeaveCriticalSection(&context->lock);
+            break;
+        }
+        context->nextTask++;
+        int batch = task / context->columns;
+        while (batch >= context->writtenRows + MONTAGE_ROWS_IN_FLIGHT) {
+            SleepConditionVariableCS(&context->changed, &context->lock, INFINITE);
+        }
+        LeaveCriticalSection(&context->lock);
+
+        // 第batch个写出的网格行是自上而下的第rows-1-batch行
+        int index = (context->rows - 1 - batch) * context->columns + task % context->columns;
+        int slot = task % (context->columns * MONTAGE_ROWS_IN_FLIGHT);
+        unsigned char* tile = context->tiles + (size_t)slot * tileSize;
+        BOOL ok = TRUE;
+        if (index < context->count) {
+            ok = renderMontageTile(context->paths[index], options->tileWidth, options->tileHeight, tile, &arena);
+            resetScratchArena(&arena);
+        } else {
+            memset(tile, MONTAGE_BACKGROUND, tileSize);
+        }
+
+        EnterCriticalSection(&context->lock);
+        if (!ok) context->failed++;
+        context->doneTiles[batch % MONTAGE_ROWS_IN_FLIGHT]++;
+        WakeAllConditionVariable(&context->changed);
+        LeaveCriticalSection(&context->lock);
+    }
+
+    freeScratchArena(&arena);
+    return 0;
+}
+
+// 生成拼图，返回失败的文件数
+int RunMontage(const MontageOptions* options, char** paths, int count) {
+    double started = getMonotonicSeconds();
+    MontageContext context;
+    memset(&context, 0, sizeof(context));
+    context.options = options;
+    context.paths = paths;
+    context.count = count;
+    context.columns = options->columns > 0 ? options->columns : (int)ceil(sqrt((double)count));
+    context.columns = min(context.columns, count);
+    context.rows = (count + context.columns - 1) / context.columns;
+    context.tileRowSize = options->tileWidth * 3;
+    int jobs = min(options->jobs, context.columns * MONTAGE_ROWS_IN_FLIGHT);
+
+    int gap = options->gap;
+    int outputWidth = context.columns * options->tileWidth + (context.columns + 1) * gap;
+    int outputHeight = context.rows * options->tileHeight + (context.rows + 1) * gap;
+    int outputRowSize = ((outputWidth * 24 + 31) / 32) * 4;
+    size_t tileSize = (size_t)context.tileRowSize * options->tileHeight;
+
+    context.tiles = (unsigned char*)malloc(tileSize * context.columns * MONTAGE_ROWS_IN_FLIGHT);
+    unsigned char* outputRow = (unsigned char*)malloc(outputRowSize * 2);
+    unsigned char* gapRow = outputRow ? outputRow + outputRowSize : NULL;
+    HANDLE* workers = (HANDLE*)calloc(jobs, sizeof(HANDLE));
+    MontageWorkerArgs* args = (MontageWorkerArgs*)calloc(jobs, sizeof(MontageWorkerArgs));
+    if (!context.tiles || !outputRow || !workers || !args) {
+        free(context.tiles);
+        free(outputRow);
+        free(workers);
+        free(args);
+        printf("内存分配失败！\n");
+        return count;
+    }
+    FILE* output = fopen(options->outputPath, "wb");
+    if (!output) {
+        free(context.tiles);
+        free(outputRow);
+        free(workers);
+        free(args);
+        printf("无法创建输出文件: %s\n", options->outputPath);
+        return count;
+    }
+
+    BITMAPINFOHEADER infoHeader;
+    memset(&infoHeader, 0, sizeof(infoHeader));
+    infoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    infoHeader.biWidth = outputWidth;
+    infoHeader.biHeight = outputHeight;
+    infoHeader.biPlanes = 1;
+    infoHeader.biBitCount = 24;
+    infoHeader.biCompression = BI_RGB;
+    infoHeader.biSizeImage = outputRowSize * outputHeight;
+    writeBmpHeaders(output, &infoHeader, 24, NULL, 0, outputRowSize, outputHeight);
+
+    InitializeCriticalSection(&context.lock);
+    InitializeConditionVariable(&context.changed);
+    int startedWorkers = 0;
+    for (int w = 0; w < jobs; w++) {
+        args[w].context = &context;
+        args[w].worker = w;
+        workers[w] = CreateThread(NULL, 0, montageWorkerThread, &args[w], 0, NULL);
+        if (!workers[w]) break;
+        startedWorkers++;
+    }
+    printf("拼图 %d 张: %d 列 x %d 行, 瓦片 %dx%d, 输出 %dx%d, %d 个解码线程\n", count, context.columns,
+           context.rows, options->tileWidth, options->tileHeight, outputWidth, outputHeight, startedWorkers);
+
+    // 输出行中间隔处的像素在拼接时不会被覆盖，只需填充一次背景色
+    memset(gapRow, MONTAGE_BACKGROUND, outputWidth * 3);
+    memset(gapRow + outputWidth * 3, 0, outputRowSize - outputWidth * 3);
+    memcpy(outputRow, gapRow, outputRowSize);
+    for (int i = 0; i < gap; i++) fwrite(gapRow, 1, outputRowSize, output);
+
+    // 自下而上写出各网格行：等该行的瓦片全部解码完成，再逐行拼接
+    for (int batch = 0; batch < context.rows && startedWorkers > 0; batch++) {
+        EnterCriticalSection(&context.lock);
+        while (context.doneTiles[batch % MONTAGE_ROWS_IN_FLIGHT] < context.columns) {
+            SleepConditionVariableCS(&context.changed, &context.lock, INFINITE);
+        }
+        LeaveCriticalSection(&context.lock);
+
+        const unsigned char* slotTiles = context.tiles + tileSize * context.columns * (batch % MONTAGE_ROWS_IN_FLIGHT);
+        for (int y = options->tileHeight - 1; y >= 0; y--) {
+            unsigned char* out = outputRow + gap * 3;
+            for (int c = 0; c < context.columns; c++) {
+                memcpy(out, slotTiles + tileSize * c + (size_t)y * context.tileRowSize, context.tileRowSize);
+                out += context.tileRowSize + gap * 3;
+            }
+            fwrite(outputRow, 1, outputRowSize, output);
+        }
+        for (int i = 0; i < gap; i++) fwrite(gapRow, 1, outputRowSize, output);
+
+        EnterCriticalSection(&context.lock);
+        context.doneTiles[batch % MONTAGE_ROWS_IN_FLIGHT] = 0;
+        context.writtenRows++;
+        WakeAllConditionVariable(&context.changed);
+        LeaveCriticalSection(&context.lock);
+    }
+    for (int w = 0; w < startedWorkers; w++) {
+        WaitForSingleObject(workers[w], INFINITE);
+        CloseHandle(workers[w]);
+    }
+    DeleteCriticalSection(&context.lock);
+    BOOL written = startedWorkers > 0 && fclose(output) == 0;
+    if (startedWorkers == 0) fclose(output);
+
+    double seconds = getMonotonicSeconds() - started;
+    if (written) {
+        printf("拼图完成: %s, 失败 %d 张, 用时 %.3f 秒\n", options->outputPath, context.failed, seconds);
+    } else {
+        printf("无法写入拼图: %s\n", options->outputPath);
+        context.failed = count;
+    }
+
+    free(context.tiles);
+    free(outputRow);
+    free(workers);
+    free(args);
+    return context.failed;
+}
+
+// 解析montage子命令的选项，*first返回第一个输入文件的下标
+BOOL parseMontageOptions(int argc, char* argv[], MontageOptions* options, int* first) {
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    options->outputPath = "montage.bmp";
+    options->columns = 0;
+    options->tileWidth = 256;
+    options->tileHeight = 256;
+    options->gap = 4;
+    options->jobs = min(max((int)systemInfo.dwNumberOfProcessors, 1), MONTAGE_MAX_WORKERS);
+    int i = 0;
+    while (i + 1 < argc && strncmp(argv[i], "--", 2) == 0) {
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--out") == 0) {
+            options->outputPath = value;
+        } else if (strcmp(argv[i], "--cols") == 0) {
+            options->columns = atoi(value);
+            if (options->columns < 1) return FALSE;
+        } else if (strcmp(argv[i], "--tile") == 0) {
+            int fields = sscanf(value, "%dx%d", &options->tileWidth, &options->tileHeight);
+            if (fields == 1) options->tileHeight = options->tileWidth;
+            if (fields < 1 || options->tileWidth < 8 || options->tileHeight < 8 ||
+                options->tileWidth > 4096 || options->tileHeight > 4096) {
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--gap") == 0) {
+            options->gap = atoi(value);
+            if (options->gap < 0 || options->gap > 64) return FALSE;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            options->jobs = atoi(value);
+            if (options->jobs < 1 || options->jobs > MONTAGE_MAX_WORKERS) return FALSE;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 颜色分割 ----
+// 命令行: bmp2gray color [--color red|yellow|green|blue] [--hsv H0-H1,S0-S1,V0-V1] [--ycbcr Y0-Y1,Cb0-Cb1,Cr0-Cr1]
+//                        [--min-size N] [--max-objects N] [--mark] <文件1> [文件2 ...]
+// 直接在原始像素上按颜色范围找物体（如light/中亮起的红色指示灯），不生成中间的灰度图或二值图：
+// 每行像素由分类器判断是否在范围内，结果直接生成游程交给labelRunComponents标记。
+// HSV中H为0~359度（下限大于上限表示跨过0度，如红色340-20），S = 255*(max-min)/max，V = max；
+// YCbCr为BT.601全范围，按8位定点计算。24/32位每次分类4个像素（SSE2），索引格式只对调色板分类一次再按索引查表。
+
+typedef enum {
+    COLOR_SPACE_HSV,
+    COLOR_SPACE_YCBCR
+} ColorSpace;
+
+typedef struct {
+    ColorSpace space;
+    int low[3];                 // HSV：H、S、V；YCbCr：Y、Cb、Cr
+    int high[3];
+} ColorRange;
+
+typedef struct {
+    ColorRange range;
+    int minObjectSize;
+    int maxObjects;
+    BOOL markOutput;            // 输出画出物体边界框的24位图像（_color.bmp）
+} ColorOptions;
+
+// 预置的HSV颜色范围
+typedef struct {
+    const char* name;
+    ColorRange range;
+} ColorPreset;
+
+static const ColorPreset colorPresets[] = {
+    { "red",    { COLOR_SPACE_HSV, { 340, 100, 80 }, { 20, 255, 255 } } },
+    { "yellow", { COLOR_SPACE_HSV, { 40, 100, 80 },  { 70, 255, 255 } } },
+    { "green",  { COLOR_SPACE_HSV, { 80, 100, 80 },  { 160, 255, 255 } } },
+    { "blue",   { COLOR_SPACE_HSV, { 200, 100, 80 }, { 260, 255, 255 } } },
+};
+
+// 判断一个像素是否在颜色范围内（标量实现，也用于向量路径的行尾像素）
+// 除色相外全部是整数比较；色相按与向量路径相同的单精度运算顺序计算，两条路径逐像素一致
+BOOL colorPixelInRange(const ColorRange* range, int r, int g, int b) {
+    if (range->space == COLOR_SPACE_YCBCR) {
+        int values[3];
+        values[0] = (77 * r + 150 * g + 29 * b) >> 8;
+        values[1] = (32768 - 43 * r - 85 * g + 128 * b) >> 8;
+        values[2] = (32768 + 128 * r - 107 * g - 21 * b) >> 8;
+        for (int i = 0; i < 3; i++) {
+            if (values[i] < range->low[i] || values[i] > range->high[i]) return FALSE;
+        }
+        return TRUE;
+    }
+
+    int maximum = max(r, max(g, b));
+    int delta = maximum - min(r, min(g, b));
+    if (maximum < range->low[2] || maximum > range->high[2]) return FALSE;
+    // S的范围按交叉相乘比较，不做除法；黑色（max为0）的S为0
+    if (255 * delta < range->low[1] * max(maximum, 1) || 255 * delta > range->high[1] * maximum) return FALSE;
+    float hue = 0.0f;
+    if (delta > 0) {
+        int numerator, base;
+        if (maximum == r) {
+            numerator = g - b;
+            base = 0;
+        } else if (maximum == g) {
+            numerator = b - r;
+            base = 120;
+        } else {
+            numerator = r - g;
+            base = 240;
+        }
+        hue = (float)base + (float)(60 * numerator) / (float)delta;
+        if (hue < 0.0f) hue += 360.0f;
+    }
+    if (range->low[0] <= range->high[0]) {
+        return hue >= (float)range->low[0] && hue <= (float)range->high[0];
+    }
+    return hue >= (float)range->low[0] || hue <= (float)range->high[0];
+}
+
+#ifdef BMP_USE_SSE2
+// 4个像素（BGRX）中在范围内的像素，返回4位掩码
+static __m128 selectPs(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+int classifyColorQuad(const ColorRange* range, const unsigned char* pixels) {
+    __m128i word = _mm_loadu_si128((const __m128i*)pixels);
+    __m128i byteMask = _mm_set1_epi32(0xFF);
+    __m128 b = _mm_cvtepi32_ps(_mm_and_si128(word, byteMask));
+    __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(word, 8), byteMask));
+    __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(word, 16), byteMask));
+    __m128 inRange;
+
+    if (range->space == COLOR_SPACE_YCBCR) {
+        // 各分量乘以256后的值都是小于2^24的整数，单精度运算是精确的；v>>8 ∈ [low, high] 即 v ∈ [256*low, 256*high+255]
+        __m128 values[3];
+        values[0] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(77.0f)), _mm_mul_ps(g, _mm_set1_ps(150.0f))),
+                               _mm_mul_ps(b, _mm_set1_ps(29.0f)));
+        values[1] = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(32768.0f), _mm_mul_ps(r, _mm_set1_ps(43.0f))),
+                                          _mm_mul_ps(g, _mm_set1_ps(85.0f))),
+                               _mm_mul_ps(b, _mm_set1_ps(128.0f)));
+        values[2] = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_set1_ps(32768.0f), _mm_mul_ps(r, _mm_set1_ps(128.0f))),
+                                          _mm_mul_ps(g, _mm_set1_ps(107.0f))),
+                               _mm_mul_ps(b, _mm_set1_ps(21.0f)));
+        inRange = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int i = 0; i < 3; i++) {
+            inRange = _mm_and_ps(inRange, _mm_cmpge_ps(values[i], _mm_set1_ps(256.0f * range->low[i])));
+            inRange = _mm_and_ps(inRange, _mm_cmple_ps(values[i], _mm_set1_ps(256.0f * range->high[i] + 255.0f)));
+        }
+        return _mm_movemask_ps(inRange);
+    }
+
+    __m128 maximum = _mm_max_ps(r, _mm_max_ps(g, b));
+    __m128 delta = _mm_sub_ps(maximum, _mm_min_ps(r, _mm_min_ps(g, b)));
+    __m128 saturation = _mm_mul_ps(delta, _mm_set1_ps(255.0f));
+    inRange = _mm_and_ps(_mm_cmpge_ps(maximum, _mm_set1_ps((float)range->low[2])),
+                         _mm_cmple_ps(maximum, _mm_set1_ps((float)range->high[2])));
+    inRange = _mm_and_ps(inRange, _mm_cmpge_ps(saturation, _mm_mul_ps(_mm_set1_ps((float)range->low[1]),
+                                                                      _mm_max_ps(maximum, _mm_set1_ps(1.0f)))));
+    inRange = _mm_and_ps(inRange, _mm_cmple_ps(saturation, _mm_mul_ps(_mm_set1_ps((float)range->high[1]), maximum)));
+    if (_mm_movemask_ps(inRange) == 0) return 0;
+
+    // 与标量路径相同：max依次与R、G、B比较选择扇区，色相 = 基准 + 60*分子/delta
+    __m128 isRed = _mm_cmpeq_ps(maximum, r);
+    __m128 isGreen = _mm_andnot_ps(isRed, _mm_cmpeq_ps(maximum, g));
+    __m128 numerator = selectPs(isRed, _mm_sub_ps(g, b), selectPs(isGreen, _mm_sub_ps(b, r), _mm_sub_ps(r, g)));
+    __m128 base = selectPs(isRed, _mm_setzero_ps(), selectPs(isGreen, _mm_set1_ps(120.0f), _mm_set1_ps(240.0f)));
+    __m128 hasHue = _mm_cmpgt_ps(delta, _mm_setzero_ps());
+    __m128 safeDelta = selectPs(hasHue, delta, _mm_set1_ps(1.0f));
+    __m128 hue = _mm_add_ps(base, _mm_div_ps(_mm_mul_ps(numerator, _mm_set1_ps(60.0f)), safeDelta));
+    hue = _mm_add_ps(hue, _mm_and_ps(_mm_cmplt_ps(hue, _mm_setzero_ps()), _mm_set1_ps(360.0f)));
+    hue = _mm_and_ps(hasHue, hue);
+    __m128 aboveLow = _mm_cmpge_ps(hue, _mm_set1_ps((float)range->low[0]));
+    __m128 belowHigh = _mm_cmple_ps(hue, _mm_set1_ps((float)range->high[0]));
+    inRange = _mm_and_ps(inRange, (range->low[0] <= range->high[0]) ? _mm_and_ps(aboveLow, belowHigh)
+                                                                      : _mm_or_ps(aboveLow, belowHigh));
+    return _mm_movemask_ps(inRange);
+}
+#endif
+
+// 对一行4字节像素（BGRX，第4字节忽略）分类，范围内的像素在mask中写1，否则写0
+void classifyColorRow(const ColorRange* range, const unsigned char* pixels, int width, unsigned char* mask) {
+    int x = 0;
+#ifdef BMP_USE_SSE2
+    for (; x + 4 <= width; x += 4) {
+        int bits = classifyColorQuad(range, pixels + x * 4);
+        mask[x] = (unsigned char)(bits & 1);
+        mask[x + 1] = (unsigned char)((bits >> 1) & 1);
+        mask[x + 2] = (unsigned char)((bits >> 2) & 1);
+        mask[x + 3] = (unsigned char)((bits >> 3) & 1);
+    }
+#endif
+    for (; x < width; x++) {
+        const unsigned char* pixel = pixels + x * 4;
+        mask[x] = (unsigned char)colorPixelInRange(range, pixel[2], pixel[1], pixel[0]);
+    }
+}
+
+// 把一行分类结果追加为游程，返回新的游程数；不在游程中时按8字节跳过全0的块
+int appendMaskRuns(const unsigned char* mask, int width, PixelRun* runs, int count) {
+    int runStart = -1;
+    for (int x = 0; x < width; x++) {
+        if (runStart < 0 && x + 8 <= width) {
+            unsigned long long chunk;
+            memcpy(&chunk, mask + x, 8);
+            if (chunk == 0) {
+                x += 7;
+                continue;
+            }
+        }
+        if (mask[x]) {
+            if (runStart < 0) runStart = x;
+        } else if (runStart >= 0) {
+            runs[count].start = runStart;
+            runs[count++].end = x;
+            runStart = -1;
+        }
+    }
+    if (runStart >= 0) {
+        runs[count].start = runStart;
+        runs[count++].end = width;
+    }
+    return count;
+}
+
+// 按颜色范围把图像分割为游程，范围内的像素为物体像素；内存不足时返回FALSE
+// 24位逐行展开为4字节像素后分类，32位直接分类，索引格式先对调色板分类再按索引查表
+BOOL colorToRuns(const unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                 const RGBQUAD* palette, const ColorRange* range, RunImage* image, ScratchArena* arena) {
+    unsigned char* mask = (unsigned char*)arenaAlloc(arena, width);
+    unsigned char* expanded = (bitCount == 24) ? (unsigned char*)arenaAlloc(arena, (size_t)width * 4) : NULL;
+    if (!mask || (bitCount == 24 && !expanded)) {
+        if (mask) arenaRelease(arena, mask);
+        if (expanded) arenaRelease(arena, expanded);
+        return FALSE;
+    }
+    unsigned char table[256];
+    if (bitCount <= 8) classifyColorRow(range, (const unsigned char*)palette, 1 << bitCount, table);
+
+    int count = 0;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = buffer + y * rowSize;
+        image->rowStart[y] = count;
+        if (bitCount == 32) {
+            classifyColorRow(range, row, width, mask);
+        } else if (bitCount == 24) {
+            for (int x = 0; x < width; x++) {
+                expanded[x * 4] = row[x * 3];
+                expanded[x * 4 + 1] = row[x * 3 + 1];
+                expanded[x * 4 + 2] = row[x * 3 + 2];
+            }
+            classifyColorRow(range, expanded, width, mask);
+        } else if (bitCount == 8) {
+            for (int x = 0; x < width; x++) mask[x] = table[row[x]];
+        } else if (bitCount == 4) {
+            for (int x = 0; x < width; x++) mask[x] = table[(x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4)];
+        } else {
+            for (int x = 0; x < width; x++) mask[x] = table[(row[x >> 3] >> (7 - (x & 7))) & 1];
+        }
+        count = appendMaskRuns(mask, width, image->runs, count);
+    }
+    image->rowStart[height] = count;
+    image->runCount = count;
+
+    if (expanded) arenaRelease(arena, expanded);
+    arenaRelease(arena, mask);
+    return TRUE;
+}
+
+// 在内存中的图像上按颜色范围查找物体，返回值与detectObjectsInBuffer相同
+int detectColorObjects(const unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                       const RGBQUAD* palette, const ColorRange* range, const DetectOptions* options,
+                       ObjectInfo* objects, int maxObjects, int* objectCount, ScratchArena* arena) {
+    *objectCount = 0;
+    if (!isSupportedBitCount(bitCount)) return 0;
+    RunImage runs;
+    if (!createRunImage(&runs, width, height, arena)) return -1;
+    int foundCount = -1;
+    if (colorToRuns(buffer, width, height, bitCount, rowSize, palette, range, &runs, arena)) {
+        foundCount = labelRunComponents(&runs, options, objects, NULL, maxObjects, objectCount, arena);
+    }
+    freeRunImage(&runs, arena);
+    return foundCount;
+}
+
+// 把图像转为24位并画出物体边界框，写入outputPath
+BOOL writeColorMarks(const char* outputPath, const BmpDescriptor* desc, const unsigned char* buffer,
+                     const RGBQUAD* palette, const ObjectInfo* objects, int objectCount, ScratchArena* arena) {
+    int outputRowSize = ((desc->width * 3 + 3) / 4) * 4;
+    unsigned char* output = (unsigned char*)arenaCalloc(arena, desc->height, outputRowSize);
+    if (!output) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int y = 0; y < desc->height; y++) {
+        expandRowToBgr(buffer + y * desc->rowSize, desc->width, desc->bitCount, palette, output + y * outputRowSize);
+    }
+    for (int i = 0; i < objectCount; i++) drawBox24(output, outputRowSize, objects[i].bbox, 0);
+
+    FILE* file = fopen(outputPath, "wb");
+    if (!file) {
+        arenaRelease(arena, output);
+        printf("无法创建输出文件: %s\n", outputPath);
+        return FALSE;
+    }
+    int written = writeBmpImage(file, &desc->infoHeader, 24, NULL, 0, output, outputRowSize, desc->width,
+                                desc->height, FALSE);
+    fclose(file);
+    arenaRelease(arena, output);
+    if (written < 0) printf("写入输出文件失败: %s\n", outputPath);
+    return written >= 0;
+}
+
+// 依次按颜色查找各文件中的物体，返回失败的文件数
+int RunColor(const ColorOptions* options, char** paths, int count) {
+    DetectOptions detectOptions;
+    initDetectOptions(&detectOptions);
+    detectOptions.minObjectSize = options->minObjectSize;
+    detectOptions.maxObjects = options->maxObjects;
+    ObjectInfo* objects = (ObjectInfo*)malloc(options->maxObjects * sizeof(ObjectInfo));
+    if (!objects) {
+        printf("内存分配失败！\n");
+        return count;
+    }
+    ScratchArena arena;
+    initScratchArena(&arena);
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        printf("[%d/%d] %s\n", i + 1, count, paths[i]);
+        FILE* file = fopen(paths[i], "rb");
+        if (!file) {
+            printf("无法打开输入文件: %s\n", paths[i]);
+            failures++;
+            continue;
+        }
+        BmpDescriptor desc;
+        RGBQUAD palette[256];
+        unsigned char* buffer = NULL;
+        if (readBmpHeader(file, &desc, palette)) {
+            buffer = (unsigned char*)arenaAlloc(&arena, desc.imageSize);
+            if (buffer && !readBmpPixelData(file, &desc, buffer)) {
+                printf("读取图像数据失败！\n");
+                buffer = NULL;
+            }
+        }
+        fclose(file);
+
+        int objectCount = 0;
+        int found = buffer ? detectColorObjects(buffer, desc.width, desc.height, desc.bitCount, desc.rowSize,
+                                                palette, &options->range, &detectOptions, objects,
+                                                options->maxObjects, &objectCount, &arena)
+                           : -1;
+        if (found < 0) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+            resetScratchArena(&arena);
+            continue;
+        }
+        for (int k = 0; k < objectCount; k++) {
+            const BoundingBox* bbox = &objects[k].bbox;
+            printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n",
+                   k + 1, bbox->minX, bbox->minY, bbox->maxX, bbox->maxY, objects[k].pixelCount);
+        }
+        printf("找到 %d 个物体\n", found);
+        if (options->markOutput) {
+            char outputPath[260];
+            makeOutputPath(outputPath, paths[i], "_color.bmp");
+            if (!writeColorMarks(outputPath, &desc, buffer, palette, objects, objectCount, &arena)) failures++;
+        }
+        resetScratchArena(&arena);
+    }
+
+    freeScratchArena(&arena);
+    free(objects);
+    return failures;
+}
+
+// 解析"a-b,c-d,e-f"形式的三个分量范围；HSV的H在0~359之间，可以下限大于上限，其余分量在0~255之间且下限不大于上限
+BOOL parseColorRange(const char* text, ColorSpace space, ColorRange* range) {
+    range->space = space;
+    if (sscanf(text, "%d-%d,%d-%d,%d-%d", &range->low[0], &range->high[0], &range->low[1], &range->high[1],
+               &range->low[2], &range->high[2]) != 6) {
+        return FALSE;
+    }
+    for (int i = 0; i < 3; i++) {
+        int limit = (space == COLOR_SPACE_HSV && i == 0) ? 359 : 255;
+        if (range->low[i] < 0 || range->high[i] > limit || range->high[i] < 0 || range->low[i] > limit) return FALSE;
+        if (range->low[i] > range->high[i] && !(space == COLOR_SPACE_HSV && i == 0)) return FALSE;
+    }
+    return TRUE;
+}
+
+// 解析color子命令的选项，*first为第一个文件参数的位置
+BOOL parseColorOptions(int argc, char* argv[], ColorOptions* options, int* first) {
+    options->range = colorPresets[0].range;
+    options->minObjectSize = 50;
+    options->maxObjects = 50;
+    options->markOutput = FALSE;
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--mark") == 0) {
+            options->markOutput = TRUE;
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc) return FALSE;
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--color") == 0) {
+            int preset = -1;
+            for (int k = 0; k < (int)(sizeof(colorPresets) / sizeof(colorPresets[0])); k++) {
+                if (strcmp(value, colorPresets[k].name) == 0) preset = k;
+            }
+            if (preset < 0) return FALSE;
+            options->range = colorPresets[preset].range;
+        } else if (strcmp(argv[i], "--hsv") == 0) {
+            if (!parseColorRange(value, COLOR_SPACE_HSV, &options->range)) return FALSE;
+        } else if (strcmp(argv[i], "--ycbcr") == 0) {
+            if (!parseColorRange(value, COLOR_SPACE_YCBCR, &options->range)) return FALSE;
+        } else if (strcmp(argv[i], "--min-size") == 0) {
+            options->minObjectSize = atoi(value);
+            if (options->minObjectSize < 1) return FALSE;
+        } else if (strcmp(argv[i], "--max-objects") == 0) {
+            options->maxObjects = atoi(value);
+            if (options->maxObjects < 1 || options->maxObjects > 100000) return FALSE;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 图像统计 ----
+// 命令行: bmp2gray stats [--threshold T] [--jobs N] [--hist] [--gray] <文件1> [文件2 ...]
+// 输出各通道和亮度的最小/最大值、均值、标准差，二值化值低于阈值的暗像素比例，以及按Otsu法求出的建议阈值，
+// 便于选择ConvertToBinary和CompareBinaryImages的阈值，而不必反复试运行。
+// 图像按行分给多个线程，各线程统计自己的部分直方图，最后合并；--gray时在灰度转换的同一遍扫描中统计（单线程）。
+
+#define STATS_MAX_WORKERS 64
+
+typedef struct {
+    int threshold;              // 暗像素的阈值：二值化值 < threshold
+    int jobs;
+    BOOL writeHistogram;        // 每个文件写出<文件>_hist.csv
+    BOOL fuseGray;              // 同时输出灰度图（_gray.bmp, _gray_cross.bmp）
+} StatsOptions;
+
+typedef struct {
+    unsigned char* buffer;
+    int width;
+    int bitCount;
+    int rowSize;
+    int firstRow;
+    int lastRow;
+    StatsPartial partial;
+} StatsWorkerArgs;
+
+typedef struct {
+    int minimum;
+    int maximum;
+    double mean;
+    double stddev;
+} ChannelSummary;
+
+DWORD WINAPI statsWorkerThread(LPVOID parameter) {
+    StatsWorkerArgs* args = (StatsWorkerArgs*)parameter;
+    accumulateStatsRows(args->buffer, args->width, args->bitCount, args->rowSize, args->firstRow, args->lastRow,
+                        &args->partial, FALSE);
+    return 0;
+}
+
+// 统计内存中的图像，jobs个线程各统计一段连续的行；内存不足或无法创建线程时返回FALSE
+BOOL computeImageStats(unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                       const RGBQUAD* palette, int jobs, ImageStats* stats) {
+    initImageStats(stats, bitCount);
+    jobs = max(1, min(jobs, height));
+    StatsWorkerArgs* args = (StatsWorkerArgs*)calloc(jobs, sizeof(StatsWorkerArgs));
+    HANDLE* workers = (HANDLE*)calloc(jobs, sizeof(HANDLE));
+    if (!args || !workers) {
+        free(args);
+        free(workers);
+        return FALSE;
+    }
+    BOOL ok = TRUE;
+    for (int i = 0; i < jobs; i++) {
+        args[i].buffer = buffer;
+        args[i].width = width;
+        args[i].bitCount = bitCount;
+        args[i].rowSize = rowSize;
+        args[i].firstRow = (int)((long long)height * i / jobs);
+        args[i].lastRow = (int)((long long)height * (i + 1) / jobs);
+        // 最后一段在当前线程中统计
+        if (i + 1 < jobs) {
+            workers[i] = CreateThread(NULL, 0, statsWorkerThread, &args[i], 0, NULL);
+            if (!workers[i]) ok = FALSE;
+        } else {
+            statsWorkerThread(&args[i]);
+        }
+    }
+    for (int i = 0; i < jobs; i++) {
+        if (workers[i]) {
+            WaitForSingleObject(workers[i], INFINITE);
+            CloseHandle(workers[i]);
+        }
+        if (ok) mergeStatsPartial(stats, &args[i].partial, palette);
+    }
+    free(args);
+    free(workers);
+    return ok;
+}
+
+// 由直方图计算最小/最大值、均值和标准差
+void summarizeHistogram(const long long* histogram, long long total, ChannelSummary* summary) {
+    memset(summary, 0, sizeof(ChannelSummary));
+    if (total <= 0) return;
+    summary->minimum = 255;
+    double sum = 0.0;
+    double sumSquares = 0.0;
+    for (int v = 0; v < 256; v++) {
+        if (histogram[v] == 0) continue;
+        summary->minimum = min(summary->minimum, v);
+        summary->maximum = v;
+        sum += (double)histogram[v] * v;
+        sumSquares += (double)histogram[v] * v * v;
+    }
+    summary->mean = sum / total;
+    summary->stddev = sqrt(max(sumSquares / total - summary->mean * summary->mean, 0.0));
+}
+
+// Otsu法：使两类（值 < T 与 值 >= T）类间方差最大的阈值T（1~255）
+// 多个阈值的方差相同时（如二值图中0与255之间的所有阈值）取其中点，只有一种值时返回128
+int otsuThreshold(const long long* histogram, long long total) {
+    double sum = 0.0;
+    for (int v = 0; v < 256; v++) sum += (double)histogram[v] * v;
+    double backgroundSum = 0.0;
+    long long background = 0;
+    double bestVariance = 0.0;
+    int best = 128;
+    int bestEnd = 128;
+    for (int v = 0; v < 255; v++) {
+        background += histogram[v];
+        backgroundSum += (double)histogram[v] * v;
+        long long foreground = total - background;
+        if (background == 0 || foreground == 0) continue;
+        double difference = backgroundSum / background - (sum - backgroundSum) / foreground;
+        double variance = (double)background * foreground * difference * difference;
+        if (variance > bestVariance) {
+            bestVariance = variance;
+            best = bestEnd = v + 1;
+        } else if (variance == bestVariance) {
+            bestEnd = v + 1;
+        }
+    }
+    return (best + bestEnd) / 2;
+}
+
+// 打印一张图像的统计结果
+void printImageStats(const char* path, int width, int height, const ImageStats* stats, int threshold) {
+    static const char* channelNames[STATS_CHANNELS] = { "R   ", "G   ", "B   ", "亮度" };
+    printf("%s: %dx%d %d位, %lld 像素\n", path, width, height, stats->bitCount, stats->pixelCount);
+    printf("  通道  最小  最大     平均    标准差\n");
+    for (int c = 0; c < STATS_CHANNELS; c++) {
+        ChannelSummary summary;
+        summarizeHistogram(stats->histogram[c], stats->pixelCount, &summary);
+        printf("  %s  %4d  %4d  %7.2f  %8.2f\n", channelNames[c], summary.minimum, summary.maximum,
+               summary.mean, summary.stddev);
+    }
+    const long long* values = thresholdHistogram(stats);
+    long long dark = 0;
+    for (int v = 0; v < threshold; v++) dark += values[v];
+    printf("  暗像素（二值化值 < %d）: %.2f%%, Otsu建议阈值: %d\n", threshold,
+           stats->pixelCount > 0 ? 100.0 * dark / stats->pixelCount : 0.0, otsuThreshold(values, stats->pixelCount));
+}
+
+// 写出直方图：每行为 值,R,G,B,亮度
+BOOL writeHistogramCsv(const char* outputPath, const ImageStats* stats) {
+    FILE* file = fopen(outputPath, "w");
+    if (!file) {
+        printf("无法创建输出文件: %s\n", outputPath);
+        return FALSE;
+    }
+    fprintf(file, "value,red,green,blue,luma\n");
+    for (int v = 0; v < 256; v++) {
+        fprintf(file, "%d,%lld,%lld,%lld,%lld\n", v, stats->histogram[0][v], stats->histogram[1][v],
+                stats->histogram[2][v], stats->histogram[STATS_LUMA][v]);
+    }
+    return fclose(file) == 0;
+}
+
+// 依次统计各文件，返回失败的文件数
+int RunStats(const StatsOptions* options, char** paths, int count) {
+    ScratchArena arena;
+    initScratchArena(&arena);
+    ImageStats* stats = (ImageStats*)malloc(sizeof(ImageStats));
+    if (!stats) {
+        printf("内存分配失败！\n");
+        return count;
+    }
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        BmpDescriptor desc;
+        BOOL ok = FALSE;
+        if (options->fuseGray) {
+            char grayPath[260];
+            char crossPath[260];
+            makeOutputPath(grayPath, paths[i], batchOutputSuffix(BATCH_GRAY, 0));
+            makeOutputPath(crossPath, paths[i], batchOutputSuffix(BATCH_GRAY, 1));
+            initImageStats(stats, 0);
+            ok = ProbeBmpFile(paths[i], &desc) == BMP_PROBE_OK &&
+                 ConvertToGrayScaleStats(paths[i], grayPath, crossPath, stats, &arena);
+        } else {
+            FILE* file = fopen(paths[i], "rb");
+            RGBQUAD palette[256];
+            if (!file) {
+                printf("无法打开输入文件: %s\n", paths[i]);
+            } else if (readBmpHeader(file, &desc, palette)) {
+                unsigned char* buffer = (unsigned char*)arenaAlloc(&arena, desc.imageSize);
+                if (!buffer) {
+                    printf("内存分配失败！\n");
+                } else if (!readBmpPixelData(file, &desc, buffer)) {
+                    printf("读取图像数据失败！\n");
+                } else {
+                    ok = computeImageStats(buffer, desc.width, desc.height, desc.bitCount, desc.rowSize, palette,
+                                           options->jobs, stats);
+                    if (!ok) printf("无法创建统计线程！\n");
+                }
+            }
+            if (file) fclose(file);
+        }
+        resetScratchArena(&arena);
+        if (!ok) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+            continue;
+        }
+
+        printImageStats(paths[i], desc.width, desc.height, stats, options->threshold);
+        if (options->writeHistogram) {
+            char outputPath[260];
+            makeOutputPath(outputPath, paths[i], "_hist.csv");
+            if (!writeHistogramCsv(outputPath, stats)) failures++;
+        }
+    }
+
+    free(stats);
+    freeScratchArena(&arena);
+    return failures;
+}
+
+// 解析stats子命令的选项，*first为第一个文件参数的位置
+BOOL parseStatsOptions(int argc, char* argv[], StatsOptions* options, int* first) {
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    options->threshold = 128;
+    options->jobs = min(max((int)systemInfo.dwNumberOfProcessors, 1), STATS_MAX_WORKERS);
+    options->writeHistogram = FALSE;
+    options->fuseGray = FALSE;
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--hist") == 0) {
+            options->writeHistogram = TRUE;
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--gray") == 0) {
+            options->fuseGray = TRUE;
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc) return FALSE;
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--threshold") == 0) {
+            options->threshold = atoi(value);
+            if (options->threshold < 1 || options->threshold > 255) return FALSE;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            options->jobs = atoi(value);
+            if (options->jobs < 1 || options->jobs > STATS_MAX_WORKERS) return FALSE;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 几何变换 ----
+// 命令行: bmp2gray transform [--rotate 90|180|270] [--flip h|v] [--resize 宽x高] [--filter nearest|bilinear|area]
+//                            [--chain gray,binary,mark] <文件1> [文件2 ...]
+// 旋转、翻转和缩放按命令行中的顺序在内存中依次执行，结果可以直接接灰度、二值化和物体标记，不生成中间文件。
+// 自上而下的图像（biHeight为负）先按显示方向改为自下而上的行顺序，因此旋转和翻转都以显示方向为准，
+// 方向不同的输入在变换后得到相同的物体坐标。
+// 旋转和nearest缩放保持原位深度；bilinear和area缩放按BGR插值，输出24位（area只用于缩小，放大时按bilinear处理）。
+#define TRANSFORM_MAX_STEPS 8
+#define TRANSFORM_TILE 32                   // 旋转时分块转置的块边长（像素）
+
+typedef enum {
+    TRANSFORM_ROTATE,
+    TRANSFORM_FLIP_HORIZONTAL,
+    TRANSFORM_FLIP_VERTICAL,
+    TRANSFORM_RESIZE
+} TransformType;
+
+typedef enum {
+    RESIZE_NEAREST,
+    RESIZE_BILINEAR,
+    RESIZE_AREA
+} ResizeFilter;
+
+typedef struct {
+    TransformType type;
+    int quarterTurns;                       // 旋转：顺时针的四分之一圈数（1~3）
+    int width;                              // 缩放：目标尺寸，一边为0时按宽高比计算
+    int height;
+} TransformStep;
+
+typedef struct {
+    TransformStep steps[TRANSFORM_MAX_STEPS];
+    int stepCount;
+    ResizeFilter filter;
+    BatchOperation chain[WATCH_MAX_CHAIN];
+    int chainLength;
+} TransformOptions;
+
+// 顺时针旋转quarterTurns个四分之一圈（行自下而上，坐标以显示方向为准）
+// 按TRANSFORM_TILE见方的块处理：块内读写的源行和目标行都只有TRANSFORM_TILE行，
+// 转置时不会每写一个像素就换一个缓存行
+BMP_FORCEINLINE void rotateImageGeneric(const unsigned char* source, int width, int height, int sourceRowSize,
+                                        unsigned char* target, int targetRowSize, int quarterTurns, int bits) {
+    for (int tileY = 0; tileY < height; tileY += TRANSFORM_TILE) {
+        int endY = min(tileY + TRANSFORM_TILE, height);
+        for (int tileX = 0; tileX < width; tileX += TRANSFORM_TILE) {
+            int endX = min(tileX + TRANSFORM_TILE, width);
+            for (int y = tileY; y < endY; y++) {
+                const unsigned char* row = source + y * sourceRowSize;
+                for (int x = tileX; x < endX; x++) {
+                    if (quarterTurns == 1) {
+                        pfCopy(target + (width - 1 - x) * targetRowSize, y, row, x, bits);
+                    } else if (quarterTurns == 2) {
+                        pfCopy(target + (height - 1 - y) * targetRowSize, width - 1 - x, row, x, bits);
+                    } else {
+                        pfCopy(target + x * targetRowSize, height - 1 - y, row, x, bits);
+                    }
+                }
+            }
+        }
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(rotateImage,
+                              (const unsigned char* source, int width, int height, int sourceRowSize,
+                               unsigned char* target, int targetRowSize, int quarterTurns),
+                              source, width, height, sourceRowSize, target, targetRowSize, quarterTurns)
+
+// 左右翻转每一行
+BMP_FORCEINLINE void flipRowsGeneric(const unsigned char* source, int width, int height, int rowSize,
+                                     unsigned char* target, int bits) {
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = source + y * rowSize;
+        unsigned char* out = target + y * rowSize;
+        for (int x = 0; x < width; x++) pfCopy(out, width - 1 - x, row, x, bits);
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(flipRows,
+                              (const unsigned char* source, int width, int height, int rowSize, unsigned char* target),
+                              source, width, height, rowSize, target)
+
+// 最近邻缩放：columns[x]和rows[y]为目标像素对应的源像素
+BMP_FORCEINLINE void resizeNearestGeneric(const unsigned char* source, int sourceRowSize, const int* columns,
+                                          const int* rows, int targetWidth, int targetHeight,
+                                          unsigned char* target, int targetRowSize, int bits) {
+    for (int y = 0; y < targetHeight; y++) {
+        const unsigned char* row = source + rows[y] * sourceRowSize;
+        unsigned char* out = target + y * targetRowSize;
+        for (int x = 0; x < targetWidth; x++) pfCopy(out, x, row, columns[x], bits);
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(resizeNearest,
+                              (const unsigned char* source, int sourceRowSize, const int* columns, const int* rows,
+                               int targetWidth, int targetHeight, unsigned char* target, int targetRowSize),
+                              source, sourceRowSize, columns, rows, targetWidth, targetHeight, target, targetRowSize)
+
+// 用新的像素数据替换图像（行自下而上），并更新尺寸、位深度和信息头
+void replaceImagePixels(WatchImage* image, unsigned char* pixels, int width, int height, int bitCount) {
+    image->pixels = pixels;
+    image->bitCount = bitCount;
+    image->rowSize = ((width * bitCount + 31) / 32) * 4;
+    if (bitCount > 8) image->paletteCount = 0;
+    image->desc.width = width;
+    image->desc.height = height;
+    image->desc.bitCount = bitCount;
+    image->desc.rowSize = image->rowSize;
+    image->desc.imageSize = image->rowSize * height;
+    image->desc.topDown = FALSE;
+    image->desc.infoHeader.biWidth = width;
+    image->desc.infoHeader.biHeight = height;
+}
+
+// 自上而下的图像改为自下而上的行顺序
+BOOL uprightImage(WatchImage* image, ScratchArena* arena) {
+    if (!image->desc.topDown) return TRUE;
+    int height = image->desc.height;
+    unsigned char* pixels = (unsigned char*)arenaAlloc(arena, image->desc.imageSize);
+    if (!pixels) return FALSE;
+    copyRowsReversed(image->pixels, pixels, image->rowSize, height);
+    replaceImagePixels(image, pixels, image->desc.width, height, image->bitCount);
+    return TRUE;
+}
+
+// 目标像素中心对应的源坐标：bilinear取两侧的源像素和权重，nearest取所在的源像素
+void buildBilinearTaps(int sourceSize, int targetSize, int* first, float* weights) {
+    double scale = (double)sourceSize / targetSize;
+    for (int i = 0; i < targetSize; i++) {
+        double position = (i + 0.5) * scale - 0.5;
+        if (position < 0.0) position = 0.0;
+        first[i] = min((int)position, sourceSize - 1);
+        weights[i] = (float)(position - first[i]);
+    }
+}
+
+// 水平方向bilinear插值一行BGR像素，out[i*3+c]为浮点值
+void interpolateBgrRow(const unsigned char* bgr, int sourceWidth, const int* first, const float* weights,
+                       int targetWidth, float* out) {
+    for (int i = 0; i < targetWidth; i++) {
+        const unsigned char* left = bgr + first[i] * 3;
+        const unsigned char* right = bgr + min(first[i] + 1, sourceWidth - 1) * 3;
+        float weight = weights[i];
+        out[i * 3] = left[0] + (right[0] - left[0]) * weight;
+        out[i * 3 + 1] = left[1] + (right[1] - left[1]) * weight;
+        out[i * 3 + 2] = left[2] + (right[2] - left[2]) * weight;
+    }
+}
+
+// bilinear或area缩放为24位：逐行展开为BGR，水平方向插值或面积求和，垂直方向用SSE2混合两行或累加
+BOOL resizeToBgr(WatchImage* image, int targetWidth, int targetHeight, ResizeFilter filter, ScratchArena* arena) {
+    int width = image->desc.width;
+    int height = image->desc.height;
+    int channels = targetWidth * 3;
+    int targetRowSize = ((targetWidth * 24 + 31) / 32) * 4;
+    BOOL area = filter == RESIZE_AREA && targetWidth <= width && targetHeight <= height;
+    unsigned char* target = (unsigned char*)arenaCalloc(arena, targetHeight, targetRowSize);
+    unsigned char* bgr = (unsigned char*)arenaAlloc(arena, (size_t)width * 3);
+    float* rowsBuffer = (float*)arenaAlloc(arena, 3 * (size_t)channels * sizeof(float));
+    int* columns = (int*)arenaAlloc(arena, max(targetWidth, targetHeight) * sizeof(int));
+    float* weights = (float*)arenaAlloc(arena, max(targetWidth, targetHeight) * sizeof(float));
+    AreaSpan* spans = (AreaSpan*)arenaAlloc(arena, targetWidth * sizeof(AreaSpan));
+    if (!target || !bgr || !rowsBuffer || !columns || !weights || !spans) return FALSE;
+    float* accumulator = rowsBuffer + 2 * channels;
+
+    if (area) {
+        // 与拼图总览相同：一个源行最多跨过一个输出行的边界
+        float* sums = rowsBuffer;
+        buildAreaSpans(spans, width, targetWidth);
+        double rowScale = (double)height / targetHeight;
+        float normalize = (float)(1.0 / (((double)width / targetWidth) * rowScale));
+        double boundary = rowScale;
+        int row = 0;
+        memset(accumulator, 0, channels * sizeof(float));
+        for (int y = 0; y < height && row < targetHeight; y++) {
+            expandRowToBgr(image->pixels + y * image->rowSize, width, image->bitCount, image->palette, bgr);
+            sumAreaSpans(bgr, spans, targetWidth, sums);
+            if (row + 1 == targetHeight) boundary = height;
+            if (y + 1 < boundary) {
+                accumulateAreaRow(accumulator, sums, 1.0f, channels);
+                continue;
+            }
+            float inside = (float)(boundary - y);
+            accumulateAreaRow(accumulator, sums, inside, channels);
+            emitAreaRow(accumulator, normalize, target + (size_t)row * targetRowSize, channels);
+            memset(accumulator, 0, channels * sizeof(float));
+            if (inside < 1.0f) accumulateAreaRow(accumulator, sums, 1.0f - inside, channels);
+            row++;
+            boundary = (row + 1) * rowScale;
+        }
+    } else {
+        // 水平插值后的源行按行号缓存两行，相邻的目标行大多共用同一对源行
+        int* rowFirst = (int*)arenaAlloc(arena, targetHeight * sizeof(int));
+        float* rowWeights = (float*)arenaAlloc(arena, targetHeight * sizeof(float));
+        if (!rowFirst || !rowWeights) return FALSE;
+        buildBilinearTaps(width, targetWidth, columns, weights);
+        buildBilinearTaps(height, targetHeight, rowFirst, rowWeights);
+        float* lines[2] = { rowsBuffer, rowsBuffer + channels };
+        int cached[2] = { -1, -1 };
+        for (int y = 0; y < targetHeight; y++) {
+            int sourceRows[2] = { rowFirst[y], min(rowFirst[y] + 1, height - 1) };
+            if (cached[0] != sourceRows[0] && cached[1] == sourceRows[0]) {
+                float* line = lines[0];
+                lines[0] = lines[1];
+                lines[1] = line;
+                cached[0] = cached[1];
+                cached[1] = -1;
+            }
+            for (int k = 0; k < 2; k++) {
+                if (cached[k] == sourceRows[k]) continue;
+                expandRowToBgr(image->pixels + sourceRows[k] * image->rowSize, width, image->bitCount,
+                               image->palette, bgr);
+                interpolateBgrRow(bgr, width, columns, weights, targetWidth, lines[k]);
+                cached[k] = sourceRows[k];
+            }
+            memset(accumulator, 0, channels * sizeof(float));
+            accumulateAreaRow(accumulator, lines[0], 1.0f - rowWeights[y], channels);
+            accumulateAreaRow(accumulator, lines[1], rowWeights[y], channels);
+            emitAreaRow(accumulator, 1.0f, target + (size_t)y * targetRowSize, channels);
+        }
+    }
+    replaceImagePixels(image, target, targetWidth, targetHeight, 24);
+    return TRUE;
+}
+
+// 执行一步变换，内存不足时返回FALSE
+BOOL applyTransformStep(WatchImage* image, const TransformStep* step, ResizeFilter filter, ScratchArena* arena) {
+    int width = image->desc.width;
+    int height = image->desc.height;
+    int bitCount = image->bitCount;
+    if (step->type == TRANSFORM_RESIZE) {
+        // 一边为0时按宽高比计算
+        int targetWidth = step->width;
+        int targetHeight = step->height;
+        if (targetWidth == 0) targetWidth = max(1, (int)((double)width * targetHeight / height + 0.5));
+        if (targetHeight == 0) targetHeight = max(1, (int)((double)height * targetWidth / width + 0.5));
+        if (filter != RESIZE_NEAREST) return resizeToBgr(image, targetWidth, targetHeight, filter, arena);
+        int targetRowSize = ((targetWidth * bitCount + 31) / 32) * 4;
+        unsigned char* target = (unsigned char*)arenaCalloc(arena, targetHeight, targetRowSize);
+        int* columns = (int*)arenaAlloc(arena, targetWidth * sizeof(int));
+        int* rows = (int*)arenaAlloc(arena, targetHeight * sizeof(int));
+        if (!target || !columns || !rows) return FALSE;
+        for (int x = 0; x < targetWidth; x++) columns[x] = min((int)((x + 0.5) * width / targetWidth), width - 1);
+        for (int y = 0; y < targetHeight; y++) rows[y] = min((int)((y + 0.5) * height / targetHeight), height - 1);
+        SELECT_PIXEL_KERNEL(resizeNearest, bitCount)(image->pixels, image->rowSize, columns, rows, targetWidth,
+                                                     targetHeight, target, targetRowSize);
+        replaceImagePixels(image, target, targetWidth, targetHeight, bitCount);
+        return TRUE;
+    }
+
+    BOOL swap = step->type == TRANSFORM_ROTATE && (step->quarterTurns & 1);
+    int targetWidth = swap ? height : width;
+    int targetHeight = swap ? width : height;
+    int targetRowSize = ((targetWidth * bitCount + 31) / 32) * 4;
+    unsigned char* target = (unsigned char*)arenaCalloc(arena, targetHeight, targetRowSize);
+    if (!target) return FALSE;
+    if (step->type == TRANSFORM_ROTATE) {
+        SELECT_PIXEL_KERNEL(rotateImage, bitCount)(image->pixels, width, height, image->rowSize, target,
+                                                   targetRowSize, step->quarterTurns);
+    } else if (step->type == TRANSFORM_FLIP_HORIZONTAL) {
+        SELECT_PIXEL_KERNEL(flipRows, bitCount)(image->pixels, width, height, image->rowSize, target);
+    } else {
+        for (int y = 0; y < height; y++) {
+            memcpy(target + (height - 1 - y) * targetRowSize, image->pixels + y * image->rowSize, targetRowSize);
+        }
+    }
+    replaceImagePixels(image, target, targetWidth, targetHeight, bitCount);
+    return TRUE;
+}
+
+// 变换一个文件，再按操作链处理，写出最后的结果（没有操作链时为_transformed.bmp）
+BOOL transformFile(const TransformOptions* options, const char* path, ScratchArena* arena) {
+    WatchImage image;
+    if (!loadWatchImage(path, &image, arena)) return FALSE;
+    int sourceWidth = image.desc.width;
+    int sourceHeight = image.desc.height;
+    if (!uprightImage(&image, arena)) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int i = 0; i < options->stepCount; i++) {
+        if (!applyTransformStep(&image, &options->steps[i], options->filter, arena)) {
+            printf("内存分配失败！\n");
+            return FALSE;
+        }
+    }
+    printf("%dx%d -> %dx%d %d位\n", sourceWidth, sourceHeight, image.desc.width, image.desc.height, image.bitCount);
+
+    int width = image.desc.width;
+    int height = image.desc.height;
+    const char* suffix = "_transformed.bmp";
+    for (int step = 0; step < options->chainLength; step++) {
+        BatchOperation operation = options->chain[step];
+        suffix = batchOutputSuffix(operation, 0);
+        if (operation == BATCH_GRAY) {
+            grayPaletteEntries(image.palette, image.paletteCount);
+            grayPixelRows(image.pixels, width, height, image.bitCount, image.rowSize);
+        } else if (operation == BATCH_BINARY) {
+            binarizeImageBuffer(image.pixels, image.palette, width, height, image.bitCount, image.rowSize,
+                                BATCH_BINARY_THRESHOLD);
+        } else {
+            DetectOptions detectOptions;
+            initDetectOptions(&detectOptions);
+            unsigned char* labelBuffer = canonicalizeLabelBuffer(image.pixels, image.palette, image.bitCount,
+                                                                 image.rowSize, height, arena);
+            ObjectInfo* objects = (ObjectInfo*)arenaAlloc(arena, detectOptions.maxObjects * sizeof(ObjectInfo));
+            int objectCount = 0;
+            int found = (labelBuffer && objects) ?
+                detectObjectsWithOptions(labelBuffer, width, height, image.bitCount, image.rowSize, &detectOptions,
+                                         NULL, objects, detectOptions.maxObjects, &objectCount, arena) : -1;
+            if (found < 0 || drawObjectMarks(image.pixels, image.palette, &image.paletteCount, width, height,
+                                             image.bitCount, image.rowSize, objects, objectCount, &image.pixels,
+                                             &image.bitCount, &image.rowSize, arena) < 0) {
+                printf("内存分配失败！\n");
+                return FALSE;
+            }
+            for (int k = 0; k < objectCount; k++) {
+                const BoundingBox* bbox = &objects[k].bbox;
+                printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n",
+                       k + 1, bbox->minX, bbox->minY, bbox->maxX, bbox->maxY, objects[k].pixelCount);
+            }
+            printf("找到 %d 个物体\n", found);
+        }
+    }
+
+    char outputPath[260];
+    makeOutputPath(outputPath, path, suffix);
+    return writeWatchImage(outputPath, &image, FALSE);
+}
+
+// 依次变换各文件，返回失败的文件数
+int RunTransform(const TransformOptions* options, char** paths, int count) {
+    ScratchArena arena;
+    initScratchArena(&arena);
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        printf("[%d/%d] %s\n", i + 1, count, paths[i]);
+        if (!transformFile(options, paths[i], &arena)) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+        }
+        resetScratchArena(&arena);
+    }
+    freeScratchArena(&arena);
+    return failures;
+}
+
+// 解析transform子命令的选项，*first为第一个文件参数的位置
+BOOL parseTransformOptions(int argc, char* argv[], TransformOptions* options, int* first) {
+    options->stepCount = 0;
+    options->filter = RESIZE_BILINEAR;
+    options->chainLength = 0;
+    int i = 0;
+    while (i + 1 < argc && strncmp(argv[i], "--", 2) == 0) {
+        const char* value = argv[i + 1];
+        TransformStep* step = &options->steps[options->stepCount];
+        BOOL isStep = strcmp(argv[i], "--rotate") == 0 || strcmp(argv[i], "--flip") == 0 ||
+                      strcmp(argv[i], "--resize") == 0;
+        if (isStep && options->stepCount == TRANSFORM_MAX_STEPS) return FALSE;
+        if (strcmp(argv[i], "--rotate") == 0) {
+            int degrees = atoi(value);
+            if (degrees != 90 && degrees != 180 && degrees != 270) return FALSE;
+            step->type = TRANSFORM_ROTATE;
+            step->quarterTurns = degrees / 90;
+        } else if (strcmp(argv[i], "--flip") == 0) {
+            if (strcmp(value, "h") == 0) {
+                step->type = TRANSFORM_FLIP_HORIZONTAL;
+            } else if (strcmp(value, "v") == 0) {
+                step->type = TRANSFORM_FLIP_VERTICAL;
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--resize") == 0) {
+            step->type = TRANSFORM_RESIZE;
+            if (sscanf(value, "%dx%d", &step->width, &step->height) != 2 || step->width < 0 || step->height < 0 ||
+                step->width > 65536 || step->height > 65536 || (step->width == 0 && step->height == 0)) {
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--filter") == 0) {
+            if (strcmp(value, "nearest") == 0) {
+                options->filter = RESIZE_NEAREST;
+            } else if (strcmp(value, "bilinear") == 0) {
+                options->filter = RESIZE_BILINEAR;
+            } else if (strcmp(value, "area") == 0) {
+                options->filter = RESIZE_AREA;
+            } else {
+                return FALSE;
+            }
+        } else if (strcmp(argv[i], "--chain") == 0) {
+            char buffer[128];
+            strncpy(buffer, value, sizeof(buffer) - 1);
+            buffer[sizeof(buffer) - 1] = '\0';
+            options->chainLength = 0;
+            for (char* token = strtok(buffer, ","); token; token = strtok(NULL, ",")) {
+                BatchOperation operation = parseBatchOperation(token);
+                // compare需要两张图像，不能接在变换后面
+                if (operation == BATCH_INVALID || operation == BATCH_COMPARE ||
+                    options->chainLength == WATCH_MAX_CHAIN) {
+                    return FALSE;
+                }
+                options->chain[options->chainLength++] = operation;
+            }
+            if (options->chainLength == 0) return FALSE;
+        } else {
+            return FALSE;
+        }
+        if (isStep) options->stepCount++;
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 滤波 ----
+// 命令行: bmp2gray filter [--box R] [--gauss SIGMA] [--sobel] [--scharr] [--threshold T] [--chain binary,mark]
+//                         <文件1> [文件2 ...]
+// 在灰度图（与gray的结果相同，8位）上按命令行顺序执行滤波，结果可以直接在内存中二值化并标记物体。
+// 盒式模糊先逐行求滑动和，再按列条累加，耗时与半径无关；高斯模糊按整数权重分两遍卷积，行方向用SSE2
+// 同时处理8个像素，列方向按FILTER_STRIP宽的列条逐行累加，参与一行的2R+1个源行都留在缓存中。
+// Sobel/Scharr输出梯度幅值（|Gx|+|Gy|，阶跃边缘为255）取反后的图像：边缘为黑色，与物体的约定一致。
+#define FILTER_MAX_STEPS 8
+#define FILTER_MAX_BOX_RADIUS 127           // 行方向的滑动和按16位保存
+#define FILTER_MAX_GAUSS_RADIUS 60
+#define FILTER_WEIGHT_BITS 12               // 高斯权重之和为1<<12
+#define FILTER_STRIP 256                    // 列方向处理的列条宽度（像素）
+
+typedef enum {
+    FILTER_BOX,
+    FILTER_GAUSS,
+    FILTER_SOBEL,
+    FILTER_SCHARR
+} FilterType;
+
+typedef struct {
+    FilterType type;
+    int radius;                             // 盒式模糊的半径
+    double sigma;                           // 高斯模糊的标准差
+} FilterStep;
+
+typedef struct {
+    FilterStep steps[FILTER_MAX_STEPS];
+    int stepCount;
+    int threshold;
+    BatchOperation chain[WATCH_MAX_CHAIN];
+    int chainLength;
+} FilterOptions;
+
+// 8位灰度平面：每行width个像素，行宽rowSize按4字节对齐，可以直接作为8位BMP的像素数据
+typedef struct {
+    unsigned char* pixels;
+    int width;
+    int height;
+    int rowSize;
+} GrayPlane;
+
+BOOL allocGrayPlane(GrayPlane* plane, int width, int height, ScratchArena* arena) {
+    plane->width = width;
+    plane->height = height;
+    plane->rowSize = ((width + 3) / 4) * 4;
+    plane->pixels = (unsigned char*)arenaCalloc(arena, height, plane->rowSize);
+    return plane->pixels != NULL;
+}
+
+// 一行像素转为灰度：24/32位按加权公式，索引格式按调色板查表（与gray的结果相同）
+BMP_FORCEINLINE void extractGrayRowGeneric(const unsigned char* row, int width, const unsigned char* paletteGray,
+                                           unsigned char* out, int bits) {
+    for (int x = 0; x < width; x++) {
+        switch (bits) {
+        case 1:  out[x] = paletteGray[(row[x >> 3] >> (7 - (x & 7))) & 1]; break;
+        case 4:  out[x] = paletteGray[(x & 1) ? (row[x >> 1] & 0x0F) : (row[x >> 1] >> 4)]; break;
+        case 8:  out[x] = paletteGray[row[x]]; break;
+        case 24: out[x] = rgbToGray(row[x * 3 + 2], row[x * 3 + 1], row[x * 3]); break;
+        default: out[x] = rgbToGray(row[x * 4 + 2], row[x * 4 + 1], row[x * 4]); break;
+        }
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(extractGrayRow,
+                              (const unsigned char* row, int width, const unsigned char* paletteGray,
+                               unsigned char* out),
+                              row, width, paletteGray, out)
+
+BOOL extractGrayPlane(const WatchImage* image, GrayPlane* plane, ScratchArena* arena) {
+    if (!allocGrayPlane(plane, image->desc.width, image->desc.height, arena)) return FALSE;
+    unsigned char paletteGray[256];
+    for (int i = 0; i < image->paletteCount; i++) paletteGray[i] = paletteEntryGray(&image->palette[i]);
+    for (int y = 0; y < plane->height; y++) {
+        SELECT_PIXEL_KERNEL(extractGrayRow, image->bitCount)(image->pixels + y * image->rowSize, plane->width,
+                                                             paletteGray, plane->pixels + y * plane->rowSize);
+    }
+    return TRUE;
+}
+
+// 行号越界时取最近的边缘行（边缘像素向外复制）
+BMP_FORCEINLINE int clampRow(int y, int height) {
+    return (y < 0) ? 0 : (y >= height) ? height - 1 : y;
+}
+
+// 一行左右各复制radius个边缘像素，padded至少width + 2 * radius + 16字节（SIMD读取时越过末尾）
+void padGrayRow(const unsigned char* row, int width, int radius, unsigned char* padded) {
+    memset(padded, row[0], radius);
+    memcpy(padded + radius, row, width);
+    memset(padded + radius + width, row[width - 1], radius + 16);
+}
+
+// 盒式模糊：结果为(2R+1)x(2R+1)窗口之和除以像素数后四舍五入
+BOOL boxBlurPlane(const GrayPlane* source, int radius, GrayPlane* target, ScratchArena* arena) {
+    int width = source->width;
+    int height = source->height;
+    int diameter = 2 * radius + 1;
+    unsigned short* rowSums = (unsigned short*)arenaAlloc(arena, (size_t)width * height * sizeof(unsigned short));
+    unsigned char* padded = (unsigned char*)arenaAlloc(arena, width + 2 * radius + 16);
+    int* columnSums = (int*)arenaAlloc(arena, FILTER_STRIP * sizeof(int));
+    if (!rowSums || !padded || !columnSums || !allocGrayPlane(target, width, height, arena)) return FALSE;
+
+    // 行方向：滑动和，每个像素一次加法和一次减法
+    for (int y = 0; y < height; y++) {
+        padGrayRow(source->pixels + y * source->rowSize, width, radius, padded);
+        unsigned short* out = rowSums + (size_t)y * width;
+        int sum = 0;
+        for (int k = 0; k < diameter; k++) sum += padded[k];
+        for (int x = 0; x < width; x++) {
+            out[x] = (unsigned short)sum;
+            sum += padded[x + diameter] - padded[x];
+        }
+    }
+
+    // 列方向：按列条逐行更新每列的滑动和；除法用双精度（正确舍入，整数商不会偏差）
+    int area = diameter * diameter;
+    for (int stripX = 0; stripX < width; stripX += FILTER_STRIP) {
+        int count = min(FILTER_STRIP, width - stripX);
+        memset(columnSums, 0, count * sizeof(int));
+        for (int k = -radius; k <= radius; k++) {
+            const unsigned short* row = rowSums + (size_t)clampRow(k, height) * width + stripX;
+            for (int i = 0; i < count; i++) columnSums[i] += row[i];
+        }
+        for (int y = 0; y < height; y++) {
+            unsigned char* out = target->pixels + y * target->rowSize + stripX;
+            const unsigned short* enter = rowSums + (size_t)clampRow(y + radius + 1, height) * width + stripX;
+            const unsigned short* leave = rowSums + (size_t)clampRow(y - radius, height) * width + stripX;
+            int i = 0;
+#ifdef BMP_USE_SSE2
+            __m128i zero = _mm_setzero_si128();
+            __m128i half = _mm_set1_epi32(area / 2);
+            __m128d divisor = _mm_set1_pd((double)area);
+            for (; i + 8 <= count; i += 8) {
+                __m128i sumLow = _mm_loadu_si128((const __m128i*)(columnSums + i));
+                __m128i sumHigh = _mm_loadu_si128((const __m128i*)(columnSums + i + 4));
+                __m128i values[2] = { _mm_add_epi32(sumLow, half), _mm_add_epi32(sumHigh, half) };
+                __m128i quotients[2];
+                for (int h = 0; h < 2; h++) {
+                    __m128d low = _mm_div_pd(_mm_cvtepi32_pd(values[h]), divisor);
+                    __m128d high = _mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(values[h], _MM_SHUFFLE(3, 2, 3, 2))),
+                                              divisor);
+                    quotients[h] = _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+                }
+                __m128i packed = _mm_packs_epi32(quotients[0], quotients[1]);
+                _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(packed, packed));
+
+                __m128i entering = _mm_loadu_si128((const __m128i*)(enter + i));
+                __m128i leaving = _mm_loadu_si128((const __m128i*)(leave + i));
+                sumLow = _mm_sub_epi32(_mm_add_epi32(sumLow, _mm_unpacklo_epi16(entering, zero)),
+                                       _mm_unpacklo_epi16(leaving, zero));
+                sumHigh = _mm_sub_epi32(_mm_add_epi32(sumHigh, _mm_unpackhi_epi16(entering, zero)),
+                                        _mm_unpackhi_epi16(leaving, zero));
+                _mm_storeu_si128((__m128i*)(columnSums + i), sumLow);
+                _mm_storeu_si128((__m128i*)(columnSums + i + 4), sumHigh);
+            }
+#endif
+            for (; i < count; i++) {
+                out[i] = (unsigned char)((columnSums[i] + area / 2) / area);
+                columnSums[i] += enter[i] - leave[i];
+            }
+        }
+    }
+    return TRUE;
+}
+
+// 高斯权重：半径取3σ，量化为和为1<<FILTER_WEIGHT_BITS的整数（舍入误差计入中心权重），返回半径
+int buildGaussWeights(double sigma, short* weights) {
+    int radius = min(max(1, (int)ceil(3.0 * sigma)), FILTER_MAX_GAUSS_RADIUS);
+    double values[2 * FILTER_MAX_GAUSS_RADIUS + 1];
+    double total = 0.0;
+    for (int k = -radius; k <= radius; k++) {
+        values[k + radius] = exp(-(double)(k * k) / (2.0 * sigma * sigma));
+        total += values[k + radius];
+    }
+    int sum = 0;
+    for (int k = 0; k <= 2 * radius; k++) {
+        weights[k] = (short)(values[k] / total * (1 << FILTER_WEIGHT_BITS) + 0.5);
+        sum += weights[k];
+    }
+    weights[radius] += (short)((1 << FILTER_WEIGHT_BITS) - sum);
+    return radius;
+}
+
+// 高斯模糊：行方向结果保留5位小数（<= 255*128，可按有符号16位做乘加），列方向再卷积后四舍五入
+BOOL gaussBlurPlane(const GrayPlane* source, double sigma, GrayPlane* target, ScratchArena* arena) {
+    int width = source->width;
+    int height = source->height;
+    short weights[2 * FILTER_MAX_GAUSS_RADIUS + 2];
+    int radius = buildGaussWeights(sigma, weights);
+    int taps = 2 * radius + 1;
+    weights[taps] = 0;                      // 按两个抽头一组处理时补齐
+    const int rowShift = FILTER_WEIGHT_BITS - 7;
+    const int columnShift = FILTER_WEIGHT_BITS + 7;
+    short* rows = (short*)arenaAlloc(arena, (size_t)width * height * sizeof(short));
+    unsigned char* padded = (unsigned char*)arenaAlloc(arena, width + 2 * radius + 16);
+    const short** sourceRows = (const short**)arenaAlloc(arena, (taps + 1) * sizeof(short*));
+    if (!rows || !padded || !sourceRows || !allocGrayPlane(target, width, height, arena)) return FALSE;
+
+    // 行方向：每次8个像素，相邻两个抽头的像素交错后用_mm_madd_epi16同时乘加
+    for (int y = 0; y < height; y++) {
+        padGrayRow(source->pixels + y * source->rowSize, width, radius, padded);
+        short* out = rows + (size_t)y * width;
+        int x = 0;
+#ifdef BMP_USE_SSE2
+        __m128i zero = _mm_setzero_si128();
+        __m128i rounding = _mm_set1_epi32(1 << (rowShift - 1));
+        for (; x + 8 <= width; x += 8) {
+            __m128i low = rounding, high = rounding;
+            for (int k = 0; k < taps; k += 2) {
+                __m128i first = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded + x + k)), zero);
+                __m128i second = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded + x + k + 1)), zero);
+                __m128i pair = _mm_set1_epi32((int)(((unsigned)(unsigned short)weights[k + 1] << 16) |
+                                                    (unsigned short)weights[k]));
+                low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(first, second), pair));
+                high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(first, second), pair));
+            }
+            __m128i packed = _mm_packs_epi32(_mm_srai_epi32(low, rowShift), _mm_srai_epi32(high, rowShift));
+            _mm_storeu_si128((__m128i*)(out + x), packed);
+        }
+#endif
+        for (; x < width; x++) {
+            int sum = 1 << (rowShift - 1);
+            for (int k = 0; k < taps; k++) sum += weights[k] * padded[x + k];
+            out[x] = (short)(sum >> rowShift);
+        }
+    }
+
+    // 列方向：按列条处理，一个输出行的2R+1个源行在列条内都在缓存中
+    for (int stripX = 0; stripX < width; stripX += FILTER_STRIP) {
+        int stripEnd = min(stripX + FILTER_STRIP, width);
+        for (int y = 0; y < height; y++) {
+            for (int k = 0; k < taps; k++) sourceRows[k] = rows + (size_t)clampRow(y - radius + k, height) * width;
+            sourceRows[taps] = sourceRows[taps - 1];
+            unsigned char* out = target->pixels + y * target->rowSize;
+            int x = stripX;
+#ifdef BMP_USE_SSE2
+            __m128i rounding = _mm_set1_epi32(1 << (columnShift - 1));
+            for (; x + 8 <= stripEnd; x += 8) {
+                __m128i low = rounding, high = rounding;
+                for (int k = 0; k < taps; k += 2) {
+                    __m128i first = _mm_loadu_si128((const __m128i*)(sourceRows[k] + x));
+                    __m128i second = _mm_loadu_si128((const __m128i*)(sourceRows[k + 1] + x));
+                    __m128i pair = _mm_set1_epi32((int)(((unsigned)(unsigned short)weights[k + 1] << 16) |
+                                                        (unsigned short)weights[k]));
+                    low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(first, second), pair));
+                    high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(first, second), pair));
+                }
+                __m128i packed = _mm_packs_epi32(_mm_srai_epi32(low, columnShift), _mm_srai_epi32(high, columnShift));
+                _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(packed, packed));
+            }
+#endif
+            for (; x < stripEnd; x++) {
+                int sum = 1 << (columnShift - 1);
+                for (int k = 0; k < taps; k++) sum += weights[k] * sourceRows[k][x];
+                out[x] = (unsigned char)min(sum >> columnShift, 255);
+            }
+        }
+    }
+    return TRUE;
+}
+
+// Sobel/Scharr边缘：先在列方向求平滑(a,b,a)与差分，再在行方向求差分与平滑，
+// 幅值|Gx|+|Gy|除以平滑权重之和（阶跃边缘为255），饱和后取反
+BOOL edgePlane(const GrayPlane* source, BOOL scharr, GrayPlane* target, ScratchArena* arena) {
+    int width = source->width;
+    int height = source->height;
+    int outer = scharr ? 3 : 1;
+    int center = scharr ? 10 : 2;
+    int shift = scharr ? 4 : 2;
+    short* smooth = (short*)arenaAlloc(arena, (width + 2 + 8) * sizeof(short));
+    short* delta = (short*)arenaAlloc(arena, (width + 2 + 8) * sizeof(short));
+    if (!smooth || !delta || !allocGrayPlane(target, width, height, arena)) return FALSE;
+
+    for (int y = 0; y < height; y++) {
+        const unsigned char* above = source->pixels + clampRow(y + 1, height) * source->rowSize;
+        const unsigned char* middle = source->pixels + y * source->rowSize;
+        const unsigned char* below = source->pixels + clampRow(y - 1, height) * source->rowSize;
+        unsigned char* out = target->pixels + y * target->rowSize;
+        // smooth[x + 1]、delta[x + 1]对应第x列，两端复制边缘列
+        int x = 0;
+#ifdef BMP_USE_SSE2
+        __m128i zero = _mm_setzero_si128();
+        __m128i outerWeight = _mm_set1_epi16((short)outer);
+        __m128i centerWeight = _mm_set1_epi16((short)center);
+        for (; x + 8 <= width; x += 8) {
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(above + x)), zero);
+            __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(middle + x)), zero);
+            __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(below + x)), zero);
+            __m128i s = _mm_add_epi16(_mm_mullo_epi16(_mm_add_epi16(a, c), outerWeight),
+                                      _mm_mullo_epi16(b, centerWeight));
+            _mm_storeu_si128((__m128i*)(smooth + x + 1), s);
+            _mm_storeu_si128((__m128i*)(delta + x + 1), _mm_sub_epi16(a, c));
+        }
+#endif
+        for (; x < width; x++) {
+            smooth[x + 1] = (short)((above[x] + below[x]) * outer + middle[x] * center);
+            delta[x + 1] = (short)(above[x] - below[x]);
+        }
+        smooth[0] = smooth[1];
+        delta[0] = delta[1];
+        smooth[width + 1] = smooth[width];
+        delta[width + 1] = delta[width];
+
+        x = 0;
+#ifdef BMP_USE_SSE2
+        __m128i invert = _mm_set1_epi8((char)0xFF);
+        for (; x + 8 <= width; x += 8) {
+            __m128i left = _mm_loadu_si128((const __m128i*)(delta + x));
+            __m128i here = _mm_loadu_si128((const __m128i*)(delta + x + 1));
+            __m128i right = _mm_loadu_si128((const __m128i*)(delta + x + 2));
+            __m128i gx = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(smooth + x + 2)),
+                                       _mm_loadu_si128((const __m128i*)(smooth + x)));
+            __m128i gy = _mm_add_epi16(_mm_mullo_epi16(_mm_add_epi16(left, right), outerWeight),
+                                       _mm_mullo_epi16(here, centerWeight));
+            gx = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+            gy = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+            __m128i magnitude = _mm_srli_epi16(_mm_add_epi16(gx, gy), shift);
+            _mm_storel_epi64((__m128i*)(out + x), _mm_xor_si128(_mm_packus_epi16(magnitude, magnitude), invert));
+        }
+#endif
+        for (; x < width; x++) {
+            int gx = abs(smooth[x + 2] - smooth[x]);
+            int gy = abs((delta[x] + delta[x + 2]) * outer + delta[x + 1] * center);
+            out[x] = (unsigned char)(255 - min((gx + gy) >> shift, 255));
+        }
+    }
+    return TRUE;
+}
+
+// 执行一步滤波，内存不足时返回FALSE
+BOOL applyFilterStep(const FilterStep* step, const GrayPlane* source, GrayPlane* target, ScratchArena* arena) {
+    switch (step->type) {
+    case FILTER_BOX:    return boxBlurPlane(source, step->radius, target, arena);
+    case FILTER_GAUSS:  return gaussBlurPlane(source, step->sigma, target, arena);
+    default:            return edgePlane(source, step->type == FILTER_SCHARR, target, arena);
+    }
+}
+
+// 滤波一个文件，再按操作链处理，写出最后的结果（没有操作链时为_filtered.bmp）
+BOOL filterFile(const FilterOptions* options, const char* path, ScratchArena* arena) {
+    WatchImage image;
+    GrayPlane plane;
+    if (!loadWatchImage(path, &image, arena)) return FALSE;
+    if (!uprightImage(&image, arena) || !extractGrayPlane(&image, &plane, arena)) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int i = 0; i < options->stepCount; i++) {
+        GrayPlane filtered;
+        if (!applyFilterStep(&options->steps[i], &plane, &filtered, arena)) {
+            printf("内存分配失败！\n");
+            return FALSE;
+        }
+        plane = filtered;
+    }
+
+    // 灰度平面作为8位灰阶图像继续处理
+    int width = plane.width;
+    int height = plane.height;
+    replaceImagePixels(&image, plane.pixels, width, height, 8);
+    image.paletteCount = 256;
+    for (int i = 0; i < 256; i++) {
+        image.palette[i].rgbBlue = image.palette[i].rgbGreen = image.palette[i].rgbRed = (BYTE)i;
+        image.palette[i].rgbReserved = 0;
+    }
+    const char* suffix = "_filtered.bmp";
+    for (int step = 0; step < options->chainLength; step++) {
+        BatchOperation operation = options->chain[step];
+        suffix = batchOutputSuffix(operation, 0);
+        if (operation == BATCH_BINARY) {
+            binarizeImageBuffer(image.pixels, image.palette, width, height, image.bitCount, image.rowSize,
+                                options->threshold);
+        } else {
+            DetectOptions detectOptions;
+            initDetectOptions(&detectOptions);
+            ObjectInfo* objects = (ObjectInfo*)arenaAlloc(arena, detectOptions.maxObjects * sizeof(ObjectInfo));
+            int objectCount = 0;
+            int found = objects ?
+                detectObjectsWithOptions(image.pixels, width, height, image.bitCount, image.rowSize, &detectOptions,
+                                         NULL, objects, detectOptions.maxObjects, &objectCount, arena) : -1;
+            if (found < 0 || drawObjectMarks(image.pixels, image.palette, &image.paletteCount, width, height,
+                                             image.bitCount, image.rowSize, objects, objectCount, &image.pixels,
+                                             &image.bitCount, &image.rowSize, arena) < 0) {
+                printf("内存分配失败！\n");
+                return FALSE;
+            }
+            for (int k = 0; k < objectCount; k++) {
+                const BoundingBox* bbox = &objects[k].bbox;
+                printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n",
+                       k + 1, bbox->minX, bbox->minY, bbox->maxX, bbox->maxY, objects[k].pixelCount);
+            }
+            printf("找到 %d 个物体\n", found);
+        }
+    }
+
+    char outputPath[260];
+    makeOutputPath(outputPath, path, suffix);
+    return writeWatchImage(outputPath, &image, FALSE);
+}
+
+// 依次滤波各文件，返回失败的文件数
+int RunFilter(const FilterOptions* options, char** paths, int count) {
+    ScratchArena arena;
+    initScratchArena(&arena);
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        printf("[%d/%d] %s\n", i + 1, count, paths[i]);
+        if (!filterFile(options, paths[i], &arena)) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+        }
+        resetScratchArena(&arena);
+    }
+    freeScratchArena(&arena);
+    return failures;
+}
+
+// 解析filter子命令的选项，*first为第一个文件参数的位置
+BOOL parseFilterOptions(int argc, char* argv[], FilterOptions* options, int* first) {
+    options->stepCount = 0;
+    options->threshold = BATCH_BINARY_THRESHOLD;
+    options->chainLength = 0;
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        FilterStep* step = &options->steps[options->stepCount];
+        if (strcmp(argv[i], "--sobel") == 0 || strcmp(argv[i], "--scharr") == 0) {
+            if (options->stepCount == FILTER_MAX_STEPS) return FALSE;
+            step->type = (strcmp(argv[i], "--sobel") == 0) ? FILTER_SOBEL : FILTER_SCHARR;
+            options->stepCount++;
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc) return FALSE;
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--box") == 0 || strcmp(argv[i], "--gauss") == 0) {
+            if (options->stepCount == FILTER_MAX_STEPS) return FALSE;
+            if (strcmp(argv[i], "--box") == 0) {
+                step->type = FILTER_BOX;
+                step->radius = atoi(value);
+                if (step->radius < 1 || step->radius > FILTER_MAX_BOX_RADIUS) return FALSE;
+            } else {
+                step->type = FILTER_GAUSS;
+                step->sigma = atof(value);
+                if (step->sigma < 0.3 || step->sigma > FILTER_MAX_GAUSS_RADIUS / 3.0) return FALSE;
+            }
+            options->stepCount++;
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            options->threshold = atoi(value);
+            if (options->threshold < 1 || options->threshold > 255) return FALSE;
+        } else if (strcmp(argv[i], "--chain") == 0) {
+            char buffer[128];
+            strncpy(buffer, value, sizeof(buffer) - 1);
+            buffer[sizeof(buffer) - 1] = '\0';
+            options->chainLength = 0;
+            for (char* token = strtok(buffer, ","); token; token = strtok(NULL, ",")) {
+                // 滤波结果已是灰度图，只能接二值化和标记
+                BatchOperation operation = parseBatchOperation(token);
+                if ((operation != BATCH_BINARY && operation != BATCH_MARK) ||
+                    options->chainLength == WATCH_MAX_CHAIN) {
+                    return FALSE;
+                }
+                options->chain[options->chainLength++] = operation;
+            }
+            if (options->chainLength == 0) return FALSE;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 轮廓 ----
+// 命令行: bmp2gray contour [--epsilon E] [--hull] [--min-size N] [--max-objects N] [--draw] <文件1> [文件2 ...]
+// 在游程标记的基础上跟踪每个物体的外轮廓（Suzuki-Abe边界跟踪，8连通）：起点是标记时记录的物体第一个像素，
+// 此后只沿边界逐个像素前进，耗时与周长成正比，不再扫描边界框。轮廓可以用Douglas-Peucker简化（--epsilon），
+// 或取凸包（--hull），结果按物体写入<文件>_contours.csv（坐标与物体边界框相同，按文件中的行顺序），
+// --draw时在标记图上画出多边形（_contours.bmp）。
+
+// 所有物体的多边形顶点连续存放：第i个物体为points[offsets[i]] .. points[offsets[i + 1] - 1]
+typedef struct {
+    Point* points;
+    int pointCount;
+    int capacity;
+    int* offsets;
+    int polygonCount;
+} ContourSet;
+
+typedef struct {
+    double epsilon;             // Douglas-Peucker的容差（像素），0表示不简化
+    BOOL convexHull;
+    BOOL drawOutput;
+    DetectOptions detect;
+} ContourOptions;
+
+void initContourSet(ContourSet* set) {
+    memset(set, 0, sizeof(ContourSet));
+}
+
+void freeContourSet(ContourSet* set) {
+    free(set->points);
+    free(set->offsets);
+    initContourSet(set);
+}
+
+// 追加一个顶点，容量不足时加倍
+BOOL appendContourPoint(ContourSet* set, int x, int y) {
+    if (set->pointCount == set->capacity) {
+        int capacity = max(set->capacity * 2, 1024);
+        Point* points = (Point*)realloc(set->points, capacity * sizeof(Point));
+        if (!points) return FALSE;
+        set->points = points;
+        set->capacity = capacity;
+    }
+    set->points[set->pointCount].x = x;
+    set->points[set->pointCount].y = y;
+    set->pointCount++;
+    return TRUE;
+}
+
+// 8邻域方向：0为x+1，按编号递增为逆时针（以行号减小为"上"）
+static const int contourStepX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int contourStepY[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+BMP_FORCEINLINE int contourPixelDark(const unsigned char* buffer, int width, int height, int rowSize,
+                                     int x, int y, int bits) {
+    return x >= 0 && y >= 0 && x < width && y < height && pfGet(buffer + y * rowSize, x, bits) < 128;
+}
+
+// 从物体的第一个像素出发跟踪外轮廓，依次追加轮廓像素；内存不足返回FALSE
+// 起点的左侧和上一行都是背景，先顺时针找到第一个黑色邻点（轮廓的最后一个像素），然后每一步从来向的下一个方向起
+// 逆时针寻找下一个像素，走到最后一个像素且下一个像素是起点时结束
+BMP_FORCEINLINE BOOL traceContourGeneric(const unsigned char* buffer, int width, int height, int rowSize,
+                                         Point start, ContourSet* set, int bits) {
+    int first = -1;
+    for (int k = 0; k < 8; k++) {
+        int direction = (4 - k) & 7;
+        if (contourPixelDark(buffer, width, height, rowSize, start.x + contourStepX[direction],
+                             start.y + contourStepY[direction], bits)) {
+            first = direction;
+            break;
+        }
+    }
+    if (first < 0) return appendContourPoint(set, start.x, start.y);    // 孤立像素
+
+    int x = start.x, y = start.y;
+    int lastX = x + contourStepX[first], lastY = y + contourStepY[first];      // 顺时针找到的是轮廓的最后一个像素
+    int from = first;
+    for (;;) {
+        int next = from;
+        for (int k = 1; k <= 8; k++) {
+            int direction = (from + k) & 7;
+            if (contourPixelDark(buffer, width, height, rowSize, x + contourStepX[direction],
+                                 y + contourStepY[direction], bits)) {
+                next = direction;
+                break;
+            }
+        }
+        if (!appendContourPoint(set, x, y)) return FALSE;
+        int nextX = x + contourStepX[next], nextY = y + contourStepY[next];
+        if (nextX == start.x && nextY == start.y && x == lastX && y == lastY) return TRUE;
+        from = (next + 4) & 7;
+        x = nextX;
+        y = nextY;
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL(BOOL, traceContour,
+                         (const unsigned char* buffer, int width, int height, int rowSize, Point start,
+                          ContourSet* set),
+                         buffer, width, height, rowSize, start, set)
+
+// 点到线段ab的距离的平方
+double segmentDistanceSquared(Point p, Point a, Point b) {
+    double dx = b.x - a.x, dy = b.y - a.y;
+    double length = dx * dx + dy * dy;
+    double t = (length > 0.0) ? ((p.x - a.x) * dx + (p.y - a.y) * dy) / length : 0.0;
+    t = (t < 0.0) ? 0.0 : (t > 1.0) ? 1.0 : t;
+    double ex = a.x + t * dx - p.x, ey = a.y + t * dy - p.y;
+    return ex * ex + ey * ey;
+}
+
+// Douglas-Peucker简化闭合轮廓points[0..count)，保留的顶点按原顺序移到前面，返回保留的顶点数
+// 以第一个点和离它最远的点分成两段，各段用显式栈迭代细分
+int simplifyContour(Point* points, int count, double epsilon, ScratchArena* arena) {
+    if (count <= 3 || epsilon <= 0.0) return count;
+    unsigned char* keep = (unsigned char*)arenaCalloc(arena, count + 1, 1);
+    int* stack = (int*)arenaAlloc(arena, 2 * (count + 1) * sizeof(int));
+    if (!keep || !stack) return count;
+    int farthest = 0;
+    double farthestDistance = -1.0;
+    for (int i = 1; i < count; i++) {
+        double distance = segmentDistanceSquared(points[i], points[0], points[0]);
+        if (distance > farthestDistance) {
+            farthestDistance = distance;
+            farthest = i;
+        }
+    }
+    keep[0] = keep[farthest] = keep[count] = 1;
+    int top = 0;
+    stack[top++] = 0;
+    stack[top++] = farthest;
+    stack[top++] = farthest;
+    stack[top++] = count;                   // 下标count表示回到第一个点
+    double limit = epsilon * epsilon;
+    while (top > 0) {
+        int last = stack[--top];
+        int firstIndex = stack[--top];
+        Point a = points[firstIndex];
+        Point b = points[last % count];
+        int split = -1;
+        double splitDistance = limit;
+        for (int i = firstIndex + 1; i < last; i++) {
+            double distance = segmentDistanceSquared(points[i], a, b);
+            if (distance > splitDistance) {
+                splitDistance = distance;
+                split = i;
+            }
+        }
+        if (split < 0) continue;
+        keep[split] = 1;
+        stack[top++] = firstIndex;
+        stack[top++] = split;
+        stack[top++] = split;
+        stack[top++] = last;
+    }
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (keep[i]) points[kept++] = points[i];
+    }
+    arenaRelease(arena, stack);
+    arenaRelease(arena, keep);
+    return kept;
+}
+
+int comparePointsXY(const void* a, const void* b) {
+    const Point* p = (const Point*)a;
+    const Point* q = (const Point*)b;
+    if (p->x != q->x) return (p->x < q->x) ? -1 : 1;
+    return (p->y < q->y) ? -1 : (p->y > q->y) ? 1 : 0;
+}
+
+BMP_FORCEINLINE long long crossProduct(Point o, Point a, Point b) {
+    return (long long)(a.x - o.x) * (b.y - o.y) - (long long)(a.y - o.y) * (b.x - o.x);
+}
+
+// 凸包（Andrew单调链），结果替换points的前若干项，返回顶点数；共线的点不保留
+int convexHull(Point* points, int count, ScratchArena* arena) {
+    if (count <= 2) return count;
+    Point* sorted = (Point*)arenaAlloc(arena, count * sizeof(Point));
+    Point* chain = (Point*)arenaAlloc(arena, (2 * count + 1) * sizeof(Point));
+    if (!sorted || !chain) return count;
+    memcpy(sorted, points, count * sizeof(Point));
+    qsort(sorted, count, sizeof(Point), comparePointsXY);
+    int hull = 0;
+    for (int i = 0; i < count; i++) {
+        while (hull >= 2 && crossProduct(chain[hull - 2], chain[hull - 1], sorted[i]) <= 0) hull--;
+        chain[hull++] = sorted[i];
+    }
+    for (int i = count - 2, lower = hull + 1; i >= 0; i--) {
+        while (hull >= lower && crossProduct(chain[hull - 2], chain[hull - 1], sorted[i]) <= 0) hull--;
+        chain[hull++] = sorted[i];
+    }
+    hull = max(hull - 1, 1);                // 最后一个点与第一个点相同
+    memcpy(points, chain, hull * sizeof(Point));
+    arenaRelease(arena, chain);
+    arenaRelease(arena, sorted);
+    return hull;
+}
+
+// 在二值图上查找物体并跟踪各物体的外轮廓，按选项简化或取凸包；返回值与detectObjectsInBuffer相同
+int traceObjectContours(const unsigned char* buffer, int width, int height, int bitCount, int rowSize,
+                        const ContourOptions* options, ObjectInfo* objects, int maxObjects, int* objectCount,
+                        ContourSet* contours, ScratchArena* arena) {
+    *objectCount = 0;
+    if (!isSupportedBitCount(bitCount)) return 0;
+    RunImage runs;
+    Point* starts = (Point*)arenaAlloc(arena, maxObjects * sizeof(Point));
+    if (!starts) return -1;
+    if (!createRunImage(&runs, width, height, arena)) {
+        arenaRelease(arena, starts);
+        return -1;
+    }
+    SELECT_PIXEL_KERNEL(thresholdToRuns, bitCount)(buffer, width, height, rowSize, 128, &runs);
+    int foundCount = labelRunComponents(&runs, &options->detect, objects, starts, maxObjects, objectCount, arena);
+    freeRunImage(&runs, arena);
+
+    contours->pointCount = 0;
+    contours->polygonCount = 0;
+    free(contours->offsets);
+    contours->offsets = (int*)malloc((*objectCount + 1) * sizeof(int));
+    if (!contours->offsets) foundCount = -1;
+    if (foundCount >= 0) contours->offsets[0] = 0;
+    for (int i = 0; foundCount >= 0 && i < *objectCount; i++) {
+        int begin = contours->pointCount;
+        if (!SELECT_PIXEL_KERNEL(traceContour, bitCount)(buffer, width, height, rowSize, starts[i], contours)) {
+            foundCount = -1;
+            break;
+        }
+        int count = contours->pointCount - begin;
+        count = simplifyContour(contours->points + begin, count, options->epsilon, arena);
+        if (options->convexHull) count = convexHull(contours->points + begin, count, arena);
+        contours->pointCount = begin + count;
+        contours->offsets[++contours->polygonCount] = contours->pointCount;
+    }
+    arenaRelease(arena, starts);
+    return foundCount;
+}
+
+// 画一条线段（Bresenham）
+BMP_FORCEINLINE void drawLineGeneric(unsigned char* buffer, int rowSize, Point a, Point b, unsigned char markIndex,
+                                     int bits) {
+    int dx = abs(b.x - a.x), dy = -abs(b.y - a.y);
+    int stepX = (a.x < b.x) ? 1 : -1, stepY = (a.y < b.y) ? 1 : -1;
+    int error = dx + dy;
+    for (;;) {
+        pfSetMark(buffer + a.y * rowSize, a.x, markIndex, bits);
+        if (a.x == b.x && a.y == b.y) break;
+        int doubled = 2 * error;
+        if (doubled >= dy) {
+            error += dy;
+            a.x += stepX;
+        }
+        if (doubled <= dx) {
+            error += dx;
+            a.y += stepY;
+        }
+    }
+}
+
+INSTANTIATE_PIXEL_KERNEL_VOID(drawLine, (unsigned char* buffer, int rowSize, Point a, Point b, unsigned char markIndex),
+                              buffer, rowSize, a, b, markIndex)
+
+// 把各物体的多边形（首尾相连）画到标记图上
+void drawContourPolygons(unsigned char* buffer, int rowSize, int bitCount, const ContourSet* contours,
+                         unsigned char markIndex) {
+    for (int i = 0; i < contours->polygonCount; i++) {
+        const Point* polygon = contours->points + contours->offsets[i];
+        int count = contours->offsets[i + 1] - contours->offsets[i];
+        for (int k = 0; k < count; k++) {
+            SELECT_PIXEL_KERNEL(drawLine, bitCount)(buffer, rowSize, polygon[k], polygon[(k + 1) % count], markIndex);
+        }
+    }
+}
+
+// 多边形写成CSV：每个物体一行，依次为序号、顶点数和各顶点的x,y
+BOOL writeContourCsv(const char* path, const ContourSet* contours) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("无法创建输出文件: %s\n", path);
+        return FALSE;
+    }
+    fprintf(file, "object,points,coordinates\n");
+    for (int i = 0; i < contours->polygonCount; i++) {
+        int begin = contours->offsets[i];
+        int count = contours->offsets[i + 1] - begin;
+        fprintf(file, "%d,%d", i + 1, count);
+        for (int k = 0; k < count; k++) fprintf(file, ",%d,%d", contours->points[begin + k].x, contours->points[begin + k].y);
+        fprintf(file, "\n");
+    }
+    BOOL ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+// 跟踪一个文件中各物体的轮廓，写出CSV，--draw时写出画有多边形的标记图
+BOOL contourFile(const ContourOptions* options, const char* path, ContourSet* contours, ScratchArena* arena) {
+    WatchImage image;
+    if (!loadWatchImage(path, &image, arena)) return FALSE;
+    int width = image.desc.width;
+    int height = image.desc.height;
+    int maxObjects = options->detect.maxObjects;
+    unsigned char* labelBuffer = canonicalizeLabelBuffer(image.pixels, image.palette, image.bitCount,
+                                                         image.rowSize, height, arena);
+    ObjectInfo* objects = (ObjectInfo*)arenaAlloc(arena, maxObjects * sizeof(ObjectInfo));
+    int objectCount = 0;
+    int found = (labelBuffer && objects) ?
+        traceObjectContours(labelBuffer, width, height, image.bitCount, image.rowSize, options, objects, maxObjects,
+                            &objectCount, contours, arena) : -1;
+    if (found < 0) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int i = 0; i < objectCount; i++) {
+        const BoundingBox* bbox = &objects[i].bbox;
+        printf("物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素, 多边形顶点: %d\n", i + 1, bbox->minX, bbox->minY,
+               bbox->maxX, bbox->maxY, objects[i].pixelCount, contours->offsets[i + 1] - contours->offsets[i]);
+    }
+    printf("找到 %d 个物体，共 %d 个顶点\n", found, contours->pointCount);
+
+    char outputPath[260];
+    makeOutputPath(outputPath, path, "_contours.csv");
+    if (!writeContourCsv(outputPath, contours)) return FALSE;
+    if (!options->drawOutput) return TRUE;
+
+    int markIndex = drawObjectMarks(image.pixels, image.palette, &image.paletteCount, width, height, image.bitCount,
+                                    image.rowSize, objects, 0, &image.pixels, &image.bitCount, &image.rowSize, arena);
+    if (markIndex < 0) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    drawContourPolygons(image.pixels, image.rowSize, image.bitCount, contours, (unsigned char)markIndex);
+    makeOutputPath(outputPath, path, "_contours.bmp");
+    return writeWatchImage(outputPath, &image, FALSE);
+}
+
+// 依次处理各文件，返回失败的文件数
+int RunContour(const ContourOptions* options, char** paths, int count) {
+    ScratchArena arena;
+    ContourSet contours;
+    initScratchArena(&arena);
+    initContourSet(&contours);
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        printf("[%d/%d] %s\n", i + 1, count, paths[i]);
+        if (!contourFile(options, paths[i], &contours, &arena)) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+        }
+        resetScratchArena(&arena);
+    }
+    freeContourSet(&contours);
+    freeScratchArena(&arena);
+    return failures;
+}
+
+// 解析contour子命令的选项，*first为第一个文件参数的位置
+BOOL parseContourOptions(int argc, char* argv[], ContourOptions* options, int* first) {
+    options->epsilon = 0.0;
+    options->convexHull = FALSE;
+    options->drawOutput = FALSE;
+    initDetectOptions(&options->detect);
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--hull") == 0 || strcmp(argv[i], "--draw") == 0) {
+            if (strcmp(argv[i], "--hull") == 0) {
+                options->convexHull = TRUE;
+            } else {
+                options->drawOutput = TRUE;
+            }
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc) return FALSE;
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--epsilon") == 0) {
+            options->epsilon = atof(value);
+            if (options->epsilon <= 0.0 || options->epsilon > 1000.0) return FALSE;
+        } else if (strcmp(argv[i], "--min-size") == 0) {
+            options->detect.minObjectSize = atoi(value);
+            if (options->detect.minObjectSize < 1) return FALSE;
+        } else if (strcmp(argv[i], "--max-objects") == 0) {
+            options->detect.maxObjects = atoi(value);
+            if (options->detect.maxObjects < 1 || options->detect.maxObjects > 100000) return FALSE;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return argc - i >= 1;
+}
+
+// ---- 模板匹配 ----
+// 命令行: bmp2gray match --template <模板.bmp> [--top K] [--min-score S] [--levels N] [--jobs N] [--mark]
+//                        <文件1> [文件2 ...]
+// 在灰度图上按归一化互相关（NCC）查找模板，输出得分最高的K个位置。窗口的像素和与平方和由积分图求出，
+// 分子ΣI·T用SSE2逐行点积。先在金字塔最粗的一层上全图搜索（按行分给多个线程），取局部极大值作为候选，
+// 再逐层放大到原图，每层只在候选位置附近±2像素内细化。坐标与物体边界框相同（自下而上的行顺序，
+// 自上而下的图像先按显示方向改为自下而上），--mark时输出画出匹配框的图像（_match.bmp）。
+#define MATCH_MAX_WORKERS 64
+#define MATCH_MAX_LEVELS 4
+#define MATCH_MAX_RESULTS 1000
+#define MATCH_MIN_TEMPLATE_SIDE 8           // 金字塔最粗一层上模板的最小边长
+#define MATCH_REFINE_RADIUS 2
+#define MATCH_CANDIDATE_FACTOR 4            // 粗搜索保留K的若干倍个候选（至少MATCH_MIN_CANDIDATES个），细化后再去重
+#define MATCH_MIN_CANDIDATES 32
+#define MATCH_COARSE_MARGIN 0.15            // 粗层的得分会偏低，候选阈值比--min-score低这么多
+
+typedef struct {
+    char templatePath[260];
+    int topCount;
+    double minScore;
+    int levels;                 // 最多缩小的层数，0表示只在原图上全图搜索
+    int jobs;
+    BOOL markOutput;
+} MatchOptions;
+
+// 金字塔的一层（行宽即宽度）
+typedef struct {
+    unsigned char* pixels;
+    int width;
+    int height;
+} MatchPlane;
+
+// 模板在某一层上的统计量
+typedef struct {
+    const MatchPlane* plane;
+    double sum;
+    double norm;                // sqrt(ΣT² - (ΣT)²/n)，为0表示模板是纯色
+} MatchTemplate;
+
+typedef struct {
+    int x;                      // 窗口左下角（行号最小的一角）在图像中的位置
+    int y;
+    double score;
+} MatchResult;
+
+typedef struct {
+    const MatchPlane* frame;
+    const MatchTemplate* pattern;
+    const unsigned int* sums;   // 积分图，(width + 1) x (height + 1)；窗口和不超过2^32，按无符号取模相减即可
+    const long long* squares;
+    int firstRow;
+    int lastRow;
+    float* scores;              // 每个位置的得分，行宽为width - 模板宽度 + 1
+} MatchWorkerArgs;
+
+// 两行像素的点积
+BMP_FORCEINLINE long long dotRow(const unsigned char* a, const unsigned char* b, int count) {
+    long long total = 0;
+    int i = 0;
+#ifdef BMP_USE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i accumulator = zero;
+    for (; i + 16 <= count; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        accumulator = _mm_add_epi32(accumulator, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero)));
+        accumulator = _mm_add_epi32(accumulator, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero)));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, accumulator);
+    total = (long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < count; i++) total += a[i] * b[i];
+    return total;
+}
+
+// 由窗口的像素和、平方和与ΣI·T计算NCC
+BMP_FORCEINLINE double nccFromSums(const MatchTemplate* pattern, double sum, double squares, double product) {
+    double count = (double)pattern->plane->width * pattern->plane->height;
+    double variance = squares - sum * sum / count;
+    if (pattern->norm <= 0.0 || variance <= 1e-6 * count) return 0.0;
+    return (product - sum * pattern->sum / count) / (sqrt(variance) * pattern->norm);
+}
+
+// 窗口左下角在(x, y)时的得分；sums为NULL时直接累加窗口的像素和与平方和
+double nccScore(const MatchPlane* frame, const MatchTemplate* pattern, const unsigned int* sums,
+                const long long* squares, int x, int y) {
+    int width = pattern->plane->width;
+    int height = pattern->plane->height;
+    long long product = 0;
+    double windowSum, windowSquares;
+    for (int row = 0; row < height; row++) {
+        product += dotRow(frame->pixels + (size_t)(y + row) * frame->width + x,
+                          pattern->plane->pixels + (size_t)row * width, width);
+    }
+    if (sums) {
+        int stride = frame->width + 1;
+        size_t top = (size_t)(y + height) * stride, bottom = (size_t)y * stride;
+        windowSum = (double)(unsigned int)(sums[top + x + width] - sums[top + x] - sums[bottom + x + width] + sums[bottom + x]);
+        windowSquares = (double)(squares[top + x + width] - squares[top + x] - squares[bottom + x + width] + squares[bottom + x]);
+    } else {
+        long long total = 0, totalSquares = 0;
+        for (int row = 0; row < height; row++) {
+            const unsigned char* pixels = frame->pixels + (size_t)(y + row) * frame->width + x;
+            for (int i = 0; i < width; i++) total += pixels[i];
+            totalSquares += dotRow(pixels, pixels, width);
+        }
+        windowSum = (double)total;
+        windowSquares = (double)totalSquares;
+    }
+    return nccFromSums(pattern, windowSum, windowSquares, (double)product);
+}
+
+void initMatchTemplate(MatchTemplate* pattern, const MatchPlane* plane) {
+    long long total = 0, totalSquares = 0;
+    for (int row = 0; row < plane->height; row++) {
+        const unsigned char* pixels = plane->pixels + (size_t)row * plane->width;
+        for (int i = 0; i < plane->width; i++) total += pixels[i];
+        totalSquares += dotRow(pixels, pixels, plane->width);
+    }
+    double count = (double)plane->width * plane->height;
+    pattern->plane = plane;
+    pattern->sum = (double)total;
+    pattern->norm = sqrt(max((double)totalSquares - (double)total * total / count, 0.0));
+}
+
+// 积分图：sums[(y + 1) * (width + 1) + x + 1]为[0,x]x[0,y]内的像素和
+BOOL buildIntegralImages(const MatchPlane* frame, unsigned int* sums, long long* squares) {
+    int stride = frame->width + 1;
+    memset(sums, 0, stride * sizeof(unsigned int));
+    memset(squares, 0, stride * sizeof(long long));
+    for (int y = 0; y < frame->height; y++) {
+        const unsigned char* row = frame->pixels + (size_t)y * frame->width;
+        unsigned int* sumRow = sums + (size_t)(y + 1) * stride;
+        long long* squareRow = squares + (size_t)(y + 1) * stride;
+        unsigned int rowSum = 0;
+        long long rowSquares = 0;
+        sumRow[0] = 0;
+        squareRow[0] = 0;
+        for (int x = 0; x < frame->width; x++) {
+            rowSum += row[x];
+            rowSquares += row[x] * row[x];
+            sumRow[x + 1] = sumRow[x + 1 - stride] + rowSum;
+            squareRow[x + 1] = squareRow[x + 1 - stride] + rowSquares;
+        }
+    }
+    return TRUE;
+}
+
+DWORD WINAPI matchWorkerThread(LPVOID parameter) {
+    MatchWorkerArgs* args = (MatchWorkerArgs*)parameter;
+    int positions = args->frame->width - args->pattern->plane->width + 1;
+    for (int y = args->firstRow; y < args->lastRow; y++) {
+        float* scores = args->scores + (size_t)y * positions;
+        for (int x = 0; x < positions; x++) {
+            scores[x] = (float)nccScore(args->frame, args->pattern, args->sums, args->squares, x, y);
+        }
+    }
+    return 0;
+}
+
+// 全图搜索：jobs个线程各计算一段连续的候选行；内存不足或无法创建线程时返回FALSE
+BOOL searchMatchPlane(const MatchPlane* frame, const MatchTemplate* pattern, int jobs, float* scores,
+                      ScratchArena* arena) {
+    int stride = frame->width + 1;
+    int rows = frame->height - pattern->plane->height + 1;
+    unsigned int* sums = (unsigned int*)arenaAlloc(arena, (size_t)stride * (frame->height + 1) * sizeof(unsigned int));
+    long long* squares = (long long*)arenaAlloc(arena, (size_t)stride * (frame->height + 1) * sizeof(long long));
+    if (!sums || !squares) {
+        arenaRelease(arena, squares);
+        arenaRelease(arena, sums);
+        return FALSE;
+    }
+    buildIntegralImages(frame, sums, squares);
+
+    jobs = max(1, min(jobs, rows));
+    MatchWorkerArgs* args = (MatchWorkerArgs*)calloc(jobs, sizeof(MatchWorkerArgs));
+    HANDLE* workers = (HANDLE*)calloc(jobs, sizeof(HANDLE));
+    if (!args || !workers) {
+        free(args);
+        free(workers);
+        arenaRelease(arena, squares);
+        arenaRelease(arena, sums);
+        return FALSE;
+    }
+    BOOL ok = TRUE;
+    for (int i = 0; i < jobs; i++) {
+        args[i].frame = frame;
+        args[i].pattern = pattern;
+        args[i].sums = sums;
+        args[i].squares = squares;
+        args[i].scores = scores;
+        args[i].firstRow = (int)((long long)rows * i / jobs);
+        args[i].lastRow = (int)((long long)rows * (i + 1) / jobs);
+        // 最后一段在当前线程中计算
+        if (i + 1 < jobs) {
+            workers[i] = CreateThread(NULL, 0, matchWorkerThread, &args[i], 0, NULL);
+            if (!workers[i]) ok = FALSE;
+        } else {
+            matchWorkerThread(&args[i]);
+        }
+    }
+    for (int i = 0; i < jobs; i++) {
+        if (workers[i]) {
+            WaitForSingleObject(workers[i], INFINITE);
+            CloseHandle(workers[i]);
+        }
+    }
+    free(args);
+    free(workers);
+    arenaRelease(arena, squares);
+    arenaRelease(arena, sums);
+    return ok;
+}
+
+int compareMatchResults(const void* a, const void* b) {
+    const MatchResult* p = (const MatchResult*)a;
+    const MatchResult* q = (const MatchResult*)b;
+    if (p->score != q->score) return (p->score > q->score) ? -1 : 1;
+    if (p->y != q->y) return (p->y < q->y) ? -1 : 1;
+    return (p->x < q->x) ? -1 : (p->x > q->x) ? 1 : 0;
+}
+
+// 从得分图中取不低于minScore的局部极大值（3x3邻域），按得分排序后最多保留maxCount个
+int collectMatchPeaks(const float* scores, int positions, int rows, double minScore, MatchResult* peaks,
+                      int maxCount, ScratchArena* arena) {
+    int capacity = maxCount * 4;
+    MatchResult* found = (MatchResult*)arenaAlloc(arena, capacity * sizeof(MatchResult));
+    if (!found) return -1;
+    int count = 0;
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < positions; x++) {
+            float score = scores[(size_t)y * positions + x];
+            if (score < minScore) continue;
+            BOOL peak = TRUE;
+            for (int dy = -1; dy <= 1 && peak; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = x + dx, ny = y + dy;
+                    if ((dx || dy) && nx >= 0 && ny >= 0 && nx < positions && ny < rows &&
+                        scores[(size_t)ny * positions + nx] > score) {
+                        peak = FALSE;
+                        break;
+                    }
+                }
+            }
+            if (!peak) continue;
+            // 缓冲区满时先排序截断，只保留得分最高的maxCount个
+            if (count == capacity) {
+                qsort(found, count, sizeof(MatchResult), compareMatchResults);
+                count = maxCount;
+            }
+            found[count].x = x;
+            found[count].y = y;
+            found[count].score = score;
+            count++;
+        }
+    }
+    qsort(found, count, sizeof(MatchResult), compareMatchResults);
+    count = min(count, maxCount);
+    memcpy(peaks, found, count * sizeof(MatchResult));
+    arenaRelease(arena, found);
+    return count;
+}
+
+// 释放金字塔中缩小出来的各层（第0层是调用者的图像）
+void releaseMatchPyramid(MatchPlane* frames, MatchPlane* patterns, int levels, ScratchArena* arena) {
+    for (int level = levels; level >= 1; level--) {
+        arenaRelease(arena, patterns[level].pixels);
+        arenaRelease(arena, frames[level].pixels);
+    }
+}
+
+// 在frame中查找模板，按得分从高到低写入最多topCount个互不重叠（位置相差小于模板的一半视为同一处）的结果
+// 返回结果数，内存不足返回-1
+int matchTemplatePlanes(const MatchPlane* frame, const MatchPlane* pattern, const MatchOptions* options,
+                        MatchResult* results, ScratchArena* arena) {
+    if (pattern->width > frame->width || pattern->height > frame->height) return 0;
+
+    // 逐层缩小，直到模板的短边不足MATCH_MIN_TEMPLATE_SIDE
+    MatchPlane frames[MATCH_MAX_LEVELS + 1], patterns[MATCH_MAX_LEVELS + 1];
+    frames[0] = *frame;
+    patterns[0] = *pattern;
+    int levels = 0;
+    while (levels < options->levels &&
+           min((patterns[levels].width + 1) / 2, (patterns[levels].height + 1) / 2) >= MATCH_MIN_TEMPLATE_SIDE) {
+        frames[levels + 1].pixels = patterns[levels + 1].pixels = NULL;
+        for (int k = 0; k < 2; k++) {
+            const MatchPlane* source = k ? &patterns[levels] : &frames[levels];
+            MatchPlane* target = k ? &patterns[levels + 1] : &frames[levels + 1];
+            target->width = (source->width + 1) / 2;
+            target->height = (source->height + 1) / 2;
+            target->pixels = (unsigned char*)arenaAlloc(arena, (size_t)target->width * target->height + 16);
+            if (!target->pixels) {
+                releaseMatchPyramid(frames, patterns, levels + 1, arena);
+                return -1;
+            }
+            downsampleGray2x(source->pixels, source->width, source->height, target->pixels, target->width,
+                             target->height);
+        }
+        levels++;
+    }
+
+    // 最粗的一层全图搜索
+    MatchTemplate coarsePattern;
+    initMatchTemplate(&coarsePattern, &patterns[levels]);
+    int positions = frames[levels].width - patterns[levels].width + 1;
+    int rows = frames[levels].height - patterns[levels].height + 1;
+    float* scores = (float*)arenaAlloc(arena, (size_t)positions * rows * sizeof(float));
+    int candidateLimit = max(min(options->topCount * MATCH_CANDIDATE_FACTOR, MATCH_MAX_RESULTS), MATCH_MIN_CANDIDATES);
+    MatchResult* candidates = (MatchResult*)arenaAlloc(arena, candidateLimit * sizeof(MatchResult));
+    int candidateCount = -1;
+    if (scores && candidates && searchMatchPlane(&frames[levels], &coarsePattern, options->jobs, scores, arena)) {
+        double coarseScore = (levels > 0) ? options->minScore - MATCH_COARSE_MARGIN : options->minScore;
+        candidateCount = collectMatchPeaks(scores, positions, rows, coarseScore, candidates, candidateLimit, arena);
+    }
+    arenaRelease(arena, scores);
+    if (candidateCount < 0) {
+        arenaRelease(arena, candidates);
+        releaseMatchPyramid(frames, patterns, levels, arena);
+        return -1;
+    }
+
+    // 逐层细化：上一层的(x, y)对应本层的(2x, 2y)附近
+    for (int level = levels - 1; level >= 0; level--) {
+        MatchTemplate levelPattern;
+        initMatchTemplate(&levelPattern, &patterns[level]);
+        int maxX = frames[level].width - patterns[level].width;
+        int maxY = frames[level].height - patterns[level].height;
+        for (int i = 0; i < candidateCount; i++) {
+            MatchResult best = { 0, 0, -2.0 };
+            for (int dy = -MATCH_REFINE_RADIUS; dy <= MATCH_REFINE_RADIUS; dy++) {
+                for (int dx = -MATCH_REFINE_RADIUS; dx <= MATCH_REFINE_RADIUS; dx++) {
+                    int x = 2 * candidates[i].x + dx, y = 2 * candidates[i].y + dy;
+                    if (x < 0 || y < 0 || x > maxX || y > maxY) continue;
+                    double score = nccScore(&frames[level], &levelPattern, NULL, NULL, x, y);
+                    if (score > best.score) {
+                        best.x = x;
+                        best.y = y;
+                        best.score = score;
+                    }
+                }
+            }
+            candidates[i] = best;
+        }
+    }
+
+    // 去重：按得分从高到低，与已选结果重叠一半以上的舍去
+    qsort(candidates, candidateCount, sizeof(MatchResult), compareMatchResults);
+    int resultCount = 0;
+    for (int i = 0; i < candidateCount && resultCount < options->topCount; i++) {
+        if (candidates[i].score < options->minScore) break;
+        BOOL duplicate = FALSE;
+        for (int k = 0; k < resultCount && !duplicate; k++) {
+            duplicate = abs(results[k].x - candidates[i].x) * 2 < pattern->width &&
+                        abs(results[k].y - candidates[i].y) * 2 < pattern->height;
+        }
+        if (!duplicate) results[resultCount++] = candidates[i];
+    }
+    arenaRelease(arena, candidates);
+    releaseMatchPyramid(frames, patterns, levels, arena);
+    return resultCount;
+}
+
+// 读取图像并转为紧凑的灰度平面（行自下而上）
+BOOL loadMatchPlane(const char* path, WatchImage* image, MatchPlane* plane, ScratchArena* arena) {
+    GrayPlane gray;
+    if (!loadWatchImage(path, image, arena)) return FALSE;
+    if (!uprightImage(image, arena) || !extractGrayPlane(image, &gray, arena)) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    plane->width = gray.width;
+    plane->height = gray.height;
+    plane->pixels = (unsigned char*)arenaAlloc(arena, (size_t)gray.width * gray.height + 16);
+    if (!plane->pixels) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int y = 0; y < gray.height; y++) {
+        memcpy(plane->pixels + (size_t)y * gray.width, gray.pixels + (size_t)y * gray.rowSize, gray.width);
+    }
+    return TRUE;
+}
+
+// 在一个文件中查找模板并输出结果，--mark时写出画出匹配框的图像
+BOOL matchFile(const MatchOptions* options, const MatchPlane* pattern, const char* path, ScratchArena* arena) {
+    WatchImage image;
+    MatchPlane frame;
+    if (!loadMatchPlane(path, &image, &frame, arena)) return FALSE;
+    MatchResult* results = (MatchResult*)arenaAlloc(arena, options->topCount * sizeof(MatchResult));
+    if (!results) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    int count = matchTemplatePlanes(&frame, pattern, options, results, arena);
+    if (count < 0) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int i = 0; i < count; i++) {
+        printf("匹配 #%d: 位置(%d,%d)-(%d,%d), 得分: %.4f\n", i + 1, results[i].x, results[i].y,
+               results[i].x + pattern->width - 1, results[i].y + pattern->height - 1, results[i].score);
+    }
+    printf("找到 %d 处匹配\n", count);
+    if (!options->markOutput) return TRUE;
+
+    ObjectInfo* boxes = (ObjectInfo*)arenaCalloc(arena, max(count, 1), sizeof(ObjectInfo));
+    if (!boxes) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    for (int i = 0; i < count; i++) {
+        boxes[i].bbox.minX = results[i].x;
+        boxes[i].bbox.minY = results[i].y;
+        boxes[i].bbox.maxX = results[i].x + pattern->width - 1;
+        boxes[i].bbox.maxY = results[i].y + pattern->height - 1;
+    }
+    if (drawObjectMarks(image.pixels, image.palette, &image.paletteCount, frame.width, frame.height, image.bitCount,
+                        image.rowSize, boxes, count, &image.pixels, &image.bitCount, &image.rowSize, arena) < 0) {
+        printf("内存分配失败！\n");
+        return FALSE;
+    }
+    char outputPath[260];
+    makeOutputPath(outputPath, path, "_match.bmp");
+    return writeWatchImage(outputPath, &image, FALSE);
+}
+
+// 依次在各文件中查找模板，返回失败的文件数
+int RunMatch(const MatchOptions* options, char** paths, int count) {
+    ScratchArena templateArena, arena;
+    initScratchArena(&templateArena);
+    initScratchArena(&arena);
+    WatchImage templateImage;
+    MatchPlane pattern;
+    int failures = 0;
+    if (!loadMatchPlane(options->templatePath, &templateImage, &pattern, &templateArena)) {
+        printf("无法读取模板: %s\n", options->templatePath);
+        failures = count;
+    }
+    for (int i = 0; i < count && failures < count; i++) {
+        printf("[%d/%d] %s\n", i + 1, count, paths[i]);
+        if (!matchFile(options, &pattern, paths[i], &arena)) {
+            printf("处理失败: %s\n", paths[i]);
+            failures++;
+        }
+        resetScratchArena(&arena);
+    }
+    freeScratchArena(&arena);
+    freeScratchArena(&templateArena);
+    return failures;
+}
+
+// 解析match子命令的选项，*first为第一个文件参数的位置
+BOOL parseMatchOptions(int argc, char* argv[], MatchOptions* options, int* first) {
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    options->templatePath[0] = '\0';
+    options->topCount = 5;
+    options->minScore = 0.8;
+    options->levels = 2;
+    options->jobs = min(max((int)systemInfo.dwNumberOfProcessors, 1), MATCH_MAX_WORKERS);
+    options->markOutput = FALSE;
+    int i = 0;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        if (strcmp(argv[i], "--mark") == 0) {
+            options->markOutput = TRUE;
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc) return FALSE;
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "--template") == 0) {
+            if (strlen(value) >= sizeof(options->templatePath)) return FALSE;
+            strcpy(options->templatePath, value);
+        } else if (strcmp(argv[i], "--top") == 0) {
+            options->topCount = atoi(value);
+            if (options->topCount < 1 || options->topCount > MATCH_MAX_RESULTS / MATCH_CANDIDATE_FACTOR) return FALSE;
+        } else if (strcmp(argv[i], "--min-score") == 0) {
+            options->minScore = atof(value);
+            if (options->minScore < -1.0 || options->minScore > 1.0) return FALSE;
+        } else if (strcmp(argv[i], "--levels") == 0) {
+            options->levels = atoi(value);
+            if (options->levels < 0 || options->levels > MATCH_MAX_LEVELS) return FALSE;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            options->jobs = atoi(value);
+            if (options->jobs < 1 || options->jobs > MATCH_MAX_WORKERS) return FALSE;
+        } else {
+            return FALSE;
+        }
+        i += 2;
+    }
+    *first = i;
+    return options->templatePath[0] && argc - i >= 1;
+}
+
+// ---- 正确性校验 ----
+// 命令行: bmp2gray verify [--random N] [--seed S] [--dir 临时目录] [样本文件...]
+// 以逐像素的标量参考实现为基准，校验优化后的各个引擎（像素格式内核、1位/4位查表、金字塔检测等）：
+// 像素输出逐像素比较（行尾填充字节不参与比较），物体检测逐个比较物体列表。
+// 输入为指定的样本文件，以及随机宽度（奇数）、随机位深度和正/负biHeight的合成图像。
+
+// 校验用的图像（保留原始信息头和调色板）
+typedef struct {
+    BITMAPINFOHEADER infoHeader;
+    int width;
+    int height;
+    int bitCount;
+    int rowSize;
+    RGBQUAD palette[256];
+    int paletteCount;
+    unsigned char* pixels;
+} VerifyImage;
+
+BOOL loadVerifyImage(const char* path, VerifyImage* image) {
+    memset(image, 0, sizeof(VerifyImage));
+    FILE* file = fopen(path, "rb");
+    if (!file) return FALSE;
+
+    BmpDescriptor desc;
+    if (probeBmpStream(file, &desc) != BMP_PROBE_OK) {
+        fclose(file);
+        return FALSE;
+    }
+
+    image->infoHeader = desc.infoHeader;
+    image->width = desc.width;
+    image->height = desc.height;
+    image->bitCount = desc.bitCount;
+    image->rowSize = desc.rowSize;
+    image->paletteCount = (image->bitCount <= 8) ? (1 << image->bitCount) : 0;
+    fseek(file, desc.paletteOffset, SEEK_SET);
+    if (desc.paletteCount > 0 &&
+        fread(image->palette, sizeof(RGBQUAD), desc.paletteCount, file) != (size_t)desc.paletteCount) {
+        fclose(file);
+        return FALSE;
+    }
+
+    image->pixels = (unsigned char*)malloc(image->rowSize * image->height);
+    fseek(file, desc.dataOffset, SEEK_SET);
+    if (!image->pixels || !readBmpPixelData(file, &desc, image->pixels)) {
+        if (image->pixels) free(image->pixels);
+        image->pixels = NULL;
+        fclose(file);
+        return FALSE;
+    }
+    fclose(file);
+    return TRUE;
+}
+
+void freeVerifyImage(VerifyImage* image) {
+    if (image->pixels) free(image->pixels);
+    image->pixels = NULL;
+}
+
+// 参考实现：逐像素读取索引（1/4/8位），不经过内核或查表
+int referenceGetIndex(const unsigned char* row, int x, int bitCount) {
+    if (bitCount == 1) return (row[x / 8] >> (7 - x % 8)) & 1;
+    if (bitCount == 4) return (x % 2 == 0) ? (row[x / 2] >> 4) : (row[x / 2] & 0x0F);
+    return row[x];
+}
+
+void referenceSetIndex(unsigned char* row, int x, int bitCount, int index) {
+    if (bitCount == 1) {
+        int shift = 7 - x % 8;
+        row[x / 8] = (unsigned char)((row[x / 8] & ~(1 << shift)) | ((index & 1) << shift));
+    } else if (bitCount == 4) {
+        int shift = (x % 2 == 0) ? 4 : 0;
+        row[x / 2] = (unsigned char)((row[x / 2] & ~(0x0F << shift)) | ((index & 0x0F) << shift));
+    } else {
+        row[x] = (unsigned char)index;
+    }
+}
+
+// 参考实现：二值化与检测使用的像素值（24/32位取红色通道，8位取索引）
+int referenceValue(const VerifyImage* image, const unsigned char* pixels, int x, int y) {
+    const unsigned char* row = pixels + y * image->rowSize;
+    if (image->bitCount == 24) return row[x * 3 + 2];
+    if (image->bitCount == 32) return row[x * 4 + 2];
+    return referenceGetIndex(row, x, image->bitCount);
+}
+
+// 参考实现：像素灰度（索引图像取调色板项的灰度，24/32位取红色通道）
+int referenceGray(const VerifyImage* image, const unsigned char* pixels, int x, int y) {
+    int value = referenceValue(image, pixels, x, y);
+    return (image->bitCount <= 8) ? paletteEntryGray(&image->palette[value]) : value;
+}
+
+// 参考实现：物体检测中的黑色像素（索引图像按调色板灰度判断）
+int referenceIsDark(const VerifyImage* image, int x, int y) {
+    return referenceGray(image, image->pixels, x, y) < 128;
+}
+
+// 参考实现：逐像素按颜色范围分类，生成8位灰阶图像（范围内为0，其余为255），可直接交给referenceDetectObjects
+BOOL referenceColorMask(const VerifyImage* image, const ColorRange* range, VerifyImage* mask) {
+    memset(mask, 0, sizeof(VerifyImage));
+    mask->width = image->width;
+    mask->height = image->height;
+    mask->bitCount = 8;
+    mask->rowSize = ((image->width + 3) / 4) * 4;
+    mask->paletteCount = 256;
+    for (int i = 0; i < 256; i++) {
+        mask->palette[i].rgbBlue = mask->palette[i].rgbGreen = mask->palette[i].rgbRed = (BYTE)i;
+    }
+    mask->pixels = (unsigned char*)calloc(mask->height, mask->rowSize);
+    if (!mask->pixels) return FALSE;
+    for (int y = 0; y < image->height; y++) {
+        const unsigned char* row = image->pixels + y * image->rowSize;
+        for (int x = 0; x < image->width; x++) {
+            int r, g, b;
+            if (image->bitCount >= 24) {
+                const unsigned char* pixel = row + x * (image->bitCount / 8);
+                b = pixel[0];
+                g = pixel[1];
+                r = pixel[2];
+            } else {
+                const RGBQUAD* entry = &image->palette[referenceGetIndex(row, x, image->bitCount)];
+                b = entry->rgbBlue;
+                g = entry->rgbGreen;
+                r = entry->rgbRed;
+            }
+            mask->pixels[y * mask->rowSize + x] = colorPixelInRange(range, r, g, b) ? 0 : 255;
+        }
+    }
+    return TRUE;
+}
+
+// 参考实现：逐像素统计各通道和亮度的直方图
+void referenceImageStats(const VerifyImage* image, ImageStats* stats) {
+    initImageStats(stats, image->bitCount);
+    for (int y = 0; y < image->height; y++) {
+        const unsigned char* row = image->pixels + y * image->rowSize;
+        for (int x = 0; x < image->width; x++) {
+            RGBQUAD color;
+            if (image->bitCount >= 24) {
+                const unsigned char* pixel = row + x * (image->bitCount / 8);
+                color.rgbBlue = pixel[0];
+                color.rgbGreen = pixel[1];
+                color.rgbRed = pixel[2];
+                color.rgbReserved = 0;
+            } else {
+                color = image->palette[referenceGetIndex(row, x, image->bitCount)];
+            }
+            stats->histogram[0][color.rgbRed]++;
+            stats->histogram[1][color.rgbGreen]++;
+            stats->histogram[2][color.rgbBlue]++;
+            stats->histogram[STATS_LUMA][(image->bitCount >= 24) ? rgbToGray(color.rgbRed, color.rgbGreen, color.rgbBlue)
+                                                                 : paletteEntryGray(&color)]++;
+            stats->pixelCount++;
+        }
+    }
+}
+
+// 参考实现：单步旋转、翻转或最近邻缩放，按显示方向（第0行在最上面）逐像素取源像素，
+// 输出为自下而上的行顺序，expected按目标尺寸清零后写入
+void referenceTransformPixels(const VerifyImage* image, const TransformStep* step, int targetWidth,
+                              int targetHeight, unsigned char* expected, int expectedRowSize) {
+    int width = image->width;
+    int height = image->height;
+    BOOL topDown = image->infoHeader.biHeight < 0;
+    int bytesPerPixel = image->bitCount / 8;
+    memset(expected, 0, expectedRowSize * targetHeight);
+    for (int y = 0; y < targetHeight; y++) {
+        int top = targetHeight - 1 - y;
+        for (int x = 0; x < targetWidth; x++) {
+            int sx = x, sy = top;
+            if (step->type == TRANSFORM_ROTATE) {
+                if (step->quarterTurns == 1) {
+                    sx = top;
+                    sy = height - 1 - x;
+                } else if (step->quarterTurns == 2) {
+                    sx = width - 1 - x;
+                    sy = height - 1 - top;
+                } else {
+                    sx = width - 1 - top;
+                    sy = x;
+                }
+            } else if (step->type == TRANSFORM_FLIP_HORIZONTAL) {
+                sx = width - 1 - x;
+            } else if (step->type == TRANSFORM_FLIP_VERTICAL) {
+                sy = height - 1 - top;
+            } else {
+                sx = (int)((x + 0.5) * width / targetWidth);
+                sy = height - 1 - (int)((y + 0.5) * height / targetHeight);
+            }
+            const unsigned char* row = image->pixels + (topDown ? sy : height - 1 - sy) * image->rowSize;
+            unsigned char* out = expected + y * expectedRowSize;
+            if (image->bitCount < 8) {
+                referenceSetIndex(out, x, image->bitCount, referenceGetIndex(row, sx, image->bitCount));
+            } else {
+                memcpy(out + x * bytesPerPixel, row + sx * bytesPerPixel, bytesPerPixel);
+            }
+        }
+    }
+}
+
+// 参考实现：灰度平面（与gray的结果相同），行自下而上
+void referenceGrayPlane(const VerifyImage* image, unsigned char* plane, int planeRowSize) {
+    BOOL topDown = image->infoHeader.biHeight < 0;
+    for (int y = 0; y < image->height; y++) {
+        const unsigned char* row = image->pixels + (topDown ? image->height - 1 - y : y) * image->rowSize;
+        for (int x = 0; x < image->width; x++) {
+            unsigned char gray;
+            if (image->bitCount >= 24) {
+                const unsigned char* pixel = row + x * (image->bitCount / 8);
+                gray = rgbToGray(pixel[2], pixel[1], pixel[0]);
+            } else {
+                gray = paletteEntryGray(&image->palette[referenceGetIndex(row, x, image->bitCount)]);
+            }
+            plane[y * planeRowSize + x] = gray;
+        }
+    }
+}
+
+// 参考实现：逐像素求窗口和的盒式模糊、逐抽头卷积的高斯模糊和3x3核的Sobel/Scharr边缘（边缘像素向外复制）
+void referenceFilterPlane(const unsigned char* plane, int width, int height, int rowSize, const FilterStep* step,
+                          unsigned char* expected) {
+    if (step->type == FILTER_BOX) {
+        int diameter = 2 * step->radius + 1;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int sum = 0;
+                for (int dy = -step->radius; dy <= step->radius; dy++) {
+                    for (int dx = -step->radius; dx <= step->radius; dx++) {
+                        int sx = min(max(x + dx, 0), width - 1);
+                        sum += plane[clampRow(y + dy, height) * rowSize + sx];
+                    }
+                }
+                expected[y * rowSize + x] = (unsigned char)((sum + diameter * diameter / 2) / (diameter * diameter));
+            }
+        }
+    } else if (step->type == FILTER_GAUSS) {
+        short weights[2 * FILTER_MAX_GAUSS_RADIUS + 2];
+        int radius = buildGaussWeights(step->sigma, weights);
+        int rowShift = FILTER_WEIGHT_BITS - 7;
+        int* rows = (int*)malloc((size_t)width * height * sizeof(int));
+        if (!rows) return;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int sum = 1 << (rowShift - 1);
+                for (int k = -radius; k <= radius; k++) {
+                    sum += weights[k + radius] * plane[y * rowSize + min(max(x + k, 0), width - 1)];
+                }
+                rows[y * width + x] = sum >> rowShift;
+            }
+        }
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int sum = 1 << (FILTER_WEIGHT_BITS + 6);
+                for (int k = -radius; k <= radius; k++) sum += weights[k + radius] * rows[clampRow(y + k, height) * width + x];
+                expected[y * rowSize + x] = (unsigned char)(sum >> (FILTER_WEIGHT_BITS + 7));
+            }
+        }
+        free(rows);
+    } else {
+        int outer = (step->type == FILTER_SCHARR) ? 3 : 1;
+        int center = (step->type == FILTER_SCHARR) ? 10 : 2;
+        int shift = (step->type == FILTER_SCHARR) ? 4 : 2;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int p[3][3];
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        p[dy + 1][dx + 1] = plane[clampRow(y + dy, height) * rowSize + min(max(x + dx, 0), width - 1)];
+                    }
+                }
+                int gx = outer * (p[0][2] - p[0][0] + p[2][2] - p[2][0]) + center * (p[1][2] - p[1][0]);
+                int gy = outer * (p[2][0] - p[0][0] + p[2][2] - p[0][2]) + center * (p[2][1] - p[0][1]);
+                expected[y * rowSize + x] = (unsigned char)(255 - min((abs(gx) + abs(gy)) >> shift, 255));
+            }
+        }
+    }
+}
+
+// 参考实现：逐窗口按均值直接计算NCC，返回得分最高的位置（得分相同时取行号、列号较小的）
+MatchResult referenceBestMatch(const unsigned char* frame, int width, int height, const unsigned char* pattern,
+                               int patternWidth, int patternHeight) {
+    MatchResult best = { 0, 0, -2.0 };
+    double count = (double)patternWidth * patternHeight;
+    double patternMean = 0.0;
+    for (int i = 0; i < patternWidth * patternHeight; i++) patternMean += pattern[i];
+    patternMean /= count;
+    for (int y = 0; y + patternHeight <= height; y++) {
+        for (int x = 0; x + patternWidth <= width; x++) {
+            double mean = 0.0;
+            for (int row = 0; row < patternHeight; row++) {
+                for (int i = 0; i < patternWidth; i++) mean += frame[(y + row) * width + x + i];
+            }
+            mean /= count;
+            double product = 0.0, frameVariance = 0.0, patternVariance = 0.0;
+            for (int row = 0; row < patternHeight; row++) {
+                for (int i = 0; i < patternWidth; i++) {
+                    double a = frame[(y + row) * width + x + i] - mean;
+                    double b = pattern[row * patternWidth + i] - patternMean;
+                    product += a * b;
+                    frameVariance += a * a;
+                    patternVariance += b * b;
+                }
+            }
+            double score = (frameVariance > 1e-6 * count && patternVariance > 0.0) ?
+                           product / sqrt(frameVariance * patternVariance) : 0.0;
+            if (score > best.score + 1e-9) {
+                best.x = x;
+                best.y = y;
+                best.score = score;
+            }
+        }
+    }
+    return best;
+}
+
+// 逐像素比较有效区域，返回不同的像素数，并记录第一个不同像素的位置
+int countPixelMismatches(const unsigned char* actual, int actualRowSize, const unsigned char* expected,
+                         int expectedRowSize, int width, int height, int bitCount, int* firstX, int* firstY) {
+    int mismatches = 0;
+    int bytesPerPixel = bitCount / 8;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* a = actual + y * actualRowSize;
+        const unsigned char* e = expected + y * expectedRowSize;
+        for (int x = 0; x < width; x++) {
+            BOOL same;
+            if (bitCount < 8) {
+                same = referenceGetIndex(a, x, bitCount) == referenceGetIndex(e, x, bitCount);
+            } else {
+                same = memcmp(a + x * bytesPerPixel, e + x * bytesPerPixel, bytesPerPixel) == 0;
+            }
+            if (!same) {
+                if (mismatches == 0) {
+                    *firstX = x;
+                    *firstY = y;
+                }
+                mismatches++;
+            }
+        }
+    }
+    return mismatches;
+}
+
+// 参考实现：灰度图像素（24/32位各像素BGR写入加权灰度，Alpha不变；索引格式像素不变）
+void referenceGrayPixels(const VerifyImage* image, unsigned char* expected) {
+    memcpy(expected, image->pixels, image->rowSize * image->height);
+    if (image->bitCount != 24 && image->bitCount != 32) return;
+    int bytesPerPixel = image->bitCount / 8;
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            unsigned char* pixel = expected + y * image->rowSize + x * bytesPerPixel;
+            unsigned char gray = rgbToGray(pixel[2], pixel[1], pixel[0]);
+            pixel[0] = pixel[1] = pixel[2] = gray;
+        }
+    }
+}
+
+// 参考实现：在24/32位灰度图中心画红色十字（半径10像素）
+void referenceCrossPixels(const VerifyImage* image, unsigned char* expected) {
+    if (image->bitCount != 24 && image->bitCount != 32) return;
+    int bytesPerPixel = image->bitCount / 8;
+    int centerX = image->width / 2;
+    int centerY = image->height / 2;
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            BOOL onCross = (y == centerY && abs(x - centerX) <= 10) || (x == centerX && abs(y - centerY) <= 10);
+            if (!onCross) continue;
+            unsigned char* pixel = expected + y * image->rowSize + x * bytesPerPixel;
+            pixel[0] = 0;
+            pixel[1] = 0;
+            pixel[2] = 255;
+        }
+    }
+}
+
+// 参考实现：二值化（索引图像按调色板灰度，其余按像素值；黑为0/索引0，白为255/最大索引）
+void referenceBinarizePixels(const VerifyImage* image, int threshold, unsigned char* expected) {
+    memcpy(expected, image->pixels, image->rowSize * image->height);
+    int maxIndex = (1 << min(image->bitCount, 8)) - 1;
+    for (int y = 0; y < image->height; y++) {
+        unsigned char* row = expected + y * image->rowSize;
+        for (int x = 0; x < image->width; x++) {
+            int value = referenceGray(image, image->pixels, x, y);
+            if (image->bitCount <= 8) {
+                referenceSetIndex(row, x, image->bitCount, (value < threshold) ? 0 : maxIndex);
+            } else {
+                unsigned char* pixel = row + x * (image->bitCount / 8);
+                pixel[0] = pixel[1] = pixel[2] = (unsigned char)((value < threshold) ? 0 : 255);
+            }
+        }
+    }
+}
+
+// 参考实现：把二值化结果打包为1位（白为1）
+void referencePackPixels(const VerifyImage* image, const unsigned char* binarized, unsigned char* expected,
+                         int expectedRowSize) {
+    memset(expected, 0, expectedRowSize * image->height);
+    int maxIndex = (1 << min(image->bitCount, 8)) - 1;
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            int value = referenceValue(image, binarized, x, y);
+            BOOL white = (image->bitCount <= 8) ? (value == maxIndex || (image->bitCount == 8 && value >= 128))
+                                                : value >= 128;
+            referenceSetIndex(expected + y * expectedRowSize, x, 1, white);
+        }
+    }
+}
+
+// 参考实现：4位图像中未出现的最大索引，16个索引都已使用时返回-1
+int referenceMarkerIndex4(const VerifyImage* image) {
+    int histogram[16] = {0};
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width; x++) {
+            histogram[referenceGetIndex(image->pixels + y * image->rowSize, x, 4)]++;
+        }
+    }
+    for (int i = 15; i >= 0; i--) {
+        if (histogram[i] == 0) return i;
+    }
+    return -1;
+}
+
+// 参考实现：差异图的位深度（1位/4位输出4位，4位图像的索引用满时输出8位）
+int referenceCompareBitCount(const VerifyImage* first) {
+    if (first->bitCount == 4 && referenceMarkerIndex4(first) < 0) return 8;
+    return (first->bitCount < 8) ? 4 : first->bitCount;
+}
+
+// 参考实现：差异图。8位：调色板灰度不同写标记索引，相同写第一张图的索引；24/32位：像素值不同写标记色，相同写第一张图的值；
+// 1位/4位：按各自调色板判断黑白，输出4位（4位图像的索引用满时输出8位，标记索引为16），相同像素沿用第一张图的索引。两张图的行顺序不同时按显示位置比较，
+// 输出按第一张图的行顺序。返回标记索引
+int referenceComparePixels(const VerifyImage* first, const VerifyImage* second, unsigned char* expected,
+                           int expectedRowSize) {
+    int bitCount = first->bitCount;
+    BOOL flipped = (first->infoHeader.biHeight < 0) != (second->infoHeader.biHeight < 0);
+    int outputBitCount = referenceCompareBitCount(first);
+    int markIndex = 240;
+    if (bitCount == 1) markIndex = 2;
+    if (bitCount == 4) markIndex = (outputBitCount == 8) ? 16 : referenceMarkerIndex4(first);
+    memset(expected, 0, expectedRowSize * first->height);
+
+    for (int y = 0; y < first->height; y++) {
+        unsigned char* out = expected + y * expectedRowSize;
+        int y2 = flipped ? first->height - 1 - y : y;
+        for (int x = 0; x < first->width; x++) {
+            if (bitCount == 1 || bitCount == 4) {
+                BOOL differs = referenceIsDark(first, x, y) != referenceIsDark(second, x, y2);
+                int index = referenceGetIndex(first->pixels + y * first->rowSize, x, bitCount);
+                referenceSetIndex(out, x, outputBitCount, differs ? markIndex : index);
+                continue;
+            }
+            int value1 = referenceValue(first, first->pixels, x, y);
+            int value2 = referenceValue(second, second->pixels, x, y2);
+            if (bitCount == 8) {
+                BOOL differs = referenceGray(first, first->pixels, x, y) != referenceGray(second, second->pixels, x, y2);
+                out[x] = (unsigned char)(differs ? markIndex : value1);
+            } else {
+                unsigned char* pixel = out + x * (bitCount / 8);
+                if (value1 != value2) {
+                    pixel[0] = 0;
+                    pixel[1] = 0;
+                    pixel[2] = 255;
+                } else {
+                    pixel[0] = pixel[1] = pixel[2] = (unsigned char)value1;
+                }
+                if (bitCount == 32) pixel[3] = 255;
+            }
+        }
+    }
+    return markIndex;
+}
+
+// 参考实现：8连通BFS物体检测，按行优先顺序记录超过最小尺寸的物体，返回超过最小尺寸的物体总数
+int referenceDetectObjects(const VerifyImage* image, int minObjectSize, ObjectInfo* objects, int maxObjects,
+                           int* objectCount) {
+    int width = image->width;
+    int height = image->height;
+    unsigned char* visited = (unsigned char*)calloc(width * height, 1);
+    int* queue = (int*)malloc(width * height * sizeof(int));
+    *objectCount = 0;
+    if (!visited || !queue) {
+        if (visited) free(visited);
+        if (queue) free(queue);
+        return -1;
+    }
+
+    int foundCount = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (visited[y * width + x] || !referenceIsDark(image, x, y)) continue;
+
+            BoundingBox bbox = { x, y, x, y };
+            int count = 0;
+            int front = 0;
+            int rear = 0;
+            queue[rear++] = y * width + x;
+            visited[y * width + x] = 1;
+            while (front < rear) {
+                int cx = queue[front] % width;
+                int cy = queue[front] / width;
+                front++;
+                count++;
+                bbox.minX = min(bbox.minX, cx);
+                bbox.maxX = max(bbox.maxX, cx);
+                bbox.minY = min(bbox.minY, cy);
+                bbox.maxY = max(bbox.maxY, cy);
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int nx = cx + dx;
+                        int ny = cy + dy;
+                        if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+                        if (visited[ny * width + nx] || !referenceIsDark(image, nx, ny)) continue;
+                        visited[ny * width + nx] = 1;
+                        queue[rear++] = ny * width + nx;
+                    }
+                }
+            }
+
+            if (count >= minObjectSize) {
+                if (*objectCount < maxObjects) {
+                    recordObject(&objects[(*objectCount)++], &bbox, count, NULL);
+                }
+                foundCount++;
+            }
+        }
+    }
+    free(visited);
+    free(queue);
+    return foundCount;
+}
+
+// 校验统计
+typedef struct {
+    int passed;
+    int failed;
+} VerifyTally;
+
+void reportVerify(VerifyTally* tally, BOOL ok, const char* engine, const char* caseName, const char* detail) {
+    if (ok) {
+        tally->passed++;
+        printf("[PASS] %-10s %s\n", engine, caseName);
+    } else {
+        tally->failed++;
+        printf("[FAIL] %-10s %s: %s\n", engine, caseName, detail);
+    }
+}
+
+// 比较引擎输出文件与期望像素，并报告结果
+void verifyPixelOutput(VerifyTally* tally, const char* engine, const char* caseName, const char* outputPath,
+                       int expectedBitCount, const unsigned char* expected, int expectedRowSize,
+                       int width, int height) {
+    char detail[160];
+    VerifyImage actual;
+    if (!loadVerifyImage(outputPath, &actual)) {
+        reportVerify(tally, FALSE, engine, caseName, "无法读取输出文件");
+        return;
+    }
+    if (actual.bitCount != expectedBitCount || actual.width != width || actual.height != height) {
+        sprintf(detail, "输出格式为 %dx%d %d位，期望 %dx%d %d位", actual.width, actual.height, actual.bitCount,
+                width, height, expectedBitCount);
+        reportVerify(tally, FALSE, engine, caseName, detail);
+        freeVerifyImage(&actual);
+        return;
+    }
+    int firstX = 0, firstY = 0;
+    int mismatches = countPixelMismatches(actual.pixels, actual.rowSize, expected, expectedRowSize,
+                                          width, height, expectedBitCount, &firstX, &firstY);
+    sprintf(detail, "%d 个像素不同，第一个位于(%d,%d)", mismatches, firstX, firstY);
+    reportVerify(tally, mismatches == 0, engine, caseName, detail);
+    freeVerifyImage(&actual);
+}
+
+// 比较物体列表并报告结果
+void verifyObjectList(VerifyTally* tally, const char* engine, const char* caseName,
+                      const ObjectInfo* expected, int expectedCount, const ObjectInfo* actual, int actualCount) {
+    char detail[160];
+    int index = compareObjectLists(expected, expectedCount, actual, actualCount);
+    if (index >= 0) {
+        sprintf(detail, "物体数 %d（期望 %d），第 %d 个物体不同", actualCount, expectedCount, index + 1);
+    }
+    reportVerify(tally, index < 0, engine, caseName, detail);
+}
+
+// 比较直方图并报告结果
+void verifyImageStats(VerifyTally* tally, const char* engine, const char* caseName, const ImageStats* expected,
+                      const ImageStats* actual) {
+    char detail[160];
+    sprintf(detail, "像素数 %lld（期望 %lld）", actual->pixelCount, expected->pixelCount);
+    for (int c = 0; c < STATS_CHANNELS; c++) {
+        for (int v = 0; v < 256; v++) {
+            if (actual->histogram[c][v] != expected->histogram[c][v]) {
+                sprintf(detail, "第 %d 通道的值 %d: %lld 个像素（期望 %lld）", c, v, actual->histogram[c][v],
+                        expected->histogram[c][v]);
+                reportVerify(tally, FALSE, engine, caseName, detail);
+                return;
+            }
+        }
+    }
+    reportVerify(tally, actual->pixelCount == expected->pixelCount, engine, caseName, detail);
+}
+
+// 检查轮廓：原始轮廓的每个点都是物体的边界像素，首尾相接的相邻点8连通，轮廓的范围就是物体的边界框，
+// 凸包包含所有轮廓点，简化后的顶点按顺序取自原始轮廓
+BOOL checkObjectContours(const VerifyImage* image, const ObjectInfo* objects, const ContourSet* raw,
+                         const ContourSet* hull, const ContourSet* simplified, char* detail) {
+    for (int i = 0; i < raw->polygonCount; i++) {
+        const Point* points = raw->points + raw->offsets[i];
+        int count = raw->offsets[i + 1] - raw->offsets[i];
+        BoundingBox extent = { points[0].x, points[0].y, points[0].x, points[0].y };
+        for (int k = 0; k < count; k++) {
+            extent.minX = min(extent.minX, points[k].x);
+            extent.minY = min(extent.minY, points[k].y);
+            extent.maxX = max(extent.maxX, points[k].x);
+            extent.maxY = max(extent.maxY, points[k].y);
+            Point p = points[k], q = points[(k + 1) % count];
+            BOOL border = FALSE;
+            for (int d = 0; d < 4; d++) {
+                int nx = p.x + ((d == 0) ? 1 : (d == 1) ? -1 : 0);
+                int ny = p.y + ((d == 2) ? 1 : (d == 3) ? -1 : 0);
+                if (nx < 0 || ny < 0 || nx >= image->width || ny >= image->height || !referenceIsDark(image, nx, ny)) {
+                    border = TRUE;
+                }
+            }
+            if (!referenceIsDark(image, p.x, p.y) || !border) {
+                sprintf(detail, "物体 %d 的轮廓点(%d,%d)不是边界像素", i + 1, p.x, p.y);
+                return FALSE;
+            }
+            if (abs(p.x - q.x) > 1 || abs(p.y - q.y) > 1) {
+                sprintf(detail, "物体 %d 的轮廓在(%d,%d)处断开", i + 1, p.x, p.y);
+                return FALSE;
+            }
+        }
+        if (memcmp(&extent, &objects[i].bbox, sizeof(BoundingBox)) != 0) {
+            sprintf(detail, "物体 %d 的轮廓范围与边界框不同", i + 1);
+            return FALSE;
+        }
+        const Point* polygon = hull->points + hull->offsets[i];
+        int corners = hull->offsets[i + 1] - hull->offsets[i];
+        for (int k = 0; corners >= 3 && k < corners; k++) {
+            for (int j = 0; j < count; j++) {
+                if (crossProduct(polygon[k], polygon[(k + 1) % corners], points[j]) < 0) {
+                    sprintf(detail, "物体 %d 的轮廓点(%d,%d)在凸包外", i + 1, points[j].x, points[j].y);
+                    return FALSE;
+                }
+            }
+        }
+        const Point* kept = simplified->points + simplified->offsets[i];
+        int keptCount = simplified->offsets[i + 1] - simplified->offsets[i];
+        int j = 0;
+        for (int k = 0; k < count && j < keptCount; k++) {
+            if (points[k].x == kept[j].x && points[k].y == kept[j].y) j++;
+        }
+        if (j != keptCount) {
+            sprintf(detail, "物体 %d 的简化顶点不是原始轮廓的子序列", i + 1);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+#define VERIFY_MAX_OBJECTS 4096
+#define VERIFY_MIN_OBJECT_SIZE 10
+
+// 对一张输入图像（及同尺寸的第二张图像）校验所有引擎
+void verifyImageCase(VerifyTally* tally, const char* inputPath, const char* secondPath,
+                     const char* directory, const char* caseName) {
+    VerifyImage image, second;
+    if (!loadVerifyImage(inputPath, &image)) {
+        printf("[SKIP] %s: 无法读取或不支持的格式\n", caseName);
+        return;
+    }
+    BOOL haveSecond = secondPath && loadVerifyImage(secondPath, &second);
+    if (haveSecond && (second.width != image.width || second.height != image.height ||
+                       second.bitCount != image.bitCount)) {
+        freeVerifyImage(&second);
+        haveSecond = FALSE;
+    }
+
+    int width = image.width;
+    int height = image.height;
+    int size = image.rowSize * height;
+    int packedRowSize = ((width + 31) / 32) * 4;
+    int compareBitCount = referenceCompareBitCount(&image);
+    int compareRowSize = ((width * compareBitCount + 31) / 32) * 4;
+    unsigned char* expected = (unsigned char*)malloc(max(size, compareRowSize * height));
+    unsigned char* binarized = (unsigned char*)malloc(size);
+    unsigned char* packed = (unsigned char*)malloc(packedRowSize * height);
+    ObjectInfo* referenceObjects = (ObjectInfo*)malloc(VERIFY_MAX_OBJECTS * sizeof(ObjectInfo));
+    ObjectInfo* objects = (ObjectInfo*)malloc(VERIFY_MAX_OBJECTS * sizeof(ObjectInfo));
+    if (!expected || !binarized || !packed || !referenceObjects || !objects) {
+        if (expected) free(expected);
+        if (binarized) free(binarized);
+        if (packed) free(packed);
+        if (referenceObjects) free(referenceObjects);
+        if (objects) free(objects);
+        freeVerifyImage(&image);
+        if (haveSecond) freeVerifyImage(&second);
+        reportVerify(tally, FALSE, "setup", caseName, "内存分配失败");
+        return;
+    }
+
+    char outputPath[260];
+    char crossPath[260];
+    sprintf(outputPath, "%.200s/verify_out.bmp", directory);
+    sprintf(crossPath, "%.200s/verify_cross.bmp", directory);
+    int savedStdout;
+
+    // 灰度图和带十字的灰度图
+    savedStdout = suppressStdout();
+    BOOL ok = ConvertToGrayScale(inputPath, outputPath, crossPath);
+    restoreStdout(savedStdout);
+    if (!ok) {
+        reportVerify(tally, FALSE, "gray", caseName, "转换失败");
+    } else {
+        referenceGrayPixels(&image, expected);
+        verifyPixelOutput(tally, "gray", caseName, outputPath, image.bitCount, expected, image.rowSize, width, height);
+        referenceCrossPixels(&image, expected);
+        verifyPixelOutput(tally, "gray_cross", caseName, crossPath, image.bitCount, expected, image.rowSize,
+                          width, height);
+    }
+
+    // 直方图统计：多线程统计，以及在灰度转换中统计（灰度输出也应与参考实现相同）
+    ImageStats* expectedStats = (ImageStats*)malloc(sizeof(ImageStats));
+    ImageStats* actualStats = (ImageStats*)malloc(sizeof(ImageStats));
+    if (expectedStats && actualStats) {
+        referenceImageStats(&image, expectedStats);
+        if (computeImageStats(image.pixels, width, height, image.bitCount, image.rowSize, image.palette, 3,
+                              actualStats)) {
+            verifyImageStats(tally, "stats", caseName, expectedStats, actualStats);
+        } else {
+            reportVerify(tally, FALSE, "stats", caseName, "统计失败");
+        }
+        initImageStats(actualStats, 0);
+        savedStdout = suppressStdout();
+        ok = ConvertToGrayScaleStats(inputPath, outputPath, crossPath, actualStats, NULL);
+        restoreStdout(savedStdout);
+        if (!ok) {
+            reportVerify(tally, FALSE, "gray_stats", caseName, "转换失败");
+        } else {
+            verifyImageStats(tally, "gray_stats", caseName, expectedStats, actualStats);
+            referenceGrayPixels(&image, expected);
+            verifyPixelOutput(tally, "gray_stats", caseName, outputPath, image.bitCount, expected, image.rowSize,
+                              width, height);
+        }
+    }
+    free(expectedStats);
+    free(actualStats);
+
+    // 二值化（同位深度与打包1位）
+    referenceBinarizePixels(&image, 100, binarized);
+    savedStdout = suppressStdout();
+    ok = ConvertToBinaryEx(inputPath, outputPath, 100, 0, FALSE, NULL);
+    restoreStdout(savedStdout);
+    if (!ok) {
+        reportVerify(tally, FALSE, "binary", caseName, "转换失败");
+    } else {
+        verifyPixelOutput(tally, "binary", caseName, outputPath, image.bitCount, binarized, image.rowSize,
+                          width, height);
+    }
+    referencePackPixels(&image, binarized, packed, packedRowSize);
+    savedStdout = suppressStdout();
+    ok = ConvertToBinaryEx(inputPath, outputPath, 100, 1, FALSE, NULL);
+    restoreStdout(savedStdout);
+    if (!ok) {
+        reportVerify(tally, FALSE, "binary_1bit", caseName, "转换失败");
+    } else {
+        verifyPixelOutput(tally, "binary_1bit", caseName, outputPath, 1, packed, packedRowSize, width, height);
+    }
+    if (image.bitCount == 4 || image.bitCount == 8) {
+        savedStdout = suppressStdout();
+        ok = ConvertToBinaryEx(inputPath, outputPath, 100, 0, TRUE, NULL);
+        restoreStdout(savedStdout);
+        if (!ok) {
+            reportVerify(tally, FALSE, "binary_rle", caseName, "转换失败");
+        } else {
+            verifyPixelOutput(tally, "binary_rle", caseName, outputPath, image.bitCount, binarized, image.rowSize,
+                              width, height);
+        }
+    }
+
+    // 差异图
+    if (haveSecond) {
+        savedStdout = suppressStdout();
+        ok = CompareBinaryImages(inputPath, secondPath, outputPath, 5);
+        restoreStdout(savedStdout);
+        if (!ok) {
+            reportVerify(tally, FALSE, "compare", caseName, "比较失败");
+        } else {
+            referenceComparePixels(&image, &second, expected, compareRowSize);
+            verifyPixelOutput(tally, "compare", caseName, outputPath, compareBitCount,
+                              expected, compareRowSize, width, height);
+        }
+        if (image.bitCount <= 8) {
+            savedStdout = suppressStdout();
+            ok = CompareBinaryImagesEx(inputPath, secondPath, outputPath, 5, TRUE, NULL, NULL);
+            restoreStdout(savedStdout);
+            if (!ok) {
+                reportVerify(tally, FALSE, "compare_rle", caseName, "比较失败");
+            } else {
+                verifyPixelOutput(tally, "compare_rle", caseName, outputPath, compareBitCount,
+                                  expected, compareRowSize, width, height);
+            }
+        }
+    }
+
+    // 物体检测：参考BFS与全分辨率内核、金字塔（候选区域BFS）以及文件级接口逐个比较物体列表
+    int referenceCount = 0;
+    referenceDetectObjects(&image, VERIFY_MIN_OBJECT_SIZE, referenceObjects, VERIFY_MAX_OBJECTS, &referenceCount);
+
+    DetectOptions options;
+    initDetectOptions(&options);
+    options.minObjectSize = VERIFY_MIN_OBJECT_SIZE;
+    options.maxObjects = VERIFY_MAX_OBJECTS;
+
+    // 与MarkObjectsInBinaryImageEx相同：索引图像先按调色板规范化为黑=0、白=最大索引
+    unsigned char* labelBuffer = canonicalizeLabelBuffer(image.pixels, image.palette, image.bitCount,
+                                                         image.rowSize, height, NULL);
+    if (!labelBuffer) labelBuffer = image.pixels;
+
+    int objectCount = 0;
+    detectObjectsInBuffer(labelBuffer, width, height, image.bitCount, image.rowSize, &options, NULL,
+                          objects, VERIFY_MAX_OBJECTS, &objectCount, NULL);
+    verifyObjectList(tally, "detect", caseName, referenceObjects, referenceCount, objects, objectCount);
+
+    // 计算特征时走逐像素BFS，物体列表应与游程标记相同
+    options.computeFeatures = TRUE;
+    detectObjectsInBuffer(labelBuffer, width, height, image.bitCount, image.rowSize, &options, NULL,
+                          objects, VERIFY_MAX_OBJECTS, &objectCount, NULL);
+    verifyObjectList(tally, "detect_bfs", caseName, referenceObjects, referenceCount, objects, objectCount);
+    options.computeFeatures = FALSE;
+
+    for (int factor = 2; factor <= 4; factor *= 2) {
+        options.pyramidFactor = factor;
+        options.pyramidExact = TRUE;
+        detectObjectsPyramid(labelBuffer, width, height, image.bitCount, image.rowSize, &options, NULL,
+                             objects, VERIFY_MAX_OBJECTS, &objectCount, NULL);
+        verifyObjectList(tally, (factor == 2) ? "pyramid2x" : "pyramid4x", caseName,
+                         referenceObjects, referenceCount, objects, objectCount);
+    }
+    // 24/32位：绿、蓝通道置为255后黑色像素不变（只看红色通道），但亮度偏高，金字塔不能因此漏检
+    if (image.bitCount == 24 || image.bitCount == 32) {
+        int bytesPerPixel = image.bitCount / 8;
+        unsigned char* tinted = (unsigned char*)malloc((size_t)image.rowSize * height);
+        if (!tinted) {
+            reportVerify(tally, FALSE, "pyramid_color", caseName, "内存分配失败");
+        } else {
+            memcpy(tinted, image.pixels, (size_t)image.rowSize * height);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    unsigned char* pixel = tinted + (size_t)y * image.rowSize + x * bytesPerPixel;
+                    pixel[0] = pixel[1] = 255;
+                }
+            }
+            for (int factor = 2; factor <= 4; factor *= 2) {
+                options.pyramidFactor = factor;
+                detectObjectsPyramid(tinted, width, height, image.bitCount, image.rowSize, &options, NULL,
+                                     objects, VERIFY_MAX_OBJECTS, &objectCount, NULL);
+                verifyObjectList(tally, (factor == 2) ? "pyramid2x_color" : "pyramid4x_color", caseName,
+                                 referenceObjects, referenceCount, objects, objectCount);
+            }
+            free(tinted);
+        }
+    }
+    options.pyramidFactor = 0;
+
+    savedStdout = suppressStdout();
+    ok = MarkObjectsInBinaryImageEx(inputPath, outputPath, &options, objects, &objectCount, NULL);
+    restoreStdout(savedStdout);
+    if (!ok) {
+        reportVerify(tally, FALSE, "mark", caseName, "标记失败");
+    } else {
+        verifyObjectList(tally, "mark", caseName, referenceObjects, referenceCount, objects, objectCount);
+    }
+
+    // 轮廓：物体列表与参考BFS相同，轮廓、凸包和简化结果满足checkObjectContours的条件
+    ContourOptions contourOptions;
+    ContourSet contourSets[3];
+    contourOptions.detect = options;
+    contourOptions.drawOutput = FALSE;
+    BOOL contourOk = TRUE;
+    for (int i = 0; i < 3; i++) {
+        initContourSet(&contourSets[i]);
+        contourOptions.epsilon = (i == 2) ? 1.5 : 0.0;
+        contourOptions.convexHull = (i == 1);
+        int found = traceObjectContours(labelBuffer, width, height, image.bitCount, image.rowSize, &contourOptions,
+                                        objects, VERIFY_MAX_OBJECTS, &objectCount, &contourSets[i], NULL);
+        if (found < 0) contourOk = FALSE;
+    }
+    if (!contourOk) {
+        reportVerify(tally, FALSE, "contour", caseName, "内存分配失败");
+    } else {
+        char detail[160];
+        verifyObjectList(tally, "contour", caseName, referenceObjects, referenceCount, objects, objectCount);
+        BOOL valid = checkObjectContours(&image, objects, &contourSets[0], &contourSets[1], &contourSets[2], detail);
+        reportVerify(tally, valid, "contour_poly", caseName, detail);
+    }
+    for (int i = 0; i < 3; i++) freeContourSet(&contourSets[i]);
+
+    // 颜色分割：与逐像素分类后的参考BFS比较。随机图像多为灰阶（色相为0），第一个范围取跨过0度的色相，
+    // 第三个范围针对重排调色板后的彩色图像
+    static const ColorRange verifyRanges[3] = {
+        { COLOR_SPACE_HSV, { 300, 0, 40 }, { 60, 255, 220 } },
+        { COLOR_SPACE_YCBCR, { 50, 0, 0 }, { 200, 255, 255 } },
+        { COLOR_SPACE_HSV, { 180, 40, 0 }, { 270, 255, 255 } },
+    };
+    const char* colorEngines[3] = { "color_hsv", "color_ycbcr", "color_hue" };
+    for (int i = 0; i < 3; i++) {
+        VerifyImage mask;
+        int found = -1;
+        if (referenceColorMask(&image, &verifyRanges[i], &mask)) {
+            referenceDetectObjects(&mask, VERIFY_MIN_OBJECT_SIZE, referenceObjects, VERIFY_MAX_OBJECTS,
+                                   &referenceCount);
+            found = detectColorObjects(image.pixels, width, height, image.bitCount, image.rowSize, image.palette,
+                                       &verifyRanges[i], &options, objects, VERIFY_MAX_OBJECTS, &objectCount, NULL);
+            freeVerifyImage(&mask);
+        }
+        if (found < 0) {
+            reportVerify(tally, FALSE, colorEngines[i], caseName, "内存分配失败");
+        } else {
+            verifyObjectList(tally, colorEngines[i], caseName, referenceObjects, referenceCount, objects, objectCount);
+        }
+    }
+
+    // 几何变换：旋转、翻转和最近邻缩放与逐像素的参考实现比较（保持位深度，自上而下的输入按显示方向校验）
+    static const TransformStep verifySteps[6] = {
+        { TRANSFORM_ROTATE, 1, 0, 0 },
+        { TRANSFORM_ROTATE, 2, 0, 0 },
+        { TRANSFORM_ROTATE, 3, 0, 0 },
+        { TRANSFORM_FLIP_HORIZONTAL, 0, 0, 0 },
+        { TRANSFORM_FLIP_VERTICAL, 0, 0, 0 },
+        { TRANSFORM_RESIZE, 0, 0, 0 },
+    };
+    const char* transformEngines[6] = { "rotate90", "rotate180", "rotate270", "flip_h", "flip_v", "resize" };
+    ScratchArena transformArena;
+    initScratchArena(&transformArena);
+    for (int i = 0; i < 6; i++) {
+        char detail[160];
+        TransformStep step = verifySteps[i];
+        if (step.type == TRANSFORM_RESIZE) {
+            step.width = width * 2 / 3 + 1;
+            step.height = height * 3 / 2 + 1;
+        }
+        WatchImage transformed;
+        savedStdout = suppressStdout();
+        ok = loadWatchImage(inputPath, &transformed, &transformArena) && uprightImage(&transformed, &transformArena) &&
+             applyTransformStep(&transformed, &step, RESIZE_NEAREST, &transformArena);
+        restoreStdout(savedStdout);
+        int targetWidth = (step.type == TRANSFORM_RESIZE) ? step.width : (step.quarterTurns & 1) ? height : width;
+        int targetHeight = (step.type == TRANSFORM_RESIZE) ? step.height : (step.quarterTurns & 1) ? width : height;
+        int targetRowSize = ((targetWidth * image.bitCount + 31) / 32) * 4;
+        unsigned char* reference = (unsigned char*)malloc(targetRowSize * targetHeight);
+        if (!ok || !reference) {
+            reportVerify(tally, FALSE, transformEngines[i], caseName, "变换失败");
+        } else if (transformed.desc.width != targetWidth || transformed.desc.height != targetHeight ||
+                   transformed.bitCount != image.bitCount) {
+            sprintf(detail, "输出格式为 %dx%d %d位，期望 %dx%d %d位", transformed.desc.width, transformed.desc.height,
+                    transformed.bitCount, targetWidth, targetHeight, image.bitCount);
+            reportVerify(tally, FALSE, transformEngines[i], caseName, detail);
+        } else {
+            referenceTransformPixels(&image, &step, targetWidth, targetHeight, reference, targetRowSize);
+            int firstX = 0, firstY = 0;
+            int mismatches = countPixelMismatches(transformed.pixels, transformed.rowSize, reference, targetRowSize,
+                                                  targetWidth, targetHeight, image.bitCount, &firstX, &firstY);
+            sprintf(detail, "%d 个像素不同，第一个位于(%d,%d)", mismatches, firstX, firstY);
+            reportVerify(tally, mismatches == 0, transformEngines[i], caseName, detail);
+        }
+        if (reference) free(reference);
+        resetScratchArena(&transformArena);
+    }
+    freeScratchArena(&transformArena);
+
+    // 滤波：灰度平面上的盒式/高斯模糊和Sobel/Scharr边缘与逐像素的参考实现比较
+    static const FilterStep verifyFilters[6] = {
+        { FILTER_BOX, 2, 0.0 },
+        { FILTER_BOX, 9, 0.0 },
+        { FILTER_GAUSS, 0, 1.2 },
+        { FILTER_GAUSS, 0, 3.0 },
+        { FILTER_SOBEL, 0, 0.0 },
+        { FILTER_SCHARR, 0, 0.0 },
+    };
+    const char* filterEngines[6] = { "box2", "box9", "gauss1.2", "gauss3", "sobel", "scharr" };
+    int planeRowSize = ((width + 3) / 4) * 4;
+    unsigned char* plane = (unsigned char*)calloc(height, planeRowSize);
+    unsigned char* filtered = (unsigned char*)calloc(height, planeRowSize);
+    ScratchArena filterArena;
+    initScratchArena(&filterArena);
+    if (plane && filtered) referenceGrayPlane(&image, plane, planeRowSize);
+    for (int i = 0; i < 6; i++) {
+        char detail[160];
+        WatchImage source;
+        GrayPlane gray, result;
+        savedStdout = suppressStdout();
+        ok = plane && filtered && loadWatchImage(inputPath, &source, &filterArena) &&
+             uprightImage(&source, &filterArena) && extractGrayPlane(&source, &gray, &filterArena) &&
+             applyFilterStep(&verifyFilters[i], &gray, &result, &filterArena);
+        restoreStdout(savedStdout);
+        if (!ok) {
+            reportVerify(tally, FALSE, filterEngines[i], caseName, "滤波失败");
+        } else {
+            referenceFilterPlane(plane, width, height, planeRowSize, &verifyFilters[i], filtered);
+            int firstX = 0, firstY = 0;
+            int mismatches = countPixelMismatches(result.pixels, result.rowSize, filtered, planeRowSize,
+                                                  width, height, 8, &firstX, &firstY);
+            sprintf(detail, "%d 个像素不同，第一个位于(%d,%d)", mismatches, firstX, firstY);
+            reportVerify(tally, mismatches == 0, filterEngines[i], caseName, detail);
+        }
+        resetScratchArena(&filterArena);
+    }
+    freeScratchArena(&filterArena);
+    if (plane) free(plane);
+    if (filtered) free(filtered);
+
+    // 模板匹配：从灰度图中间截取一块作为模板，全图搜索的最佳位置与逐窗口直接计算的参考实现一致；
+    // 金字塔搜索要求图像的结构在缩小后仍然保留，逐像素的随机噪声在粗层上被平均掉，
+    // 因此先对灰度图做5x5盒式模糊，再截取模板，最佳位置和得分也要与参考实现一致
+    int patternWidth = min(24, width / 2), patternHeight = min(16, height / 2);
+    unsigned char* framePixels = (unsigned char*)malloc((size_t)width * height + 16);
+    unsigned char* patternPixels = (unsigned char*)malloc((size_t)patternWidth * patternHeight + 16);
+    if (patternWidth >= MATCH_MIN_TEMPLATE_SIDE && patternHeight >= MATCH_MIN_TEMPLATE_SIDE && framePixels &&
+        patternPixels) {
+        unsigned char* graySource = (unsigned char*)calloc(height, ((width + 3) / 4) * 4);
+        if (graySource) {
+            referenceGrayPlane(&image, graySource, ((width + 3) / 4) * 4);
+            for (int y = 0; y < height; y++) memcpy(framePixels + y * width, graySource + y * (((width + 3) / 4) * 4), width);
+            free(graySource);
+        }
+        int patternX = width / 3, patternY = height / 3;
+        BOOL flat = TRUE;
+        for (int y = 0; y < patternHeight; y++) {
+            memcpy(patternPixels + y * patternWidth, framePixels + (patternY + y) * width + patternX, patternWidth);
+            for (int x = 0; x < patternWidth; x++) flat = flat && patternPixels[y * patternWidth + x] == patternPixels[0];
+        }
+        if (graySource && !flat) {
+            MatchPlane framePlane = { framePixels, width, height };
+            MatchPlane patternPlane = { patternPixels, patternWidth, patternHeight };
+            MatchOptions matchOptions;
+            MatchResult matches[1];
+            char detail[160];
+            matchOptions.topCount = 1;
+            matchOptions.minScore = -1.0;
+            matchOptions.levels = 0;
+            matchOptions.jobs = 3;
+            matchOptions.markOutput = FALSE;
+            MatchResult expectedMatch = referenceBestMatch(framePixels, width, height, patternPixels, patternWidth,
+                                                           patternHeight);
+            int matchCount = matchTemplatePlanes(&framePlane, &patternPlane, &matchOptions, matches, NULL);
+            sprintf(detail, "找到 %d 处", matchCount);
+            if (matchCount == 1) {
+                MatchTemplate pattern;
+                initMatchTemplate(&pattern, &patternPlane);
+                double score = nccScore(&framePlane, &pattern, NULL, NULL, matches[0].x, matches[0].y);
+                sprintf(detail, "位置(%d,%d)得分 %.6f，期望(%d,%d)得分 %.6f", matches[0].x, matches[0].y, score,
+                        expectedMatch.x, expectedMatch.y, expectedMatch.score);
+                matchCount = (fabs(score - expectedMatch.score) < 1e-5 && fabs(matches[0].score - score) < 1e-4) ? 1 : 0;
+            }
+            reportVerify(tally, matchCount == 1, "match", caseName, detail);
+
+            static const FilterStep smoothing = { FILTER_BOX, 2, 0.0 };
+            unsigned char* smoothPixels = (unsigned char*)malloc((size_t)width * height + 16);
+            if (!smoothPixels) {
+                reportVerify(tally, FALSE, "match_pyramid", caseName, "内存分配失败");
+            } else {
+                referenceFilterPlane(framePixels, width, height, width, &smoothing, smoothPixels);
+                flat = TRUE;
+                for (int y = 0; y < patternHeight; y++) {
+                    memcpy(patternPixels + y * patternWidth, smoothPixels + (patternY + y) * width + patternX,
+                           patternWidth);
+                    for (int x = 0; x < patternWidth; x++) {
+                        flat = flat && patternPixels[y * patternWidth + x] == patternPixels[0];
+                    }
+                }
+                if (!flat) {
+                    framePlane.pixels = smoothPixels;
+                    expectedMatch = referenceBestMatch(smoothPixels, width, height, patternPixels, patternWidth,
+                                                       patternHeight);
+                    matchOptions.levels = 2;
+                    matchCount = matchTemplatePlanes(&framePlane, &patternPlane, &matchOptions, matches, NULL);
+                    sprintf(detail, "找到 %d 处", matchCount);
+                    if (matchCount == 1) {
+                        sprintf(detail, "位置(%d,%d)得分 %.6f，期望(%d,%d)得分 %.6f", matches[0].x, matches[0].y,
+                                matches[0].score, expectedMatch.x, expectedMatch.y, expectedMatch.score);
+                        matchCount = (matches[0].x == expectedMatch.x && matches[0].y == expectedMatch.y &&
+                                      fabs(matches[0].score - expectedMatch.score) < 1e-5) ? 1 : 0;
+                    }
+                    reportVerify(tally, matchCount == 1, "match_pyramid", caseName, detail);
+                }
+                free(smoothPixels);
+            }
+        }
+    }
+    if (framePixels) free(framePixels);
+    if (patternPixels) free(patternPixels);
+
+    // 增量标记：在第一张图像上贴一块取自第二张图像的补丁，再改回原图，每次都与整帧标记比较
+    if (haveSecond) {
+        unsigned char* secondLabel = canonicalizeLabelBuffer(second.pixels, second.palette, second.bitCount,
+                                                             second.rowSize, height, NULL);
+        unsigned char* patched = (unsigned char*)malloc(size);
+        if (secondLabel && patched) {
+            int usedBytes = (width * image.bitCount + 7) / 8;
+            int patchTop = height / 3;
+            int patchBottom = min(height - 1, patchTop + height / 4);
+            int patchLeft = usedBytes / 4;
+            int patchRight = max(patchLeft, usedBytes / 2);
+            memcpy(patched, labelBuffer, size);
+            for (int y = patchTop; y <= patchBottom; y++) {
+                memcpy(patched + y * image.rowSize + patchLeft, secondLabel + y * image.rowSize + patchLeft,
+                       patchRight - patchLeft + 1);
+            }
+            const unsigned char* frames[3] = { labelBuffer, patched, labelBuffer };
+            const char* engines[3] = { NULL, "relabel", "relabel_back" };
+            LabelState state;
+            RelabelStats stats;
+            initLabelState(&state);
+            for (int f = 0; f < 3; f++) {
+                int found = -1;
+                if (updateLabelState(&state, frames[f], width, height, image.bitCount, image.rowSize, &stats, NULL)) {
+                    found = collectLabelObjects(&state, &options, objects, VERIFY_MAX_OBJECTS, &objectCount, NULL);
+                }
+                if (found < 0) {
+                    reportVerify(tally, FALSE, "relabel", caseName, "内存分配失败");
+                    break;
+                }
+                if (!engines[f]) continue;
+                int expectedCount = 0;
+                detectObjectsInBuffer((unsigned char*)frames[f], width, height, image.bitCount, image.rowSize,
+                                      &options, NULL, referenceObjects, VERIFY_MAX_OBJECTS, &expectedCount, NULL);
+                verifyObjectList(tally, engines[f], caseName, referenceObjects, expectedCount, objects, objectCount);
+            }
+            freeLabelState(&state);
+        }
+        if (secondLabel && secondLabel != second.pixels) free(secondLabel);
+        if (patched) free(patched);
+    }
+
+    remove(outputPath);
+    remove(crossPath);
+    if (labelBuffer != image.pixels) free(labelBuffer);
+    free(expected);
+    free(binarized);
+    free(packed);
+    free(referenceObjects);
+    free(objects);
+    freeVerifyImage(&image);
+    if (haveSecond) freeVerifyImage(&second);
+}
+
+// 将图像重新写为RLE压缩的文件
+BOOL writeRleCopy(const char* inputPath, const char* outputPath) {
+    VerifyImage image;
+    if (!loadVerifyImage(inputPath, &image)) return FALSE;
+    FILE* file = fopen(outputPath, "wb");
+    if (!file) {
+        freeVerifyImage(&image);
+        return FALSE;
+    }
+    int written = writeBmpImage(file, &image.infoHeader, image.bitCount, image.palette, image.paletteCount,
+                                image.pixels, image.rowSize, image.width, image.height, TRUE);
+    fclose(file);
+    freeVerifyImage(&image);
+    return written >= 0;
+}
+
+// 将索引图像重新写为打乱顺序的彩色调色板：调色板项随机重排，像素索引随之改写，各项改为蓝色与亮度反向的彩色。
+// 像素值与灰度不再有关，只有按调色板查表才能得到参考实现的结果
+BOOL writePermutedPaletteCopy(const char* inputPath, const char* outputPath, unsigned int* state) {
+    VerifyImage image;
+    if (!loadVerifyImage(inputPath, &image)) return FALSE;
+    int permutation[256];
+    for (int i = 0; i < image.paletteCount; i++) permutation[i] = i;
+    for (int i = image.paletteCount - 1; i > 0; i--) {
+        int j = (int)(nextRandom(state) % (unsigned int)(i + 1));
+        int swap = permutation[i];
+        permutation[i] = permutation[j];
+        permutation[j] = swap;
+    }
+
+    RGBQUAD palette[256];
+    for (int i = 0; i < image.paletteCount; i++) {
+        BYTE value = image.palette[i].rgbRed;
+        palette[permutation[i]].rgbRed = value;
+        palette[permutation[i]].rgbGreen = value;
+        palette[permutation[i]].rgbBlue = (BYTE)(255 - value);
+        palette[permutation[i]].rgbReserved = 0;
+    }
+    for (int y = 0; y < image.height; y++) {
+        unsigned char* row = image.pixels + y * image.rowSize;
+        for (int x = 0; x < image.width; x++) {
+            referenceSetIndex(row, x, image.bitCount, permutation[referenceGetIndex(row, x, image.bitCount)]);
+        }
+    }
+
+    FILE* file = fopen(outputPath, "wb");
+    if (!file) {
+        freeVerifyImage(&image);
+        return FALSE;
+    }
+    int written = writeBmpImage(file, &image.infoHeader, image.bitCount, palette, image.paletteCount,
+                                image.pixels, image.rowSize, image.width, image.height, FALSE);
+    fclose(file);
+    freeVerifyImage(&image);
+    return written >= 0;
+}
+
+// 运行校验，返回失败项数
+int RunVerification(char** samplePaths, int sampleCount, int randomCases, unsigned int seed, const char* directory) {
+    VerifyTally tally = { 0, 0 };
+    char caseName[300];
+    char variantName[320];
+    char pathA[260];
+    char pathB[260];
+    char pathRle[260];
+    sprintf(pathA, "%.200s/verify_a.bmp", directory);
+    sprintf(pathB, "%.200s/verify_b.bmp", directory);
+    sprintf(pathRle, "%.200s/verify_rle.bmp", directory);
+
+    // 样本文件：与自身的二值化结果做差异比较
+    for (int i = 0; i < sampleCount; i++) {
+        int savedStdout = suppressStdout();
+        BOOL haveSecond = ConvertToBinary(samplePaths[i], pathB, 100);
+        restoreStdout(savedStdout);
+        sprintf(caseName, "%.250s", samplePaths[i]);
+        verifyImageCase(&tally, samplePaths[i], haveSecond ? pathB : NULL, directory, caseName);
+    }
+
+    // 合成图像：随机奇数宽度、位深度和行顺序，像素值随机分布在阈值两侧
+    static const int bitCounts[5] = { 1, 4, 8, 24, 32 };
+    unsigned int state = seed ? seed : 1;
+    for (int i = 0; i < randomCases; i++) {
+        int width = (int)(nextRandom(&state) % 500) * 2 + 1;
+        int height = (int)(nextRandom(&state) % 300) + 1;
+        int bitCount = bitCounts[nextRandom(&state) % 5];
+
+        SyntheticSpec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.blobCount = (int)(nextRandom(&state) % 30);
+        spec.blobRadius = 2 + (int)(nextRandom(&state) % 40);
+        spec.noise = (nextRandom(&state) % 100) / 1000.0;
+        spec.seed = nextRandom(&state);
+        spec.topDown = (nextRandom(&state) & 1) != 0;
+        spec.randomColors = TRUE;
+        SyntheticSpec specB = spec;
+        specB.seed = spec.seed + 1;
+
+        sprintf(caseName, "random#%d %dx%d %d位 %s", i + 1, width, height, bitCount,
+                spec.topDown ? "自上而下" : "自下而上");
+        if (!GenerateSyntheticBmp(pathA, width, height, bitCount, &spec) ||
+            !GenerateSyntheticBmp(pathB, width, height, bitCount, &specB)) {
+            reportVerify(&tally, FALSE, "generate", caseName, "无法生成合成图像");
+            continue;
+        }
+        verifyImageCase(&tally, pathA, pathB, directory, caseName);
+
+        // 第二张图改为相反的行顺序再校验一遍：差异图按显示位置比较
+        SyntheticSpec specFlipped = specB;
+        specFlipped.topDown = !spec.topDown;
+        if (!GenerateSyntheticBmp(pathRle, width, height, bitCount, &specFlipped)) {
+            reportVerify(&tally, FALSE, "generate", caseName, "无法生成合成图像");
+            continue;
+        }
+        sprintf(variantName, "%s 行顺序不同", caseName);
+        verifyImageCase(&tally, pathA, pathRle, directory, variantName);
+
+        // 4位/8位图像再以RLE压缩的输入校验一遍（自上而下的图像不能用RLE，按原样写出）
+        if (bitCount == 4 || bitCount == 8) {
+            if (!writeRleCopy(pathA, pathRle)) {
+                reportVerify(&tally, FALSE, "generate", caseName, "无法生成RLE图像");
+                continue;
+            }
+            sprintf(variantName, "%s RLE", caseName);
+            verifyImageCase(&tally, pathRle, pathB, directory, variantName);
+        }
+
+        // 索引图像再以打乱顺序的彩色调色板校验一遍（与灰阶调色板的第二张图比较）
+        if (bitCount <= 8) {
+            if (!writePermutedPaletteCopy(pathA, pathRle, &state)) {
+                reportVerify(&tally, FALSE, "generate", caseName, "无法生成彩色调色板图像");
+                continue;
+            }
+            sprintf(variantName, "%s 彩色调色板", caseName);
+            verifyImageCase(&tally, pathRle, pathB, directory, variantName);
+        }
+
+        // 8/24/32位图像再以两张二值图校验一遍（差异图走游程合并）
+        if (bitCount >= 8) {
+            int savedStdout = suppressStdout();
+            BOOL ok = ConvertToBinary(pathA, pathRle, 128) && ConvertToBinary(pathB, pathA, 128);
+            restoreStdout(savedStdout);
+            if (!ok) {
+                reportVerify(&tally, FALSE, "generate", caseName, "无法生成二值图像");
+                continue;
+            }
+            sprintf(variantName, "%s 二值", caseName);
+            verifyImageCase(&tally, pathRle, pathA, directory, variantName);
+        }
     }
 
-    // 获取图像信息
-    int width = infoHeader.biWidth;
-    int height = abs(infoHeader.biHeight);
-    int bitCount = infoHeader.biBitCount;
-    int rowSize = ((width * bitCount + 31) / 32) * 4;
-    
-    printf("图片信息: 宽度=%d, 高度=%d, 位深=%d\n", width, height, bitCount);
-    
-    // 创建输出文件
-    FILE *outputFile = fopen(outputPath, "wb");
-    if (!outputFile) {
-        fclose(inputFile);
-        printf("无法创建输出文件！\n");
-        return FALSE;
+    remove(pathA);
+    remove(pathB);
+    remove(pathRle);
+    printf("校验完成: 通过 %d 项, 失败 %d 项\n", tally.passed, tally.failed);
+    return tally.failed;
+}
+
+void printCommandLineUsage(void) {
+    printf("用法: bmp2gray batch <gray|binary|mark|compare> [--metrics prom|json] [--rle] [--jobs N|auto]\n");
+    printf("                     [--cache 目录] [--cache-mb N] [--cache-results-only]\n");
+    printf("                     [--shard i/N] [--results 结果文件] <文件1> [文件2 ...]\n");
+    printf("  gray     转换为灰度图（_gray.bmp, _gray_cross.bmp）\n");
+    printf("  binary   转换为二值图（_binary.bmp）\n");
+    printf("  mark     标记二值图中的物体（_objects.bmp）\n");
+    printf("  compare  将每个文件与下一个文件比较（_diff.bmp）\n");
+    printf("  --rle    4位/8位输出按BI_RLE4/BI_RLE8压缩\n");
+    printf("  --jobs   读取、计算、写出分线程流水线处理，N为计算线程数（1~%d），按文件顺序打印与逐个处理相同的信息\n",
+           PIPELINE_MAX_WORKERS);
+    printf("  --cache  按像素内容和参数缓存结果与输出文件，相同的图像直接取回（不能与--jobs同时使用）\n");
+    printf("  --cache-mb  缓存的输出文件总大小上限（默认512），超出时淘汰最久未用的项\n");
+    printf("  --cache-results-only  只缓存物体列表和差异统计，命中时不恢复输出文件\n");
+    printf("  --shard  i/N，按路径哈希只处理分到第i个（0~N-1）分片的项，各进程或机器分别运行（不能与--jobs同时使用）\n");
+    printf("  --results  把每项的状态、物体列表和差异统计写入结果文件\n");
+    printf("用法: bmp2gray merge <输出文件> <结果文件1> [结果文件2 ...]   检查并合并各分片的结果文件\n");
+    printf("用法: bmp2gray bench [--sizes vga,hd,fhd,4k,8k,16k,all,宽x高] [--bits 1,8,24,32]\n");
+    printf("                     [--ops gray,binary,mark,compare] [--warmup N] [--reps N]\n");
+    printf("                     [--blobs N] [--radius R] [--noise 比例] [--seed N] [--dir 临时目录]\n");
+    printf("用法: bmp2gray probe <文件1> [文件2 ...]   只读文件头，输出尺寸、行字节数、行顺序、格式和数据偏移\n");
+    printf("用法: bmp2gray verify [--random N] [--seed N] [--dir 临时目录] [样本文件...]\n");
+    printf("用法: bmp2gray temporal [--lag K] [--threshold T] [--event 百分比] [--min-region N]\n");
+    printf("                     [--diff-out 目录] [--metrics prom|json] <帧1> <帧2> ...\n");
+    printf("  按顺序比较各帧与上一帧及前第K帧，输出变化比例、变化区域和亮起/熄灭事件\n");
+    printf("用法: bmp2gray relabel [--min-size N] [--check] [--metrics prom|json] <帧1> <帧2> ...\n");
+    printf("  按顺序标记各帧中的物体，只重新标记与变化区域相接的物体；--check时与整帧标记核对\n");
+    printf("用法: bmp2gray montage [--out 文件] [--cols N] [--tile 宽[x高]] [--gap N] [--jobs N] <文件1> [文件2 ...]\n");
+    printf("  把多张图像缩小拼成一张24位总览图（默认montage.bmp，瓦片256x256），多线程并行解码\n");
+    printf("用法: bmp2gray color [--color red|yellow|green|blue] [--hsv H0-H1,S0-S1,V0-V1] [--ycbcr Y0-Y1,Cb0-Cb1,Cr0-Cr1]\n");
+    printf("                     [--min-size N] [--max-objects N] [--mark] <文件1> [文件2 ...]\n");
+    printf("  直接在原始像素上按颜色范围查找物体（默认red），--mark时输出画出边界框的24位图像（_color.bmp）\n");
+    printf("用法: bmp2gray stats [--threshold T] [--jobs N] [--hist] [--gray] <文件1> [文件2 ...]\n");
+    printf("  统计各通道和亮度的直方图、最小/最大值、均值、标准差、暗像素比例和Otsu建议阈值；\n");
+    printf("  --hist写出<文件>_hist.csv，--gray在灰度转换的同一遍扫描中统计并输出灰度图\n");
+    printf("用法: bmp2gray transform [--rotate 90|180|270] [--flip h|v] [--resize 宽x高] [--filter nearest|bilinear|area]\n");
+    printf("                         [--chain gray,binary,mark] <文件1> [文件2 ...]\n");
+    printf("  按顺序旋转、翻转、缩放（宽或高为0时保持宽高比，默认bilinear，输出24位），再在内存中执行操作链，\n");
+    printf("  写出<文件>_transformed.bmp或最后一步的结果\n");
+    printf("用法: bmp2gray filter [--box R] [--gauss SIGMA] [--sobel] [--scharr] [--threshold T] [--chain binary,mark]\n");
+    printf("                      <文件1> [文件2 ...]\n");
+    printf("  在灰度图上按顺序执行盒式/高斯模糊和Sobel/Scharr边缘（边缘为黑色），再在内存中二值化和标记，\n");
+    printf("  写出<文件>_filtered.bmp或最后一步的结果\n");
+    printf("用法: bmp2gray contour [--epsilon E] [--hull] [--min-size N] [--max-objects N] [--draw] <文件1> [文件2 ...]\n");
+    printf("  跟踪各物体的外轮廓，可用Douglas-Peucker简化或取凸包，多边形写入<文件>_contours.csv，\n");
+    printf("  --draw时输出画出多边形的标记图（_contours.bmp）\n");
+    printf("用法: bmp2gray match --template <模板.bmp> [--top K] [--min-score S] [--levels N] [--jobs N] [--mark]\n");
+    printf("                     <文件1> [文件2 ...]\n");
+    printf("  按归一化互相关查找模板，输出得分最高的K个位置（默认5个，得分不低于0.8），先在金字塔上粗搜再逐层细化，\n");
+    printf("  --mark时输出画出匹配框的图像（_match.bmp）\n");
+    printf("用法: bmp2gray watch <目录> [--chain gray,binary,mark|compare] [--out 输出目录] [--jobs N]\n");
+    printf("                     [--backlog N] [--overload drop-newest|drop-oldest] [--max-age 毫秒] [--limit N]\n");
+    printf("                     [--rle] [--metrics prom|json]\n");
+    printf("  监视目录中新写入的BMP，按操作链处理，每步结果写入输出目录（默认为<目录>/out），Ctrl+C结束\n");
+    printf("不带参数运行时进入交互菜单\n");
+}
+
+// 命令行模式入口，返回进程退出码
+int RunCommandLine(int argc, char* argv[]) {
+    if (strcmp(argv[1], "bench") == 0) {
+        BenchOptions options;
+        if (parseBenchOptions(argc - 2, argv + 2, &options)) {
+            return RunBenchmark(&options) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
     }
-    
-    // 写入文件头和信息头
-    fwrite(&fileHeader, sizeof(BITMAPFILEHEADER), 1, outputFile);
-    fwrite(&infoHeader, sizeof(BITMAPINFOHEADER), 1, outputFile);
-    
-    // 处理调色板（如果有）
-    unsigned char *palette = NULL;
-    int paletteSize = 0;
-    if (bitCount <= 8) {
-        paletteSize = (1 << bitCount) * sizeof(RGBQUAD);
-        palette = (unsigned char*)malloc(paletteSize);
-        if (!palette) {
-            fclose(inputFile);
-            fclose(outputFile);
-            printf("内存分配失败！\n");
-            return FALSE;
+    if (strcmp(argv[1], "verify") == 0) {
+        int randomCases = 50;
+        unsigned int seed = 1;
+        const char* directory = ".";
+        int first = 2;
+        while (first + 1 < argc && strncmp(argv[first], "--", 2) == 0) {
+            if (strcmp(argv[first], "--random") == 0) {
+                randomCases = max(0, atoi(argv[first + 1]));
+            } else if (strcmp(argv[first], "--seed") == 0) {
+                seed = (unsigned int)strtoul(argv[first + 1], NULL, 10);
+            } else if (strcmp(argv[first], "--dir") == 0) {
+                directory = argv[first + 1];
+            } else {
+                printCommandLineUsage();
+                return 2;
+            }
+            first += 2;
         }
-        
-        readSize = fread(palette, 1, paletteSize, inputFile);
-        if (readSize != paletteSize) {
-            free(palette);
-            fclose(inputFile);
-            fclose(outputFile);
-            printf("读取调色板失败！\n");
-            return FALSE;
+        return RunVerification(argv + first, argc - first, randomCases, seed, directory) ? 1 : 0;
+    }
+    if (strcmp(argv[1], "temporal") == 0) {
+        TemporalOptions options;
+        int first;
+        if (parseTemporalOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunTemporal(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
         }
-        
-        // 对于8位图像，我们需要修改调色板以支持红色边框
-        if (bitCount == 8) {
-            // 保留一个调色板索引用于红色边框（选择最后一个索引240）
-            int redIndex = 240;
-            RGBQUAD* palEntries = (RGBQUAD*)palette;
-            palEntries[redIndex].rgbRed = 255;     // 设置为红色
-            palEntries[redIndex].rgbGreen = 0;
-            palEntries[redIndex].rgbBlue = 0;
-            palEntries[redIndex].rgbReserved = 0;
-            
-            printf("为8位图像预留调色板索引 %d 用于红色边框\n", redIndex);
+        printCommandLineUsage();
+        return 2;
+    }
+    if (strcmp(argv[1], "relabel") == 0) {
+        RelabelOptions options;
+        int first;
+        if (parseRelabelOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunRelabel(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
         }
-        
-        fwrite(palette, 1, paletteSize, outputFile);
+        printCommandLineUsage();
+        return 2;
     }
-    
-    // 创建缓冲区
-    unsigned char *buffer = (unsigned char*)malloc(rowSize * height);
-    if (!buffer) {
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("内存分配失败！\n");
-        return FALSE;
+    if (strcmp(argv[1], "montage") == 0) {
+        MontageOptions options;
+        int first;
+        if (parseMontageOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunMontage(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
     }
-    
-    // 读取图像数据
-    fseek(inputFile, fileHeader.bfOffBits, SEEK_SET);
-    readSize = fread(buffer, 1, rowSize * height, inputFile);
-    if (readSize != rowSize * height) {
-        free(buffer);
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("读取图像数据失败！实际读取 %zu 字节，期望 %d 字节\n", readSize, rowSize * height);
-        return FALSE;
+    if (argc >= 4 && strcmp(argv[1], "merge") == 0) {
+        return RunMerge(argv[2], argv + 3, argc - 3) ? 1 : 0;
     }
-    
-    // 创建访问标记地图
-    VisitedMap* visited = createVisitedMap(width, height);
-    if (!visited) {
-        free(buffer);
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("内存分配失败！\n");
-        return FALSE;
+    if (strcmp(argv[1], "color") == 0) {
+        ColorOptions options;
+        int first;
+        if (parseColorOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunColor(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
     }
-
-    // 查找并标记物体
-    int objectCount = 0;
-    int minObjectSize = 50;     // 最小物体像素数量，降低以检测更小的物体
-    int maxObjects = 50;        // 增加最大物体数量
-    BoundingBox* objects = (BoundingBox*)malloc(maxObjects * sizeof(BoundingBox));
-    if (!objects) {
-        freeVisitedMap(visited);
-        free(buffer);
-        fclose(inputFile);
-        fclose(outputFile);
-        printf("内存分配失败！\n");
-        return FALSE;
+    if (strcmp(argv[1], "stats") == 0) {
+        StatsOptions options;
+        int first;
+        if (parseStatsOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunStats(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
     }
-    
-    printf("开始分析图像...\n");
-    
-    // 根据位深度处理图像
-    if (bitCount == 24 || bitCount == 32) {
-        // 直接处理24位或32位图像
-        int bytesPerPixel = bitCount / 8;
-        
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                // 检查像素是否已访问
-                if (isVisited(visited, x, y)) continue;
-                
-                // 获取像素值
-                unsigned char pixelValue;
-                if (bitCount == 24) {
-                    RGB* pixel = (RGB*)(buffer + y * rowSize + x * 3);
-                    pixelValue = pixel->red; // 二值图中RGB通常相等
-                } else { // 32位
-                    unsigned char* pixel = buffer + y * rowSize + x * 4;
-                    pixelValue = pixel[2]; // R值
-                }
-                
-                // 如果是黑色像素(值小于128)
-                if (pixelValue < 128) {
-                    BoundingBox bbox;
-                    int pixelCount = 0;
-                    
-                    // 查找连通区域
-                    findConnectedComponent(buffer, width, height, bitCount, rowSize, 
-                                          x, y, visited, &bbox, &pixelCount);
-                    
-                    // 过滤小区域
-                    if (pixelCount >= minObjectSize) {
-                        printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n", 
-                               objectCount+1, bbox.minX, bbox.minY, bbox.maxX, bbox.maxY, pixelCount);
-                        
-                        if (objectCount < maxObjects) {
-                            objects[objectCount++] = bbox;
-                        }
-                    }
-                } else {
-                    // 标记白色区域为已访问，加速处理
-                    markVisited(visited, x, y);
-                }
-            }
+    if (strcmp(argv[1], "transform") == 0) {
+        TransformOptions options;
+        int first;
+        if (parseTransformOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunTransform(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
         }
-    } else if (bitCount == 8) {
-        // 处理8位图像
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                if (isVisited(visited, x, y)) continue;
-                
-                unsigned char* pixel = buffer + y * rowSize + x;
-                if (*pixel < 128) {
-                    BoundingBox bbox;
-                    int pixelCount = 0;
-                    
-                    // 特殊处理8位图像的连通区域
-                    // 创建一个临时队列
-                    Point* queue = (Point*)malloc(width * height * sizeof(Point));
-                    if (!queue) {
-                        printf("内存分配失败！\n");
-                        continue;
-                    }
-                    
-                    int front = 0, rear = 0;
-                    queue[rear].x = x;
-                    queue[rear].y = y;
-                    rear++;
-                    markVisited(visited, x, y);
-                    
-                    // 初始化边界框
-                    bbox.minX = x;
-                    bbox.minY = y;
-                    bbox.maxX = x;
-                    bbox.maxY = y;
-                    pixelCount = 1;
-                    
-                    // 方向数组
-                    int dx[8] = {-1, -1, -1, 0, 0, 1, 1, 1};
-                    int dy[8] = {-1, 0, 1, -1, 1, -1, 0, 1};
-                    
-                    while (front < rear) {
-                        Point current = queue[front++];
-                        int cx = current.x;
-                        int cy = current.y;
-                        
-                        for (int i = 0; i < 8; i++) {
-                            int nx = cx + dx[i];
-                            int ny = cy + dy[i];
-                            
-                            if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
-                            if (isVisited(visited, nx, ny)) continue;
-                            
-                            unsigned char* p = buffer + ny * rowSize + nx;
-                            if (*p < 128) {
-                                queue[rear].x = nx;
-                                queue[rear].y = ny;
-                                rear++;
-                                markVisited(visited, nx, ny);
-                                pixelCount++;
-                                
-                                // 更新边界框
-                                if (nx < bbox.minX) bbox.minX = nx;
-                                if (ny < bbox.minY) bbox.minY = ny;
-                                if (nx > bbox.maxX) bbox.maxX = nx;
-                                if (ny > bbox.maxY) bbox.maxY = ny;
-                            }
-                        }
-                    }
-                    
-                    free(queue);
-                    
-                    if (pixelCount >= minObjectSize) {
-                        printf("找到物体 #%d: 位置(%d,%d)-(%d,%d), 大小: %d像素\n", 
-                               objectCount+1, bbox.minX, bbox.minY, bbox.maxX, bbox.maxY, pixelCount);
-                        
-                        if (objectCount < maxObjects) {
-                            objects[objectCount++] = bbox;
-                        }
-                    }
+        printCommandLineUsage();
+        return 2;
+    }
+    if (strcmp(argv[1], "filter") == 0) {
+        FilterOptions options;
+        int first;
+        if (parseFilterOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunFilter(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
+    }
+    if (strcmp(argv[1], "contour") == 0) {
+        ContourOptions options;
+        int first;
+        if (parseContourOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunContour(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
+    }
+    if (strcmp(argv[1], "match") == 0) {
+        MatchOptions options;
+        int first;
+        if (parseMatchOptions(argc - 2, argv + 2, &options, &first)) {
+            return RunMatch(&options, argv + 2 + first, argc - 2 - first) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
+    }
+    if (strcmp(argv[1], "watch") == 0) {
+        WatchOptions options;
+        if (parseWatchOptions(argc - 2, argv + 2, &options)) {
+            return RunWatch(&options) ? 1 : 0;
+        }
+        printCommandLineUsage();
+        return 2;
+    }
+    if (argc >= 3 && strcmp(argv[1], "probe") == 0) {
+        return RunProbe(argv + 2, argc - 2) ? 1 : 0;
+    }
+    if (argc >= 4 && strcmp(argv[1], "batch") == 0) {
+        BatchOptions options;
+        options.operation = parseBatchOperation(argv[2]);
+        options.metricsFormat = NULL;
+        options.rleOutput = FALSE;
+        options.jobs = 0;
+        options.cacheDirectory = NULL;
+        options.cacheMegabytes = 512;
+        options.cacheResultsOnly = FALSE;
+        options.shardIndex = 0;
+        options.shardCount = 1;
+        options.resultsPath = NULL;
+        BOOL validJobs = TRUE;
+        BOOL validShard = TRUE;
+        int first = 3;
+        for (;;) {
+            if (first + 1 < argc && strcmp(argv[first], "--metrics") == 0) {
+                options.metricsFormat = argv[first + 1];
+                first += 2;
+            } else if (first < argc && strcmp(argv[first], "--rle") == 0) {
+                options.rleOutput = TRUE;
+                first++;
+            } else if (first + 1 < argc && strcmp(argv[first], "--jobs") == 0) {
+                // auto：读取和写出各占一个处理器，其余用于计算
+                if (strcmp(argv[first + 1], "auto") == 0) {
+                    SYSTEM_INFO systemInfo;
+                    GetSystemInfo(&systemInfo);
+                    options.jobs = max((int)systemInfo.dwNumberOfProcessors - 2, 1);
                 } else {
-                    markVisited(visited, x, y);
+                    options.jobs = atoi(argv[first + 1]);
+                    validJobs = options.jobs >= 1 && options.jobs <= PIPELINE_MAX_WORKERS;
                 }
+                first += 2;
+            } else if (first + 1 < argc && strcmp(argv[first], "--cache") == 0) {
+                options.cacheDirectory = argv[first + 1];
+                first += 2;
+            } else if (first + 1 < argc && strcmp(argv[first], "--cache-mb") == 0) {
+                options.cacheMegabytes = atoi(argv[first + 1]);
+                first += 2;
+            } else if (first < argc && strcmp(argv[first], "--cache-results-only") == 0) {
+                options.cacheResultsOnly = TRUE;
+                first++;
+            } else if (first + 1 < argc && strcmp(argv[first], "--shard") == 0) {
+                validShard = sscanf(argv[first + 1], "%d/%d", &options.shardIndex, &options.shardCount) == 2 &&
+                             options.shardCount >= 1 && options.shardIndex >= 0 &&
+                             options.shardIndex < options.shardCount;
+                first += 2;
+            } else if (first + 1 < argc && strcmp(argv[first], "--results") == 0) {
+                options.resultsPath = argv[first + 1];
+                first += 2;
+            } else {
+                break;
             }
         }
-    } else if (bitCount == 1 || bitCount == 4) {
-        printf("目前不支持 %d 位深度的图像自动检测物体\n", bitCount);
-        // 用户可以先转换为24位再处理
-    }
-    
-    printf("找到 %d 个物体\n", objectCount);
-    
-    // 用红色框标记物体
-    for (int i = 0; i < objectCount; i++) {
-        BoundingBox bbox = objects[i];
-        
-        // 边界框扩展
-        int padding = 2;
-        bbox.minX = max(0, bbox.minX - padding);
-        bbox.minY = max(0, bbox.minY - padding);
-        bbox.maxX = min(width - 1, bbox.maxX + padding);
-        bbox.maxY = min(height - 1, bbox.maxY + padding);
-        
-        // 画红框，根据不同位深度处理
-        if (bitCount == 24) {
-            // 绘制水平线
-            for (int x = bbox.minX; x <= bbox.maxX; x++) {
-                // 上边框
-                RGB* pixel = (RGB*)(buffer + bbox.minY * rowSize + x * 3);
-                pixel->red = 255;   // 红色
-                pixel->green = 0;
-                pixel->blue = 0;
-                
-                // 下边框
-                pixel = (RGB*)(buffer + bbox.maxY * rowSize + x * 3);
-                pixel->red = 255;
-                pixel->green = 0;
-                pixel->blue = 0;
-            }
-            
-            // 绘制垂直线
-            for (int y = bbox.minY; y <= bbox.maxY; y++) {
-                // 左边框
-                RGB* pixel = (RGB*)(buffer + y * rowSize + bbox.minX * 3);
-                pixel->red = 255;
-                pixel->green = 0;
-                pixel->blue = 0;
-                
-                // 右边框
-                pixel = (RGB*)(buffer + y * rowSize + bbox.maxX * 3);
-                pixel->red = 255;
-                pixel->green = 0;
-                pixel->blue = 0;
-            }
-        } else if (bitCount == 32) {
-            // 绘制水平线
-            for (int x = bbox.minX; x <= bbox.maxX; x++) {
-                // 上边框
-                unsigned char* pixel = buffer + bbox.minY * rowSize + x * 4;
-                pixel[2] = 255; // R
-                pixel[1] = 0;   // G
-                pixel[0] = 0;   // B
-                
-                // 下边框
-                pixel = buffer + bbox.maxY * rowSize + x * 4;
-                pixel[2] = 255;
-                pixel[1] = 0;
-                pixel[0] = 0;
-            }
-            
-            // 绘制垂直线
-            for (int y = bbox.minY; y <= bbox.maxY; y++) {
-                // 左边框
-                unsigned char* pixel = buffer + y * rowSize + bbox.minX * 4;
-                pixel[2] = 255;
-                pixel[1] = 0;
-                pixel[0] = 0;
-                
-                // 右边框
-                pixel = buffer + y * rowSize + bbox.maxX * 4;
-                pixel[2] = 255;
-                pixel[1] = 0;
-                pixel[0] = 0;
-            }
-        } else if (bitCount == 8) {
-            // 对于8位图像，使用我们在调色板中预留的红色索引
-            unsigned char frameColor = 240; // 调色板中预留的红色索引
-            
-            // 绘制水平线
-            for (int x = bbox.minX; x <= bbox.maxX; x++) {
-                buffer[bbox.minY * rowSize + x] = frameColor;
-                buffer[bbox.maxY * rowSize + x] = frameColor;
-            }
-            
-            // 绘制垂直线
-            for (int y = bbox.minY; y <= bbox.maxY; y++) {
-                buffer[y * rowSize + bbox.minX] = frameColor;
-                buffer[y * rowSize + bbox.maxX] = frameColor;
-            }
+        int fileCount = argc - first;
+        // 结果缓存只用于逐个处理模式
+        BOOL validCache = options.cacheMegabytes >= 0 && (!options.cacheDirectory || options.jobs == 0);
+        // 分片和结果文件同样只用于逐个处理模式
+        validShard = validShard && ((options.shardCount == 1 && !options.resultsPath) || options.jobs == 0);
+        BOOL validMetrics = !options.metricsFormat || strcmp(options.metricsFormat, "prom") == 0 ||
+                            strcmp(options.metricsFormat, "json") == 0;
+        if (options.operation != BATCH_INVALID && validMetrics && validJobs && validCache && validShard &&
+            fileCount >= 1 &&
+            (options.operation != BATCH_COMPARE || fileCount >= 2)) {
+            return RunBatch(&options, argv + first, fileCount) ? 1 : 0;
         }
     }
-    
-    // 写入处理后的图像数据
-    fwrite(buffer, 1, rowSize * height, outputFile);
-    
-    // 释放资源
-    free(objects);
-    freeVisitedMap(visited);
-    free(buffer);
-    fclose(inputFile);
-    fclose(outputFile);
-    
-    return TRUE;
+    printCommandLineUsage();
+    return 2;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // 带参数运行时进入命令行模式，不显示交互菜单
+    if (argc > 1) {
+        return RunCommandLine(argc, argv);
+    }
+
     int choice;
     while (1) { // 添加循环以保持程序运行
         system("cls"); // 清屏以保持界面整洁
@@ -1227,6 +11663,9 @@ int main() {
         printf("3 - 转换JPG为BMP\n");
         printf("4 - 标记二值图中的物体\n");
         printf("5 - 比较两张二值图像\n");
+        printf("6 - 标记物体并计算物体特征\n");
+        printf("7 - 金字塔检测与全分辨率检测对比\n");
+        printf("8 - 转换BMP为1位二值图\n");
         printf("0 - 退出程序\n");
         printf("选项: ");
         
@@ -1496,6 +11935,143 @@ int main() {
             fflush(stdin);
             getchar();
         }
+        else if (choice == 6) {
+            OPENFILENAME ofn;
+            char szFile[260] = {0};
+            char grayFile[260] = {0};
+            char outFile[260] = {0};
+
+            ZeroMemory(&ofn, sizeof(ofn));
+            ofn.lStructSize = sizeof(OPENFILENAME);
+            ofn.hwndOwner = NULL;
+            ofn.lpstrFile = szFile;
+            ofn.nMaxFile = sizeof(szFile);
+            ofn.lpstrFilter = "BMP Files (*.bmp)\0*.bmp\0All Files (*.*)\0*.*\0";
+            ofn.nFilterIndex = 1;
+            ofn.lpstrFileTitle = NULL;
+            ofn.nMaxFileTitle = 0;
+            ofn.lpstrInitialDir = NULL;
+            ofn.lpstrTitle = "选择二值图BMP文件";
+            ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST | OFN_HIDEREADONLY;
+
+            if (!GetOpenFileName(&ofn)) {
+                DWORD error = CommDlgExtendedError();
+                if (error) {
+                    printf("打开文件对话框失败，错误代码: %lu\n", error);
+                } else {
+                    printf("用户取消了选择\n");
+                }
+            } else {
+                DetectOptions options;
+                initDetectOptions(&options);
+                options.computeFeatures = TRUE;
+
+                // 选择对应的灰度图（可选，取消则使用二值图本身计算平均灰度）
+                ofn.lpstrFile = grayFile;
+                ofn.nMaxFile = sizeof(grayFile);
+                ofn.lpstrTitle = "选择对应的灰度图（可取消）";
+                if (GetOpenFileName(&ofn)) {
+                    options.grayPath = grayFile;
+                }
+
+                strncpy(outFile, szFile, sizeof(outFile) - 12);
+                outFile[sizeof(outFile) - 12] = '\0';
+                strcat(outFile, "_objects.bmp");
+
+                printf("开始识别物体并计算特征...\n");
+                if (MarkObjectsInBinaryImageEx(szFile, outFile, &options, NULL, NULL, NULL)) {
+                    printf("识别完成！\n");
+                    printf("标记物体后的图像: %s\n", outFile);
+                } else {
+                    printf("识别失败！\n");
+                }
+            }
+            printf("按任意键继续...\n");
+            fflush(stdin);
+            getchar();
+        }
+        else if (choice == 7) {
+            OPENFILENAME ofn;
+            char szFile[260] = {0};
+            int factor;
+
+            ZeroMemory(&ofn, sizeof(ofn));
+            ofn.lStructSize = sizeof(OPENFILENAME);
+            ofn.hwndOwner = NULL;
+            ofn.lpstrFile = szFile;
+            ofn.nMaxFile = sizeof(szFile);
+            ofn.lpstrFilter = "BMP Files (*.bmp)\0*.bmp\0All Files (*.*)\0*.*\0";
+            ofn.nFilterIndex = 1;
+            ofn.lpstrFileTitle = NULL;
+            ofn.nMaxFileTitle = 0;
+            ofn.lpstrInitialDir = NULL;
+            ofn.lpstrTitle = "选择二值图BMP文件";
+            ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST | OFN_HIDEREADONLY;
+
+            if (!GetOpenFileName(&ofn)) {
+                DWORD error = CommDlgExtendedError();
+                if (error) {
+                    printf("打开文件对话框失败，错误代码: %lu\n", error);
+                } else {
+                    printf("用户取消了选择\n");
+                }
+            } else {
+                printf("请输入缩小倍数(2或4): ");
+                fflush(stdin);
+                if (scanf("%d", &factor) != 1 || (factor != 2 && factor != 4)) {
+                    printf("无效的倍数，使用默认值4\n");
+                    factor = 4;
+                }
+                if (!ComparePyramidDetection(szFile, factor, 10)) {
+                    printf("对比失败！\n");
+                }
+            }
+            printf("按任意键继续...\n");
+            fflush(stdin);
+            getchar();
+        }
+        else if (choice == 8) {
+            OPENFILENAME ofn;
+            char szFile[260] = {0};
+            char outputFile[260] = {0};
+
+            ZeroMemory(&ofn, sizeof(ofn));
+            ofn.lStructSize = sizeof(OPENFILENAME);
+            ofn.hwndOwner = NULL;
+            ofn.lpstrFile = szFile;
+            ofn.nMaxFile = sizeof(szFile);
+            ofn.lpstrFilter = "BMP Files (*.bmp)\0*.bmp\0All Files (*.*)\0*.*\0";
+            ofn.nFilterIndex = 1;
+            ofn.lpstrFileTitle = NULL;
+            ofn.nMaxFileTitle = 0;
+            ofn.lpstrInitialDir = NULL;
+            ofn.lpstrTitle = "选择BMP文件";
+            ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST | OFN_HIDEREADONLY;
+
+            if (!GetOpenFileName(&ofn)) {
+                DWORD error = CommDlgExtendedError();
+                if (error) {
+                    printf("打开文件对话框失败，错误代码: %lu\n", error);
+                } else {
+                    printf("用户取消了选择\n");
+                }
+            } else {
+                // 创建输出文件名
+                strncpy(outputFile, szFile, sizeof(outputFile) - 17);
+                outputFile[sizeof(outputFile) - 17] = '\0';
+                strcat(outputFile, "_binary_1bit.bmp");
+
+                if (ConvertToBinaryEx(szFile, outputFile, 100, 1, FALSE, NULL)) {
+                    printf("处理完成！\n");
+                    printf("1位二值图像: %s\n", outputFile);
+                } else {
+                    printf("处理失败！\n");
+                }
+            }
+            printf("按任意键继续...\n");
+            fflush(stdin);
+            getchar();
+        }
         else if (choice == 0) {
             printf("程序退出\n");
             printf("按任意键关闭...\n");